@@ -21,6 +21,16 @@
 
 #define ZARUFS_NAME_LEN          255
 
+/* block size is 1024 << s_log_block_size, up to the page size. */
+#define ZARUFS_MIN_BLOCK_LOG_SIZE (10)
+#define ZARUFS_MAX_BLOCK_LOG_SIZE (16)
+#define ZARUFS_MIN_BLOCK_SIZE     (1 << ZARUFS_MIN_BLOCK_LOG_SIZE)
+#define ZARUFS_MAX_BLOCK_SIZE     (1 << ZARUFS_MAX_BLOCK_LOG_SIZE)
+#define ZARUFS_MAX_REC_LEN        ((1 << 16) - 1)
+
+/* cluster size of bigalloc is 1024 << s_log_frag_size. */
+#define ZARUFS_MAX_CLUSTER_LOG_SIZE (29)
+
 /* defines for s_state. */
 #define EXT2_VALID_FS (1)
 #define EXT2_ERROR_FS (2)
@@ -53,19 +63,24 @@
 #define EXT2_FEATURE_COMPAT_HAS_JOURNAL  (0x0004)
 #define EXT2_FEATURE_COMPAT_EXT_ATTR     (0x0008)
 #define EXT2_FEATURE_COMPAT_RESIZE_INO   (0x0010)
-#define EXT2_FEATURE_COMPAT_DIR_INDEX    (0x0012)
+#define EXT2_FEATURE_COMPAT_DIR_INDEX    (0x0020)
 
-#define EXT2_FEATURE_COMPAT_SUPP         ZARUFS_FEATURE_COMPAT_EXT_ATTR
+#define EXT2_FEATURE_COMPAT_SUPP         (EXT2_FEATURE_COMPAT_EXT_ATTR | \
+                                          EXT2_FEATURE_COMPAT_DIR_INDEX)
 
 /* defines for s_feature_ro_compat. */
 #define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER (0x0001)
 #define EXT2_FEATURE_RO_COMPAT_LARGE_FILE   (0x0002)
 #define EXT2_FEATURE_RO_COMPAT_BTREE_DIR    (0x0004)
+#define EXT2_FEATURE_RO_COMPAT_GDT_CSUM     (0x0010)
+#define EXT2_FEATURE_RO_COMPAT_BIGALLOC     (0x0200)
 #define EXT2_FEATURE_RO_COMPAT_ANY          (0xFFFFFFFF)
 
-#define EZT2_FEATURE_RO_COMPAT_SUPP (EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER | \
+#define EXT2_FEATURE_RO_COMPAT_SUPP (EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER | \
                                      EXT2_FEATURE_RO_COMPAT_LARGE_FILE   | \
-                                     EXT2_FEATURE_RO_COMPAT_BTREE_DIR)
+                                     EXT2_FEATURE_RO_COMPAT_BTREE_DIR    | \
+                                     EXT2_FEATURE_RO_COMPAT_GDT_CSUM     | \
+                                     EXT2_FEATURE_RO_COMPAT_BIGALLOC)
 #define EXT2_FEATURE_RO_COMPAT_UNSUPPORTED ~EXT2_FEATURE_RO_COMPAT_SUPP
 
 /* defines for s_feature_icompat. */
@@ -74,9 +89,12 @@
 #define EXT2_FEATURE_INCOMPAT_RECOVER     (0x0004)
 #define EXT2_FEATURE_INCOMPAT_JOURNAL_DEV (0x0008)
 #define EXT2_FEATURE_INCOMPAT_META_BG     (0x0010)
+#define EXT2_FEATURE_INCOMPAT_64BIT       (0x0080)
 
-#define EXT2_FEATURE_INCOMPAT_SUPP (EXT2_FEATURE_INCOMPAT_FILETYPE | \
-                                    EXT2_FEATURE_INCOMPAT_META_BG)
+#define EXT2_FEATURE_INCOMPAT_SUPP (EXT2_FEATURE_INCOMPAT_COMPRESSION | \
+                                    EXT2_FEATURE_INCOMPAT_FILETYPE    | \
+                                    EXT2_FEATURE_INCOMPAT_META_BG     | \
+                                    EXT2_FEATURE_INCOMPAT_64BIT)
 #define EXT2_FEATURE_INCOMPAT_UNSUPPORTED ~EXT2_FEATURE_INCOMPAT_SUPP
 
 
@@ -97,9 +115,86 @@
 #define EXT2_MOUNT_USRQUOTA     (0x00002000)
 #define EXT2_MOUNT_GRPQUOTA     (0x00004000)
 #define EXT2_MOUNT_RESERVATION  (0x00008000)
+#define EXT2_MOUNT_PREFETCH     (0x00010000)
+
+/* defines for s_default_mount_opts. */
+#define EXT2_DEFM_DEBUG       (0x0001)
+#define EXT2_DEFM_BSDGROUPS   (0x0002)
+#define EXT2_DEFM_XATTR_USER  (0x0004)
+#define EXT2_DEFM_ACL         (0x0008)
+#define EXT2_DEFM_UID16       (0x0010)
+
+/* limits of the tunables taken by mount options and sysfs. */
+#define ZARUFS_MAX_COMMIT_INTERVAL (3600) /* seconds. */
+#define ZARUFS_MAX_DIR_RA_PAGES    (1024)
+#define ZARUFS_MAX_ALLOC_COLORS    (64)
+#define ZARUFS_MAX_BITMAP_CACHE    (65536)
+
+/* defines for compressed clusters. */
+#define ZARUFS_CLUSTER_BITS        (14) /* 16KiB per cluster. */
+#define ZARUFS_CLUSTER_SIZE        (1 << ZARUFS_CLUSTER_BITS)
+#define ZARUFS_CLUSTER_MAX_BLOCKS  (ZARUFS_CLUSTER_SIZE / BLOCK_SIZE)
+#define ZARUFS_CLUSTER_BLOCKS_BITS(sb) (ZARUFS_CLUSTER_BITS - (sb)->s_blocksize_bits)
+#define ZARUFS_CLUSTER_BLOCKS(sb)  (1 << ZARUFS_CLUSTER_BLOCKS_BITS(sb))
+#define ZARUFS_CLUSTER_PAGES_BITS  (ZARUFS_CLUSTER_BITS - PAGE_CACHE_SHIFT)
+#define ZARUFS_CLUSTER_PAGES       (1 << ZARUFS_CLUSTER_PAGES_BITS)
+/* last block pointer of a compressed cluster holds this marker. */
+#define ZARUFS_COMPRESSED_BLKADDR  (0xFFFFFFFF)
+#define ZARUFS_CLUSTER_MAGIC       (0x5A434C55) /* "ZCLU" */
+#define ZARUFS_COMPR_LZ4           (1)
 
 #define ZARUFS_DIR_REC_LEN(name_len) (((name_len) + 8 + (4 - 1)) & ~(4 - 1))
 
+/* hashed directory index. block 0 holds the root behind "." and "..". */
+#define ZARUFS_DX_HASH_LEGACY            (0)
+#define ZARUFS_DX_HASH_HALF_MD4          (1)
+#define ZARUFS_DX_HASH_TEA               (2)
+#define ZARUFS_DX_HASH_LEGACY_UNSIGNED   (3)
+#define ZARUFS_DX_HASH_HALF_MD4_UNSIGNED (4)
+#define ZARUFS_DX_HASH_TEA_UNSIGNED      (5)
+#define ZARUFS_DX_MAX_LEVELS             (2)
+
+/* a directory entry without name, as laid over index blocks. */
+struct zarufs_fake_dirent {
+  __le32 inode;
+  __le16 rec_len;
+  __u8   name_len;
+  __u8   file_type;
+};
+
+struct zarufs_dx_countlimit {
+  __le16 limit;
+  __le16 count;
+};
+
+/* the first entry of a block overlays its hash with dx_countlimit. */
+struct zarufs_dx_entry {
+  __le32 hash;
+  __le32 block;
+};
+
+struct zarufs_dx_root_info {
+  __le32 reserved_zero;
+  __u8   hash_version;
+  __u8   info_length;
+  __u8   indirect_levels;
+  __u8   unused_flags;
+};
+
+struct zarufs_dx_root {
+  struct zarufs_fake_dirent  dot;
+  char                       dot_name[4];
+  struct zarufs_fake_dirent  dotdot;
+  char                       dotdot_name[4];
+  struct zarufs_dx_root_info info;
+  struct zarufs_dx_entry     entries[0];
+};
+
+struct zarufs_dx_node {
+  struct zarufs_fake_dirent fake;
+  struct zarufs_dx_entry    entries[0];
+};
+
 struct ext2_inode {
   __le16 i_mode;
   __le16 i_uid;
@@ -137,7 +232,7 @@ struct ext2_inode {
     struct {
       __u8   l_i_frag;
       __u8   l_i_fsize;
-      __u16  i_pad1;
+      __le16 l_i_file_acl_high;
       __le16 l_i_uid_high;
       __le16 l_i_gid_high;
       __u32  l_i_reserved2;
@@ -161,22 +256,67 @@ struct ext2_inode {
   } osd2;
 };
 
+#define EXT2_GOOD_OLD_INODE_SIZE (128)
+#define ZARUFS_MIN_EXTRA_ISIZE   (4)
+
+/* fields of large inodes, following struct ext2_inode. */
+struct zarufs_inode_extra {
+  __le16 i_extra_isize;
+  __le16 i_checksum_hi;
+  __le32 i_ctime_extra;
+  __le32 i_mtime_extra;
+  __le32 i_atime_extra;
+  __le32 i_crtime;
+  __le32 i_crtime_extra;
+  __le32 i_version_hi;
+  __le32 i_projid;
+  /* high 16 bits of i_block[], with 64bit feature. */
+  __le16 i_block_hi[ZARUFS_NR_BLOCKS];
+  __le16 i_pad;
+};
+
+#define ZARUFS_64BIT_EXTRA_ISIZE (sizeof(struct zarufs_inode_extra))
+
 struct zarufs_inode_info {
-  __le32        i_data[ZARUFS_NR_BLOCKS];
+  __le64        i_data[ZARUFS_NR_BLOCKS]; /* widened to 64bit in memory. */
   __u32         i_flags;
   __u32         i_faddr;
   __u8          i_frag_no;
   __u8          i_frag_size;
   __u16         i_state;
-  __u32         i_file_acl;
+  unsigned long i_file_acl;
   __u32         i_dir_acl;
   __u32         i_dtime;
   __u32         i_block_group;
   __u32         i_dir_start_lookup;
+  __u16         i_extra_isize;
   struct inode  vfs_inode;
   /* lock */
-  rwlock_t      i_meta_lock;
-  struct mutex  truncate_mutex;
+  seqlock_t     i_meta_lock; /* block map readers retry, never wait. */
+  /* iblock ranges held by allocating writers and truncate. */
+  spinlock_t    i_range_lock;
+  struct list_head i_ranges;
+  wait_queue_head_t i_range_wait;
+  struct rw_semaphore xattr_sem;
+  /* compression of clusters against their expansion. */
+  struct mutex  i_compr_mutex;
+  /* clusters written since the last pass, start up to end. */
+  spinlock_t    i_compr_lock;
+  unsigned long i_compr_start;
+  unsigned long i_compr_end;
+  struct work_struct i_compr_work;
+  /* name cache of an unindexed directory. */
+  spinlock_t    i_dir_cache_lock;
+  struct zarufs_dir_cache *i_dir_cache;
+  /* largest free space of each directory block. */
+  spinlock_t    i_dir_gap_lock;
+  __u16         *i_dir_gaps;
+  unsigned long i_dir_nr_gaps;
+  /* shared by changes within a block, exclusive for the layout. */
+  struct rw_semaphore i_dir_sem;
+  /* inodes likely free for the files of a directory, next up to end. */
+  __u32         i_ino_rsv_next;
+  __u32         i_ino_rsv_end;
 };
 
 #define EXT2_STATE_NEW       0x00000001
@@ -213,6 +353,21 @@ struct zarufs_inode_info {
                               EXT2_DIRSYNC_FL   )
 #define EXT2_REG_FLMASK      (~(EXT2_DIRSYNC_FL | EXT2_TOPDIR_FL))
 #define EXT2_OTHER_FLMASK    (EXT2_NODUMP_FL    | EXT2_TOPDIR_FL)
+#define EXT2_FL_USER_VISIBLE    (FS_FL_USER_VISIBLE)
+#define EXT2_FL_USER_MODIFIABLE (FS_FL_USER_MODIFIABLE | EXT2_NOCOMP_FL)
+
+/* ioctl commands. */
+#define ZARUFS_IOC_COMPACT_DIR _IO('z', 1) /* cut empty tail of a directory */
+
+static inline __u32 zarufs_mask_flags(umode_t mode, __u32 flags) {
+  if (S_ISDIR(mode)) {
+    return (flags);
+  } else if (S_ISREG(mode)) {
+    return (flags & EXT2_REG_FLMASK);
+  } else {
+    return (flags & EXT2_OTHER_FLMASK);
+  }
+}
 
 struct zarufs_super_block {
   __le32 s_inodes_count;
@@ -222,9 +377,9 @@ struct zarufs_super_block {
   __le32 s_free_inodes_count;
   __le32 s_first_data_block;
   __le32 s_log_block_size;
-  __le32 s_log_frag_size;
+  __le32 s_log_frag_size;      /* log2 of cluster size under bigalloc. */
   __le32 s_blocks_per_group;
-  __le32 s_frags_per_group;
+  __le32 s_frags_per_group;    /* clusters per group under bigalloc.   */
   __le32 s_inodes_per_group;
   __le32 s_mtime;
   __le32 s_wtime;
@@ -256,7 +411,7 @@ struct zarufs_super_block {
   // performance hints
   __u8   s_preallock_blocks;
   __u8   s_preallock_dir_blocks;
-  __u16  s_padding1;
+  __le16 s_reserved_gdt_blocks; /* kept for online growth. */
 
   // journaling support
   __u8   s_journal_uuid[16];
@@ -268,19 +423,34 @@ struct zarufs_super_block {
   __u32  s_hash_seed[4];
   __u8   s_def_hash_version;
   __u8   s_reserved_char_pad;
-  __u16  s_reserved_word_pad;
+  __le16 s_desc_size;          /* size of group descriptor with 64bit. */
 
   // other options
   __le32 s_default_mount_opts;
   __le32 s_first_meta_bg;
-  __u32  s_reserved[190];
+  __le32 s_mkfs_time;
+  __le32 s_jnl_blocks[17];
+
+  // 64bit support
+  __le32 s_blocks_count_hi;
+  __le32 s_r_blocks_count_hi;
+  __le32 s_free_blocks_count_hi;
+  __le16 s_min_extra_isize;
+  __le16 s_want_extra_isize;
+  __le32 s_flags;
+  __u32  s_reserved[167];
 };
 
+/* defines for s_flags. */
+#define EXT2_FLAGS_SIGNED_HASH   (0x0001)
+#define EXT2_FLAGS_UNSIGNED_HASH (0x0002)
+
 struct zarufs_sb_info {
   /* buffer cache infomations. */
   struct zarufs_super_block *s_zsb;
   struct buffer_head        *s_sbh;
-  struct buffer_head        **s_group_desc;
+  struct buffer_head        **s_group_desc;   /* loaded descriptor blocks. */
+  unsigned long             *s_group_checked; /* descriptors found sane.   */
 
   /* disk information cache. */
   // super block.
@@ -298,9 +468,18 @@ struct zarufs_sb_info {
   // group.
   unsigned long  s_groups_count;
   unsigned long  s_blocks_per_group;
+  unsigned long  s_clusters_per_group; /* bits in a block bitmap.  */
+  unsigned int   s_cluster_bits;       /* log2 of blocks/cluster.  */
+  unsigned int   s_cluster_ratio;      /* # of blocks per cluster. */
+  unsigned long  s_desc_size;      /* size of a group desc.      */
   unsigned long  s_desc_per_block; /* # of group desc per block. */
   unsigned long  s_gdb_count;      /* # of group desc blocks.    */
 
+  // directory index.
+  __u32          s_hash_seed[4];
+  int            s_def_hash_version;
+  int            s_hash_unsigned; /* 3 if hashes are unsigned, or 0. */
+
   // fragment.
   unsigned long  s_frag_size;
   unsigned long  s_frags_per_block;
@@ -314,8 +493,60 @@ struct zarufs_sb_info {
   struct percpu_counter  s_freeblocks_counter;
   struct percpu_counter  s_freeinodes_counter;
   struct percpu_counter  s_dirs_counter;
+
+  // group descriptor cache.
+  spinlock_t             s_group_desc_lock;
+  unsigned long          *s_group_desc_ref;  /* used since the last scan. */
+  unsigned long          s_group_desc_cached;
+  unsigned long          s_group_desc_hand;  /* where a scan goes on.     */
+  struct shrinker        s_group_desc_shrinker;
+
+  // group summaries, one per group in a dense array.
+  struct zarufs_group_info *s_group_info;
+
+  // bitmap cache, in lru order.
+  spinlock_t             s_bitmap_lock;
+  struct list_head       s_bitmap_lru;
+  unsigned long          s_bitmap_cached;
+  unsigned long          *s_bitmap_checked; /* block bitmaps found sane. */
+  struct shrinker        s_bitmap_shrinker;
+
+  // lazy inode table initialization.
+  struct task_struct     *s_lazyinit_task;
+  struct rw_semaphore    s_itable_sem;    /* zeroing against allocation. */
+
+  // metadata prefetch after mount.
+  struct task_struct     *s_prefetch_task;
+
+  // compression of written clusters.
+  struct workqueue_struct *s_compr_wq;
+
+  // statfs.
+  struct super_block     *s_sb;
+  unsigned long          s_overhead;     /* blocks of metadata.           */
+  struct delayed_work    s_counter_work; /* checks the counters on disk. */
+  s64                    s_blocks_drift; /* gaps found by the last check. */
+  s64                    s_inodes_drift;
+  s64                    s_dirs_drift;
+
+  // metadata writeback.
+  unsigned long          s_commit_interval; /* jiffies between flushes. */
+  struct delayed_work    s_flush_work;
+
+  // tunables, also in /sys/fs/zarufs/<dev>/.
+  unsigned int           s_dir_ra_pages;   /* 0 follows the device.       */
+  unsigned int           s_inode_prefetch; /* inodes read ahead by readdir. */
+  unsigned int           s_alloc_colors;   /* pid stripes in a group.     */
+  unsigned int           s_bitmap_cache_max; /* bitmaps kept cached.      */
+  struct kobject         s_kobj;
+  struct completion      s_kobj_unregister;
 };
 
+/* defines for bg_flags, which are valid under gdt_csum feature. */
+#define EXT2_BG_INODE_UNINIT (0x0001) /* inode bitmap is not written. */
+#define EXT2_BG_BLOCK_UNINIT (0x0002) /* block bitmap is not written. */
+#define EXT2_BG_INODE_ZEROED (0x0004) /* inode table is zeroed.       */
+
 struct ext2_group_desc {
   __le32 bg_block_bitmap;
   __le32 bg_inode_bitmap;
@@ -323,10 +554,87 @@ struct ext2_group_desc {
   __le16 bg_free_blocks_count;
   __le16 bg_free_inodes_count;
   __le16 bg_used_dirs_count;
-  __le16 bg_pad;
-  __le32 bg_reserved[3];
+  __le16 bg_flags;
+  __le32 bg_exclude_bitmap_lo;
+  __le16 bg_block_bitmap_csum_lo;
+  __le16 bg_inode_bitmap_csum_lo;
+  __le16 bg_itable_unused;    /* inodes at the end never used. */
+  __le16 bg_checksum;         /* crc16 under gdt_csum feature.  */
+
+  /* the following fields exist only with 64bit feature. */
+  __le32 bg_block_bitmap_hi;
+  __le32 bg_inode_bitmap_hi;
+  __le32 bg_inode_table_hi;
+  __le16 bg_free_blocks_count_hi;
+  __le16 bg_free_inodes_count_hi;
+  __le16 bg_used_dirs_count_hi;
+  __le16 bg_itable_unused_hi;
+  __le32 bg_exclude_bitmap_hi;
+  __le16 bg_block_bitmap_csum_hi;
+  __le16 bg_inode_bitmap_csum_hi;
+  __u32  bg_reserved2;
 };
 
+#define EXT2_MIN_DESC_SIZE         (32)
+#define ZARUFS_MIN_DESC_SIZE_64BIT (64)
+#define ZARUFS_MAX_DESC_SIZE       ZARUFS_MIN_BLOCK_SIZE
+
+/* head of the first block of a compressed cluster. */
+struct zarufs_cluster_head {
+  __le32 ch_magic;
+  __le16 ch_method;
+  __le16 ch_pad;
+  __le32 ch_csize; /* bytes of compressed data following this head. */
+  __le32 ch_usize; /* bytes of uncompressed data. */
+};
+
+/* extended attributes. */
+#define ZARUFS_XATTR_MAGIC         (0xEA020000)
+#define ZARUFS_XATTR_REFCOUNT_MAX  (1024)
+
+#define ZARUFS_XATTR_INDEX_USER              (1)
+#define ZARUFS_XATTR_INDEX_POSIX_ACL_ACCESS  (2)
+#define ZARUFS_XATTR_INDEX_POSIX_ACL_DEFAULT (3)
+#define ZARUFS_XATTR_INDEX_TRUSTED           (4)
+#define ZARUFS_XATTR_INDEX_SECURITY          (6)
+
+/* head of an external attribute block. */
+struct zarufs_xattr_header {
+  __le32 h_magic;
+  __le32 h_refcount; /* # of inodes sharing this block. */
+  __le32 h_blocks;
+  __le32 h_hash;
+  __u32  h_reserved[4];
+};
+
+/* head of attributes in spare space of a large inode. */
+struct zarufs_xattr_ibody_header {
+  __le32 h_magic;
+};
+
+struct zarufs_xattr_entry {
+  __u8   e_name_len;
+  __u8   e_name_index;
+  __le16 e_value_offs;
+  __le32 e_value_block;
+  __le32 e_value_size;
+  __le32 e_hash;
+  char   e_name[0];
+};
+
+#define ZARUFS_XATTR_PAD_BITS      (2)
+#define ZARUFS_XATTR_PAD           (1 << ZARUFS_XATTR_PAD_BITS)
+#define ZARUFS_XATTR_ROUND         (ZARUFS_XATTR_PAD - 1)
+#define ZARUFS_XATTR_LEN(name_len)                               \
+  (((name_len) + ZARUFS_XATTR_ROUND +                             \
+    sizeof(struct zarufs_xattr_entry)) & ~ZARUFS_XATTR_ROUND)
+#define ZARUFS_XATTR_NEXT(entry)                                 \
+  ((struct zarufs_xattr_entry*)                                  \
+   ((char*)(entry) + ZARUFS_XATTR_LEN((entry)->e_name_len)))
+#define ZARUFS_XATTR_SIZE(size)                                  \
+  (((size) + ZARUFS_XATTR_ROUND) & ~ZARUFS_XATTR_ROUND)
+#define ZARUFS_XATTR_IS_LAST(entry) (*(__u32*)(entry) == 0)
+
 struct ext2_dir_entry {
   __le32 inode;
   __le16 rec_len;
@@ -351,15 +659,91 @@ static inline struct zarufs_sb_info *ZARUFS_SB(struct super_block *sb) {
   return ((struct zarufs_sb_info*) sb->s_fs_info);
 }
 
+static inline int
+zarufs_has_64bit(struct super_block *sb) {
+  return (!!(ZARUFS_SB(sb)->s_zsb->s_feature_incompat
+             & cpu_to_le32(EXT2_FEATURE_INCOMPAT_64BIT)));
+}
+
+static inline int
+zarufs_has_gdt_csum(struct super_block *sb) {
+  return (!!(ZARUFS_SB(sb)->s_zsb->s_feature_ro_compat
+             & cpu_to_le32(EXT2_FEATURE_RO_COMPAT_GDT_CSUM)));
+}
+
+static inline int
+zarufs_has_meta_bg(struct super_block *sb) {
+  return (!!(ZARUFS_SB(sb)->s_zsb->s_feature_incompat
+             & cpu_to_le32(EXT2_FEATURE_INCOMPAT_META_BG)));
+}
+
+/* number of block pointers in an indirect block. */
+static inline unsigned long
+zarufs_addr_per_block(struct super_block *sb) {
+  return (sb->s_blocksize >> (zarufs_has_64bit(sb) ? 3 : 2));
+}
+
+/* size of the extra inode fields given to new inodes. */
+static inline __u16
+zarufs_want_extra_isize(struct super_block *sb) {
+  if (zarufs_has_64bit(sb)) {
+    return (ZARUFS_64BIT_EXTRA_ISIZE);
+  }
+  return (ZARUFS_MIN_EXTRA_ISIZE);
+}
+
+static inline unsigned long
+zarufs_blocks_count(struct super_block *sb) {
+  struct zarufs_super_block *zsb;
+  unsigned long             count;
+
+  zsb   = ZARUFS_SB(sb)->s_zsb;
+  count = le32_to_cpu(zsb->s_blocks_count);
+  if (zarufs_has_64bit(sb)) {
+    count |= (u64) le32_to_cpu(zsb->s_blocks_count_hi) << 32;
+  }
+  return (count);
+}
+
+static inline unsigned long
+zarufs_r_blocks_count(struct super_block *sb) {
+  struct zarufs_super_block *zsb;
+  unsigned long             count;
+
+  zsb   = ZARUFS_SB(sb)->s_zsb;
+  count = le32_to_cpu(zsb->s_r_blocks_count);
+  if (zarufs_has_64bit(sb)) {
+    count |= (u64) le32_to_cpu(zsb->s_r_blocks_count_hi) << 32;
+  }
+  return (count);
+}
+
 static inline unsigned long
 zarufs_get_first_block_num(struct super_block *sb,
                            unsigned long group_no) {
   unsigned long first_block_num;
-  first_block_num = group_no * le32_to_cpu(ZARUFS_SB(sb)->s_blocks_per_group)
+  first_block_num = group_no * ZARUFS_SB(sb)->s_blocks_per_group
     + le32_to_cpu(ZARUFS_SB(sb)->s_zsb->s_first_data_block);
   return (first_block_num);
 }
 
+/* block <-> cluster. without bigalloc a cluster is a single block. */
+#define ZARUFS_B2C(zsi, blk) ((blk) >> (zsi)->s_cluster_bits)
+#define ZARUFS_C2B(zsi, cls) ((cls) << (zsi)->s_cluster_bits)
+#define ZARUFS_CLUSTER_OFFSET(zsi, blk) ((blk) & ((zsi)->s_cluster_ratio - 1))
+
+static inline int
+zarufs_has_bigalloc(struct super_block *sb) {
+  return (!!(ZARUFS_SB(sb)->s_zsb->s_feature_ro_compat
+             & cpu_to_le32(EXT2_FEATURE_RO_COMPAT_BIGALLOC)));
+}
+
+static inline int
+zarufs_has_dir_index(struct super_block *sb) {
+  return (!!(ZARUFS_SB(sb)->s_zsb->s_feature_compat
+             & cpu_to_le32(EXT2_FEATURE_COMPAT_DIR_INDEX)));
+}
+
 static inline struct zarufs_inode_info
 *ZARUFS_I(struct inode *inode) {
   return (container_of(inode, struct zarufs_inode_info, vfs_inode));
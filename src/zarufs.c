@@ -5,17 +5,23 @@
 #include "../include/zarufs.h"
 #include "zarufs_super.h"
 #include "zarufs_utils.h"
+#include "zarufs_xattr.h"
+#include "zarufs_dir_cache.h"
+#include "zarufs_dir.h"
+#include "zarufs_sysfs.h"
+#include "zarufs_bitmap.h"
 
 static struct dentry *zarufs_mount(struct file_system_type *fs_type,
                                    int flags,
                                    const char *dev_name,
                                    void *data);
 
+static void zarufs_kill_sb(struct super_block *sb);
 
 static struct file_system_type zarufs_fstype = {
   .name     = "zarufs",
   .mount    = zarufs_mount,
-  .kill_sb  = kill_block_super,
+  .kill_sb  = zarufs_kill_sb,
   .fs_flags = FS_REQUIRES_DEV,
 };
 
@@ -28,23 +34,70 @@ static struct dentry *zarufs_mount(struct file_system_type *fs_type,
   return zarufs_mount_block_dev(fs_type, flags, dev_name, data);
 }
 
+static void zarufs_kill_sb(struct super_block *sb) {
+  struct zarufs_sb_info *zsi;
+
+  /* a pending compression pass holds an inode, */
+  /* which has to go before the inodes are evicted. */
+  zsi = ZARUFS_SB(sb);
+  if (zsi) {
+    flush_workqueue(zsi->s_compr_wq);
+  }
+  kill_block_super(sb);
+}
+
 static int __init init_zarufs(void) {
   int error;
   DBGPRINT("[ZARUFS] Hello, World.\n");
+  zarufs_init_dir_locks();
+  error = zarufs_init_xattr();
+  if (error) {
+    return (error);
+  }
+  error = zarufs_init_dir_cache();
+  if (error) {
+    zarufs_exit_xattr();
+    return (error);
+  }
   error = zarufs_init_inode_cache();
   if (error) {
+    zarufs_exit_dir_cache();
+    zarufs_exit_xattr();
+    return (error);
+  }
+  error = zarufs_init_sysfs();
+  if (error) {
+    zarufs_destroy_inode_cache();
+    zarufs_exit_dir_cache();
+    zarufs_exit_xattr();
+    return (error);
+  }
+  error = zarufs_init_bitmap_entries();
+  if (error) {
+    zarufs_exit_sysfs();
+    zarufs_destroy_inode_cache();
+    zarufs_exit_dir_cache();
+    zarufs_exit_xattr();
     return (error);
   }
   error = register_filesystem(&zarufs_fstype);
   if (error) {
+    zarufs_exit_bitmap_entries();
+    zarufs_exit_sysfs();
     zarufs_destroy_inode_cache();
+    zarufs_exit_dir_cache();
+    zarufs_exit_xattr();
   }
   return(error);
 }
 
 static void __exit exit_zarufs(void) {
   DBGPRINT("[ZARUFS] GoodBye!.\n");
+  zarufs_exit_bitmap_entries();
+  zarufs_exit_sysfs();
   zarufs_destroy_inode_cache();
+  zarufs_exit_dir_cache();
+  zarufs_exit_xattr();
   unregister_filesystem(&zarufs_fstype);
   return;
 }
@@ -0,0 +1,131 @@
+/* zarufs_acl.c */
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/posix_acl.h>
+#include <linux/posix_acl_xattr.h>
+
+#include "../include/zarufs.h"
+#include "zarufs_utils.h"
+#include "zarufs_xattr.h"
+#include "zarufs_acl.h"
+
+/* acls are stored as attributes in the posix_acl_xattr format. */
+
+struct posix_acl*
+zarufs_get_acl(struct inode *inode, int type) {
+  struct posix_acl *acl;
+  char             *value;
+  int              name_index;
+  int              size;
+
+  switch (type) {
+  case ACL_TYPE_ACCESS:
+    name_index = ZARUFS_XATTR_INDEX_POSIX_ACL_ACCESS;
+    break;
+  case ACL_TYPE_DEFAULT:
+    name_index = ZARUFS_XATTR_INDEX_POSIX_ACL_DEFAULT;
+    break;
+  default:
+    return (ERR_PTR(-EINVAL));
+  }
+
+  value = NULL;
+  size  = zarufs_xattr_get(inode, name_index, "", NULL, 0);
+  if (0 < size) {
+    if (!(value = kmalloc(size, GFP_NOFS))) {
+      return (ERR_PTR(-ENOMEM));
+    }
+    size = zarufs_xattr_get(inode, name_index, "", value, size);
+  }
+
+  if (0 < size) {
+    acl = posix_acl_from_xattr(&init_user_ns, value, size);
+  } else if ((size == -ENODATA) || (size == -ENOSYS)) {
+    acl = NULL;
+  } else {
+    acl = ERR_PTR(size);
+  }
+  kfree(value);
+
+  if (!IS_ERR(acl)) {
+    set_cached_acl(inode, type, acl);
+  }
+  return (acl);
+}
+
+int
+zarufs_set_acl(struct inode *inode, struct posix_acl *acl, int type) {
+  char   *value;
+  size_t size;
+  int    name_index;
+  int    err;
+
+  switch (type) {
+  case ACL_TYPE_ACCESS:
+    name_index = ZARUFS_XATTR_INDEX_POSIX_ACL_ACCESS;
+    if (acl) {
+      if ((err = posix_acl_equiv_mode(acl, &inode->i_mode)) < 0) {
+        return (err);
+      }
+      inode->i_ctime = CURRENT_TIME_SEC;
+      mark_inode_dirty(inode);
+      if (!err) {
+        /* the acl is expressed by the mode bits. */
+        acl = NULL;
+      }
+    }
+    break;
+  case ACL_TYPE_DEFAULT:
+    name_index = ZARUFS_XATTR_INDEX_POSIX_ACL_DEFAULT;
+    if (!S_ISDIR(inode->i_mode)) {
+      return (acl ? -EACCES : 0);
+    }
+    break;
+  default:
+    return (-EINVAL);
+  }
+
+  value = NULL;
+  size  = 0;
+  if (acl) {
+    size = posix_acl_xattr_size(acl->a_count);
+    if (!(value = kmalloc(size, GFP_NOFS))) {
+      return (-ENOMEM);
+    }
+    if ((err = posix_acl_to_xattr(&init_user_ns, acl, value, size)) < 0) {
+      goto out;
+    }
+  }
+
+  err = zarufs_xattr_set(inode, name_index, "", value, size, 0);
+  if (!err) {
+    set_cached_acl(inode, type, acl);
+  }
+
+ out:
+  kfree(value);
+  return (err);
+}
+
+int
+zarufs_init_acl(struct inode *inode, struct inode *dir) {
+  struct posix_acl *default_acl;
+  struct posix_acl *acl;
+  int              err;
+
+  if ((err = posix_acl_create(dir, &inode->i_mode, &default_acl, &acl))) {
+    return (err);
+  }
+
+  if (default_acl) {
+    err = zarufs_set_acl(inode, default_acl, ACL_TYPE_DEFAULT);
+    posix_acl_release(default_acl);
+  }
+  if (acl) {
+    if (!err) {
+      err = zarufs_set_acl(inode, acl, ACL_TYPE_ACCESS);
+    }
+    posix_acl_release(acl);
+  }
+  return (err);
+}
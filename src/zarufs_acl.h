@@ -0,0 +1,14 @@
+/* zarufs_acl.h */
+#ifndef _ZARUFS_ACL_H_
+#define _ZARUFS_ACL_H_
+
+struct posix_acl*
+zarufs_get_acl(struct inode *inode, int type);
+
+int
+zarufs_set_acl(struct inode *inode, struct posix_acl *acl, int type);
+
+int
+zarufs_init_acl(struct inode *inode, struct inode *dir);
+
+#endif
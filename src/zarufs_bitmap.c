@@ -0,0 +1,308 @@
+/* zarufs_bitmap.c */
+#include <linux/fs.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+
+#include "../include/zarufs.h"
+#include "zarufs_block.h"
+#include "zarufs_bitmap.h"
+#include "zarufs_utils.h"
+
+/*
+ * block and inode bitmaps which the allocators have used are kept with a
+ * reference of their own, so that the next allocation in the group finds
+ * them without a descriptor or buffer cache lookup. they are listed in
+ * lru order. beyond s_bitmap_cache_max, and when memory is short, the
+ * least recently used ones which are clean, idle and held by no caller
+ * are given back.
+ */
+
+/* groups whose bitmaps are read ahead when the allocator moves on. */
+#define ZARUFS_BITMAP_RA_GROUPS (8)
+
+struct zarufs_bitmap_entry {
+  struct list_head   lru;
+  struct buffer_head *bh;
+  unsigned long      block_group;
+  int                kind;
+};
+
+static unsigned long
+release_bitmaps(struct zarufs_sb_info *zsi, unsigned long nr, int force);
+
+static unsigned long
+count_bitmaps(struct shrinker *shrink, struct shrink_control *sc);
+
+static unsigned long
+scan_bitmaps(struct shrinker *shrink, struct shrink_control *sc);
+
+static struct kmem_cache *zarufs_bitmap_entry_cachep;
+
+/* a cached bitmap with a reference for the caller, or NULL. */
+struct buffer_head*
+zarufs_bitmap_cache_get(struct super_block *sb,
+                        unsigned long block_group,
+                        int kind) {
+  struct zarufs_sb_info      *zsi;
+  struct zarufs_group_info   *gi;
+  struct zarufs_bitmap_entry *entry;
+  struct buffer_head         *bh;
+
+  zsi = ZARUFS_SB(sb);
+  gi  = zarufs_group_info(sb, block_group);
+  if (!ACCESS_ONCE(gi->bitmaps[kind])) {
+    return (NULL);
+  }
+
+  bh = NULL;
+  spin_lock(&zsi->s_bitmap_lock);
+  if ((entry = gi->bitmaps[kind])) {
+    bh = entry->bh;
+    get_bh(bh);
+    list_move_tail(&entry->lru, &zsi->s_bitmap_lru);
+  }
+  spin_unlock(&zsi->s_bitmap_lock);
+  return (bh);
+}
+
+/* keep bh, which has just been read, for the next allocations. */
+void
+zarufs_bitmap_cache_add(struct super_block *sb,
+                        unsigned long block_group,
+                        int kind,
+                        struct buffer_head *bh) {
+  struct zarufs_sb_info      *zsi;
+  struct zarufs_group_info   *gi;
+  struct zarufs_bitmap_entry *entry;
+
+  zsi = ZARUFS_SB(sb);
+  gi  = zarufs_group_info(sb, block_group);
+  if (!zsi->s_bitmap_cache_max) {
+    return;
+  }
+  if (!(entry = kmem_cache_alloc(zarufs_bitmap_entry_cachep, GFP_NOFS))) {
+    return;
+  }
+
+  spin_lock(&zsi->s_bitmap_lock);
+  if (gi->bitmaps[kind]) {
+    /* a racing reader has cached it. */
+    spin_unlock(&zsi->s_bitmap_lock);
+    kmem_cache_free(zarufs_bitmap_entry_cachep, entry);
+    return;
+  }
+  get_bh(bh);
+  entry->bh          = bh;
+  entry->block_group = block_group;
+  entry->kind        = kind;
+  list_add_tail(&entry->lru, &zsi->s_bitmap_lru);
+  gi->bitmaps[kind] = entry;
+  zsi->s_bitmap_cached++;
+  if (zsi->s_bitmap_cache_max < zsi->s_bitmap_cached) {
+    release_bitmaps(zsi, zsi->s_bitmap_cached - zsi->s_bitmap_cache_max, 0);
+  }
+  spin_unlock(&zsi->s_bitmap_lock);
+}
+
+/*
+ * the allocator has found the group full. read ahead the bitmaps of the
+ * next groups with room, so that they are in memory when it gets there.
+ * an uninitialized bitmap is derived rather than read, and is left alone.
+ */
+void
+zarufs_bitmap_readahead(struct super_block *sb,
+                        unsigned long block_group,
+                        int kind) {
+  struct zarufs_sb_info    *zsi;
+  struct zarufs_group_info *gi;
+  struct ext2_group_desc   *gdesc;
+  struct buffer_head       *gdesc_bh;
+  struct buffer_head       *bhs[ZARUFS_BITMAP_RA_GROUPS];
+  struct blk_plug          plug;
+  unsigned long            group;
+  unsigned long            block;
+  __u16                    uninit;
+  int                      nr;
+  int                      i;
+
+  zsi    = ZARUFS_SB(sb);
+  uninit = (kind == ZARUFS_BLOCK_BITMAP) ?
+    EXT2_BG_BLOCK_UNINIT : EXT2_BG_INODE_UNINIT;
+  nr     = 0;
+  for (i = 1;
+       (i <= ZARUFS_BITMAP_RA_GROUPS) && (i < zsi->s_groups_count);
+       i++) {
+    group = (block_group + i) % zsi->s_groups_count;
+    gi    = zarufs_group_info(sb, group);
+    if (ACCESS_ONCE(gi->bitmaps[kind])) {
+      continue;
+    }
+    if ((kind == ZARUFS_BLOCK_BITMAP) ? !gi->free_blocks : !gi->free_inodes) {
+      continue;
+    }
+    if (zarufs_has_gdt_csum(sb) && (gi->flags & uninit)) {
+      continue;
+    }
+
+    if (!(gdesc = zarufs_get_group_descriptor(sb, group, &gdesc_bh))) {
+      continue;
+    }
+    block = 0;
+    if (zarufs_valid_group_desc(sb, group, gdesc)) {
+      block = (kind == ZARUFS_BLOCK_BITMAP) ?
+        zarufs_block_bitmap(sb, gdesc) : zarufs_inode_bitmap(sb, gdesc);
+    }
+    brelse(gdesc_bh);
+    if (!block || !(bhs[nr] = sb_getblk(sb, block))) {
+      continue;
+    }
+    if (buffer_uptodate(bhs[nr])) {
+      brelse(bhs[nr]);
+      continue;
+    }
+    nr++;
+  }
+  if (!nr) {
+    return;
+  }
+
+  blk_start_plug(&plug);
+  ll_rw_block(READA, nr, bhs);
+  blk_finish_plug(&plug);
+  for (i = 0; i < nr; i++) {
+    brelse(bhs[i]);
+  }
+}
+
+int
+zarufs_init_bitmap_cache(struct super_block *sb) {
+  struct zarufs_sb_info *zsi;
+  int                   err;
+
+  zsi = ZARUFS_SB(sb);
+  spin_lock_init(&zsi->s_bitmap_lock);
+  INIT_LIST_HEAD(&zsi->s_bitmap_lru);
+  zsi->s_bitmap_cached  = 0;
+  zsi->s_bitmap_checked = kcalloc(BITS_TO_LONGS(zsi->s_groups_count),
+                                  sizeof(unsigned long),
+                                  GFP_KERNEL);
+  if (!zsi->s_bitmap_checked) {
+    ZARUFS_ERROR("[ZARUFS] %s: cannot allocate bitmap cache.\n", __func__);
+    return (-ENOMEM);
+  }
+
+  zsi->s_bitmap_shrinker.count_objects = count_bitmaps;
+  zsi->s_bitmap_shrinker.scan_objects  = scan_bitmaps;
+  zsi->s_bitmap_shrinker.seeks         = DEFAULT_SEEKS;
+  if ((err = register_shrinker(&zsi->s_bitmap_shrinker))) {
+    kfree(zsi->s_bitmap_checked);
+    zsi->s_bitmap_checked = NULL;
+    return (err);
+  }
+  return (0);
+}
+
+/*
+ * give back the bitmaps beyond the limit, after it was lowered. one which
+ * is dirty or in use stays until the shrinker finds it idle.
+ */
+void
+zarufs_trim_bitmap_cache(struct super_block *sb) {
+  struct zarufs_sb_info *zsi;
+
+  zsi = ZARUFS_SB(sb);
+  spin_lock(&zsi->s_bitmap_lock);
+  if (zsi->s_bitmap_cache_max < zsi->s_bitmap_cached) {
+    release_bitmaps(zsi, zsi->s_bitmap_cached - zsi->s_bitmap_cache_max, 0);
+  }
+  spin_unlock(&zsi->s_bitmap_lock);
+}
+
+/* dirty bitmaps are left to the buffer cache, which writes them back. */
+void
+zarufs_destroy_bitmap_cache(struct super_block *sb) {
+  struct zarufs_sb_info *zsi;
+
+  zsi = ZARUFS_SB(sb);
+  unregister_shrinker(&zsi->s_bitmap_shrinker);
+  spin_lock(&zsi->s_bitmap_lock);
+  release_bitmaps(zsi, zsi->s_bitmap_cached, 1);
+  spin_unlock(&zsi->s_bitmap_lock);
+  kfree(zsi->s_bitmap_checked);
+  zsi->s_bitmap_checked = NULL;
+}
+
+int
+zarufs_init_bitmap_entries(void) {
+  zarufs_bitmap_entry_cachep =
+    kmem_cache_create("zarufs_bitmap_entry",
+                      sizeof(struct zarufs_bitmap_entry),
+                      0,
+                      SLAB_RECLAIM_ACCOUNT,
+                      NULL);
+  if (!zarufs_bitmap_entry_cachep) {
+    return (-ENOMEM);
+  }
+  return (0);
+}
+
+void
+zarufs_exit_bitmap_entries(void) {
+  kmem_cache_destroy(zarufs_bitmap_entry_cachep);
+}
+
+/*
+ * give back up to nr bitmaps from the cold end of the list, under the
+ * cache lock. one which is dirty, under i/o or held by a caller stays,
+ * unless force is set at unmount.
+ */
+static unsigned long
+release_bitmaps(struct zarufs_sb_info *zsi, unsigned long nr, int force) {
+  struct zarufs_bitmap_entry *entry;
+  struct zarufs_bitmap_entry *next;
+  struct buffer_head         *bh;
+  unsigned long              freed;
+
+  freed = 0;
+  list_for_each_entry_safe(entry, next, &zsi->s_bitmap_lru, lru) {
+    if (nr <= freed) {
+      break;
+    }
+    bh = entry->bh;
+    if (!force &&
+        ((atomic_read(&bh->b_count) != 1) ||
+         buffer_dirty(bh) ||
+         buffer_locked(bh))) {
+      continue;
+    }
+    list_del(&entry->lru);
+    zsi->s_group_info[entry->block_group].bitmaps[entry->kind] = NULL;
+    zsi->s_bitmap_cached--;
+    brelse(bh);
+    kmem_cache_free(zarufs_bitmap_entry_cachep, entry);
+    freed++;
+  }
+  return (freed);
+}
+
+static unsigned long
+count_bitmaps(struct shrinker *shrink, struct shrink_control *sc) {
+  struct zarufs_sb_info *zsi;
+
+  zsi = container_of(shrink, struct zarufs_sb_info, s_bitmap_shrinker);
+  return (ACCESS_ONCE(zsi->s_bitmap_cached));
+}
+
+static unsigned long
+scan_bitmaps(struct shrinker *shrink, struct shrink_control *sc) {
+  struct zarufs_sb_info *zsi;
+  unsigned long         freed;
+
+  zsi = container_of(shrink, struct zarufs_sb_info, s_bitmap_shrinker);
+  spin_lock(&zsi->s_bitmap_lock);
+  freed = release_bitmaps(zsi, sc->nr_to_scan, 0);
+  spin_unlock(&zsi->s_bitmap_lock);
+  return (freed ? freed : SHRINK_STOP);
+}
@@ -0,0 +1,33 @@
+/* zarufs_bitmap.h */
+#ifndef _ZARUFS_BITMAP_H_
+#define _ZARUFS_BITMAP_H_
+
+struct buffer_head*
+zarufs_bitmap_cache_get(struct super_block *sb,
+                        unsigned long block_group,
+                        int kind);
+
+void
+zarufs_bitmap_cache_add(struct super_block *sb,
+                        unsigned long block_group,
+                        int kind,
+                        struct buffer_head *bh);
+
+void
+zarufs_trim_bitmap_cache(struct super_block *sb);
+
+void
+zarufs_bitmap_readahead(struct super_block *sb,
+                        unsigned long block_group,
+                        int kind);
+
+int
+zarufs_init_bitmap_cache(struct super_block *sb);
+
+void
+zarufs_destroy_bitmap_cache(struct super_block *sb);
+
+int  zarufs_init_bitmap_entries(void);
+void zarufs_exit_bitmap_entries(void);
+
+#endif
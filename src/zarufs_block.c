@@ -1,9 +1,14 @@
 /* zarufs_block.c */
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
+#include <linux/blkdev.h>
+#include <linux/slab.h>
+#include <linux/crc16.h>
+#include <linux/vmalloc.h>
 
 #include "../include/zarufs.h"
 #include "zarufs_block.h"
+#include "zarufs_bitmap.h"
 #include "zarufs_utils.h"
 
 #define IN_RANGE(b, first, len) (((first) <= (b)) \
@@ -16,11 +21,17 @@ static int
 test_root(int group, int multiple);
 
 static int
-has_free_blocks(struct zarufs_sb_info *zsi);
+has_free_blocks(struct super_block *sb);
 
 static struct buffer_head*
 read_block_bitmap(struct super_block *sb, unsigned long block_group);
 
+static void
+init_block_bitmap(struct super_block *sb,
+                  unsigned long block_group,
+                  struct ext2_group_desc *gdesc,
+                  struct buffer_head *bh);
+
 static int
 valid_block_bitmap(struct super_block *sb,
                    struct ext2_group_desc *gdesc,
@@ -41,17 +52,34 @@ adjust_group_blocks(struct super_block *sb,
                     unsigned long group_no,
                     struct ext2_group_desc *gdesc,
                     struct buffer_head *bh,
-                    long count);
+                    long count,
+                    unsigned long from,
+                    unsigned long cluster);
+
+static struct buffer_head*
+get_gdesc_block(struct super_block *sb, unsigned long index);
+
+static unsigned long
+count_gdesc_blocks(struct shrinker *shrink, struct shrink_control *sc);
 
+static unsigned long
+scan_gdesc_blocks(struct shrinker *shrink, struct shrink_control *sc);
+
+/*
+ * the descriptor is valid while *bhp is held, which the caller releases
+ * by brelse. *bhp is NULL on failure.
+ */
 struct ext2_group_desc*
 zarufs_get_group_descriptor(struct super_block *sb,
-                            unsigned int block_group) {
+                            unsigned int block_group,
+                            struct buffer_head **bhp) {
   struct zarufs_sb_info  *zsi;
   unsigned long          gdesc_index;
   unsigned long          gdesc_offset;
   struct ext2_group_desc *group_desc;
 
-  zsi = ZARUFS_SB(sb);
+  zsi  = ZARUFS_SB(sb);
+  *bhp = NULL;
 
   if (zsi->s_groups_count <= block_group) {
     ZARUFS_ERROR("[ZARUFS] block group number is out of group count of sb.\n");
@@ -61,13 +89,191 @@ zarufs_get_group_descriptor(struct super_block *sb,
   }
 
   gdesc_index = block_group / zsi->s_desc_per_block;
-  if (!(group_desc = (struct ext2_group_desc*)(zsi->s_group_desc[gdesc_index]->b_data))) {
+  if (!(*bhp = get_gdesc_block(sb, gdesc_index))) {
     ZARUFS_ERROR("[ZARUFS] cannot find %u th group descriptor\n", block_group);
     return NULL;
   }
+  group_desc = (struct ext2_group_desc*) (*bhp)->b_data;
 
+  /* descriptors are s_desc_size apart, which may exceed the struct. */
   gdesc_offset = block_group % zsi->s_desc_per_block;
-  return (group_desc + gdesc_offset);
+  return ((struct ext2_group_desc*)
+          ((char*) group_desc + gdesc_offset * zsi->s_desc_size));
+}
+
+/* fields of a group descriptor, with the high half under 64bit feature. */
+unsigned long
+zarufs_block_bitmap(struct super_block *sb, struct ext2_group_desc *gdesc) {
+  unsigned long blk;
+
+  blk = le32_to_cpu(gdesc->bg_block_bitmap);
+  if (zarufs_has_64bit(sb)) {
+    blk |= (u64) le32_to_cpu(gdesc->bg_block_bitmap_hi) << 32;
+  }
+  return (blk);
+}
+
+unsigned long
+zarufs_inode_bitmap(struct super_block *sb, struct ext2_group_desc *gdesc) {
+  unsigned long blk;
+
+  blk = le32_to_cpu(gdesc->bg_inode_bitmap);
+  if (zarufs_has_64bit(sb)) {
+    blk |= (u64) le32_to_cpu(gdesc->bg_inode_bitmap_hi) << 32;
+  }
+  return (blk);
+}
+
+unsigned long
+zarufs_inode_table(struct super_block *sb, struct ext2_group_desc *gdesc) {
+  unsigned long blk;
+
+  blk = le32_to_cpu(gdesc->bg_inode_table);
+  if (zarufs_has_64bit(sb)) {
+    blk |= (u64) le32_to_cpu(gdesc->bg_inode_table_hi) << 32;
+  }
+  return (blk);
+}
+
+__u32
+zarufs_free_blocks_count(struct super_block *sb,
+                         struct ext2_group_desc *gdesc) {
+  __u32 count;
+
+  count = le16_to_cpu(gdesc->bg_free_blocks_count);
+  if (zarufs_has_64bit(sb)) {
+    count |= (__u32) le16_to_cpu(gdesc->bg_free_blocks_count_hi) << 16;
+  }
+  return (count);
+}
+
+__u32
+zarufs_free_inodes_count(struct super_block *sb,
+                         struct ext2_group_desc *gdesc) {
+  __u32 count;
+
+  count = le16_to_cpu(gdesc->bg_free_inodes_count);
+  if (zarufs_has_64bit(sb)) {
+    count |= (__u32) le16_to_cpu(gdesc->bg_free_inodes_count_hi) << 16;
+  }
+  return (count);
+}
+
+__u32
+zarufs_used_dirs_count(struct super_block *sb,
+                       struct ext2_group_desc *gdesc) {
+  __u32 count;
+
+  count = le16_to_cpu(gdesc->bg_used_dirs_count);
+  if (zarufs_has_64bit(sb)) {
+    count |= (__u32) le16_to_cpu(gdesc->bg_used_dirs_count_hi) << 16;
+  }
+  return (count);
+}
+
+void
+zarufs_free_blocks_count_set(struct super_block *sb,
+                             struct ext2_group_desc *gdesc,
+                             __u32 count) {
+  gdesc->bg_free_blocks_count = cpu_to_le16((__u16) count);
+  if (zarufs_has_64bit(sb)) {
+    gdesc->bg_free_blocks_count_hi = cpu_to_le16(count >> 16);
+  }
+}
+
+void
+zarufs_free_inodes_count_set(struct super_block *sb,
+                             struct ext2_group_desc *gdesc,
+                             __u32 count) {
+  gdesc->bg_free_inodes_count = cpu_to_le16((__u16) count);
+  if (zarufs_has_64bit(sb)) {
+    gdesc->bg_free_inodes_count_hi = cpu_to_le16(count >> 16);
+  }
+}
+
+void
+zarufs_used_dirs_count_set(struct super_block *sb,
+                           struct ext2_group_desc *gdesc,
+                           __u32 count) {
+  gdesc->bg_used_dirs_count = cpu_to_le16((__u16) count);
+  if (zarufs_has_64bit(sb)) {
+    gdesc->bg_used_dirs_count_hi = cpu_to_le16(count >> 16);
+  }
+}
+
+__u32
+zarufs_itable_unused(struct super_block *sb, struct ext2_group_desc *gdesc) {
+  __u32 count;
+
+  count = le16_to_cpu(gdesc->bg_itable_unused);
+  if (zarufs_has_64bit(sb)) {
+    count |= (__u32) le16_to_cpu(gdesc->bg_itable_unused_hi) << 16;
+  }
+  return (count);
+}
+
+void
+zarufs_itable_unused_set(struct super_block *sb,
+                         struct ext2_group_desc *gdesc,
+                         __u32 count) {
+  gdesc->bg_itable_unused = cpu_to_le16((__u16) count);
+  if (zarufs_has_64bit(sb)) {
+    gdesc->bg_itable_unused_hi = cpu_to_le16(count >> 16);
+  }
+}
+
+/*
+ * crc16 of the uuid, the group number and the descriptor except its
+ * checksum field, as e2fsprogs computes it under gdt_csum feature.
+ */
+static __le16
+group_desc_csum(struct super_block *sb,
+                unsigned long block_group,
+                struct ext2_group_desc *gdesc) {
+  struct zarufs_sb_info *zsi;
+  __le32                le_group;
+  size_t                offset;
+  __u16                 crc;
+
+  zsi      = ZARUFS_SB(sb);
+  le_group = cpu_to_le32(block_group);
+  offset   = offsetof(struct ext2_group_desc, bg_checksum);
+
+  crc = crc16(~0, zsi->s_zsb->s_uuid, sizeof(zsi->s_zsb->s_uuid));
+  crc = crc16(crc, (__u8*) &le_group, sizeof(le_group));
+  crc = crc16(crc, (__u8*) gdesc, offset);
+  offset += sizeof(gdesc->bg_checksum);
+  if (offset < zsi->s_desc_size) {
+    crc = crc16(crc, (__u8*) gdesc + offset, zsi->s_desc_size - offset);
+  }
+  return (cpu_to_le16(crc));
+}
+
+/* to be called with the group lock held, after changing a descriptor. */
+void
+zarufs_group_desc_csum_set(struct super_block *sb,
+                           unsigned long block_group,
+                           struct ext2_group_desc *gdesc) {
+  if (zarufs_has_gdt_csum(sb)) {
+    gdesc->bg_checksum = group_desc_csum(sb, block_group, gdesc);
+  }
+}
+
+/* blocks of super block, descriptors and reserved descriptors in a group. */
+unsigned long
+zarufs_bg_meta_blocks(struct super_block *sb, unsigned long group) {
+  struct zarufs_sb_info *zsi;
+  unsigned long         blocks;
+
+  zsi    = ZARUFS_SB(sb);
+  blocks = zarufs_has_bg_super(sb, group) + zarufs_bg_num_gdb(sb, group);
+  if (zarufs_has_bg_super(sb, group) &&
+      (!zarufs_has_meta_bg(sb) ||
+       ((group / zsi->s_desc_per_block) <
+        le32_to_cpu(zsi->s_zsb->s_first_meta_bg)))) {
+    blocks += le16_to_cpu(zsi->s_zsb->s_reserved_gdt_blocks);
+  }
+  return (blocks);
 }
 
 int
@@ -80,59 +286,310 @@ zarufs_has_bg_super(struct super_block *sb, int group) {
   return (1);
 }
 
-struct buffer_head*
-zarufs_get_gdesc_buffer_cache(struct super_block *sb, unsigned int block_group) {
+/*
+ * the block of the nr-th descriptor block. under meta_bg, descriptor
+ * blocks from s_first_meta_bg on sit in the first group of the meta group
+ * they describe, after its super block backup if any.
+ */
+unsigned long
+zarufs_descriptor_block(struct super_block *sb, unsigned long nr) {
+  struct zarufs_sb_info *zsi;
+  unsigned long         logic_sb_block;
+  unsigned long         bg;
+
+  zsi            = ZARUFS_SB(sb);
+  logic_sb_block = (zsi->s_sb_block * BLOCK_SIZE) / sb->s_blocksize;
+  if (!zarufs_has_meta_bg(sb) ||
+      (nr < le32_to_cpu(zsi->s_zsb->s_first_meta_bg))) {
+    return (logic_sb_block + nr + 1);
+  }
+  bg = zsi->s_desc_per_block * nr;
+  return (zarufs_get_first_block_num(sb, bg) + zarufs_has_bg_super(sb, bg));
+}
+
+/* number of descriptor blocks, primary or backup, stored in a group. */
+unsigned long
+zarufs_bg_num_gdb(struct super_block *sb, unsigned long group) {
   struct zarufs_sb_info *zsi;
-  unsigned long         gdesc_index;
+  unsigned long         first_meta_bg;
+  unsigned long         index;
+
+  zsi           = ZARUFS_SB(sb);
+  first_meta_bg = le32_to_cpu(zsi->s_zsb->s_first_meta_bg);
+  if (!zarufs_has_meta_bg(sb) ||
+      ((group / zsi->s_desc_per_block) < first_meta_bg)) {
+    if (!zarufs_has_bg_super(sb, group)) {
+      return (0);
+    }
+    if (zarufs_has_meta_bg(sb)) {
+      return (min(first_meta_bg, zsi->s_gdb_count));
+    }
+    return (zsi->s_gdb_count);
+  }
+
+  /* a meta group keeps its block in the first, second and last groups. */
+  index = group % zsi->s_desc_per_block;
+  if ((index == 0) || (index == 1) || (index == zsi->s_desc_per_block - 1)) {
+    return (1);
+  }
+  return (0);
+}
+
+/*
+ * descriptor blocks are loaded when first used and kept in s_group_desc[]
+ * with a reference of their own. a shrinker gives back the ones which are
+ * clean, idle and not used since its last pass, so that a large volume
+ * does not pin all of them for the lifetime of the mount.
+ */
+int
+zarufs_init_gdesc_cache(struct super_block *sb) {
+  struct zarufs_sb_info *zsi;
+  int                   err;
 
   zsi = ZARUFS_SB(sb);
-  if (zsi->s_groups_count <= block_group) {
-    ZARUFS_ERROR("[ZARUFS] %s: large block group number.", __func__);
-    ZARUFS_ERROR("[ZARUFS] block_group=%u, s_groups_count=%lu\n",
-                 block_group, zsi->s_groups_count);
-    return(NULL);
+  spin_lock_init(&zsi->s_group_desc_lock);
+  zsi->s_group_desc_cached = 0;
+  zsi->s_group_desc_hand   = 0;
+  zsi->s_group_desc = kcalloc(zsi->s_gdb_count,
+                              sizeof(struct buffer_head*),
+                              GFP_KERNEL);
+  zsi->s_group_desc_ref = kcalloc(BITS_TO_LONGS(zsi->s_gdb_count),
+                                  sizeof(unsigned long),
+                                  GFP_KERNEL);
+  zsi->s_group_checked = kcalloc(BITS_TO_LONGS(zsi->s_groups_count),
+                                 sizeof(unsigned long),
+                                 GFP_KERNEL);
+  if (!zsi->s_group_desc || !zsi->s_group_desc_ref || !zsi->s_group_checked) {
+    ZARUFS_ERROR("[ZARUFS] %s: cannot allocate descriptor cache.\n", __func__);
+    err = -ENOMEM;
+    goto out_free;
   }
 
-  gdesc_index = block_group / zsi->s_desc_per_block;
-  return(zsi->s_group_desc[gdesc_index]);
+  zsi->s_group_desc_shrinker.count_objects = count_gdesc_blocks;
+  zsi->s_group_desc_shrinker.scan_objects  = scan_gdesc_blocks;
+  zsi->s_group_desc_shrinker.seeks         = DEFAULT_SEEKS;
+  if ((err = register_shrinker(&zsi->s_group_desc_shrinker))) {
+    goto out_free;
+  }
+  return (0);
+
+ out_free:
+  kfree(zsi->s_group_checked);
+  kfree(zsi->s_group_desc_ref);
+  kfree(zsi->s_group_desc);
+  zsi->s_group_checked  = NULL;
+  zsi->s_group_desc_ref = NULL;
+  zsi->s_group_desc     = NULL;
+  return (err);
 }
 
-unsigned long
-zarufs_count_free_blocks(struct super_block *sb) {
-  unsigned long desc_count;
-  int           i;
-
-  desc_count = 0;
-  for (i = 0; i < ZARUFS_SB(sb)->s_groups_count; i++) {
-    struct ext2_group_desc *gdesc;
-    if (!(gdesc = zarufs_get_group_descriptor(sb, i))) {
+void
+zarufs_destroy_gdesc_cache(struct super_block *sb) {
+  struct zarufs_sb_info *zsi;
+  unsigned long         i;
+
+  zsi = ZARUFS_SB(sb);
+  unregister_shrinker(&zsi->s_group_desc_shrinker);
+  for (i = 0; i < zsi->s_gdb_count; i++) {
+    brelse(zsi->s_group_desc[i]);
+  }
+  kfree(zsi->s_group_checked);
+  kfree(zsi->s_group_desc_ref);
+  kfree(zsi->s_group_desc);
+}
+
+/*
+ * bring every descriptor block into the cache at once. the reads are
+ * issued together under a plug and waited for afterwards, so that mount
+ * does not wait for one block after another.
+ */
+int
+zarufs_read_group_descriptors(struct super_block *sb) {
+  struct zarufs_sb_info *zsi;
+  struct buffer_head    **bhs;
+  struct blk_plug       plug;
+  unsigned long         i;
+
+  zsi = ZARUFS_SB(sb);
+  bhs = zsi->s_group_desc;
+  for (i = 0; i < zsi->s_gdb_count; i++) {
+    if (!(bhs[i] = sb_getblk(sb, zarufs_descriptor_block(sb, i)))) {
+      ZARUFS_ERROR("[ZARUFS] Error: cannot read block group descriptor[block=%lu]\n", i);
+      return (-ENOMEM);
+    }
+    zsi->s_group_desc_cached++;
+  }
+
+  blk_start_plug(&plug);
+  ll_rw_block(READ_META, zsi->s_gdb_count, bhs);
+  blk_finish_plug(&plug);
+
+  for (i = 0; i < zsi->s_gdb_count; i++) {
+    wait_on_buffer(bhs[i]);
+    if (!buffer_uptodate(bhs[i])) {
+      ZARUFS_ERROR("[ZARUFS] Error: cannot read block group descriptor[block=%lu]\n", i);
+      return (-EIO);
+    }
+  }
+  return (0);
+}
+
+/*
+ * fill the summary of every group from its descriptor, and sum the free
+ * clusters, free inodes and directories of the volume on the way. a
+ * group whose descriptor cannot be read looks full.
+ */
+int
+zarufs_init_group_info(struct super_block *sb,
+                       unsigned long *free_blocks,
+                       unsigned long *free_inodes,
+                       unsigned long *dirs) {
+  struct zarufs_sb_info    *zsi;
+  struct zarufs_group_info *gi;
+  struct ext2_group_desc   *gdesc;
+  struct buffer_head       *bh;
+  unsigned long            group;
+
+  zsi = ZARUFS_SB(sb);
+  zsi->s_group_info = vzalloc(zsi->s_groups_count
+                              * sizeof(struct zarufs_group_info));
+  if (!zsi->s_group_info) {
+    ZARUFS_ERROR("[ZARUFS] %s: cannot allocate group summaries.\n", __func__);
+    return (-ENOMEM);
+  }
+
+  *free_blocks = 0;
+  *free_inodes = 0;
+  *dirs        = 0;
+  for (group = 0; group < zsi->s_groups_count; group++) {
+    if (!(gdesc = zarufs_get_group_descriptor(sb, group, &bh))) {
       continue;
     }
-    desc_count += le16_to_cpu(gdesc->bg_free_blocks_count);
+    gi              = zarufs_group_info(sb, group);
+    gi->free_blocks = zarufs_free_blocks_count(sb, gdesc);
+    gi->free_inodes = zarufs_free_inodes_count(sb, gdesc);
+    gi->used_dirs   = zarufs_used_dirs_count(sb, gdesc);
+    gi->flags       = le16_to_cpu(gdesc->bg_flags);
+    brelse(bh);
+    *free_blocks += gi->free_blocks;
+    *free_inodes += gi->free_inodes;
+    *dirs        += gi->used_dirs;
+  }
+  return (0);
+}
+
+void
+zarufs_destroy_group_info(struct super_block *sb) {
+  vfree(ZARUFS_SB(sb)->s_group_info);
+  ZARUFS_SB(sb)->s_group_info = NULL;
+}
+
+/*
+ * free clusters, free inodes and directories of the volume, summed from
+ * the group summaries. they change with the descriptors under the group
+ * lock, so no descriptor block is read or kept in memory for this. a
+ * cluster is a block without bigalloc.
+ */
+void
+zarufs_count_groups(struct super_block *sb,
+                    unsigned long *free_blocks,
+                    unsigned long *free_inodes,
+                    unsigned long *dirs) {
+  struct zarufs_group_info *gi;
+  unsigned long            group;
+
+  *free_blocks = 0;
+  *free_inodes = 0;
+  *dirs        = 0;
+  for (group = 0; group < ZARUFS_SB(sb)->s_groups_count; group++) {
+    gi            = zarufs_group_info(sb, group);
+    *free_blocks += ACCESS_ONCE(gi->free_blocks);
+    *free_inodes += ACCESS_ONCE(gi->free_inodes);
+    *dirs        += ACCESS_ONCE(gi->used_dirs);
   }
-  return (desc_count);
 }
 
+/*
+ * the bitmaps and the inode table of a group must lie in that group. a
+ * descriptor is checked when its blocks are first used rather than at
+ * mount, which would have to walk every group. returns 1 if sane.
+ */
+int
+zarufs_valid_group_desc(struct super_block *sb,
+                        unsigned long block_group,
+                        struct ext2_group_desc *gdesc) {
+  struct zarufs_sb_info *zsi;
+  unsigned long         first_block;
+  unsigned long         last_block;
+  unsigned long         block;
+
+  zsi = ZARUFS_SB(sb);
+  if (likely(test_bit(block_group, zsi->s_group_checked))) {
+    return (1);
+  }
+
+  if (zarufs_has_gdt_csum(sb) &&
+      (gdesc->bg_checksum != group_desc_csum(sb, block_group, gdesc))) {
+    ZARUFS_ERROR("[ZARUFS] %s: checksum of group %lu is wrong\n",
+                 __func__, block_group);
+    return (0);
+  }
+
+  first_block = zarufs_get_first_block_num(sb, block_group);
+  if (block_group == (zsi->s_groups_count - 1)) {
+    last_block = zarufs_blocks_count(sb) - 1;
+  } else {
+    last_block = first_block + (zsi->s_blocks_per_group - 1);
+  }
+
+  block = zarufs_block_bitmap(sb, gdesc);
+  if ((block < first_block) || (last_block < block)) {
+    goto err_out;
+  }
+  block = zarufs_inode_bitmap(sb, gdesc);
+  if ((block < first_block) || (last_block < block)) {
+    goto err_out;
+  }
+  block = zarufs_inode_table(sb, gdesc);
+  if ((block < first_block) ||
+      (last_block < block + zsi->s_itb_per_group - 1)) {
+    goto err_out;
+  }
+  set_bit(block_group, zsi->s_group_checked);
+  return (1);
+
+ err_out:
+  ZARUFS_ERROR("[ZARUFS] %s: insane group descriptor ", __func__);
+  ZARUFS_ERROR("[ group=%lu, first=%lu, block=%lu, last=%lu ]\n",
+               block_group, first_block, block, last_block);
+  return (0);
+}
+
+/*
+ * allocate a cluster near goal. the first block of the cluster is returned
+ * and *count is set to the number of blocks in it.
+ */
 unsigned long
 zarufs_new_blocks(struct inode *inode,
-                  unsigned goal,
+                  unsigned long goal,
                   unsigned long *count,
                   int *err) {
   struct super_block        *sb;
   struct zarufs_sb_info     *zsi;
   struct zarufs_super_block *zsb;
   struct ext2_group_desc    *gdesc;
+  struct zarufs_group_info  *gi;
 
   struct buffer_head      *bitmap_bh;
   struct buffer_head      *gdesc_bh;
 
   unsigned long           group_no;
-  unsigned long           goal_group;
-  unsigned long           free_blocks;
-  unsigned long           grp_alloc_blk;
-  unsigned long           grp_target_blk;
+  long                    grp_alloc_cls;
+  unsigned long           grp_target_cls;
+  unsigned long           grp_start_cls;
   unsigned long           ret_block;
   unsigned long           num;
+  unsigned long           i;
   int                     performed_allocation;
 
   sb = inode->i_sb;
@@ -140,77 +597,104 @@ zarufs_new_blocks(struct inode *inode,
   zsb = zsi->s_zsb;
 
   bitmap_bh = NULL;
+  gdesc_bh  = NULL;
   ret_block = 0;
   num       = *count;
   performed_allocation = 0;
 
-  if (!has_free_blocks(zsi)) {
+  if (!has_free_blocks(sb)) {
     *err = -ENOSPC;
     goto out;
   }
 
   /* test whether the goal block is free. */
   if ((goal < le32_to_cpu(zsb->s_first_data_block))
-      || le32_to_cpu(zsb->s_blocks_count) <= goal) {
+      || zarufs_blocks_count(sb) <= goal) {
     goal = le32_to_cpu(zsb->s_first_data_block);
   }
 
   group_no = (goal - le32_to_cpu(zsb->s_first_data_block))
     / zsi->s_blocks_per_group;
-  goal_group = group_no;
-
-  if (!(gdesc = zarufs_get_group_descriptor(sb, group_no))) {
-    goto io_error;
-  }
-
-  if (!(gdesc_bh = zarufs_get_gdesc_buffer_cache(sb, group_no))) {
-    goto io_error;
-  }
-
-  free_blocks = le16_to_cpu(gdesc->bg_free_blocks_count);
-  if (0 < free_blocks) {
-    grp_target_blk = (goal - le32_to_cpu(zsb->s_first_data_block))
-      % zsi->s_blocks_per_group;
-    bitmap_bh = read_block_bitmap(sb, group_no);
-    if (!bitmap_bh) {
-      goto io_error;
+  grp_target_cls = ZARUFS_B2C(zsi,
+                              (goal - le32_to_cpu(zsb->s_first_data_block))
+                              % zsi->s_blocks_per_group);
+
+  /* full groups are passed over by their summaries alone. */
+  for (i = 0; i < zsi->s_groups_count; i++) {
+    gi = zarufs_group_info(sb, group_no);
+    if (0 < gi->free_blocks) {
+      if (!(gdesc = zarufs_get_group_descriptor(sb, group_no, &gdesc_bh))) {
+        goto io_error;
+      }
+      bitmap_bh = read_block_bitmap(sb, group_no);
+      if (!bitmap_bh) {
+        goto io_error;
+      }
+      grp_start_cls = max_t(unsigned long,
+                            grp_target_cls,
+                            ACCESS_ONCE(gi->first_free));
+      grp_alloc_cls = try_to_allocate(sb,
+                                      group_no,
+                                      bitmap_bh,
+                                      grp_start_cls,
+                                      &num,
+                                      NULL);
+      /* a racing free may have left the hint too high. */
+      if ((grp_alloc_cls < 0) && (grp_target_cls < grp_start_cls)) {
+        grp_start_cls = grp_target_cls;
+        grp_alloc_cls = try_to_allocate(sb,
+                                        group_no,
+                                        bitmap_bh,
+                                        grp_start_cls,
+                                        &num,
+                                        NULL);
+      }
+      if (0 <= grp_alloc_cls) {
+        goto allocated;
+      }
+      brelse(bitmap_bh);
+      bitmap_bh = NULL;
+      brelse(gdesc_bh);
+      gdesc_bh = NULL;
+      zarufs_bitmap_readahead(sb, group_no, ZARUFS_BLOCK_BITMAP);
     }
-    grp_alloc_blk = try_to_allocate(sb,
-                                    group_no,
-                                    bitmap_bh,
-                                    grp_target_blk,
-                                    &num,
-                                    NULL);
-    if (0 <= grp_alloc_blk) {
-      goto allocated;
+
+    /* the group is full. search the next one from its head. */
+    if (zsi->s_groups_count <= ++group_no) {
+      group_no = 0;
     }
-  } else {
-    *err = -ENOSPC;
-    goto out;
+    grp_target_cls = 0;
   }
+  *err = -ENOSPC;
+  goto out;
 
  allocated:
-  DBGPRINT("[ZARUFS] %s: using block group = %lu, free_blocks = %d\n",
-           __func__, group_no, gdesc->bg_free_blocks_count);
-  ret_block = grp_alloc_blk + zarufs_get_first_block_num(sb, group_no);
-  if (IN_RANGE(le32_to_cpu(gdesc->bg_block_bitmap), ret_block, num) ||
-      IN_RANGE(le32_to_cpu(gdesc->bg_inode_bitmap), ret_block, num) ||
-      IN_RANGE(ret_block, le32_to_cpu(gdesc->bg_inode_table), ZARUFS_SB(sb)->s_itb_per_group)) {
+  DBGPRINT("[ZARUFS] %s: using block group = %lu, free_blocks = %u\n",
+           __func__, group_no, gi->free_blocks);
+  ret_block = ZARUFS_C2B(zsi, (unsigned long) grp_alloc_cls)
+    + zarufs_get_first_block_num(sb, group_no);
+  num       = zsi->s_cluster_ratio;
+  if (IN_RANGE(zarufs_block_bitmap(sb, gdesc), ret_block, num) ||
+      IN_RANGE(zarufs_inode_bitmap(sb, gdesc), ret_block, num) ||
+      IN_RANGE(ret_block, zarufs_inode_table(sb, gdesc), ZARUFS_SB(sb)->s_itb_per_group)) {
     ZARUFS_ERROR("[ZARUFS] %s: allocating block in system zone -", __func__);
     ZARUFS_ERROR(" block from %lu, length %lu\n", ret_block, num);
     /* as for now, i do not implement retry_alloc. */
     *err = -ENOSPC;
-    goto out;
+    goto release;
   }
 
-  performed_allocation = 1;
-  if (le32_to_cpu(zsb->s_blocks_count) <= (ret_block + num - 1)) {
-    ZARUFS_ERROR("[ZARUFS] %s: blocks count(%d) <= block(%lu)", __func__, le32_to_cpu(zsb->s_blocks_count), ret_block);
-    goto out;
+  if (zarufs_blocks_count(sb) <= (ret_block + num - 1)) {
+    ZARUFS_ERROR("[ZARUFS] %s: blocks count(%lu) <= block(%lu)", __func__, zarufs_blocks_count(sb), ret_block);
+    *err = -ENOSPC;
+    goto release;
   }
+  performed_allocation = 1;
 
-  adjust_group_blocks(sb, group_no, gdesc, gdesc_bh, -num);
-  percpu_counter_sub(&zsi->s_freeblocks_counter, num);
+  /* group and volume counters are kept in clusters. */
+  adjust_group_blocks(sb, group_no, gdesc, gdesc_bh, -1,
+                      grp_start_cls, grp_alloc_cls);
+  percpu_counter_sub(&zsi->s_freeblocks_counter, 1);
 
   mark_buffer_dirty(bitmap_bh);
 
@@ -221,15 +705,18 @@ zarufs_new_blocks(struct inode *inode,
   *err = 0;
 
   brelse(bitmap_bh);
+  brelse(gdesc_bh);
 
-  if (num < *count) {
-    /* dquot_free_block_nodirty(inode, *count - num); */
-    mark_inode_dirty(inode);
-    *count = num;
-  }
-
+  *count = num;
   return(ret_block);
 
+  /* the cluster is taken in the bitmap only. */
+ release:
+  ext2_clear_bit_atomic(get_sb_blockgroup_lock(zsi, group_no),
+                        grp_alloc_cls,
+                        bitmap_bh->b_data);
+  goto out;
+
  io_error:
   *err = -EIO;
 
@@ -239,9 +726,110 @@ zarufs_new_blocks(struct inode *inode,
     mark_inode_dirty(inode);
   }
   brelse(bitmap_bh);
+  brelse(gdesc_bh);
   return (0);
 }
 
+/*
+ * under bigalloc every cluster the range touches is released, so callers
+ * must own the whole clusters.
+ */
+void
+zarufs_free_blocks(struct inode *inode,
+                   unsigned long block,
+                   unsigned long count) {
+  struct super_block        *sb;
+  struct zarufs_sb_info     *zsi;
+  struct zarufs_super_block *zsb;
+  struct ext2_group_desc    *gdesc;
+  struct buffer_head        *bitmap_bh;
+  struct buffer_head        *gdesc_bh;
+  unsigned long             group_no;
+  unsigned long             bit;
+  unsigned long             overflow;
+  unsigned long             freed;
+  unsigned long             i;
+
+  sb  = inode->i_sb;
+  zsi = ZARUFS_SB(sb);
+  zsb = zsi->s_zsb;
+
+  if ((block < le32_to_cpu(zsb->s_first_data_block)) ||
+      (block + count < block) ||
+      (zarufs_blocks_count(sb) < block + count)) {
+    ZARUFS_ERROR("[ZARUFS] %s: freeing blocks not in datazone -", __func__);
+    ZARUFS_ERROR(" block=%lu, count=%lu\n", block, count);
+    return;
+  }
+
+ do_more:
+  bitmap_bh = NULL;
+  gdesc_bh  = NULL;
+  overflow  = 0;
+  freed     = 0;
+  group_no  = (block - le32_to_cpu(zsb->s_first_data_block))
+    / zsi->s_blocks_per_group;
+  bit       = (block - le32_to_cpu(zsb->s_first_data_block))
+    % zsi->s_blocks_per_group;
+
+  /* the range spans over block groups. free it group by group. */
+  if (zsi->s_blocks_per_group < bit + count) {
+    overflow = bit + count - zsi->s_blocks_per_group;
+    count   -= overflow;
+  }
+
+  if (!(bitmap_bh = read_block_bitmap(sb, group_no))) {
+    goto error_return;
+  }
+
+  if (!(gdesc = zarufs_get_group_descriptor(sb, group_no, &gdesc_bh))) {
+    goto error_return;
+  }
+
+  if (IN_RANGE(zarufs_block_bitmap(sb, gdesc), block, count) ||
+      IN_RANGE(zarufs_inode_bitmap(sb, gdesc), block, count) ||
+      IN_RANGE(block, zarufs_inode_table(sb, gdesc), zsi->s_itb_per_group) ||
+      IN_RANGE(block + count - 1, zarufs_inode_table(sb, gdesc), zsi->s_itb_per_group)) {
+    ZARUFS_ERROR("[ZARUFS] %s: freeing blocks in system zone -", __func__);
+    ZARUFS_ERROR(" block=%lu, count=%lu\n", block, count);
+    goto error_return;
+  }
+
+  for (i = ZARUFS_B2C(zsi, bit); i <= ZARUFS_B2C(zsi, bit + count - 1); i++) {
+    if (!ext2_clear_bit_atomic(get_sb_blockgroup_lock(zsi, group_no),
+                               i,
+                               bitmap_bh->b_data)) {
+      ZARUFS_ERROR("[ZARUFS] %s: bit already cleared for block %lu\n",
+                   __func__,
+                   zarufs_get_first_block_num(sb, group_no)
+                   + ZARUFS_C2B(zsi, i));
+    } else {
+      freed++;
+    }
+  }
+
+  mark_buffer_dirty(bitmap_bh);
+  if (sb->s_flags & MS_SYNCHRONOUS) {
+    sync_dirty_buffer(bitmap_bh);
+  }
+
+  adjust_group_blocks(sb, group_no, gdesc, gdesc_bh, freed,
+                      ZARUFS_B2C(zsi, bit), ZARUFS_B2C(zsi, bit));
+  percpu_counter_add(&zsi->s_freeblocks_counter, freed);
+
+  block += count;
+  count  = overflow;
+  if (overflow) {
+    brelse(bitmap_bh);
+    brelse(gdesc_bh);
+    goto do_more;
+  }
+
+ error_return:
+  brelse(bitmap_bh);
+  brelse(gdesc_bh);
+}
+
 static int
 is_group_sparse(int group) {
   if (group <= 1) {
@@ -263,12 +851,13 @@ test_root(int group, int multiple) {
 }
 
 static int
-has_free_blocks(struct zarufs_sb_info *zsi) {
+has_free_blocks(struct super_block *sb) {
   unsigned long free_blocks;
   unsigned long root_blocks;
 
-  free_blocks = percpu_counter_read_positive(&zsi->s_freeblocks_counter);
-  root_blocks = le32_to_cpu(zsi->s_zsb->s_r_blocks_count);
+  /* the free counter is in clusters. */
+  free_blocks = percpu_counter_read_positive(&ZARUFS_SB(sb)->s_freeblocks_counter);
+  root_blocks = ZARUFS_B2C(ZARUFS_SB(sb), zarufs_r_blocks_count(sb));
 
   /* if ((free_blocks < (root_blocks + 1)) */
   /*     && !capable(CAP_SYS_RESOURCE) */
@@ -286,73 +875,151 @@ has_free_blocks(struct zarufs_sb_info *zsi) {
 
 static struct buffer_head*
 read_block_bitmap(struct super_block *sb, unsigned long block_group) {
+  struct zarufs_sb_info  *zsi;
   struct ext2_group_desc *gdesc;
+  struct buffer_head     *gdesc_bh;
   struct buffer_head     *bh;
   unsigned long          bitmap_blk;
 
-  if (!(gdesc = zarufs_get_group_descriptor(sb, block_group))) {
+  zsi = ZARUFS_SB(sb);
+  if ((bh = zarufs_bitmap_cache_get(sb, block_group, ZARUFS_BLOCK_BITMAP))) {
+    return (bh);
+  }
+
+  if (!(gdesc = zarufs_get_group_descriptor(sb, block_group, &gdesc_bh))) {
     return (NULL);
   }
+  bh = NULL;
+  if (!zarufs_valid_group_desc(sb, block_group, gdesc)) {
+    goto out;
+  }
 
-  bitmap_blk = le32_to_cpu(gdesc->bg_block_bitmap);
+  bitmap_blk = zarufs_block_bitmap(sb, gdesc);
   bh         = sb_getblk(sb, bitmap_blk);
   if (unlikely(!bh)) {
     ZARUFS_ERROR("[ZARUFS] %s: cannot read block bitmap.", __func__);
-    ZARUFS_ERROR("block_group=%lu, block_bitmap=%u\n",
-                 block_group, le32_to_cpu(gdesc->bg_block_bitmap));
-    return(NULL);
+    ZARUFS_ERROR("block_group=%lu, block_bitmap=%lu\n",
+                 block_group, bitmap_blk);
+    goto out;
   }
 
   if (likely(bh_uptodate_or_lock(bh))) {
-    return (bh);
+    goto out;
+  }
+
+  /* an uninitialized bitmap is never read. its contents are derived. */
+  if (zarufs_has_gdt_csum(sb) &&
+      (gdesc->bg_flags & cpu_to_le16(EXT2_BG_BLOCK_UNINIT))) {
+    init_block_bitmap(sb, block_group, gdesc, bh);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+    goto out;
   }
 
   if (bh_submit_read(bh) < 0) {
     brelse(bh);
+    bh = NULL;
     ZARUFS_ERROR("[ZARUFS] %s: cannot read block bitmap.", __func__);
-    ZARUFS_ERROR("block_group=%lu, block_bitmap=%u\n",
-                 block_group, le32_to_cpu(gdesc->bg_block_bitmap));
-    return (NULL);
+    ZARUFS_ERROR("block_group=%lu, block_bitmap=%lu\n",
+                 block_group, bitmap_blk);
+    goto out;
+  }
+
+  /*
+   * sanity check for bitmap. (here this is just for displaying error.)
+   * a bitmap found sane is not checked again when it is read back.
+   */
+  if (!test_bit(block_group, zsi->s_bitmap_checked) &&
+      valid_block_bitmap(sb, gdesc, block_group, bh)) {
+    set_bit(block_group, zsi->s_bitmap_checked);
   }
 
-  /* sanity check for bitmap. (here this is just for displaying error.) */
-  valid_block_bitmap(sb, gdesc, block_group, bh);
+ out:
+  brelse(gdesc_bh);
+  if (bh) {
+    zarufs_bitmap_cache_add(sb, block_group, ZARUFS_BLOCK_BITMAP, bh);
+  }
   return(bh);
 }
 
+/*
+ * the bitmap of a group nothing has been allocated from: its own metadata
+ * is in use, and so are the bits past the end of a short last group.
+ */
+static void
+init_block_bitmap(struct super_block *sb,
+                  unsigned long block_group,
+                  struct ext2_group_desc *gdesc,
+                  struct buffer_head *bh) {
+  struct zarufs_sb_info *zsi;
+  unsigned long         group_first_block;
+  unsigned long         group_blocks;
+  unsigned long         block;
+  unsigned long         i;
+
+  zsi               = ZARUFS_SB(sb);
+  group_first_block = zarufs_get_first_block_num(sb, block_group);
+  memset(bh->b_data, 0, sb->s_blocksize);
+
+  for (i = 0; i < zarufs_bg_meta_blocks(sb, block_group); i++) {
+    set_bit_le(ZARUFS_B2C(zsi, i), bh->b_data);
+  }
+  block = zarufs_block_bitmap(sb, gdesc) - group_first_block;
+  set_bit_le(ZARUFS_B2C(zsi, block), bh->b_data);
+  block = zarufs_inode_bitmap(sb, gdesc) - group_first_block;
+  set_bit_le(ZARUFS_B2C(zsi, block), bh->b_data);
+  block = zarufs_inode_table(sb, gdesc) - group_first_block;
+  for (i = 0; i < zsi->s_itb_per_group; i++) {
+    set_bit_le(ZARUFS_B2C(zsi, block + i), bh->b_data);
+  }
+
+  group_blocks = zsi->s_blocks_per_group;
+  if (block_group == (zsi->s_groups_count - 1)) {
+    group_blocks = zarufs_blocks_count(sb) - group_first_block;
+  }
+  for (i = ZARUFS_B2C(zsi, group_blocks + zsi->s_cluster_ratio - 1);
+       i < sb->s_blocksize * 8;
+       i++) {
+    set_bit_le(i, bh->b_data);
+  }
+}
+
 static int
 valid_block_bitmap(struct super_block *sb,
                    struct ext2_group_desc *gdesc,
                    unsigned long block_group,
                    struct buffer_head *bh) {
-  unsigned long offset;
-  unsigned long next_zero_bit;
-  unsigned long bitmap_blk;
-  unsigned long group_first_block;
+  struct zarufs_sb_info *zsi;
+  unsigned long         offset;
+  unsigned long         last;
+  unsigned long         next_zero_bit;
+  unsigned long         bitmap_blk;
+  unsigned long         group_first_block;
 
+  zsi               = ZARUFS_SB(sb);
   group_first_block = zarufs_get_first_block_num(sb, block_group);
   /* check whether block bitmap block number is set. */
-  bitmap_blk = le32_to_cpu(gdesc->bg_block_bitmap);
-  offset     = bitmap_blk - group_first_block;
+  bitmap_blk = zarufs_block_bitmap(sb, gdesc);
+  offset     = ZARUFS_B2C(zsi, bitmap_blk - group_first_block);
   if (!test_bit_le(offset, bh->b_data)) {
     /* bad block bitmap. */
     goto err_out;
   }
 
   /* check whether inode bitmap block number is set. */
-  bitmap_blk = le32_to_cpu(gdesc->bg_inode_bitmap);
-  offset     = bitmap_blk - group_first_block;
+  bitmap_blk = zarufs_inode_bitmap(sb, gdesc);
+  offset     = ZARUFS_B2C(zsi, bitmap_blk - group_first_block);
   if (!test_bit_le(offset, bh->b_data)) {
     goto err_out;
   }
 
   /* check whether inode table block number is set. */
-  bitmap_blk    = le32_to_cpu(gdesc->bg_inode_table);
-  offset        = bitmap_blk - group_first_block;
-  next_zero_bit = find_next_zero_bit_le(bh->b_data,
-                                        offset + ZARUFS_SB(sb)->s_itb_per_group,
-                                        offset);
-  if ((offset + ZARUFS_SB(sb)->s_itb_per_group) <= next_zero_bit) {
+  bitmap_blk    = zarufs_inode_table(sb, gdesc);
+  offset        = ZARUFS_B2C(zsi, bitmap_blk - group_first_block);
+  last          = ZARUFS_B2C(zsi, bitmap_blk - group_first_block
+                             + zsi->s_itb_per_group - 1);
+  next_zero_bit = find_next_zero_bit_le(bh->b_data, last + 1, offset);
+  if (last < next_zero_bit) {
     /* good bitmap for inode tables. */
     return (1);
   }
@@ -372,10 +1039,20 @@ try_to_allocate(struct super_block *sb,
                 struct ext2_reserve_window *my_rsv) {
   unsigned long start;
   unsigned long end;
+  unsigned long last;
   unsigned long num;
 
   num = 0;
-  end = ZARUFS_SB(sb)->s_blocks_per_group;
+  end = ZARUFS_SB(sb)->s_clusters_per_group;
+  /* a cluster cut by the end of the volume is never handed out. */
+  last = (zarufs_blocks_count(sb) - zarufs_get_first_block_num(sb, group))
+    >> ZARUFS_SB(sb)->s_cluster_bits;
+  if (last < end) {
+    end = last;
+  }
+  if (end <= grp_goal) {
+    goto fail_access;
+  }
 
  repeat:
   start = grp_goal;
@@ -400,23 +1077,144 @@ try_to_allocate(struct super_block *sb,
   return(-1);
 }
 
+/*
+ * count clusters are given back to the group, or taken if negative. the
+ * first free hint goes down to the first cluster given back. it passes a
+ * cluster taken by a search which began at from, if the search covered
+ * the hint.
+ */
 static void
 adjust_group_blocks(struct super_block *sb,
                     unsigned long group_no,
                     struct ext2_group_desc *gdesc,
                     struct buffer_head *bh,
-                    long count) {
+                    long count,
+                    unsigned long from,
+                    unsigned long cluster) {
   if (count) {
-    struct zarufs_sb_info *zsi;
-    unsigned              free_blocks;
+    struct zarufs_sb_info    *zsi;
+    struct zarufs_group_info *gi;
+    unsigned                 free_blocks;
 
     zsi = ZARUFS_SB(sb);
+    gi  = zarufs_group_info(sb, group_no);
     spin_lock(get_sb_blockgroup_lock(zsi, group_no));
 
-    free_blocks = le16_to_cpu(gdesc->bg_free_blocks_count);
-    gdesc->bg_free_blocks_count = cpu_to_le16(free_blocks + count);
+    free_blocks = zarufs_free_blocks_count(sb, gdesc);
+    zarufs_free_blocks_count_set(sb, gdesc, free_blocks + count);
+    /* the derived bitmap is written from now on. */
+    gdesc->bg_flags &= cpu_to_le16(~EXT2_BG_BLOCK_UNINIT);
+    zarufs_group_desc_csum_set(sb, group_no, gdesc);
+
+    gi->free_blocks = free_blocks + count;
+    gi->flags       = le16_to_cpu(gdesc->bg_flags);
+    if (count < 0) {
+      if ((from <= gi->first_free) && (gi->first_free <= cluster)) {
+        gi->first_free = cluster + 1;
+      }
+    } else if (cluster < gi->first_free) {
+      gi->first_free = cluster;
+    }
 
     spin_unlock(get_sb_blockgroup_lock(zsi, group_no));
     mark_buffer_dirty(bh);
   }
 }
+
+/*
+ * hand out a reference of the index-th descriptor block, loading it if it
+ * is not cached. a block loaded twice by racing callers is cached once.
+ */
+static struct buffer_head*
+get_gdesc_block(struct super_block *sb, unsigned long index) {
+  struct zarufs_sb_info *zsi;
+  struct buffer_head    *bh;
+  struct buffer_head    *cached;
+
+  zsi = ZARUFS_SB(sb);
+  spin_lock(&zsi->s_group_desc_lock);
+  if ((bh = zsi->s_group_desc[index])) {
+    get_bh(bh);
+    spin_unlock(&zsi->s_group_desc_lock);
+    goto out;
+  }
+  spin_unlock(&zsi->s_group_desc_lock);
+
+  if (!(bh = sb_bread(sb, zarufs_descriptor_block(sb, index)))) {
+    ZARUFS_ERROR("[ZARUFS] %s: cannot read descriptor block %lu\n",
+                 __func__, index);
+    return (NULL);
+  }
+
+  spin_lock(&zsi->s_group_desc_lock);
+  if ((cached = zsi->s_group_desc[index])) {
+    get_bh(cached);
+    spin_unlock(&zsi->s_group_desc_lock);
+    brelse(bh);
+    bh = cached;
+    goto out;
+  }
+  /* the reference read is kept by the cache, and another is returned. */
+  zsi->s_group_desc[index] = bh;
+  zsi->s_group_desc_cached++;
+  get_bh(bh);
+  spin_unlock(&zsi->s_group_desc_lock);
+
+ out:
+  /* avoid dirtying the shared line when the bit is already set. */
+  if (!test_bit(index, zsi->s_group_desc_ref)) {
+    set_bit(index, zsi->s_group_desc_ref);
+  }
+  return (bh);
+}
+
+static unsigned long
+count_gdesc_blocks(struct shrinker *shrink, struct shrink_control *sc) {
+  struct zarufs_sb_info *zsi;
+
+  zsi = container_of(shrink, struct zarufs_sb_info, s_group_desc_shrinker);
+  return (ACCESS_ONCE(zsi->s_group_desc_cached));
+}
+
+/*
+ * a clock over the cached blocks. a block used since the last pass gets
+ * another chance. one which is dirty, under i/o or held by a caller stays.
+ */
+static unsigned long
+scan_gdesc_blocks(struct shrinker *shrink, struct shrink_control *sc) {
+  struct zarufs_sb_info *zsi;
+  struct buffer_head    *bh;
+  unsigned long         index;
+  unsigned long         scanned;
+  unsigned long         freed;
+
+  zsi   = container_of(shrink, struct zarufs_sb_info, s_group_desc_shrinker);
+  freed = 0;
+  spin_lock(&zsi->s_group_desc_lock);
+  index = zsi->s_group_desc_hand;
+  for (scanned = 0;
+       (scanned < zsi->s_gdb_count) && (freed < sc->nr_to_scan);
+       scanned++) {
+    if (zsi->s_gdb_count <= ++index) {
+      index = 0;
+    }
+    if (!(bh = zsi->s_group_desc[index])) {
+      continue;
+    }
+    if (test_and_clear_bit(index, zsi->s_group_desc_ref)) {
+      continue;
+    }
+    if ((atomic_read(&bh->b_count) != 1) ||
+        buffer_dirty(bh) ||
+        buffer_locked(bh)) {
+      continue;
+    }
+    zsi->s_group_desc[index] = NULL;
+    zsi->s_group_desc_cached--;
+    brelse(bh);
+    freed++;
+  }
+  zsi->s_group_desc_hand = index;
+  spin_unlock(&zsi->s_group_desc_lock);
+  return (freed ? freed : SHRINK_STOP);
+}
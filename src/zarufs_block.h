@@ -2,22 +2,135 @@
 #ifndef _ZARUFS_BLOCK_H_
 #define _ZARUFS_BLOCK_H_
 
+/* kinds of bitmaps. */
+#define ZARUFS_BLOCK_BITMAP (0)
+#define ZARUFS_INODE_BITMAP (1)
+#define ZARUFS_NR_BITMAPS   (2)
+
+struct zarufs_bitmap_entry;
+
+/*
+ * summary of a group, kept with its descriptor under the group lock. group
+ * searches scan these without the lock rather than the descriptors. the
+ * cached bitmaps are under s_bitmap_lock.
+ */
+struct zarufs_group_info {
+  struct zarufs_bitmap_entry *bitmaps[ZARUFS_NR_BITMAPS];
+  __u32                      free_blocks; /* in clusters.                       */
+  __u32                      free_inodes;
+  __u32                      used_dirs;
+  __u32                      first_free;  /* no cluster below is free, a hint. */
+  __u16                      flags;       /* bg_flags.                          */
+};
+
+static inline struct zarufs_group_info*
+zarufs_group_info(struct super_block *sb, unsigned long block_group) {
+  return (&ZARUFS_SB(sb)->s_group_info[block_group]);
+}
+
 struct ext2_group_desc*
 zarufs_get_group_descriptor(struct super_block *sb,
-                            unsigned int block_group);
+                            unsigned int block_group,
+                            struct buffer_head **bhp);
+
+unsigned long
+zarufs_block_bitmap(struct super_block *sb, struct ext2_group_desc *gdesc);
+
+unsigned long
+zarufs_inode_bitmap(struct super_block *sb, struct ext2_group_desc *gdesc);
+
+unsigned long
+zarufs_inode_table(struct super_block *sb, struct ext2_group_desc *gdesc);
+
+__u32
+zarufs_free_blocks_count(struct super_block *sb,
+                         struct ext2_group_desc *gdesc);
+
+__u32
+zarufs_free_inodes_count(struct super_block *sb,
+                         struct ext2_group_desc *gdesc);
+
+__u32
+zarufs_used_dirs_count(struct super_block *sb,
+                       struct ext2_group_desc *gdesc);
+
+void
+zarufs_free_blocks_count_set(struct super_block *sb,
+                             struct ext2_group_desc *gdesc,
+                             __u32 count);
+
+void
+zarufs_free_inodes_count_set(struct super_block *sb,
+                             struct ext2_group_desc *gdesc,
+                             __u32 count);
+
+void
+zarufs_used_dirs_count_set(struct super_block *sb,
+                           struct ext2_group_desc *gdesc,
+                           __u32 count);
+
+__u32
+zarufs_itable_unused(struct super_block *sb, struct ext2_group_desc *gdesc);
+
+void
+zarufs_itable_unused_set(struct super_block *sb,
+                         struct ext2_group_desc *gdesc,
+                         __u32 count);
+
+void
+zarufs_group_desc_csum_set(struct super_block *sb,
+                           unsigned long block_group,
+                           struct ext2_group_desc *gdesc);
+
+unsigned long
+zarufs_bg_meta_blocks(struct super_block *sb, unsigned long group);
 
 int zarufs_has_bg_super(struct super_block *sb, int group);
 
-struct buffer_head*
-zarufs_get_gdesc_buffer_cache(struct super_block *sb, unsigned int block_group);
+unsigned long
+zarufs_descriptor_block(struct super_block *sb, unsigned long nr);
 
 unsigned long
-zarufs_count_free_blocks(struct super_block *sb);
+zarufs_bg_num_gdb(struct super_block *sb, unsigned long group);
+
+int
+zarufs_init_gdesc_cache(struct super_block *sb);
+
+void
+zarufs_destroy_gdesc_cache(struct super_block *sb);
+
+int
+zarufs_read_group_descriptors(struct super_block *sb);
+
+int
+zarufs_init_group_info(struct super_block *sb,
+                       unsigned long *free_blocks,
+                       unsigned long *free_inodes,
+                       unsigned long *dirs);
+
+void
+zarufs_destroy_group_info(struct super_block *sb);
+
+void
+zarufs_count_groups(struct super_block *sb,
+                    unsigned long *free_blocks,
+                    unsigned long *free_inodes,
+                    unsigned long *dirs);
+
+int
+zarufs_valid_group_desc(struct super_block *sb,
+                        unsigned long block_group,
+                        struct ext2_group_desc *gdesc);
 
 unsigned long
 zarufs_new_blocks(struct inode *inode,
-                  unsigned goal,
+                  unsigned long goal,
                   unsigned long *count,
                   int *err);
 
+void
+zarufs_free_blocks(struct inode *inode,
+                   unsigned long block,
+                   unsigned long count);
+
 #endif
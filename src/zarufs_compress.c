@@ -0,0 +1,778 @@
+/* zarufs_compress.c */
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/slab.h>
+#include <linux/lz4.h>
+
+#include "../include/zarufs.h"
+#include "zarufs_utils.h"
+#include "zarufs_block.h"
+#include "zarufs_inode.h"
+#include "zarufs_compress.h"
+
+/*
+ * a cluster is ZARUFS_CLUSTER_SIZE bytes of a regular file. when it is
+ * compressed, its data is stored as [zarufs_cluster_head | lz4 stream] in
+ * the first blocks of the cluster, the following block pointers are holes,
+ * and the last block pointer is ZARUFS_COMPRESSED_BLKADDR.
+ */
+
+struct zarufs_compr_bufs {
+  char *ubuf;    /* uncompressed cluster. */
+  char *cbuf;    /* compressed cluster with its head. */
+  void *wrkmem;  /* lz4 working memory. */
+};
+
+static int
+compress_inode(struct inode *inode);
+
+static void
+add_dirty_clusters(struct zarufs_inode_info *zi,
+                   unsigned long            first,
+                   unsigned long            last);
+
+static int
+alloc_compr_bufs(struct zarufs_compr_bufs *bufs, int compress);
+
+static void
+free_compr_bufs(struct zarufs_compr_bufs *bufs);
+
+static int
+read_cluster_pointers(struct inode *inode,
+                      unsigned long cluster,
+                      unsigned long *blks);
+
+static int
+is_compressed_cluster(struct inode *inode, unsigned long cluster);
+
+static int
+load_cluster(struct inode *inode,
+             unsigned long *blks,
+             struct zarufs_compr_bufs *bufs);
+
+static int
+compress_cluster(struct inode *inode,
+                 unsigned long cluster,
+                 struct zarufs_compr_bufs *bufs);
+
+static int
+write_cluster_blocks(struct inode *inode,
+                     unsigned long goal,
+                     const char *data,
+                     int nblocks,
+                     unsigned long *new_blks,
+                     int wait);
+
+static int
+switch_cluster_pointers(struct inode *inode,
+                        unsigned long cluster,
+                        const unsigned long *to,
+                        const unsigned long *from,
+                        int *stuck);
+
+static void
+free_cluster_blocks(struct inode *inode, const unsigned long *blks, int nr);
+
+static void
+set_compression_feature(struct super_block *sb);
+
+static inline void
+fill_page(struct page *page, const char *src) {
+  char *kaddr;
+
+  kaddr = kmap_atomic(page);
+  memcpy(kaddr, src, PAGE_CACHE_SIZE);
+  kunmap_atomic(kaddr);
+  flush_dcache_page(page);
+}
+
+int
+zarufs_read_compressed_page(struct inode *inode, struct page *page) {
+  struct zarufs_compr_bufs bufs;
+  unsigned long            blks[ZARUFS_CLUSTER_MAX_BLOCKS];
+  unsigned long            cluster;
+  pgoff_t                  first_index;
+  pgoff_t                  index;
+  int                      err;
+
+  cluster = page->index >> ZARUFS_CLUSTER_PAGES_BITS;
+  if ((err = is_compressed_cluster(inode, cluster)) <= 0) {
+    if (!err) {
+      /* plain cluster. let the caller map it. */
+      return (1);
+    }
+    goto out;
+  }
+
+  if ((err = read_cluster_pointers(inode, cluster, blks))) {
+    goto out;
+  }
+
+  if ((err = alloc_compr_bufs(&bufs, 0))) {
+    goto out;
+  }
+
+  if ((err = load_cluster(inode, blks, &bufs))) {
+    goto out_free;
+  }
+
+  /* fill the requested page, then the rest of the cluster if possible. */
+  first_index = cluster << ZARUFS_CLUSTER_PAGES_BITS;
+  fill_page(page, bufs.ubuf + ((page->index - first_index) << PAGE_CACHE_SHIFT));
+  SetPageUptodate(page);
+
+  for (index = first_index;
+       index < first_index + ZARUFS_CLUSTER_PAGES;
+       index++) {
+    struct page *sibling;
+
+    if (index == page->index) {
+      continue;
+    }
+    if (!(sibling = grab_cache_page_nowait(inode->i_mapping, index))) {
+      continue;
+    }
+    if (!PageUptodate(sibling)) {
+      fill_page(sibling, bufs.ubuf + ((index - first_index) << PAGE_CACHE_SHIFT));
+      SetPageUptodate(sibling);
+    }
+    unlock_page(sibling);
+    page_cache_release(sibling);
+  }
+
+ out_free:
+  free_compr_bufs(&bufs);
+
+ out:
+  if (err) {
+    ZARUFS_ERROR("[ZARUFS] %s: cannot read compressed cluster.", __func__);
+    ZARUFS_ERROR("ino=%lu, cluster=%lu\n", inode->i_ino, cluster);
+    SetPageError(page);
+  }
+  unlock_page(page);
+  return (err);
+}
+
+int
+zarufs_uncompress_cluster(struct inode *inode, unsigned long cluster) {
+  struct super_block       *sb;
+  struct zarufs_inode_info *zi;
+  struct address_space     *mapping;
+  struct zarufs_compr_bufs bufs;
+  unsigned long            blks[ZARUFS_CLUSTER_MAX_BLOCKS];
+  unsigned long            new_blks[ZARUFS_CLUSTER_MAX_BLOCKS];
+  loff_t                   start;
+  int                      nblocks;
+  int                      stuck;
+  int                      err;
+
+  zi = ZARUFS_I(inode);
+  if (!(zi->i_flags & EXT2_COMPRBLK_FL)) {
+    return (0);
+  }
+
+  /* a write and a fault on a mapping may come for the same cluster. */
+  mutex_lock(&zi->i_compr_mutex);
+  if ((err = is_compressed_cluster(inode, cluster)) <= 0) {
+    goto out_unlock;
+  }
+
+  if ((err = read_cluster_pointers(inode, cluster, blks))) {
+    goto out_unlock;
+  }
+
+  if ((err = alloc_compr_bufs(&bufs, 0))) {
+    goto out_unlock;
+  }
+
+  if ((err = load_cluster(inode, blks, &bufs))) {
+    goto out;
+  }
+
+  sb      = inode->i_sb;
+  mapping = inode->i_mapping;
+  nblocks = ZARUFS_CLUSTER_BLOCKS(sb);
+  start   = (loff_t) cluster << ZARUFS_CLUSTER_BITS;
+
+  /* the plain data goes to new blocks and reaches the disk first, so */
+  /* that the compressed cluster stays intact until the pointers switch. */
+  if ((err = write_cluster_blocks(inode, blks[0], bufs.ubuf, nblocks,
+                                  new_blks, 1))) {
+    goto out;
+  }
+  if ((err = switch_cluster_pointers(inode, cluster, new_blks, blks,
+                                     &stuck))) {
+    if (!stuck) {
+      free_cluster_blocks(inode, new_blks, nblocks);
+    }
+    goto out;
+  }
+
+  /* forget pages filled from the compressed data. they have no buffers. */
+  unmap_mapping_range(mapping, start, ZARUFS_CLUSTER_SIZE, 0);
+  truncate_inode_pages_range(mapping, start, start + ZARUFS_CLUSTER_SIZE - 1);
+  free_cluster_blocks(inode, blks, nblocks);
+
+ out:
+  free_compr_bufs(&bufs);
+ out_unlock:
+  mutex_unlock(&zi->i_compr_mutex);
+  return (err);
+}
+
+/*
+ * clusters are compressed when the last writer closes the file. the
+ * pass runs from a worker on the clusters written since the last one,
+ * so a cluster which did not shrink is not read again until rewritten.
+ */
+void
+zarufs_compress_mark_dirty(struct inode *inode, loff_t pos, loff_t len) {
+  if (!S_ISREG(inode->i_mode) ||
+      !(ZARUFS_I(inode)->i_flags & EXT2_COMPR_FL) ||
+      (len <= 0)) {
+    return;
+  }
+  add_dirty_clusters(ZARUFS_I(inode),
+                     pos >> ZARUFS_CLUSTER_BITS,
+                     ((pos + len - 1) >> ZARUFS_CLUSTER_BITS) + 1);
+}
+
+void
+zarufs_queue_compress(struct inode *inode) {
+  struct zarufs_inode_info *zi;
+  int                      pending;
+
+  zi = ZARUFS_I(inode);
+  if (!(zi->i_flags & EXT2_COMPR_FL)) {
+    return;
+  }
+
+  spin_lock(&zi->i_compr_lock);
+  pending = (zi->i_compr_start != zi->i_compr_end);
+  spin_unlock(&zi->i_compr_lock);
+  if (!pending) {
+    return;
+  }
+
+  /* the worker holds the inode until the pass is done. */
+  if (!igrab(inode)) {
+    return;
+  }
+  if (!queue_work(ZARUFS_SB(inode->i_sb)->s_compr_wq, &zi->i_compr_work)) {
+    iput(inode);
+  }
+}
+
+void
+zarufs_compress_work(struct work_struct *work) {
+  struct zarufs_inode_info *zi;
+  struct inode             *inode;
+  struct super_block       *sb;
+  int                      err;
+
+  zi    = container_of(work, struct zarufs_inode_info, i_compr_work);
+  inode = &zi->vfs_inode;
+  sb    = inode->i_sb;
+
+  /* a frozen file system keeps the clusters for the next close. */
+  if (sb_start_write_trylock(sb)) {
+    if ((err = compress_inode(inode)) < 0) {
+      ZARUFS_ERROR("[ZARUFS] %s: cannot compress clusters.", __func__);
+      ZARUFS_ERROR("ino=%lu, err=%d\n", inode->i_ino, err);
+    }
+    sb_end_write(sb);
+  }
+  iput(inode);
+}
+
+static int
+compress_inode(struct inode *inode) {
+  struct super_block       *sb;
+  struct zarufs_inode_info *zi;
+  struct address_space     *mapping;
+  struct zarufs_compr_bufs bufs;
+  unsigned long            nr_clusters;
+  unsigned long            start;
+  unsigned long            end;
+  unsigned long            cluster;
+  unsigned long            compressed;
+  int                      err;
+
+  sb      = inode->i_sb;
+  zi      = ZARUFS_I(inode);
+  mapping = inode->i_mapping;
+
+  if (!S_ISREG(inode->i_mode) ||
+      !(zi->i_flags & EXT2_COMPR_FL) ||
+      (zi->i_flags & EXT2_NOCOMP_FL)) {
+    return (0);
+  }
+
+  /* a cluster spans whole pages and whole blocks. */
+  /* under bigalloc a block cannot be freed apart from its cluster. */
+  /* under 64bit the marker is a block which may be allocated. */
+  if ((sb->s_flags & MS_RDONLY) ||
+      (ZARUFS_CLUSTER_BITS < PAGE_CACHE_SHIFT) ||
+      (ZARUFS_CLUSTER_BITS < sb->s_blocksize_bits) ||
+      ZARUFS_SB(sb)->s_cluster_bits ||
+      zarufs_has_64bit(sb)) {
+    return (0);
+  }
+
+  mutex_lock(&inode->i_mutex);
+  mutex_lock(&zi->i_compr_mutex);
+  spin_lock(&zi->i_compr_lock);
+  start              = zi->i_compr_start;
+  end                = zi->i_compr_end;
+  zi->i_compr_start  = 0;
+  zi->i_compr_end    = 0;
+  spin_unlock(&zi->i_compr_lock);
+
+  /* the partial cluster at the end of the file is left plain. */
+  nr_clusters = i_size_read(inode) >> ZARUFS_CLUSTER_BITS;
+  if (nr_clusters < end) {
+    end = nr_clusters;
+  }
+  if (end <= start) {
+    err = 0;
+    goto out_unlock;
+  }
+
+  /* shared writable mappings may dirty pages behind our back. one made */
+  /* from now on waits in page_mkwrite until we are done. */
+  if (mapping_writably_mapped(mapping)) {
+    add_dirty_clusters(zi, start, end);
+    err = 0;
+    goto out_unlock;
+  }
+
+  /* clusters are built from clean pages. */
+  if ((err = filemap_write_and_wait_range(mapping,
+                                          (loff_t) start << ZARUFS_CLUSTER_BITS,
+                                          ((loff_t) end << ZARUFS_CLUSTER_BITS)
+                                          - 1))) {
+    add_dirty_clusters(zi, start, end);
+    goto out_unlock;
+  }
+
+  if ((err = alloc_compr_bufs(&bufs, 1))) {
+    add_dirty_clusters(zi, start, end);
+    goto out_unlock;
+  }
+
+  compressed = 0;
+  for (cluster = start; cluster < end; cluster++) {
+    if ((err = compress_cluster(inode, cluster, &bufs)) < 0) {
+      add_dirty_clusters(zi, cluster, end);
+      break;
+    }
+    compressed += err;
+    err = 0;
+    cond_resched();
+  }
+  free_compr_bufs(&bufs);
+
+  if (compressed) {
+    DBGPRINT("[ZARUFS] %s: ino=%lu, compressed %lu clusters\n",
+             __func__, inode->i_ino, compressed);
+    zi->i_flags |= EXT2_COMPRBLK_FL;
+    mark_inode_dirty(inode);
+    set_compression_feature(sb);
+  }
+
+ out_unlock:
+  mutex_unlock(&zi->i_compr_mutex);
+  mutex_unlock(&inode->i_mutex);
+  return (err);
+}
+
+static void
+add_dirty_clusters(struct zarufs_inode_info *zi,
+                   unsigned long            first,
+                   unsigned long            last) {
+  spin_lock(&zi->i_compr_lock);
+  if (zi->i_compr_start == zi->i_compr_end) {
+    zi->i_compr_start = first;
+    zi->i_compr_end   = last;
+  } else {
+    if (first < zi->i_compr_start) {
+      zi->i_compr_start = first;
+    }
+    if (zi->i_compr_end < last) {
+      zi->i_compr_end = last;
+    }
+  }
+  spin_unlock(&zi->i_compr_lock);
+}
+
+static int
+alloc_compr_bufs(struct zarufs_compr_bufs *bufs, int compress) {
+  size_t csize;
+
+  csize = sizeof(struct zarufs_cluster_head)
+    + lz4_compressbound(ZARUFS_CLUSTER_SIZE);
+
+  bufs->ubuf   = kmalloc(ZARUFS_CLUSTER_SIZE, GFP_NOFS);
+  bufs->cbuf   = kmalloc(csize, GFP_NOFS);
+  bufs->wrkmem = NULL;
+  if (compress) {
+    bufs->wrkmem = kmalloc(LZ4_MEM_COMPRESS, GFP_NOFS);
+  }
+
+  if (!bufs->ubuf || !bufs->cbuf || (compress && !bufs->wrkmem)) {
+    free_compr_bufs(bufs);
+    return (-ENOMEM);
+  }
+  return (0);
+}
+
+static void
+free_compr_bufs(struct zarufs_compr_bufs *bufs) {
+  kfree(bufs->ubuf);
+  kfree(bufs->cbuf);
+  kfree(bufs->wrkmem);
+}
+
+static int
+read_cluster_pointers(struct inode *inode,
+                      unsigned long cluster,
+                      unsigned long *blks) {
+  unsigned long first_block;
+  int           nblocks;
+  int           i;
+  int           err;
+
+  nblocks     = ZARUFS_CLUSTER_BLOCKS(inode->i_sb);
+  first_block = cluster << ZARUFS_CLUSTER_BLOCKS_BITS(inode->i_sb);
+  for (i = 0; i < nblocks; i++) {
+    if ((err = zarufs_get_block_ptr(inode, first_block + i, &blks[i]))) {
+      return (err);
+    }
+  }
+  return (0);
+}
+
+static int
+is_compressed_cluster(struct inode *inode, unsigned long cluster) {
+  unsigned long last_block;
+  unsigned long blk;
+  int           err;
+
+  last_block = ((cluster + 1) << ZARUFS_CLUSTER_BLOCKS_BITS(inode->i_sb)) - 1;
+  if ((err = zarufs_get_block_ptr(inode, last_block, &blk))) {
+    return (err);
+  }
+  return (blk == ZARUFS_COMPRESSED_BLKADDR);
+}
+
+static int
+load_cluster(struct inode *inode,
+             unsigned long *blks,
+             struct zarufs_compr_bufs *bufs) {
+  struct super_block         *sb;
+  struct zarufs_cluster_head *head;
+  struct buffer_head         *bhs[ZARUFS_CLUSTER_MAX_BLOCKS];
+  size_t                     csize;
+  size_t                     usize;
+  int                        nblocks;
+  int                        nr;
+  int                        i;
+  int                        err;
+
+  sb      = inode->i_sb;
+  nblocks = ZARUFS_CLUSTER_BLOCKS(sb);
+
+  /* compressed data is packed at the head of the cluster. */
+  for (nr = 0; (nr < nblocks - 1) && blks[nr]; nr++) {
+    if (!(bhs[nr] = sb_getblk(sb, blks[nr]))) {
+      err = -ENOMEM;
+      goto out;
+    }
+  }
+  ll_rw_block(READ, nr, bhs);
+
+  err = 0;
+  for (i = 0; i < nr; i++) {
+    wait_on_buffer(bhs[i]);
+    if (!buffer_uptodate(bhs[i])) {
+      err = -EIO;
+      goto out;
+    }
+    memcpy(bufs->cbuf + (i << sb->s_blocksize_bits), bhs[i]->b_data, sb->s_blocksize);
+  }
+
+  head  = (struct zarufs_cluster_head*) bufs->cbuf;
+  csize = le32_to_cpu(head->ch_csize);
+  if ((le32_to_cpu(head->ch_magic) != ZARUFS_CLUSTER_MAGIC) ||
+      (le16_to_cpu(head->ch_method) != ZARUFS_COMPR_LZ4) ||
+      (le32_to_cpu(head->ch_usize) != ZARUFS_CLUSTER_SIZE) ||
+      ((nr << sb->s_blocksize_bits) < sizeof(*head) + csize)) {
+    ZARUFS_ERROR("[ZARUFS] %s: bad cluster head.", __func__);
+    ZARUFS_ERROR("ino=%lu, block=%lu\n", inode->i_ino, blks[0]);
+    err = -EIO;
+    goto out;
+  }
+
+  usize = ZARUFS_CLUSTER_SIZE;
+  if ((lz4_decompress_unknownoutputsize((unsigned char*)(head + 1),
+                                        csize,
+                                        (unsigned char*) bufs->ubuf,
+                                        &usize) < 0) ||
+      (usize != ZARUFS_CLUSTER_SIZE)) {
+    ZARUFS_ERROR("[ZARUFS] %s: corrupted cluster.", __func__);
+    ZARUFS_ERROR("ino=%lu, block=%lu\n", inode->i_ino, blks[0]);
+    err = -EIO;
+  }
+
+ out:
+  while (nr--) {
+    brelse(bhs[nr]);
+  }
+  return (err);
+}
+
+static int
+compress_cluster(struct inode *inode,
+                 unsigned long cluster,
+                 struct zarufs_compr_bufs *bufs) {
+  struct super_block         *sb;
+  struct zarufs_cluster_head *head;
+  unsigned long              blks[ZARUFS_CLUSTER_MAX_BLOCKS];
+  unsigned long              new_blks[ZARUFS_CLUSTER_MAX_BLOCKS];
+  size_t                     clen;
+  pgoff_t                    first_index;
+  int                        nblocks;
+  int                        need;
+  int                        stuck;
+  int                        i;
+  int                        err;
+
+  sb      = inode->i_sb;
+  nblocks = ZARUFS_CLUSTER_BLOCKS(sb);
+
+  if ((err = read_cluster_pointers(inode, cluster, blks))) {
+    return (err);
+  }
+
+  /* only fully allocated plain clusters are compressed. */
+  for (i = 0; i < nblocks; i++) {
+    if (!blks[i] || (blks[i] == ZARUFS_COMPRESSED_BLKADDR)) {
+      return (0);
+    }
+  }
+
+  first_index = cluster << ZARUFS_CLUSTER_PAGES_BITS;
+  for (i = 0; i < ZARUFS_CLUSTER_PAGES; i++) {
+    struct page *page;
+    char        *kaddr;
+
+    page = read_mapping_page(inode->i_mapping, first_index + i, NULL);
+    if (IS_ERR(page)) {
+      return (PTR_ERR(page));
+    }
+    kaddr = kmap_atomic(page);
+    memcpy(bufs->ubuf + (i << PAGE_CACHE_SHIFT), kaddr, PAGE_CACHE_SIZE);
+    kunmap_atomic(kaddr);
+    page_cache_release(page);
+  }
+
+  head = (struct zarufs_cluster_head*) bufs->cbuf;
+  if (lz4_compress((unsigned char*) bufs->ubuf,
+                   ZARUFS_CLUSTER_SIZE,
+                   (unsigned char*)(head + 1),
+                   &clen,
+                   bufs->wrkmem) < 0) {
+    return (0);
+  }
+
+  /* the last block pointer is kept for the marker, */
+  /* so at least one block must be saved. */
+  need = DIV_ROUND_UP(sizeof(*head) + clen, sb->s_blocksize);
+  if (nblocks - 1 < need) {
+    return (0);
+  }
+
+  head->ch_magic  = cpu_to_le32(ZARUFS_CLUSTER_MAGIC);
+  head->ch_method = cpu_to_le16(ZARUFS_COMPR_LZ4);
+  head->ch_pad    = 0;
+  head->ch_csize  = cpu_to_le32(clen);
+  head->ch_usize  = cpu_to_le32(ZARUFS_CLUSTER_SIZE);
+  memset((char*)(head + 1) + clen,
+         0,
+         (need << sb->s_blocksize_bits) - sizeof(*head) - clen);
+
+  /* write the compressed data to new blocks first, so that the plain */
+  /* cluster stays intact until the block pointers are switched. */
+  if ((err = write_cluster_blocks(inode, blks[0], bufs->cbuf, need,
+                                  new_blks, 0))) {
+    return (err);
+  }
+  for (i = need; i < nblocks; i++) {
+    new_blks[i] = (i == nblocks - 1) ? ZARUFS_COMPRESSED_BLKADDR : 0;
+  }
+  if ((err = switch_cluster_pointers(inode, cluster, new_blks, blks,
+                                     &stuck))) {
+    if (!stuck) {
+      free_cluster_blocks(inode, new_blks, need);
+    }
+    return (err);
+  }
+
+  /* cached pages still refer to the plain blocks. a page which cannot */
+  /* be dropped keeps the cluster plain. */
+  if (invalidate_inode_pages2_range(inode->i_mapping,
+                                    first_index,
+                                    first_index + ZARUFS_CLUSTER_PAGES - 1)) {
+    if ((err = switch_cluster_pointers(inode, cluster, blks, new_blks,
+                                       &stuck))) {
+      /* neither layout can be freed while a page may refer to it. */
+      ZARUFS_ERROR("[ZARUFS] %s: cannot restore plain cluster.", __func__);
+      ZARUFS_ERROR("ino=%lu, cluster=%lu\n", inode->i_ino, cluster);
+      return (err);
+    }
+    free_cluster_blocks(inode, new_blks, need);
+    return (0);
+  }
+  free_cluster_blocks(inode, blks, nblocks);
+  return (1);
+}
+
+/*
+ * write nblocks of data to new blocks allocated near goal. with wait, the
+ * data is on disk when this returns. on failure no block is left.
+ */
+static int
+write_cluster_blocks(struct inode *inode,
+                     unsigned long goal,
+                     const char *data,
+                     int nblocks,
+                     unsigned long *new_blks,
+                     int wait) {
+  struct super_block *sb;
+  struct buffer_head *bhs[ZARUFS_CLUSTER_MAX_BLOCKS];
+  unsigned long      count;
+  int                nr;
+  int                i;
+  int                err;
+
+  sb  = inode->i_sb;
+  err = 0;
+  for (nr = 0; nr < nblocks; nr++) {
+    count        = 1;
+    new_blks[nr] = zarufs_new_blocks(inode, goal, &count, &err);
+    if (err) {
+      break;
+    }
+    goal = new_blks[nr] + 1;
+
+    if (unlikely(!(bhs[nr] = sb_getblk(sb, new_blks[nr])))) {
+      zarufs_free_blocks(inode, new_blks[nr], 1);
+      err = -ENOMEM;
+      break;
+    }
+    lock_buffer(bhs[nr]);
+    memcpy(bhs[nr]->b_data, data + (nr << sb->s_blocksize_bits), sb->s_blocksize);
+    set_buffer_uptodate(bhs[nr]);
+    unlock_buffer(bhs[nr]);
+    mark_buffer_dirty_inode(bhs[nr], inode);
+  }
+
+  if (!err && wait) {
+    for (i = 0; i < nr; i++) {
+      write_dirty_buffer(bhs[i], WRITE);
+    }
+    for (i = 0; i < nr; i++) {
+      wait_on_buffer(bhs[i]);
+      if (!buffer_uptodate(bhs[i])) {
+        err = -EIO;
+      }
+    }
+  }
+
+  for (i = 0; i < nr; i++) {
+    if (err) {
+      /* the block goes back free. its data must never reach it. */
+      bforget(bhs[i]);
+      zarufs_free_blocks(inode, new_blks[i], 1);
+    } else {
+      brelse(bhs[i]);
+    }
+  }
+  return (err);
+}
+
+/*
+ * point the blocks of a cluster to 'to'. on failure, the pointers already
+ * switched are put back to 'from', and the caller still owns the blocks
+ * of 'to'. if even that fails, stuck is set, and both are left allocated,
+ * since either may be referenced.
+ */
+static int
+switch_cluster_pointers(struct inode *inode,
+                        unsigned long cluster,
+                        const unsigned long *to,
+                        const unsigned long *from,
+                        int *stuck) {
+  struct zarufs_block_range range;
+  unsigned long             first_block;
+  int                       nblocks;
+  int                       i;
+  int                       err;
+
+  nblocks     = ZARUFS_CLUSTER_BLOCKS(inode->i_sb);
+  first_block = cluster << ZARUFS_CLUSTER_BLOCKS_BITS(inode->i_sb);
+  *stuck      = 0;
+  err         = 0;
+
+  zarufs_lock_block_range(inode, &range, first_block, first_block + nblocks);
+  for (i = 0; i < nblocks; i++) {
+    if ((err = zarufs_set_block_ptr(inode, first_block + i, to[i]))) {
+      break;
+    }
+  }
+  if (err) {
+    while (0 < i--) {
+      if (zarufs_set_block_ptr(inode, first_block + i, from[i])) {
+        *stuck = 1;
+      }
+    }
+  }
+  zarufs_unlock_block_range(inode, &range);
+
+  if (*stuck) {
+    ZARUFS_ERROR("[ZARUFS] %s: cannot restore block pointers.", __func__);
+    ZARUFS_ERROR("ino=%lu, cluster=%lu\n", inode->i_ino, cluster);
+  }
+  return (err);
+}
+
+/* holes and the marker among blks are skipped. */
+static void
+free_cluster_blocks(struct inode *inode, const unsigned long *blks, int nr) {
+  int i;
+
+  for (i = 0; i < nr; i++) {
+    if (blks[i] && (blks[i] != ZARUFS_COMPRESSED_BLKADDR)) {
+      zarufs_free_blocks(inode, blks[i], 1);
+    }
+  }
+}
+
+static void
+set_compression_feature(struct super_block *sb) {
+  struct zarufs_sb_info *zsi;
+
+  zsi = ZARUFS_SB(sb);
+  if (zsi->s_zsb->s_feature_incompat
+      & cpu_to_le32(EXT2_FEATURE_INCOMPAT_COMPRESSION)) {
+    return;
+  }
+
+  lock_buffer(zsi->s_sbh);
+  zsi->s_zsb->s_feature_incompat
+    |= cpu_to_le32(EXT2_FEATURE_INCOMPAT_COMPRESSION);
+  unlock_buffer(zsi->s_sbh);
+  mark_buffer_dirty(zsi->s_sbh);
+}
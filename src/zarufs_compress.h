@@ -0,0 +1,20 @@
+/* zarufs_compress.h */
+#ifndef _ZARUFS_COMPRESS_H_
+#define _ZARUFS_COMPRESS_H_
+
+int
+zarufs_read_compressed_page(struct inode *inode, struct page *page);
+
+int
+zarufs_uncompress_cluster(struct inode *inode, unsigned long cluster);
+
+void
+zarufs_compress_mark_dirty(struct inode *inode, loff_t pos, loff_t len);
+
+void
+zarufs_queue_compress(struct inode *inode);
+
+void
+zarufs_compress_work(struct work_struct *work);
+
+#endif
@@ -1,35 +1,82 @@
 /* zarufs_dir.c */
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/slab.h>
+#include <linux/log2.h>
+#include <linux/hash.h>
+#include <linux/mutex.h>
 
 #include "../include/zarufs.h"
 #include "zarufs_dir.h"
 #include "zarufs_utils.h"
 #include "zarufs_inode.h"
+#include "zarufs_ioctl.h"
+#include "zarufs_dx.h"
+#include "zarufs_dir_cache.h"
 
 int
 zarufs_read_dir(struct file *file, struct dir_context *ctx);
 
-static struct page*
-zarufs_get_dir_page_cache(struct inode *inode, unsigned long index);
-
-static inline void
-zarufs_put_dir_page_cache(struct page *page);
-
 static unsigned long
 zarufs_get_page_last_byte(struct inode *inode, unsigned long page_nr);
 
 static inline unsigned long
 get_dir_num_pages(struct inode *inode);
 
-static inline int
-prepare_write_block(struct page *page, loff_t pos, unsigned long len);
+static unsigned
+validate_entry(char *base, unsigned offset, unsigned mask);
+
+static void
+dir_readahead(struct inode *dir,
+              struct file_ra_state *ra,
+              struct file *file,
+              unsigned long index,
+              unsigned long end_index);
+
+static struct page*
+get_dir_block_page(struct inode *dir, unsigned long block, char **start);
+
+static unsigned int
+get_dir_block_gap(char *start, unsigned long block_size);
+
+static unsigned long
+find_dir_gap(struct inode *dir, unsigned long from, unsigned int rec_len);
+
+static void
+set_dir_gap(struct inode *dir, unsigned long block, unsigned int gap);
+
+static void
+widen_dir_gap(struct inode *dir, unsigned long block, unsigned int gap);
 
-static inline void
-set_dir_entry_type(struct ext2_dir_entry *dent, struct inode *inode);
+static void
+free_dir_gaps(struct inode *dir);
 
 static int
-commit_block_write(struct page *page, loff_t pos, unsigned long len);
+read_dir_block(struct inode *dir, unsigned long block, char *buf);
+
+static int
+do_add_link(struct dentry *dentry, struct inode *inode, int exclusive);
+
+static inline struct mutex*
+get_dir_block_lock(struct inode *dir, unsigned long block);
+
+/*
+ * the largest free space of each directory block is kept in i_dir_gaps,
+ * so that zarufs_add_link() skips the blocks which cannot hold the entry.
+ * the map is only in memory. blocks not scanned yet are unknown.
+ */
+#define ZARUFS_DIR_GAP_UNKNOWN (0xFFFF)
+#define ZARUFS_DIR_GAP_MAX     (0xFFFE)
+
+/*
+ * entries are changed in place under a lock of their block, hashed from the
+ * inode number and the block number. blocks of distinct directories may
+ * share a lock, so no more than one is held at a time.
+ */
+#define ZARUFS_DIR_LOCK_BITS (8)
+static struct mutex zarufs_dir_block_locks[1 << ZARUFS_DIR_LOCK_BITS];
 
 #define S_SHIFT 12
 static unsigned char zarufs_type_by_mode[S_IFMT >> S_SHIFT] = {
@@ -42,12 +89,25 @@ static unsigned char zarufs_type_by_mode[S_IFMT >> S_SHIFT] = {
   [S_IFLNK  >> S_SHIFT] = EXT2_FT_SYMLINK,
 };
 
+/*
+ * nothing of the inode is written here, and the state of the scan lives in
+ * the file and ctx, so readdir needs no more than a shared lock of the
+ * directory. the kernels this tree builds for have no such lock for it,
+ * and the vfs still calls ->iterate under i_mutex. the directory may still
+ * have changed since the last call, or since the last page, which is found
+ * by i_version.
+ */
 int
 zarufs_read_dir(struct file *file, struct dir_context *ctx) {
   struct super_block       *sb;
   struct inode             *inode;
+  loff_t                   size;
   unsigned long            offset;
   unsigned long            page_index;
+  unsigned long            nr_pages;
+  unsigned long            inos[ZARUFS_PREFETCH_INODES];
+  int                      nr_inos;
+  int                      batch;
   unsigned char            ftype_table[EXT2_FT_MAX] = {
     [ EXT2_FT_UNKNOWN ]  = DT_UNKNOWN,
     [ EXT2_FT_REG_FILE ] = DT_REG,
@@ -60,31 +120,49 @@ zarufs_read_dir(struct file *file, struct dir_context *ctx) {
   };
 
   inode = file_inode(file);
+  size  = i_size_read(inode);
   /* whether position exceeds last of minimum dir entry or not. */
-  if ((inode->i_size - (1 + 8 + 3)) < ctx->pos) {
+  if ((size - (1 + 8 + 3)) < ctx->pos) {
     /* there is no more entry in the directory. */
     return (0);
   }
 
-  sb     = inode->i_sb;
-  offset = ctx->pos & ~PAGE_CACHE_MASK;
+  sb       = inode->i_sb;
+  offset   = ctx->pos & ~PAGE_CACHE_MASK;
+  nr_pages = (size + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
+  nr_inos  = 0;
+  batch    = min_t(int, ZARUFS_SB(sb)->s_inode_prefetch,
+                   ZARUFS_PREFETCH_INODES);
 
   for (page_index = ctx->pos >> PAGE_CACHE_SHIFT;
-       page_index < get_dir_num_pages(inode);
+       page_index < nr_pages;
        page_index++) {
     struct page           *page;
     struct ext2_dir_entry *dent;
     char                  *start;
     char                  *end;
-    
+    u64                   version;
+
+    /* the window of f_ra grows while readdir goes on sequentially. */
+    dir_readahead(inode, &file->f_ra, file, page_index, nr_pages);
     page = (struct page*) zarufs_get_dir_page_cache(inode, page_index);
     if (IS_ERR(page)) {
       ZARUFS_ERROR("[ZARUFS] bad page in %lu\n", inode->i_ino);
       ctx->pos += PAGE_CACHE_SIZE - offset;
+      zarufs_prefetch_inodes(sb, inos, nr_inos);
       return(PTR_ERR(page));
     }
 
     start = (char*) page_address((const struct page*) page);
+    /* entries may have been moved since ctx->pos was taken. */
+    version = inode->i_version;
+    if (file->f_version != version) {
+      if (offset) {
+        offset   = validate_entry(start, offset, sb->s_blocksize - 1);
+        ctx->pos = (page_index << PAGE_CACHE_SHIFT) + offset;
+      }
+      file->f_version = version;
+    }
     end   = start + zarufs_get_page_last_byte(inode, page_index) - (1 + 8 + 3);
     dent  = (struct ext2_dir_entry*) (start + offset);
     while ((char*) dent <= end) {
@@ -93,6 +171,7 @@ zarufs_read_dir(struct file *file, struct dir_context *ctx) {
       if (!dent->rec_len) {
         ZARUFS_ERROR("[ZARUFS] Error: zero-length directory entry.\n");
         zarufs_put_dir_page_cache(page);
+        zarufs_prefetch_inodes(sb, inos, nr_inos);
         return(-EIO);
       }
 
@@ -108,26 +187,57 @@ zarufs_read_dir(struct file *file, struct dir_context *ctx) {
                        dent->name_len,
                        le32_to_cpu(dent->inode),
                        ftype_table[ftype_index]))) {
-          break;
+          /* the buffer of the caller is full. */
+          zarufs_put_dir_page_cache(page);
+          zarufs_prefetch_inodes(sb, inos, nr_inos);
+          return (0);
+        }
+
+        /* a stat of each entry usually follows. */
+        if (batch) {
+          inos[nr_inos++] = le32_to_cpu(dent->inode);
+          if (batch <= nr_inos) {
+            zarufs_prefetch_inodes(sb, inos, nr_inos);
+            nr_inos = 0;
+          }
         }
       }
       /* goto next entry. */
-      rec_len = le16_to_cpu(dent->rec_len);
+      rec_len = zarufs_rec_len_from_disk(dent->rec_len);
       ctx->pos += rec_len;
       dent = (struct ext2_dir_entry*) ((char*) dent + rec_len);
     }
     zarufs_put_dir_page_cache(page);
+    offset = 0;
   }
+  zarufs_prefetch_inodes(sb, inos, nr_inos);
   return (0);
 }
 
-static struct page*
+/* find the head of the entry at or before offset in its block. */
+static unsigned
+validate_entry(char *base, unsigned offset, unsigned mask) {
+  struct ext2_dir_entry *dent;
+  struct ext2_dir_entry *p;
+
+  dent = (struct ext2_dir_entry*) (base + offset);
+  p    = (struct ext2_dir_entry*) (base + (offset & ~mask));
+  while ((char*) p < (char*) dent) {
+    if (p->rec_len == 0) {
+      break;
+    }
+    p = (struct ext2_dir_entry*) ((char*) p + zarufs_rec_len_from_disk(p->rec_len));
+  }
+  return ((char*) p - base);
+}
+
+struct page*
 zarufs_get_dir_page_cache(struct inode *inode, unsigned long index) {
   struct page *page;
   /* read blocks from device and map them. */
   DBGPRINT("page cache inode=%lu\n", (unsigned long) inode->i_ino);
   DBGPRINT("index=%lu\n", index);
-  inode->i_mapping->a_ops = &zarufs_aops;
+  /* a_ops is set up with the inode. nothing here may write the inode. */
   page = read_mapping_page(inode->i_mapping, index, NULL);
   if (!IS_ERR(page)) {
     kmap(page);
@@ -139,26 +249,27 @@ zarufs_get_dir_page_cache(struct inode *inode, unsigned long index) {
   return (page);
 }
 
-static inline void
+void
 zarufs_put_dir_page_cache(struct page *page) {
   kunmap(page);
   page_cache_release(page);
 }
 
 const struct file_operations zarufs_dir_operations = {
-  .iterate = zarufs_read_dir,
+  .iterate        = zarufs_read_dir,
+  .unlocked_ioctl = zarufs_ioctl,
 };
 
 
 static inline unsigned long
 get_dir_num_pages(struct inode *inode) {
-  return ((inode->i_size + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT);
+  return ((i_size_read(inode) + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT);
 }
 
 static unsigned long
 zarufs_get_page_last_byte(struct inode *inode, unsigned long page_nr) {
   unsigned long last_byte;
-  last_byte = inode->i_size - (page_nr << PAGE_CACHE_SHIFT);
+  last_byte = i_size_read(inode) - (page_nr << PAGE_CACHE_SHIFT);
   if (last_byte > PAGE_CACHE_SIZE) {
     return PAGE_CACHE_SIZE;
   }
@@ -194,13 +305,13 @@ zarufs_strcmp(int len, const char* const name, struct ext2_dir_entry *dent) {
   return(!memcmp(name, dent->name, len));
 }
 
-static inline int
-prepare_write_block(struct page *page, loff_t pos, unsigned long len) {
+int
+zarufs_prepare_write_block(struct page *page, loff_t pos, unsigned long len) {
   return(__block_write_begin(page, pos, (unsigned) len, zarufs_get_block));
 }
 
-static inline void
-set_dir_entry_type(struct ext2_dir_entry *dent, struct inode *inode) {
+void
+zarufs_set_dir_entry_type(struct ext2_dir_entry *dent, struct inode *inode) {
   struct zarufs_sb_info *zsi;
   umode_t               mode;
 
@@ -215,8 +326,8 @@ set_dir_entry_type(struct ext2_dir_entry *dent, struct inode *inode) {
   }
 }
 
-static int
-commit_block_write(struct page *page, loff_t pos, unsigned long len) {
+int
+zarufs_commit_block_write(struct page *page, loff_t pos, unsigned long len) {
   struct address_space *mapping;
   struct inode         *dir;
   int                  err;
@@ -225,7 +336,8 @@ commit_block_write(struct page *page, loff_t pos, unsigned long len) {
   dir     = mapping->host;
   err     = 0;
 
-  /* commit block write. */
+  /* commit block write. readers of the directory check i_version. */
+  dir->i_version++;
   block_write_end(NULL, mapping, pos, len, len, page, NULL);
   if (dir->i_size < (pos + len)) {
     i_size_write(dir, pos + len);
@@ -249,20 +361,54 @@ zarufs_find_dir_entry(struct inode *dir,
                       struct page  **res_page) {
   struct page           *page;
   struct ext2_dir_entry *dent;
+  struct file_ra_state  ra;
   unsigned long         rec_len;
   unsigned long         page_index;
+  unsigned long         start_index;
+  unsigned long         nr_pages;
   const char            *name = child->name;
   int                   namelen;
 
   namelen = child->len;
   rec_len = ZARUFS_DIR_REC_LEN(namelen);
 
-  for (page_index = 0;
-       page_index < get_dir_num_pages(dir);
-       page_index++) {
+  if (zarufs_is_dx_dir(dir)) {
+    int err;
+
+    dent = zarufs_dx_find_entry(dir, child, res_page, &err);
+    if (dent || (err != ZARUFS_ERR_BAD_DX_DIR)) {
+      return (dent);
+    }
+    /* broken index. the entries can still be found linearly. */
+    ZARUFS_ERROR("[ZARUFS] %s: falling back to linear search [ino=%lu]\n",
+                 __func__, dir->i_ino);
+  } else {
+    int err;
+
+    dent = zarufs_dir_cache_find(dir, child, res_page, &err);
+    if (dent || (err == -ENOENT)) {
+      return (dent);
+    }
+  }
+
+  if (!(nr_pages = get_dir_num_pages(dir))) {
+    goto not_found;
+  }
+
+  /* start from the page of the last hit, and wrap around. */
+  start_index = ZARUFS_I(dir)->i_dir_start_lookup;
+  if (nr_pages <= start_index) {
+    start_index = 0;
+  }
+  page_index = start_index;
+  file_ra_state_init(&ra, dir->i_mapping);
+  do {
     char *start;
     char *end;
 
+    /* read ahead up to the end of the directory, or of the wrapped scan. */
+    dir_readahead(dir, &ra, NULL, page_index,
+                  (page_index < start_index) ? start_index : nr_pages);
     page = (struct page*) zarufs_get_dir_page_cache(dir, page_index);
     if (IS_ERR(page)) {
       ZARUFS_ERROR("[ZARUFS] %s: bad page [%lu]\n", __func__, page_index);
@@ -284,15 +430,22 @@ zarufs_find_dir_entry(struct inode *dir,
         goto found;
       }
 
-      d_rec_len = le16_to_cpu(dent->rec_len);
+      d_rec_len = zarufs_rec_len_from_disk(dent->rec_len);
       dent = (struct ext2_dir_entry*) ((char*) dent + d_rec_len);
     }
     zarufs_put_dir_page_cache(page);
-  }
+    if (nr_pages <= ++page_index) {
+      page_index = 0;
+    }
+  } while (page_index != start_index);
+  /* the whole directory has been scanned. cache it for the next lookups. */
+  zarufs_dir_cache_build(dir);
+
  not_found:
   return(NULL);
 
  found:
+  ZARUFS_I(dir)->i_dir_start_lookup = page_index;
   *res_page = page;
   return(dent);
 }
@@ -312,7 +465,7 @@ zarufs_make_empty(struct inode *inode, struct inode *parent) {
 
   /* get block size in file system. */
   block_size = inode->i_sb->s_blocksize;
-  if ((err = prepare_write_block(page, 0, block_size))) {
+  if ((err = zarufs_prepare_write_block(page, 0, block_size))) {
     /* failed to prepare. */
     unlock_page(page);
     page_cache_release(page);
@@ -324,30 +477,56 @@ zarufs_make_empty(struct inode *inode, struct inode *parent) {
   /* make dot. */
   dent = (struct ext2_dir_entry*) start;
   dent->name_len = 1;
-  dent->rec_len  = cpu_to_le16(ZARUFS_DIR_REC_LEN(dent->name_len));
+  dent->rec_len  = zarufs_rec_len_to_disk(ZARUFS_DIR_REC_LEN(dent->name_len));
   memcpy(dent->name, ".\0\0", 4);
   dent->inode = cpu_to_le32(inode->i_ino);
-  set_dir_entry_type(dent, inode);
+  zarufs_set_dir_entry_type(dent, inode);
 
   /* make dot dot. */
   dent = (struct ext2_dir_entry*) (start + ZARUFS_DIR_REC_LEN(1));
   dent->name_len = 2;
-  dent->rec_len  = cpu_to_le16(block_size - ZARUFS_DIR_REC_LEN(1));
+  dent->rec_len  = zarufs_rec_len_to_disk(block_size - ZARUFS_DIR_REC_LEN(1));
   dent->inode    = cpu_to_le32(parent->i_ino);
   memcpy(dent->name, "..\0", 4);
-  set_dir_entry_type(dent, inode);
+  zarufs_set_dir_entry_type(dent, inode);
 
   kunmap_atomic(start);
 
   /* commit write block of empty contents. */
-  err = commit_block_write(page, 0, block_size);
+  err = zarufs_commit_block_write(page, 0, block_size);
   page_cache_release(page);
 
   return(err);
 }
 
+/*
+ * most links go into a block as it is, and only that block is locked, so
+ * links into distinct blocks may be made at once under the shared i_dir_sem.
+ * appending a block, splitting a leaf or indexing the directory moves the
+ * layout, and is retried with i_dir_sem held exclusive.
+ */
 int
 zarufs_add_link(struct dentry *dentry, struct inode *inode) {
+  struct zarufs_inode_info *zi;
+  int                      err;
+
+  zi = ZARUFS_I(dentry->d_parent->d_inode);
+
+  down_read(&zi->i_dir_sem);
+  err = do_add_link(dentry, inode, 0);
+  up_read(&zi->i_dir_sem);
+  if (err != -EAGAIN) {
+    return (err);
+  }
+
+  down_write(&zi->i_dir_sem);
+  err = do_add_link(dentry, inode, 1);
+  up_write(&zi->i_dir_sem);
+  return (err);
+}
+
+static int
+do_add_link(struct dentry *dentry, struct inode *inode, int exclusive) {
   struct inode          *dir;
   struct page           *page;
   struct ext2_dir_entry *dent;
@@ -355,9 +534,13 @@ zarufs_add_link(struct dentry *dentry, struct inode *inode) {
   int                   link_name_len;
   unsigned long         block_size;
   unsigned long         link_rec_len;
-  unsigned short        rec_len;
-  unsigned short        name_len;
-  unsigned long         page_index;
+  unsigned int          rec_len;
+  unsigned int          name_len;
+  unsigned int          gap;
+  unsigned long         nr_blocks;
+  unsigned long         block;
+  char                  *start;
+  char                  *end;
   loff_t                pos;
   int                   err;
 
@@ -366,39 +549,39 @@ zarufs_add_link(struct dentry *dentry, struct inode *inode) {
   link_rec_len  = ZARUFS_DIR_REC_LEN(link_name_len);
   block_size    = dir->i_sb->s_blocksize;
 
-  /* find entry space in the directory. */
-  for (page_index = 0;
-       page_index <= get_dir_num_pages(dir);
-       page_index++) {
-    char *start;
-    char *end;
-    char *dir_end;
+  if (zarufs_is_dx_dir(dir)) {
+    err = zarufs_dx_add_link(dentry, inode, exclusive);
+    if (err != ZARUFS_ERR_BAD_DX_DIR) {
+      return (err);
+    }
+    if (!exclusive) {
+      return (-EAGAIN);
+    }
+    /* broken index. drop it and go on with the linear format. */
+    ZARUFS_I(dir)->i_flags &= ~EXT2_INDEX_FL;
+    mark_inode_dirty(dir);
+  }
 
-    page = (struct page*) zarufs_get_dir_page_cache(dir, page_index);
-    err = PTR_ERR(page);
+  /* find entry space only in the blocks which may have it. */
+  nr_blocks = dir->i_size >> dir->i_blkbits;
+  for (block = find_dir_gap(dir, 0, link_rec_len);
+       block < nr_blocks;
+       block = find_dir_gap(dir, block + 1, link_rec_len)) {
+    page = get_dir_block_page(dir, block, &start);
     if (IS_ERR(page)) {
-      ZARUFS_ERROR("[ZARUFS] %s: bad page [%lu]\n", __func__, page_index);
-      return (err);
+      ZARUFS_ERROR("[ZARUFS] %s: bad page [%lu]\n", __func__,
+                   block >> (PAGE_CACHE_SHIFT - dir->i_blkbits));
+      return (PTR_ERR(page));
     }
 
+    zarufs_lock_dir_block(dir, block);
     lock_page(page);
-    start = (char*) page_address((const struct page*) page);
-    dir_end = start
-      + zarufs_get_page_last_byte(dir, page_index);
+    end  = start + block_size;
     dent = (struct ext2_dir_entry*) start;
-    end  = start + PAGE_CACHE_SIZE - link_rec_len;
-
-    /* find entry space in the page cache of the directory. */
-    while ((char*) dent <= end) {
-      if ((char*) dent == dir_end) {
-        /* reach i_size */
-        name_len      = 0;
-        rec_len       = block_size;
-        dent->rec_len = cpu_to_le16(rec_len);
-        dent->inode   = 0;
-        goto got_it;
-      }
+    gap  = 0;
 
+    /* find entry space in the block. */
+    while ((char*) dent < end) {
       /* invalid entry. */
       if (!dent->rec_len) {
         ZARUFS_ERROR("[ZARUFS] %s: zero-length directory entry.\n", __func__);
@@ -412,29 +595,66 @@ zarufs_add_link(struct dentry *dentry, struct inode *inode) {
         goto out_unlock;
       }
 
-      name_len = ZARUFS_DIR_REC_LEN(dent->name_len);
-      rec_len  = le16_to_cpu(dent->rec_len);
-
-      /* found empty entry. */
-      if (!dent->inode && (link_rec_len <= rec_len)) {
-        goto got_it;
-      }
+      name_len = dent->inode ? ZARUFS_DIR_REC_LEN(dent->name_len) : 0;
+      rec_len  = zarufs_rec_len_from_disk(dent->rec_len);
 
-      /* detected deleted entry. */
+      /* found an unused entry, or space behind a live one. */
       if ((name_len + link_rec_len) <= rec_len) {
         goto got_it;
       }
+      if (name_len < rec_len) {
+        gap = max(gap, rec_len - name_len);
+      }
       dent = (struct ext2_dir_entry*) ((char*) dent + rec_len);
     }
+    set_dir_gap(dir, block, gap);
     unlock_page(page);
+    zarufs_unlock_dir_block(dir, block);
+    zarufs_put_dir_page_cache(page);
+  }
+
+  /* the layout changes from here. */
+  if (!exclusive) {
+    return (-EAGAIN);
+  }
+
+  /* the first block is full. index it instead of growing linearly. */
+  if (nr_blocks == 1) {
+    int can_index;
+
+    page = get_dir_block_page(dir, 0, &start);
+    if (IS_ERR(page)) {
+      return (PTR_ERR(page));
+    }
+    can_index = zarufs_dx_can_index(dir, start);
     zarufs_put_dir_page_cache(page);
+    if (can_index) {
+      zarufs_dir_cache_drop(dir);
+      free_dir_gaps(dir);
+      return (zarufs_dx_make_indexed_dir(dentry, inode));
+    }
+  }
+
+  /* no block has space. append a new one at i_size. */
+  block = nr_blocks;
+  page  = get_dir_block_page(dir, block, &start);
+  if (IS_ERR(page)) {
+    ZARUFS_ERROR("[ZARUFS] %s: bad page [%lu]\n", __func__,
+                 block >> (PAGE_CACHE_SHIFT - dir->i_blkbits));
+    return (PTR_ERR(page));
   }
-  return (-EINVAL);
+  zarufs_lock_dir_block(dir, block);
+  lock_page(page);
+  dent          = (struct ext2_dir_entry*) start;
+  name_len      = 0;
+  rec_len       = block_size;
+  dent->rec_len = zarufs_rec_len_to_disk(rec_len);
+  dent->inode   = 0;
 
  got_it:
   pos = page_offset(page)
     + ((char*) dent - (char*) page_address(page));
-  if ((err = prepare_write_block(page, pos, rec_len))) {
+  if ((err = zarufs_prepare_write_block(page, pos, rec_len))) {
     goto out_unlock;
   }
 
@@ -443,8 +663,8 @@ zarufs_add_link(struct dentry *dentry, struct inode *inode) {
     struct ext2_dir_entry *cur_dent;
     /* here, name_len = rec_len of deleted entry. */
     cur_dent = (struct ext2_dir_entry*) ((char*) dent + name_len);
-    cur_dent->rec_len = cpu_to_le16(rec_len - name_len);
-    dent->rec_len     = cpu_to_le16(name_len);
+    cur_dent->rec_len = zarufs_rec_len_to_disk(rec_len - name_len);
+    dent->rec_len     = zarufs_rec_len_to_disk(name_len);
     dent              = cur_dent;
   }
 
@@ -452,19 +672,23 @@ zarufs_add_link(struct dentry *dentry, struct inode *inode) {
   dent->name_len = link_name_len;
   memcpy(dent->name, link_name, link_name_len);
   dent->inode = cpu_to_le32(inode->i_ino);
-  set_dir_entry_type(dent, inode);
+  zarufs_set_dir_entry_type(dent, inode);
 
-  err = commit_block_write(page, pos, rec_len);
+  err = zarufs_commit_block_write(page, pos, rec_len);
+  zarufs_dir_cache_insert(dir, dent, page);
+  set_dir_gap(dir, block, get_dir_block_gap(start, block_size));
   dir->i_mtime = CURRENT_TIME_SEC;
   dir->i_ctime = dir->i_mtime;
   ZARUFS_I(dir)->i_flags &= ~EXT2_BTREE_FL;
   mark_inode_dirty(dir);
 
+  zarufs_unlock_dir_block(dir, block);
   zarufs_put_dir_page_cache(page);
   return(err);
 
  out_unlock:
   unlock_page(page);
+  zarufs_unlock_dir_block(dir, block);
   zarufs_put_dir_page_cache(page);
   return(err);
 }
@@ -494,6 +718,7 @@ zarufs_is_empty_dir(struct inode *inode) {
       if (dent->rec_len == 0) {
         ZARUFS_ERROR("[ZARUFS] %s: zero-length directry entry.\n",
                      __func__);
+        goto not_empty;
       }
 
       if (dent->inode != 0) {
@@ -510,11 +735,11 @@ zarufs_is_empty_dir(struct inode *inode) {
         } else if (dent->name[1] != '.') {
           goto not_empty;
         }
-        /* goto next entry. */
-        dent = (struct ext2_dir_entry*) ((char*) dent + le16_to_cpu(dent->rec_len));
       }
-      zarufs_put_dir_page_cache(page);
+      /* goto next entry. unused entries fill index blocks. */
+      dent = (struct ext2_dir_entry*) ((char*) dent + zarufs_rec_len_from_disk(dent->rec_len));
     }
+    zarufs_put_dir_page_cache(page);
   }
   return (1);
 
@@ -529,6 +754,7 @@ zarufs_delete_dir_entry(struct ext2_dir_entry *dir, struct page *page) {
   char                  *start;
   unsigned              from;
   unsigned              to;
+  unsigned long         block;
   loff_t                pos;
   struct ext2_dir_entry *pde;
   struct ext2_dir_entry *dent;
@@ -537,8 +763,13 @@ zarufs_delete_dir_entry(struct ext2_dir_entry *dir, struct page *page) {
   inode = page->mapping->host;
   start = page_address(page);
   from  = ((char*) dir - start) & ~(inode->i_sb->s_blocksize - 1);
-  to    = ((char*) dir - start) + le16_to_cpu(dir->rec_len);
+  block = (page->index << (PAGE_CACHE_SHIFT - inode->i_blkbits))
+    + (from >> inode->i_blkbits);
 
+  /* the previous entry may be changed by a link into the same block. */
+  down_read(&ZARUFS_I(inode)->i_dir_sem);
+  zarufs_lock_dir_block(inode, block);
+  to   = ((char*) dir - start) + zarufs_rec_len_from_disk(dir->rec_len);
   pde  = NULL;
   dent = (struct ext2_dir_entry*) (start + from);
 
@@ -549,7 +780,7 @@ zarufs_delete_dir_entry(struct ext2_dir_entry *dir, struct page *page) {
       goto out;
     }
     pde = dent;
-    dent = (struct ext2_dir_entry*) ((char*) dent + le16_to_cpu(dent->rec_len));
+    dent = (struct ext2_dir_entry*) ((char*) dent + zarufs_rec_len_from_disk(dent->rec_len));
   }
 
   if (pde) {
@@ -558,24 +789,114 @@ zarufs_delete_dir_entry(struct ext2_dir_entry *dir, struct page *page) {
 
   pos = page_offset(page) + from;
   lock_page(page);
-  err = prepare_write_block(page, pos, to - from);
+  err = zarufs_prepare_write_block(page, pos, to - from);
   if (pde) {
-    pde->rec_len = le16_to_cpu(to - from);
+    pde->rec_len = zarufs_rec_len_to_disk(to - from);
   }
 
+  zarufs_dir_cache_remove(inode, dir, page);
   dir->inode = 0;
-  err = commit_block_write(page, pos, to - from);
+  err = zarufs_commit_block_write(page, pos, to - from);
+  /* the entry has merged into the previous one, or become unused. */
+  widen_dir_gap(inode,
+                block,
+                (to - from) - (pde ? ZARUFS_DIR_REC_LEN(pde->name_len) : 0));
   inode->i_mtime = CURRENT_TIME_SEC;
   inode->i_ctime = inode->i_mtime;
-  ZARUFS_I(inode)->i_flags &= ~EXT2_BTREE_FL;
-
+  /* the index stays valid, since the entry leaves no block. */
   mark_inode_dirty(inode);
 
  out:
+  zarufs_unlock_dir_block(inode, block);
+  up_read(&ZARUFS_I(inode)->i_dir_sem);
   zarufs_put_dir_page_cache(page);
   return (err);
 }
 
+/*
+ * cut the blocks at the end of a linear directory which hold no entry.
+ * entries never move, so that a readdir going on meanwhile sees every
+ * name once. every block cut is read and checked first, so that a bad
+ * entry or a failed read leaves the directory as it was. the caller
+ * holds i_mutex.
+ */
+int
+zarufs_compact_dir(struct inode *dir) {
+  struct ext2_dir_entry *dent;
+  unsigned long         block_size;
+  unsigned long         nr_blocks;
+  unsigned long         keep;
+  unsigned int          rec_len;
+  char                  *buf;
+  int                   err;
+
+  if (zarufs_is_dx_dir(dir)) {
+    return (-EOPNOTSUPP);
+  }
+  /* clusters cannot be cut. */
+  if (zarufs_has_bigalloc(dir->i_sb)) {
+    return (0);
+  }
+
+  block_size = dir->i_sb->s_blocksize;
+  if (!(buf = kmalloc(block_size, GFP_NOFS))) {
+    return (-ENOMEM);
+  }
+
+  /* no entry is added to a block meanwhile. */
+  down_write(&ZARUFS_I(dir)->i_dir_sem);
+
+  err       = 0;
+  nr_blocks = dir->i_size >> dir->i_blkbits;
+  /* a directory keeps at least one block. */
+  for (keep = nr_blocks; 1 < keep; keep--) {
+    if ((err = read_dir_block(dir, keep - 1, buf))) {
+      goto out;
+    }
+
+    dent = (struct ext2_dir_entry*) buf;
+    while ((char*) dent < buf + block_size) {
+      rec_len = zarufs_rec_len_from_disk(dent->rec_len);
+      if ((rec_len < ZARUFS_DIR_REC_LEN(1)) ||
+          (buf + block_size < (char*) dent + rec_len) ||
+          (dent->inode && (rec_len < ZARUFS_DIR_REC_LEN(dent->name_len)))) {
+        ZARUFS_ERROR("[ZARUFS] %s: bad directory entry [ino=%lu]\n",
+                     __func__, dir->i_ino);
+        err = -EIO;
+        goto out;
+      }
+      if (dent->inode) {
+        break;
+      }
+      dent = (struct ext2_dir_entry*) ((char*) dent + rec_len);
+    }
+    if ((char*) dent < buf + block_size) {
+      break;
+    }
+  }
+  if (nr_blocks <= keep) {
+    goto out;
+  }
+
+  /* the gap map knows the blocks cut. */
+  free_dir_gaps(dir);
+  if (keep <= ZARUFS_I(dir)->i_dir_start_lookup) {
+    ZARUFS_I(dir)->i_dir_start_lookup = 0;
+  }
+
+  i_size_write(dir, (loff_t) keep << dir->i_blkbits);
+  truncate_pagecache(dir, dir->i_size);
+  err = zarufs_truncate_blocks(dir, keep);
+  dir->i_mtime = CURRENT_TIME_SEC;
+  dir->i_ctime = dir->i_mtime;
+  mark_inode_dirty(dir);
+
+ out:
+  up_write(&ZARUFS_I(dir)->i_dir_sem);
+  kfree(buf);
+  return (err);
+}
+
 struct ext2_dir_entry*
 zarufs_get_dot_dot_entry(struct inode *dir, struct page **p) {
   struct page           *page;
@@ -587,7 +908,7 @@ zarufs_get_dot_dot_entry(struct inode *dir, struct page **p) {
   if (!IS_ERR(page)) {
     struct ext2_dir_entry *cur_dent;
     cur_dent = (struct ext2_dir_entry*) page_address(page);
-    dent = (struct ext2_dir_entry*)((char*) cur_dent + le16_to_cpu(cur_dent->rec_len));
+    dent = (struct ext2_dir_entry*)((char*) cur_dent + zarufs_rec_len_from_disk(cur_dent->rec_len));
     *p = page;
   }
   return(dent);
@@ -599,18 +920,25 @@ zarufs_set_link(struct inode *dir,
                 struct page *page,
                 struct inode *inode,
                 int update_times) {
-  loff_t   pos;
-  unsigned len;
-  int      err;
+  unsigned long block;
+  loff_t        pos;
+  unsigned      len;
+  int           err;
 
-  pos = page_offset(page) + ((char*) dent - (char*) page_address(page));
-  len = le16_to_cpu(dent->rec_len);
+  pos   = page_offset(page) + ((char*) dent - (char*) page_address(page));
+  block = pos >> dir->i_blkbits;
 
+  down_read(&ZARUFS_I(dir)->i_dir_sem);
+  zarufs_lock_dir_block(dir, block);
+  len = zarufs_rec_len_from_disk(dent->rec_len);
   lock_page(page);
-  err = prepare_write_block(page, pos, len);
+  err = zarufs_prepare_write_block(page, pos, len);
   dent->inode = cpu_to_le32(inode->i_ino);
-  set_dir_entry_type(dent, inode);
-  err = commit_block_write(page, pos, len);
+  zarufs_set_dir_entry_type(dent, inode);
+  err = zarufs_commit_block_write(page, pos, len);
+  zarufs_dir_cache_update(dir, dent, page);
+  zarufs_unlock_dir_block(dir, block);
+  up_read(&ZARUFS_I(dir)->i_dir_sem);
   zarufs_put_dir_page_cache(page);
 
   if (update_times) {
@@ -618,6 +946,206 @@ zarufs_set_link(struct inode *dir,
     dir->i_ctime = dir->i_mtime;
   }
 
-  ZARUFS_I(dir)->i_flags &= ~EXT2_BTREE_FL;
   mark_inode_dirty(dir);
 }
+
+/*
+ * read pages from index on asynchronously before they are needed. a page
+ * marked by the last readahead means the window is being consumed, so the
+ * next window is issued.
+ */
+static void
+dir_readahead(struct inode *dir,
+              struct file_ra_state *ra,
+              struct file *file,
+              unsigned long index,
+              unsigned long end_index) {
+  struct address_space *mapping;
+  struct page          *page;
+  unsigned int         ra_pages;
+
+  /* a window set by the administrator overrides that of the device. */
+  if ((ra_pages = ZARUFS_SB(dir->i_sb)->s_dir_ra_pages)) {
+    ra->ra_pages = ra_pages;
+  }
+  mapping = dir->i_mapping;
+  if (!(page = find_get_page(mapping, index))) {
+    page_cache_sync_readahead(mapping, ra, file, index, end_index - index);
+    return;
+  }
+  if (PageReadahead(page)) {
+    page_cache_async_readahead(mapping, ra, file, page, index,
+                               end_index - index);
+  }
+  page_cache_release(page);
+}
+
+static struct page*
+get_dir_block_page(struct inode *dir, unsigned long block, char **start) {
+  struct page  *page;
+  unsigned int bits;
+
+  bits = PAGE_CACHE_SHIFT - dir->i_blkbits;
+  page = zarufs_get_dir_page_cache(dir, block >> bits);
+  if (!IS_ERR(page)) {
+    *start = (char*) page_address(page)
+      + ((block & ((1 << bits) - 1)) << dir->i_blkbits);
+  }
+  return (page);
+}
+
+/* the largest space for a new entry in a block. */
+static unsigned int
+get_dir_block_gap(char *start, unsigned long block_size) {
+  struct ext2_dir_entry *dent;
+  unsigned int          rec_len;
+  unsigned int          name_len;
+  unsigned int          gap;
+
+  gap  = 0;
+  dent = (struct ext2_dir_entry*) start;
+  while ((char*) dent < start + block_size) {
+    if (!(rec_len = zarufs_rec_len_from_disk(dent->rec_len))) {
+      break;
+    }
+    name_len = dent->inode ? ZARUFS_DIR_REC_LEN(dent->name_len) : 0;
+    if (name_len < rec_len) {
+      gap = max(gap, rec_len - name_len);
+    }
+    dent = (struct ext2_dir_entry*) ((char*) dent + rec_len);
+  }
+  return (gap);
+}
+
+/*
+ * the first block from 'from' which may have space for rec_len. links into
+ * other blocks may update the map meanwhile, so it is read under
+ * i_dir_gap_lock.
+ */
+static unsigned long
+find_dir_gap(struct inode *dir, unsigned long from, unsigned int rec_len) {
+  struct zarufs_inode_info *zi;
+  unsigned long            nr_blocks;
+
+  zi = ZARUFS_I(dir);
+  spin_lock(&zi->i_dir_gap_lock);
+  nr_blocks = min(dir->i_size >> dir->i_blkbits,
+                  (loff_t) zi->i_dir_nr_gaps);
+  for (; from < nr_blocks; from++) {
+    if ((zi->i_dir_gaps[from] == ZARUFS_DIR_GAP_UNKNOWN) ||
+        (rec_len <= zi->i_dir_gaps[from])) {
+      break;
+    }
+  }
+  spin_unlock(&zi->i_dir_gap_lock);
+  return (from);
+}
+
+static void
+set_dir_gap(struct inode *dir, unsigned long block, unsigned int gap) {
+  struct zarufs_inode_info *zi;
+  unsigned long            nr_gaps;
+  __u16                    *gaps;
+
+  zi      = ZARUFS_I(dir);
+  nr_gaps = 0;
+  gaps    = NULL;
+
+  spin_lock(&zi->i_dir_gap_lock);
+  while (zi->i_dir_nr_gaps <= block) {
+    /* the map grows outside of the lock. */
+    if (gaps && (block < nr_gaps)) {
+      memcpy(gaps, zi->i_dir_gaps, zi->i_dir_nr_gaps * sizeof(__u16));
+      memset(gaps + zi->i_dir_nr_gaps,
+             0xFF,
+             (nr_gaps - zi->i_dir_nr_gaps) * sizeof(__u16));
+      swap(zi->i_dir_gaps, gaps);
+      zi->i_dir_nr_gaps = nr_gaps;
+      break;
+    }
+    spin_unlock(&zi->i_dir_gap_lock);
+
+    kfree(gaps);
+    /* without the map, every block is scanned. */
+    nr_gaps = max(roundup_pow_of_two(block + 1), 16UL);
+    gaps    = kmalloc(nr_gaps * sizeof(__u16), GFP_NOFS);
+    if (!gaps) {
+      return;
+    }
+
+    spin_lock(&zi->i_dir_gap_lock);
+  }
+  zi->i_dir_gaps[block] = min(gap, (unsigned int) ZARUFS_DIR_GAP_MAX);
+  spin_unlock(&zi->i_dir_gap_lock);
+
+  /* the old map, or a new one which somebody else has grown first. */
+  kfree(gaps);
+}
+
+static void
+widen_dir_gap(struct inode *dir, unsigned long block, unsigned int gap) {
+  struct zarufs_inode_info *zi;
+
+  zi = ZARUFS_I(dir);
+  spin_lock(&zi->i_dir_gap_lock);
+  if ((block < zi->i_dir_nr_gaps) &&
+      (zi->i_dir_gaps[block] != ZARUFS_DIR_GAP_UNKNOWN) &&
+      (zi->i_dir_gaps[block] < gap)) {
+    zi->i_dir_gaps[block] = min(gap, (unsigned int) ZARUFS_DIR_GAP_MAX);
+  }
+  spin_unlock(&zi->i_dir_gap_lock);
+}
+
+static void
+free_dir_gaps(struct inode *dir) {
+  struct zarufs_inode_info *zi;
+  __u16                    *gaps;
+
+  zi = ZARUFS_I(dir);
+  spin_lock(&zi->i_dir_gap_lock);
+  gaps              = zi->i_dir_gaps;
+  zi->i_dir_gaps    = NULL;
+  zi->i_dir_nr_gaps = 0;
+  spin_unlock(&zi->i_dir_gap_lock);
+  kfree(gaps);
+}
+
+static int
+read_dir_block(struct inode *dir, unsigned long block, char *buf) {
+  struct page *page;
+  char        *start;
+
+  page = get_dir_block_page(dir, block, &start);
+  if (IS_ERR(page)) {
+    return (PTR_ERR(page));
+  }
+  memcpy(buf, start, dir->i_sb->s_blocksize);
+  zarufs_put_dir_page_cache(page);
+  return (0);
+}
+
+void
+zarufs_init_dir_locks(void) {
+  int i;
+
+  for (i = 0; i < (1 << ZARUFS_DIR_LOCK_BITS); i++) {
+    mutex_init(&zarufs_dir_block_locks[i]);
+  }
+}
+
+void
+zarufs_lock_dir_block(struct inode *dir, unsigned long block) {
+  mutex_lock(get_dir_block_lock(dir, block));
+}
+
+void
+zarufs_unlock_dir_block(struct inode *dir, unsigned long block) {
+  mutex_unlock(get_dir_block_lock(dir, block));
+}
+
+static inline struct mutex*
+get_dir_block_lock(struct inode *dir, unsigned long block) {
+  return (&zarufs_dir_block_locks[hash_long(dir->i_ino
+                                            ^ hash_long(block, BITS_PER_LONG),
+                                            ZARUFS_DIR_LOCK_BITS)]);
+}
@@ -38,4 +38,55 @@ zarufs_set_link(struct inode *dir,
                 struct inode *inode,
                 int update_times);
 
+int
+zarufs_compact_dir(struct inode *dir);
+
+void
+zarufs_init_dir_locks(void);
+
+void
+zarufs_lock_dir_block(struct inode *dir, unsigned long block);
+
+void
+zarufs_unlock_dir_block(struct inode *dir, unsigned long block);
+
+struct page*
+zarufs_get_dir_page_cache(struct inode *inode, unsigned long index);
+
+void
+zarufs_put_dir_page_cache(struct page *page);
+
+int
+zarufs_prepare_write_block(struct page *page, loff_t pos, unsigned long len);
+
+int
+zarufs_commit_block_write(struct page *page, loff_t pos, unsigned long len);
+
+void
+zarufs_set_dir_entry_type(struct ext2_dir_entry *dent, struct inode *inode);
+
+/* a 64KiB block holds a single entry whose rec_len does not fit in 16 bits. */
+static inline unsigned int
+zarufs_rec_len_from_disk(__le16 dlen) {
+  unsigned int len;
+
+  len = le16_to_cpu(dlen);
+#if (PAGE_CACHE_SIZE >= 65536)
+  if (len == ZARUFS_MAX_REC_LEN) {
+    return (1 << 16);
+  }
+#endif
+  return (len);
+}
+
+static inline __le16
+zarufs_rec_len_to_disk(unsigned int len) {
+#if (PAGE_CACHE_SIZE >= 65536)
+  if (len == (1 << 16)) {
+    return (cpu_to_le16(ZARUFS_MAX_REC_LEN));
+  }
+#endif
+  return (cpu_to_le16(len));
+}
+
 #endif
@@ -0,0 +1,569 @@
+/* zarufs_dir_cache.c */
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/pagemap.h>
+#include <linux/slab.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/dcache.h>
+
+#include "../include/zarufs.h"
+#include "zarufs_dir.h"
+#include "zarufs_dir_cache.h"
+#include "zarufs_utils.h"
+
+/*
+ * in-memory name cache of unindexed directories. it maps the hash of a
+ * name to the place of its entry, so that lookups in a large linear
+ * directory need not scan it. the cache is built by the first lookup
+ * which scanned the whole directory, and it is complete from then on, so
+ * a name which is not in it does not exist. all changes to the directory
+ * are made under i_mutex, and they keep the cache coherent or drop it.
+ */
+
+/* small directories are scanned quickly enough. */
+#define ZARUFS_DIR_CACHE_MIN_PAGES   (2)
+#define ZARUFS_DIR_CACHE_MIN_BITS    (6)
+#define ZARUFS_DIR_CACHE_MAX_BITS    (12)
+/* estimated bytes of a directory entry to size the table. */
+#define ZARUFS_DIR_CACHE_ENTRY_BYTES (32)
+/* a table holds this many entries per bucket before it is rebuilt. */
+#define ZARUFS_DIR_CACHE_LOAD        (8)
+/* names with more colliding hashes are searched linearly. */
+#define ZARUFS_DIR_CACHE_MAX_PROBES  (4)
+
+struct zarufs_dir_cache_entry {
+  struct hlist_node node;
+  unsigned long     index;
+  unsigned int      offset;
+  __u32             hash;
+  ino_t             ino;
+};
+
+struct zarufs_dir_cache {
+  struct list_head  lru;
+  struct inode      *dir;
+  struct hlist_head *buckets;
+  unsigned int      bits;
+  unsigned long     nr_entries;
+  int               referenced;
+};
+
+struct dir_cache_probe {
+  unsigned long index;
+  unsigned int  offset;
+  ino_t         ino;
+};
+
+/* upper limit of cached entries of all directories. 0 disables the cache. */
+static unsigned long dir_cache_max_entries = 1 << 20;
+module_param(dir_cache_max_entries, ulong, 0644);
+MODULE_PARM_DESC(dir_cache_max_entries,
+                 "max directory name cache entries (0 to disable)");
+
+static struct kmem_cache *zarufs_dir_cache_entry_cachep;
+
+/* lock order is i_dir_cache_lock, then zarufs_dir_cache_lru_lock. */
+static LIST_HEAD(zarufs_dir_cache_lru);
+static DEFINE_SPINLOCK(zarufs_dir_cache_lru_lock);
+static atomic_long_t zarufs_dir_cache_nr_entries;
+
+static __u32
+dir_cache_hash(const char *name, unsigned int len);
+
+static struct hlist_head*
+dir_cache_bucket(struct zarufs_dir_cache *cache, __u32 hash);
+
+static struct zarufs_dir_cache_entry*
+dir_cache_lookup_entry(struct zarufs_dir_cache *cache,
+                       __u32 hash,
+                       unsigned long index,
+                       unsigned int offset);
+
+static int
+dir_cache_add(struct zarufs_dir_cache *cache,
+              struct zarufs_dir_cache_entry *entry);
+
+static struct zarufs_dir_cache*
+dir_cache_detach(struct inode *dir);
+
+static void
+dir_cache_free(struct zarufs_dir_cache *cache);
+
+static unsigned long
+zarufs_dir_cache_count(struct shrinker *shrink, struct shrink_control *sc);
+
+static unsigned long
+zarufs_dir_cache_scan(struct shrinker *shrink, struct shrink_control *sc);
+
+static struct shrinker zarufs_dir_cache_shrinker = {
+  .count_objects = zarufs_dir_cache_count,
+  .scan_objects  = zarufs_dir_cache_scan,
+  .seeks         = DEFAULT_SEEKS,
+};
+
+struct ext2_dir_entry*
+zarufs_dir_cache_find(struct inode *dir,
+                      struct qstr  *child,
+                      struct page  **res_page,
+                      int          *err) {
+  struct zarufs_inode_info      *zi;
+  struct zarufs_dir_cache       *cache;
+  struct zarufs_dir_cache_entry *entry;
+  struct dir_cache_probe        probes[ZARUFS_DIR_CACHE_MAX_PROBES];
+  struct ext2_dir_entry         *dent;
+  struct page                   *page;
+  __u32                         hash;
+  int                           nr_probes;
+  int                           i;
+
+  zi   = ZARUFS_I(dir);
+  hash = dir_cache_hash((const char*) child->name, child->len);
+
+  /* take the candidates out, since reading pages may sleep. */
+  nr_probes = 0;
+  spin_lock(&zi->i_dir_cache_lock);
+  if (!(cache = zi->i_dir_cache)) {
+    spin_unlock(&zi->i_dir_cache_lock);
+    *err = -EAGAIN;
+    return (NULL);
+  }
+  cache->referenced = 1;
+  hlist_for_each_entry(entry, dir_cache_bucket(cache, hash), node) {
+    if (entry->hash != hash) {
+      continue;
+    }
+    if (nr_probes == ZARUFS_DIR_CACHE_MAX_PROBES) {
+      spin_unlock(&zi->i_dir_cache_lock);
+      *err = -EAGAIN;
+      return (NULL);
+    }
+    probes[nr_probes].index  = entry->index;
+    probes[nr_probes].offset = entry->offset;
+    probes[nr_probes].ino    = entry->ino;
+    nr_probes++;
+  }
+  spin_unlock(&zi->i_dir_cache_lock);
+
+  for (i = 0; i < nr_probes; i++) {
+    page = zarufs_get_dir_page_cache(dir, probes[i].index);
+    if (IS_ERR(page)) {
+      goto stale;
+    }
+
+    dent = (struct ext2_dir_entry*) ((char*) page_address(page)
+                                     + probes[i].offset);
+    if ((dent->inode != cpu_to_le32(probes[i].ino)) ||
+        (dir_cache_hash(dent->name, dent->name_len) != hash)) {
+      zarufs_put_dir_page_cache(page);
+      goto stale;
+    }
+    if ((dent->name_len == child->len) &&
+        !memcmp(dent->name, child->name, child->len)) {
+      *res_page = page;
+      *err      = 0;
+      return (dent);
+    }
+    zarufs_put_dir_page_cache(page);
+  }
+
+  /* the cache holds every name of the directory. */
+  *err = -ENOENT;
+  return (NULL);
+
+ stale:
+  ZARUFS_ERROR("[ZARUFS] %s: stale name cache [ino=%lu]\n",
+               __func__, dir->i_ino);
+  zarufs_dir_cache_drop(dir);
+  *err = -EAGAIN;
+  return (NULL);
+}
+
+/* called when a lookup has scanned the whole directory. */
+void
+zarufs_dir_cache_build(struct inode *dir) {
+  struct zarufs_inode_info      *zi;
+  struct zarufs_dir_cache       *cache;
+  struct zarufs_dir_cache_entry *entry;
+  unsigned long                 nr_pages;
+  unsigned long                 index;
+  unsigned long                 estimate;
+  unsigned int                  bits;
+
+  zi       = ZARUFS_I(dir);
+  nr_pages = (dir->i_size + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
+  if (!dir_cache_max_entries ||
+      (zi->i_flags & EXT2_INDEX_FL) ||
+      (nr_pages < ZARUFS_DIR_CACHE_MIN_PAGES) ||
+      (dir_cache_max_entries
+       <= atomic_long_read(&zarufs_dir_cache_nr_entries))) {
+    return;
+  }
+  if (zi->i_dir_cache) {
+    return;
+  }
+
+  /* too large directories would only churn the cache. */
+  estimate = dir->i_size / ZARUFS_DIR_CACHE_ENTRY_BYTES;
+  if ((ZARUFS_DIR_CACHE_LOAD << ZARUFS_DIR_CACHE_MAX_BITS) <= estimate) {
+    return;
+  }
+  bits = ilog2(roundup_pow_of_two(estimate));
+  bits = clamp_t(unsigned int,
+                 bits,
+                 ZARUFS_DIR_CACHE_MIN_BITS,
+                 ZARUFS_DIR_CACHE_MAX_BITS);
+
+  if (!(cache = kzalloc(sizeof(*cache), GFP_NOFS))) {
+    return;
+  }
+  cache->buckets = kcalloc(1 << bits, sizeof(struct hlist_head), GFP_NOFS);
+  if (!cache->buckets) {
+    kfree(cache);
+    return;
+  }
+  INIT_LIST_HEAD(&cache->lru);
+  cache->dir  = dir;
+  cache->bits = bits;
+
+  for (index = 0; index < nr_pages; index++) {
+    struct page           *page;
+    struct ext2_dir_entry *dent;
+    char                  *start;
+    char                  *end;
+    unsigned long         last_byte;
+
+    page = zarufs_get_dir_page_cache(dir, index);
+    if (IS_ERR(page)) {
+      goto fail;
+    }
+
+    last_byte = dir->i_size - (index << PAGE_CACHE_SHIFT);
+    if (PAGE_CACHE_SIZE < last_byte) {
+      last_byte = PAGE_CACHE_SIZE;
+    }
+    start = (char*) page_address(page);
+    end   = start + last_byte - ZARUFS_DIR_REC_LEN(1);
+    dent  = (struct ext2_dir_entry*) start;
+    while ((char*) dent <= end) {
+      if (!dent->rec_len) {
+        zarufs_put_dir_page_cache(page);
+        goto fail;
+      }
+
+      if (dent->inode) {
+        entry = kmem_cache_alloc(zarufs_dir_cache_entry_cachep, GFP_NOFS);
+        if (!entry) {
+          zarufs_put_dir_page_cache(page);
+          goto fail;
+        }
+        entry->index  = index;
+        entry->offset = (char*) dent - start;
+        entry->hash   = dir_cache_hash(dent->name, dent->name_len);
+        entry->ino    = le32_to_cpu(dent->inode);
+        if (dir_cache_add(cache, entry)) {
+          zarufs_put_dir_page_cache(page);
+          goto fail;
+        }
+      }
+      dent = (struct ext2_dir_entry*) ((char*) dent
+                                       + zarufs_rec_len_from_disk(dent->rec_len));
+    }
+    zarufs_put_dir_page_cache(page);
+  }
+
+  spin_lock(&zi->i_dir_cache_lock);
+  if (!zi->i_dir_cache) {
+    zi->i_dir_cache = cache;
+    spin_lock(&zarufs_dir_cache_lru_lock);
+    list_add_tail(&cache->lru, &zarufs_dir_cache_lru);
+    spin_unlock(&zarufs_dir_cache_lru_lock);
+    cache = NULL;
+  }
+  spin_unlock(&zi->i_dir_cache_lock);
+
+ fail:
+  if (cache) {
+    dir_cache_free(cache);
+  }
+}
+
+/* dent in page has just been linked. */
+void
+zarufs_dir_cache_insert(struct inode *dir,
+                        struct ext2_dir_entry *dent,
+                        struct page *page) {
+  struct zarufs_inode_info      *zi;
+  struct zarufs_dir_cache       *cache;
+  struct zarufs_dir_cache_entry *entry;
+
+  zi = ZARUFS_I(dir);
+  if (!zi->i_dir_cache) {
+    return;
+  }
+
+  entry = kmem_cache_alloc(zarufs_dir_cache_entry_cachep, GFP_NOFS);
+  if (!entry) {
+    /* the cache would miss the name. */
+    zarufs_dir_cache_drop(dir);
+    return;
+  }
+  entry->index  = page->index;
+  entry->offset = (char*) dent - (char*) page_address(page);
+  entry->hash   = dir_cache_hash(dent->name, dent->name_len);
+  entry->ino    = le32_to_cpu(dent->inode);
+
+  spin_lock(&zi->i_dir_cache_lock);
+  if ((cache = zi->i_dir_cache) && !dir_cache_add(cache, entry)) {
+    entry = NULL;
+  }
+  spin_unlock(&zi->i_dir_cache_lock);
+
+  if (entry) {
+    kmem_cache_free(zarufs_dir_cache_entry_cachep, entry);
+    if (cache) {
+      /* the table has outgrown its size. it is rebuilt by a later scan. */
+      zarufs_dir_cache_drop(dir);
+    }
+  }
+}
+
+/* dent in page is about to be unlinked. */
+void
+zarufs_dir_cache_remove(struct inode *dir,
+                        struct ext2_dir_entry *dent,
+                        struct page *page) {
+  struct zarufs_inode_info      *zi;
+  struct zarufs_dir_cache       *cache;
+  struct zarufs_dir_cache_entry *entry;
+  int                           missing;
+
+  zi = ZARUFS_I(dir);
+  if (!zi->i_dir_cache) {
+    return;
+  }
+
+  missing = 0;
+  spin_lock(&zi->i_dir_cache_lock);
+  if ((cache = zi->i_dir_cache)) {
+    entry = dir_cache_lookup_entry(cache,
+                                   dir_cache_hash(dent->name, dent->name_len),
+                                   page->index,
+                                   (char*) dent - (char*) page_address(page));
+    if (entry) {
+      hlist_del(&entry->node);
+      cache->nr_entries--;
+      atomic_long_dec(&zarufs_dir_cache_nr_entries);
+      kmem_cache_free(zarufs_dir_cache_entry_cachep, entry);
+    } else {
+      missing = 1;
+    }
+  }
+  spin_unlock(&zi->i_dir_cache_lock);
+
+  if (missing) {
+    zarufs_dir_cache_drop(dir);
+  }
+}
+
+/* dent in page has been linked to another inode. */
+void
+zarufs_dir_cache_update(struct inode *dir,
+                        struct ext2_dir_entry *dent,
+                        struct page *page) {
+  struct zarufs_inode_info      *zi;
+  struct zarufs_dir_cache       *cache;
+  struct zarufs_dir_cache_entry *entry;
+  int                           missing;
+
+  zi = ZARUFS_I(dir);
+  if (!zi->i_dir_cache) {
+    return;
+  }
+
+  missing = 0;
+  spin_lock(&zi->i_dir_cache_lock);
+  if ((cache = zi->i_dir_cache)) {
+    entry = dir_cache_lookup_entry(cache,
+                                   dir_cache_hash(dent->name, dent->name_len),
+                                   page->index,
+                                   (char*) dent - (char*) page_address(page));
+    if (entry) {
+      entry->ino = le32_to_cpu(dent->inode);
+    } else {
+      missing = 1;
+    }
+  }
+  spin_unlock(&zi->i_dir_cache_lock);
+
+  if (missing) {
+    zarufs_dir_cache_drop(dir);
+  }
+}
+
+void
+zarufs_dir_cache_drop(struct inode *dir) {
+  struct zarufs_dir_cache *cache;
+
+  if ((cache = dir_cache_detach(dir))) {
+    dir_cache_free(cache);
+  }
+}
+
+int
+zarufs_init_dir_cache(void) {
+  int err;
+
+  zarufs_dir_cache_entry_cachep =
+    kmem_cache_create("zarufs_dir_cache_entry",
+                      sizeof(struct zarufs_dir_cache_entry),
+                      0,
+                      SLAB_RECLAIM_ACCOUNT,
+                      NULL);
+  if (!zarufs_dir_cache_entry_cachep) {
+    return (-ENOMEM);
+  }
+
+  if ((err = register_shrinker(&zarufs_dir_cache_shrinker))) {
+    kmem_cache_destroy(zarufs_dir_cache_entry_cachep);
+    return (err);
+  }
+  return (0);
+}
+
+void
+zarufs_exit_dir_cache(void) {
+  unregister_shrinker(&zarufs_dir_cache_shrinker);
+  kmem_cache_destroy(zarufs_dir_cache_entry_cachep);
+}
+
+static __u32
+dir_cache_hash(const char *name, unsigned int len) {
+  return (full_name_hash((const unsigned char*) name, len));
+}
+
+static struct hlist_head*
+dir_cache_bucket(struct zarufs_dir_cache *cache, __u32 hash) {
+  return (&cache->buckets[hash_32(hash, cache->bits)]);
+}
+
+static struct zarufs_dir_cache_entry*
+dir_cache_lookup_entry(struct zarufs_dir_cache *cache,
+                       __u32 hash,
+                       unsigned long index,
+                       unsigned int offset) {
+  struct zarufs_dir_cache_entry *entry;
+
+  hlist_for_each_entry(entry, dir_cache_bucket(cache, hash), node) {
+    if ((entry->index == index) && (entry->offset == offset)) {
+      return (entry);
+    }
+  }
+  return (NULL);
+}
+
+/* returns -ENOSPC when the cache may not hold one more entry. */
+static int
+dir_cache_add(struct zarufs_dir_cache *cache,
+              struct zarufs_dir_cache_entry *entry) {
+  if (((ZARUFS_DIR_CACHE_LOAD << cache->bits) <= cache->nr_entries) ||
+      (dir_cache_max_entries
+       <= atomic_long_read(&zarufs_dir_cache_nr_entries))) {
+    return (-ENOSPC);
+  }
+
+  hlist_add_head(&entry->node, dir_cache_bucket(cache, entry->hash));
+  cache->nr_entries++;
+  atomic_long_inc(&zarufs_dir_cache_nr_entries);
+  return (0);
+}
+
+static struct zarufs_dir_cache*
+dir_cache_detach(struct inode *dir) {
+  struct zarufs_inode_info *zi;
+  struct zarufs_dir_cache  *cache;
+
+  zi = ZARUFS_I(dir);
+  if (!zi->i_dir_cache) {
+    return (NULL);
+  }
+
+  spin_lock(&zi->i_dir_cache_lock);
+  if ((cache = zi->i_dir_cache)) {
+    zi->i_dir_cache = NULL;
+    spin_lock(&zarufs_dir_cache_lru_lock);
+    list_del_init(&cache->lru);
+    spin_unlock(&zarufs_dir_cache_lru_lock);
+  }
+  spin_unlock(&zi->i_dir_cache_lock);
+  return (cache);
+}
+
+static void
+dir_cache_free(struct zarufs_dir_cache *cache) {
+  struct zarufs_dir_cache_entry *entry;
+  struct hlist_node             *tmp;
+  unsigned int                  i;
+
+  for (i = 0; i < (1U << cache->bits); i++) {
+    hlist_for_each_entry_safe(entry, tmp, &cache->buckets[i], node) {
+      kmem_cache_free(zarufs_dir_cache_entry_cachep, entry);
+    }
+  }
+  atomic_long_sub(cache->nr_entries, &zarufs_dir_cache_nr_entries);
+  kfree(cache->buckets);
+  kfree(cache);
+}
+
+static unsigned long
+zarufs_dir_cache_count(struct shrinker *shrink, struct shrink_control *sc) {
+  return (vfs_pressure_ratio(atomic_long_read(&zarufs_dir_cache_nr_entries)));
+}
+
+/*
+ * drop whole caches in lru order. a cache used since the last pass gets
+ * a second chance.
+ */
+static unsigned long
+zarufs_dir_cache_scan(struct shrinker *shrink, struct shrink_control *sc) {
+  struct zarufs_dir_cache  *cache;
+  struct zarufs_dir_cache  *tmp;
+  struct zarufs_inode_info *zi;
+  unsigned long            nr_to_scan;
+  unsigned long            freed;
+  LIST_HEAD(dispose);
+
+  nr_to_scan = sc->nr_to_scan;
+  freed      = 0;
+
+  spin_lock(&zarufs_dir_cache_lru_lock);
+  while (nr_to_scan && !list_empty(&zarufs_dir_cache_lru)) {
+    cache = list_first_entry(&zarufs_dir_cache_lru,
+                             struct zarufs_dir_cache,
+                             lru);
+    nr_to_scan -= min(nr_to_scan, max(cache->nr_entries, 1UL));
+
+    if (cache->referenced) {
+      cache->referenced = 0;
+      list_move_tail(&cache->lru, &zarufs_dir_cache_lru);
+      continue;
+    }
+
+    /* the owner is busy with the cache. leave it for the next pass. */
+    zi = ZARUFS_I(cache->dir);
+    if (!spin_trylock(&zi->i_dir_cache_lock)) {
+      list_move_tail(&cache->lru, &zarufs_dir_cache_lru);
+      continue;
+    }
+    zi->i_dir_cache = NULL;
+    list_move(&cache->lru, &dispose);
+    spin_unlock(&zi->i_dir_cache_lock);
+    freed += cache->nr_entries;
+  }
+  spin_unlock(&zarufs_dir_cache_lru_lock);
+
+  list_for_each_entry_safe(cache, tmp, &dispose, lru) {
+    dir_cache_free(cache);
+  }
+  return (freed);
+}
@@ -0,0 +1,35 @@
+/* zarufs_dir_cache.h */
+#ifndef _ZARUFS_DIR_CACHE_H_
+#define _ZARUFS_DIR_CACHE_H_
+
+struct ext2_dir_entry*
+zarufs_dir_cache_find(struct inode *dir,
+                      struct qstr  *child,
+                      struct page  **res_page,
+                      int          *err);
+
+void
+zarufs_dir_cache_build(struct inode *dir);
+
+void
+zarufs_dir_cache_insert(struct inode *dir,
+                        struct ext2_dir_entry *dent,
+                        struct page *page);
+
+void
+zarufs_dir_cache_remove(struct inode *dir,
+                        struct ext2_dir_entry *dent,
+                        struct page *page);
+
+void
+zarufs_dir_cache_update(struct inode *dir,
+                        struct ext2_dir_entry *dent,
+                        struct page *page);
+
+void
+zarufs_dir_cache_drop(struct inode *dir);
+
+int  zarufs_init_dir_cache(void);
+void zarufs_exit_dir_cache(void);
+
+#endif
@@ -0,0 +1,1058 @@
+/* zarufs_dx.c */
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/pagemap.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+
+#include "../include/zarufs.h"
+#include "zarufs_utils.h"
+#include "zarufs_dir.h"
+#include "zarufs_hash.h"
+#include "zarufs_dx.h"
+
+/*
+ * hashed directory index, laid out as ext3/4 htree. block 0 keeps "." and
+ * "..", whose rec_len covers the rest of the block holding the root of the
+ * index. index nodes are blocks with a single unused entry. leaves are
+ * ordinary directory blocks, so linear readers still see every entry.
+ */
+
+struct dx_frame {
+  struct page            *page;
+  char                   *data;  /* head of the block in the page. */
+  struct zarufs_dx_entry *entries;
+  struct zarufs_dx_entry *at;
+  unsigned long          block;
+};
+
+/* a live entry of a leaf to be split. */
+struct dx_map_entry {
+  __u32 hash;
+  __u16 offs;
+  __u16 size;
+};
+
+static inline unsigned long
+dx_get_block(struct zarufs_dx_entry *entry);
+
+static inline void
+dx_set_block(struct zarufs_dx_entry *entry, unsigned long block);
+
+static inline __u32
+dx_get_hash(struct zarufs_dx_entry *entry);
+
+static inline void
+dx_set_hash(struct zarufs_dx_entry *entry, __u32 hash);
+
+static inline unsigned int
+dx_get_count(struct zarufs_dx_entry *entries);
+
+static inline unsigned int
+dx_get_limit(struct zarufs_dx_entry *entries);
+
+static inline void
+dx_set_count(struct zarufs_dx_entry *entries, unsigned int count);
+
+static inline void
+dx_set_limit(struct zarufs_dx_entry *entries, unsigned int limit);
+
+static inline unsigned int
+dx_root_limit(struct inode *dir, unsigned int infosize);
+
+static inline unsigned int
+dx_node_limit(struct inode *dir);
+
+static char*
+dx_read_block(struct inode *dir, unsigned long block, struct page **pagep);
+
+static char*
+dx_append_block(struct inode *dir, unsigned long *block, struct page **pagep);
+
+static int
+dx_write_block(struct inode *dir,
+               struct page *page,
+               char *data,
+               const char *src);
+
+static void
+dx_release(struct dx_frame *frames);
+
+static struct dx_frame*
+dx_probe(struct inode *dir,
+         struct qstr *name,
+         struct zarufs_dx_hash_info *hinfo,
+         struct dx_frame *frames,
+         int *err);
+
+static int
+dx_next_block(struct inode *dir,
+              __u32 hash,
+              struct dx_frame *frames,
+              struct dx_frame *frame);
+
+static struct ext2_dir_entry*
+search_dir_block(struct inode *dir,
+                 char *data,
+                 struct qstr *child,
+                 int *err);
+
+static int
+add_dirent_to_block(struct dentry *dentry,
+                    struct inode *inode,
+                    struct page *page,
+                    char *data);
+
+static void
+dx_insert_block(struct dx_frame *frame, __u32 hash, unsigned long block);
+
+static int
+dx_grow_index(struct inode *dir,
+              struct dx_frame *frames,
+              struct dx_frame **framep);
+
+static int
+dx_map_cmp(const void *a, const void *b);
+
+static void
+dx_pack_entries(struct inode *dir,
+                char *dst,
+                char *src,
+                struct dx_map_entry *map,
+                int count);
+
+static char*
+do_split(struct inode *dir,
+         struct page **pagep,
+         char *data,
+         struct dx_frame *frame,
+         struct zarufs_dx_hash_info *hinfo,
+         int *err);
+
+int
+zarufs_is_dx_dir(struct inode *dir) {
+  return (zarufs_has_dir_index(dir->i_sb)
+          && (ZARUFS_I(dir)->i_flags & EXT2_INDEX_FL));
+}
+
+/* whether a full single block directory can be turned into an index. */
+int
+zarufs_dx_can_index(struct inode *dir, char *block0) {
+  struct ext2_dir_entry *dot;
+  struct ext2_dir_entry *dotdot;
+
+  if (!zarufs_has_dir_index(dir->i_sb) ||
+      (ZARUFS_I(dir)->i_flags & EXT2_INDEX_FL) ||
+      (dir->i_size != dir->i_sb->s_blocksize)) {
+    return (0);
+  }
+
+  /* the root is put at fixed offsets behind "." and "..". */
+  dot    = (struct ext2_dir_entry*) block0;
+  dotdot = (struct ext2_dir_entry*) (block0 + ZARUFS_DIR_REC_LEN(1));
+  return ((zarufs_rec_len_from_disk(dot->rec_len) == ZARUFS_DIR_REC_LEN(1)) &&
+          (dot->name_len == 1) && (dot->name[0] == '.') &&
+          (dotdot->name_len == 2) &&
+          (dotdot->name[0] == '.') && (dotdot->name[1] == '.') &&
+          (ZARUFS_DIR_REC_LEN(2)
+           <= zarufs_rec_len_from_disk(dotdot->rec_len)));
+}
+
+struct ext2_dir_entry*
+zarufs_dx_find_entry(struct inode *dir,
+                     struct qstr  *child,
+                     struct page  **res_page,
+                     int          *err) {
+  struct dx_frame            frames[ZARUFS_DX_MAX_LEVELS];
+  struct dx_frame            *frame;
+  struct zarufs_dx_hash_info hinfo;
+  struct ext2_dir_entry      *dent;
+  struct page                *page;
+  char                       *data;
+  int                        ret;
+
+  memset(frames, 0, sizeof(frames));
+  if (!(frame = dx_probe(dir, child, &hinfo, frames, err))) {
+    return (NULL);
+  }
+
+  *err = 0;
+  do {
+    data = dx_read_block(dir, dx_get_block(frame->at), &page);
+    if (IS_ERR(data)) {
+      *err = PTR_ERR(data);
+      break;
+    }
+
+    if ((dent = search_dir_block(dir, data, child, err))) {
+      *res_page = page;
+      dx_release(frames);
+      return (dent);
+    }
+    zarufs_put_dir_page_cache(page);
+    if (*err) {
+      break;
+    }
+
+    /* entries of the same hash may continue to the next leaf. */
+    if ((ret = dx_next_block(dir, hinfo.hash, frames, frame)) < 0) {
+      *err = ret;
+      break;
+    }
+  } while (ret == 1);
+
+  if (!*err) {
+    *err = -ENOENT;
+  }
+  dx_release(frames);
+  return (NULL);
+}
+
+int
+zarufs_dx_add_link(struct dentry *dentry, struct inode *inode, int exclusive) {
+  struct inode               *dir;
+  struct dx_frame            frames[ZARUFS_DX_MAX_LEVELS];
+  struct dx_frame            *frame;
+  struct zarufs_dx_hash_info hinfo;
+  struct page                *page;
+  unsigned long              block;
+  char                       *data;
+  char                       *target;
+  int                        err;
+
+  dir = dentry->d_parent->d_inode;
+
+  memset(frames, 0, sizeof(frames));
+  if (!(frame = dx_probe(dir, &dentry->d_name, &hinfo, frames, &err))) {
+    return (err);
+  }
+
+  block = dx_get_block(frame->at);
+  data  = dx_read_block(dir, block, &page);
+  if (IS_ERR(data)) {
+    err = PTR_ERR(data);
+    goto out;
+  }
+
+  zarufs_lock_dir_block(dir, block);
+  err = add_dirent_to_block(dentry, inode, page, data);
+  zarufs_unlock_dir_block(dir, block);
+  if (err != -ENOSPC) {
+    goto out_page;
+  }
+
+  /* splitting moves entries between blocks. the caller retries exclusive. */
+  if (!exclusive) {
+    err = -EAGAIN;
+    goto out_page;
+  }
+
+  /* the leaf is full. make room for one more leaf in the index. */
+  if (dx_get_count(frame->entries) == dx_get_limit(frame->entries)) {
+    if ((err = dx_grow_index(dir, frames, &frame))) {
+      goto out_page;
+    }
+  }
+
+  if (!(target = do_split(dir, &page, data, frame, &hinfo, &err))) {
+    goto out_page;
+  }
+  err = add_dirent_to_block(dentry, inode, page, target);
+
+ out_page:
+  zarufs_put_dir_page_cache(page);
+
+ out:
+  dx_release(frames);
+  return (err);
+}
+
+/*
+ * move the entries behind ".." of a full single block directory to a new
+ * block 1, and put the root of the index pointing to it into block 0.
+ */
+int
+zarufs_dx_make_indexed_dir(struct dentry *dentry, struct inode *inode) {
+  struct inode              *dir;
+  struct zarufs_dx_root     *root;
+  struct ext2_dir_entry     *dotdot;
+  struct ext2_dir_entry     *dent;
+  struct page               *page0;
+  struct page               *page1;
+  unsigned long             blocksize;
+  unsigned long             block;
+  unsigned long             len;
+  char                      *data0;
+  char                      *data1;
+  char                      *buf;
+  char                      *start;
+  int                       err;
+
+  dir       = dentry->d_parent->d_inode;
+  blocksize = dir->i_sb->s_blocksize;
+
+  if (!(buf = kzalloc(blocksize, GFP_NOFS))) {
+    return (-ENOMEM);
+  }
+
+  data0 = dx_read_block(dir, 0, &page0);
+  if (IS_ERR(data0)) {
+    err = PTR_ERR(data0);
+    goto out_free;
+  }
+
+  dotdot = (struct ext2_dir_entry*) (data0 + ZARUFS_DIR_REC_LEN(1));
+  start  = (char*) dotdot + zarufs_rec_len_from_disk(dotdot->rec_len);
+  len    = data0 + blocksize - start;
+
+  /* the last entry takes the rest of the new block. */
+  memcpy(buf, start, len);
+  dent = (struct ext2_dir_entry*) buf;
+  while ((char*) dent < buf + len) {
+    unsigned int rec_len;
+
+    rec_len = zarufs_rec_len_from_disk(dent->rec_len);
+    if (!rec_len) {
+      ZARUFS_ERROR("[ZARUFS] %s: zero-length directory entry.\n", __func__);
+      err = -EIO;
+      goto out_page;
+    }
+    if (buf + len <= (char*) dent + rec_len) {
+      break;
+    }
+    dent = (struct ext2_dir_entry*) ((char*) dent + rec_len);
+  }
+  dent->rec_len = zarufs_rec_len_to_disk(blocksize - ((char*) dent - buf));
+
+  data1 = dx_append_block(dir, &block, &page1);
+  if (IS_ERR(data1)) {
+    err = PTR_ERR(data1);
+    goto out_page;
+  }
+  err = dx_write_block(dir, page1, data1, buf);
+  zarufs_put_dir_page_cache(page1);
+  if (err) {
+    goto out_page;
+  }
+
+  /* "." and ".." stay, and ".." hides the root. */
+  memset(buf, 0, blocksize);
+  memcpy(buf, data0, ZARUFS_DIR_REC_LEN(1) + ZARUFS_DIR_REC_LEN(2));
+  root = (struct zarufs_dx_root*) buf;
+  root->dotdot.rec_len    = zarufs_rec_len_to_disk(blocksize
+                                                   - ZARUFS_DIR_REC_LEN(1));
+  root->info.info_length  = sizeof(root->info);
+  root->info.hash_version = ZARUFS_SB(dir->i_sb)->s_def_hash_version;
+  dx_set_block(root->entries, block);
+  dx_set_count(root->entries, 1);
+  dx_set_limit(root->entries, dx_root_limit(dir, sizeof(root->info)));
+  if ((err = dx_write_block(dir, page0, data0, buf))) {
+    goto out_page;
+  }
+
+  ZARUFS_I(dir)->i_flags |= EXT2_INDEX_FL;
+  mark_inode_dirty(dir);
+  zarufs_put_dir_page_cache(page0);
+  kfree(buf);
+
+  return (zarufs_dx_add_link(dentry, inode, 1));
+
+ out_page:
+  zarufs_put_dir_page_cache(page0);
+
+ out_free:
+  kfree(buf);
+  return (err);
+}
+
+/* the high byte of a block number is reserved. */
+static inline unsigned long
+dx_get_block(struct zarufs_dx_entry *entry) {
+  return (le32_to_cpu(entry->block) & 0x00ffffff);
+}
+
+static inline void
+dx_set_block(struct zarufs_dx_entry *entry, unsigned long block) {
+  entry->block = cpu_to_le32(block);
+}
+
+static inline __u32
+dx_get_hash(struct zarufs_dx_entry *entry) {
+  return (le32_to_cpu(entry->hash));
+}
+
+static inline void
+dx_set_hash(struct zarufs_dx_entry *entry, __u32 hash) {
+  entry->hash = cpu_to_le32(hash);
+}
+
+static inline unsigned int
+dx_get_count(struct zarufs_dx_entry *entries) {
+  return (le16_to_cpu(((struct zarufs_dx_countlimit*) entries)->count));
+}
+
+static inline unsigned int
+dx_get_limit(struct zarufs_dx_entry *entries) {
+  return (le16_to_cpu(((struct zarufs_dx_countlimit*) entries)->limit));
+}
+
+static inline void
+dx_set_count(struct zarufs_dx_entry *entries, unsigned int count) {
+  ((struct zarufs_dx_countlimit*) entries)->count = cpu_to_le16(count);
+}
+
+static inline void
+dx_set_limit(struct zarufs_dx_entry *entries, unsigned int limit) {
+  ((struct zarufs_dx_countlimit*) entries)->limit = cpu_to_le16(limit);
+}
+
+static inline unsigned int
+dx_root_limit(struct inode *dir, unsigned int infosize) {
+  return ((dir->i_sb->s_blocksize
+           - ZARUFS_DIR_REC_LEN(1) - ZARUFS_DIR_REC_LEN(2) - infosize)
+          / sizeof(struct zarufs_dx_entry));
+}
+
+static inline unsigned int
+dx_node_limit(struct inode *dir) {
+  return ((dir->i_sb->s_blocksize - ZARUFS_DIR_REC_LEN(0))
+          / sizeof(struct zarufs_dx_entry));
+}
+
+/* map a directory block. the page is held until it is put. */
+static char*
+dx_read_block(struct inode *dir, unsigned long block, struct page **pagep) {
+  struct page  *page;
+  unsigned int bits;
+
+  bits = PAGE_CACHE_SHIFT - dir->i_blkbits;
+  page = zarufs_get_dir_page_cache(dir, block >> bits);
+  if (IS_ERR(page)) {
+    return ((char*) page);
+  }
+
+  *pagep = page;
+  return ((char*) page_address(page)
+          + ((block & ((1 << bits) - 1)) << dir->i_blkbits));
+}
+
+/* map the block past i_size. it is allocated when it is written. */
+static char*
+dx_append_block(struct inode *dir, unsigned long *block, struct page **pagep) {
+  *block = dir->i_size >> dir->i_blkbits;
+  return (dx_read_block(dir, *block, pagep));
+}
+
+/* write a whole block, copying src into it first if given. */
+static int
+dx_write_block(struct inode *dir,
+               struct page *page,
+               char *data,
+               const char *src) {
+  unsigned long blocksize;
+  loff_t        pos;
+  int           err;
+
+  blocksize = dir->i_sb->s_blocksize;
+  pos       = page_offset(page) + (data - (char*) page_address(page));
+
+  lock_page(page);
+  if ((err = zarufs_prepare_write_block(page, pos, blocksize))) {
+    unlock_page(page);
+    return (err);
+  }
+  if (src) {
+    memcpy(data, src, blocksize);
+  }
+  return (zarufs_commit_block_write(page, pos, blocksize));
+}
+
+static void
+dx_release(struct dx_frame *frames) {
+  int i;
+
+  for (i = 0; i < ZARUFS_DX_MAX_LEVELS; i++) {
+    if (frames[i].page) {
+      zarufs_put_dir_page_cache(frames[i].page);
+      frames[i].page = NULL;
+    }
+  }
+}
+
+/*
+ * walk down the index to the leaf which may hold name. frames are filled
+ * from the root, and the deepest one is returned.
+ */
+static struct dx_frame*
+dx_probe(struct inode *dir,
+         struct qstr *name,
+         struct zarufs_dx_hash_info *hinfo,
+         struct dx_frame *frames,
+         int *err) {
+  struct zarufs_sb_info  *zsi;
+  struct zarufs_dx_root  *root;
+  struct zarufs_dx_entry *entries;
+  struct zarufs_dx_entry *p;
+  struct zarufs_dx_entry *q;
+  struct zarufs_dx_entry *m;
+  struct dx_frame        *frame;
+  unsigned int           count;
+  unsigned int           levels;
+  char                   *data;
+
+  zsi   = ZARUFS_SB(dir->i_sb);
+  frame = frames;
+
+  data = dx_read_block(dir, 0, &frame->page);
+  if (IS_ERR(data)) {
+    *err = PTR_ERR(data);
+    return (NULL);
+  }
+  frame->data  = data;
+  frame->block = 0;
+
+  root = (struct zarufs_dx_root*) data;
+  if ((root->info.hash_version != ZARUFS_DX_HASH_LEGACY) &&
+      (root->info.hash_version != ZARUFS_DX_HASH_HALF_MD4) &&
+      (root->info.hash_version != ZARUFS_DX_HASH_TEA)) {
+    ZARUFS_ERROR("[ZARUFS] %s: unrecognised hash version %u [ino=%lu]\n",
+                 __func__, root->info.hash_version, dir->i_ino);
+    goto fail_bad;
+  }
+  if (root->info.unused_flags & 1) {
+    ZARUFS_ERROR("[ZARUFS] %s: unimplemented hash flags %#x [ino=%lu]\n",
+                 __func__, root->info.unused_flags, dir->i_ino);
+    goto fail_bad;
+  }
+  if (ZARUFS_DX_MAX_LEVELS <= root->info.indirect_levels) {
+    ZARUFS_ERROR("[ZARUFS] %s: unimplemented hash depth %u [ino=%lu]\n",
+                 __func__, root->info.indirect_levels, dir->i_ino);
+    goto fail_bad;
+  }
+
+  hinfo->hash_version = root->info.hash_version + zsi->s_hash_unsigned;
+  hinfo->seed         = zsi->s_hash_seed;
+  if (name) {
+    zarufs_dirhash((const char*) name->name, name->len, hinfo);
+  }
+
+  entries = (struct zarufs_dx_entry*) ((char*) &root->info
+                                       + root->info.info_length);
+  if (dx_get_limit(entries) != dx_root_limit(dir, root->info.info_length)) {
+    ZARUFS_ERROR("[ZARUFS] %s: dx root limit is broken [ino=%lu]\n",
+                 __func__, dir->i_ino);
+    goto fail_bad;
+  }
+
+  levels = root->info.indirect_levels;
+  while (1) {
+    count = dx_get_count(entries);
+    if (!count || (dx_get_limit(entries) < count)) {
+      ZARUFS_ERROR("[ZARUFS] %s: dx entry count is broken [ino=%lu]\n",
+                   __func__, dir->i_ino);
+      goto fail_bad;
+    }
+
+    /* the first entry covers hashes below the second one. */
+    p = entries + 1;
+    q = entries + count - 1;
+    while (p <= q) {
+      m = p + (q - p) / 2;
+      if (hinfo->hash < dx_get_hash(m)) {
+        q = m - 1;
+      } else {
+        p = m + 1;
+      }
+    }
+
+    frame->entries = entries;
+    frame->at      = p - 1;
+    if (!levels--) {
+      return (frame);
+    }
+
+    frame++;
+    frame->block = dx_get_block((frame - 1)->at);
+    if ((dir->i_size >> dir->i_blkbits) <= frame->block) {
+      ZARUFS_ERROR("[ZARUFS] %s: dx block %lu is out of the directory\n",
+                   __func__, frame->block);
+      goto fail_bad;
+    }
+    data = dx_read_block(dir, frame->block, &frame->page);
+    if (IS_ERR(data)) {
+      *err = PTR_ERR(data);
+      goto fail;
+    }
+    frame->data = data;
+    entries     = ((struct zarufs_dx_node*) data)->entries;
+    if (dx_get_limit(entries) != dx_node_limit(dir)) {
+      ZARUFS_ERROR("[ZARUFS] %s: dx node limit is broken [ino=%lu]\n",
+                   __func__, dir->i_ino);
+      goto fail_bad;
+    }
+  }
+
+ fail_bad:
+  *err = ZARUFS_ERR_BAD_DX_DIR;
+
+ fail:
+  dx_release(frames);
+  return (NULL);
+}
+
+/*
+ * step frame to the next leaf if it may still hold entries of hash.
+ * returns 1 when stepped, 0 when the search is over.
+ */
+static int
+dx_next_block(struct inode *dir,
+              __u32 hash,
+              struct dx_frame *frames,
+              struct dx_frame *frame) {
+  struct dx_frame *p;
+  struct page     *page;
+  unsigned long   block;
+  char            *data;
+  int             num_frames;
+
+  p          = frame;
+  num_frames = 0;
+  while (1) {
+    p->at++;
+    if (p->at < p->entries + dx_get_count(p->entries)) {
+      break;
+    }
+    if (p == frames) {
+      return (0);
+    }
+    num_frames++;
+    p--;
+  }
+
+  /* the lowest bit of an index hash tells a collision continues. */
+  if ((dx_get_hash(p->at) & ~1) != hash) {
+    return (0);
+  }
+
+  while (num_frames--) {
+    block = dx_get_block(p->at);
+    data  = dx_read_block(dir, block, &page);
+    if (IS_ERR(data)) {
+      return (PTR_ERR(data));
+    }
+    p++;
+    zarufs_put_dir_page_cache(p->page);
+    p->page    = page;
+    p->data    = data;
+    p->block   = block;
+    p->entries = ((struct zarufs_dx_node*) data)->entries;
+    p->at      = p->entries;
+  }
+  return (1);
+}
+
+static struct ext2_dir_entry*
+search_dir_block(struct inode *dir,
+                 char *data,
+                 struct qstr *child,
+                 int *err) {
+  struct ext2_dir_entry *dent;
+  char                  *end;
+  unsigned int          rec_len;
+
+  dent = (struct ext2_dir_entry*) data;
+  end  = data + dir->i_sb->s_blocksize;
+  while ((char*) dent < end) {
+    rec_len = zarufs_rec_len_from_disk(dent->rec_len);
+    if ((rec_len < ZARUFS_DIR_REC_LEN(dent->name_len)) ||
+        (end < (char*) dent + rec_len)) {
+      ZARUFS_ERROR("[ZARUFS] %s: bad directory entry [ino=%lu]\n",
+                   __func__, dir->i_ino);
+      *err = -EIO;
+      return (NULL);
+    }
+
+    if (dent->inode &&
+        (dent->name_len == child->len) &&
+        !memcmp(dent->name, child->name, child->len)) {
+      return (dent);
+    }
+    dent = (struct ext2_dir_entry*) ((char*) dent + rec_len);
+  }
+  return (NULL);
+}
+
+/* same as zarufs_add_link() but within a single block. */
+static int
+add_dirent_to_block(struct dentry *dentry,
+                    struct inode *inode,
+                    struct page *page,
+                    char *data) {
+  struct inode          *dir;
+  struct ext2_dir_entry *dent;
+  const char            *link_name;
+  unsigned int          link_name_len;
+  unsigned int          link_rec_len;
+  unsigned int          rec_len;
+  unsigned int          name_len;
+  char                  *end;
+  loff_t                pos;
+  int                   err;
+
+  dir           = dentry->d_parent->d_inode;
+  link_name     = (const char*) dentry->d_name.name;
+  link_name_len = dentry->d_name.len;
+  link_rec_len  = ZARUFS_DIR_REC_LEN(link_name_len);
+
+  dent = (struct ext2_dir_entry*) data;
+  end  = data + dir->i_sb->s_blocksize;
+  while ((char*) dent < end) {
+    rec_len = zarufs_rec_len_from_disk(dent->rec_len);
+    if ((rec_len < ZARUFS_DIR_REC_LEN(dent->name_len)) ||
+        (end < (char*) dent + rec_len)) {
+      ZARUFS_ERROR("[ZARUFS] %s: bad directory entry [ino=%lu]\n",
+                   __func__, dir->i_ino);
+      return (-EIO);
+    }
+
+    /* the entry already exists. */
+    if (dent->inode &&
+        (dent->name_len == link_name_len) &&
+        !memcmp(dent->name, link_name, link_name_len)) {
+      return (-EEXIST);
+    }
+
+    name_len = dent->inode ? ZARUFS_DIR_REC_LEN(dent->name_len) : 0;
+    if (link_rec_len <= rec_len - name_len) {
+      goto got_it;
+    }
+    dent = (struct ext2_dir_entry*) ((char*) dent + rec_len);
+  }
+  return (-ENOSPC);
+
+ got_it:
+  pos = page_offset(page) + ((char*) dent - (char*) page_address(page));
+  lock_page(page);
+  if ((err = zarufs_prepare_write_block(page, pos, rec_len))) {
+    unlock_page(page);
+    return (err);
+  }
+
+  /* insert into the space behind a live entry. */
+  if (dent->inode) {
+    struct ext2_dir_entry *cur_dent;
+
+    cur_dent = (struct ext2_dir_entry*) ((char*) dent + name_len);
+    cur_dent->rec_len = zarufs_rec_len_to_disk(rec_len - name_len);
+    dent->rec_len     = zarufs_rec_len_to_disk(name_len);
+    dent              = cur_dent;
+  }
+
+  dent->name_len = link_name_len;
+  memcpy(dent->name, link_name, link_name_len);
+  dent->inode = cpu_to_le32(inode->i_ino);
+  zarufs_set_dir_entry_type(dent, inode);
+
+  err = zarufs_commit_block_write(page, pos, rec_len);
+  dir->i_mtime = CURRENT_TIME_SEC;
+  dir->i_ctime = dir->i_mtime;
+  mark_inode_dirty(dir);
+  return (err);
+}
+
+/* add an index entry behind frame->at. the caller made room for it. */
+static void
+dx_insert_block(struct dx_frame *frame, __u32 hash, unsigned long block) {
+  struct zarufs_dx_entry *entries;
+  struct zarufs_dx_entry *new;
+  unsigned int           count;
+
+  entries = frame->entries;
+  count   = dx_get_count(entries);
+  new     = frame->at + 1;
+
+  memmove(new + 1, new, (char*) (entries + count) - (char*) new);
+  dx_set_hash(new, hash);
+  dx_set_block(new, block);
+  dx_set_count(entries, count + 1);
+}
+
+/*
+ * the index block of *framep is full. split a node in half under the root,
+ * or move the entries of the root into a new node when it has no level.
+ */
+static int
+dx_grow_index(struct inode *dir,
+              struct dx_frame *frames,
+              struct dx_frame **framep) {
+  struct dx_frame        *frame;
+  struct zarufs_dx_root  *root;
+  struct zarufs_dx_node  *node2;
+  struct zarufs_dx_entry *entries;
+  struct zarufs_dx_entry *entries2;
+  struct page            *page2;
+  unsigned long          blocksize;
+  unsigned long          block2;
+  unsigned int           count;
+  unsigned int           icount1;
+  unsigned int           icount2;
+  __u32                  hash2;
+  char                   *data2;
+  char                   *buf;
+  int                    err;
+
+  frame     = *framep;
+  entries   = frame->entries;
+  count     = dx_get_count(entries);
+  blocksize = dir->i_sb->s_blocksize;
+
+  if ((frame != frames) &&
+      (dx_get_count(frames->entries) == dx_get_limit(frames->entries))) {
+    ZARUFS_ERROR("[ZARUFS] %s: directory index full [ino=%lu]\n",
+                 __func__, dir->i_ino);
+    return (-ENOSPC);
+  }
+
+  if (!(buf = kzalloc(blocksize, GFP_NOFS))) {
+    return (-ENOMEM);
+  }
+
+  data2 = dx_append_block(dir, &block2, &page2);
+  if (IS_ERR(data2)) {
+    err = PTR_ERR(data2);
+    goto out_free;
+  }
+
+  node2 = (struct zarufs_dx_node*) buf;
+  node2->fake.rec_len = zarufs_rec_len_to_disk(blocksize);
+  entries2 = node2->entries;
+
+  if (frame != frames) {
+    /* split the node. the root takes the second half. */
+    icount1 = count / 2;
+    icount2 = count - icount1;
+    hash2   = dx_get_hash(entries + icount1);
+    memcpy(entries2, entries + icount1,
+           icount2 * sizeof(struct zarufs_dx_entry));
+    dx_set_count(entries2, icount2);
+    dx_set_limit(entries2, dx_node_limit(dir));
+    if ((err = dx_write_block(dir, page2, data2, buf))) {
+      goto out_page;
+    }
+
+    dx_set_count(entries, icount1);
+    if ((err = dx_write_block(dir, frame->page, frame->data, NULL))) {
+      goto out_page;
+    }
+
+    dx_insert_block(frames, hash2, block2);
+    if ((err = dx_write_block(dir, frames->page, frames->data, NULL))) {
+      goto out_page;
+    }
+
+    /* follow the half which has the target leaf. */
+    if (entries + icount1 <= frame->at) {
+      entries2 = ((struct zarufs_dx_node*) data2)->entries;
+      frame->at = entries2 + (frame->at - entries - icount1);
+      zarufs_put_dir_page_cache(frame->page);
+      frame->page    = page2;
+      frame->data    = data2;
+      frame->block   = block2;
+      frame->entries = entries2;
+      frames->at++;
+      goto out_free;
+    }
+  } else {
+    /* add a level. the root keeps a single entry to the new node. */
+    memcpy(entries2, entries, count * sizeof(struct zarufs_dx_entry));
+    dx_set_limit(entries2, dx_node_limit(dir));
+    if ((err = dx_write_block(dir, page2, data2, buf))) {
+      goto out_page;
+    }
+
+    root = (struct zarufs_dx_root*) frames->data;
+    dx_set_count(entries, 1);
+    dx_set_block(entries, block2);
+    root->info.indirect_levels = 1;
+    if ((err = dx_write_block(dir, frames->page, frames->data, NULL))) {
+      goto out_page;
+    }
+
+    entries2       = ((struct zarufs_dx_node*) data2)->entries;
+    frame          = frames + 1;
+    frame->page    = page2;
+    frame->data    = data2;
+    frame->block   = block2;
+    frame->entries = entries2;
+    frame->at      = entries2 + (frames->at - entries);
+    frames->at     = entries;
+    *framep        = frame;
+    goto out_free;
+  }
+
+ out_page:
+  zarufs_put_dir_page_cache(page2);
+
+ out_free:
+  kfree(buf);
+  return (err);
+}
+
+static int
+dx_map_cmp(const void *a, const void *b) {
+  const struct dx_map_entry *m1;
+  const struct dx_map_entry *m2;
+
+  m1 = a;
+  m2 = b;
+  if (m1->hash != m2->hash) {
+    return ((m1->hash < m2->hash) ? -1 : 1);
+  }
+  return ((int) m1->offs - (int) m2->offs);
+}
+
+/* copy entries of map from src packed into dst. */
+static void
+dx_pack_entries(struct inode *dir,
+                char *dst,
+                char *src,
+                struct dx_map_entry *map,
+                int count) {
+  struct ext2_dir_entry *dent;
+  unsigned long         blocksize;
+  unsigned int          offset;
+  int                   i;
+
+  blocksize = dir->i_sb->s_blocksize;
+  dent      = (struct ext2_dir_entry*) dst;
+  offset    = 0;
+  memset(dst, 0, blocksize);
+  for (i = 0; i < count; i++) {
+    dent = (struct ext2_dir_entry*) (dst + offset);
+    memcpy(dent, src + map[i].offs, map[i].size);
+    dent->rec_len = zarufs_rec_len_to_disk(map[i].size);
+    offset += map[i].size;
+  }
+  /* the last entry, or an unused one, takes the rest of the block. */
+  dent->rec_len = zarufs_rec_len_to_disk(blocksize - ((char*) dent - dst));
+}
+
+/*
+ * split a full leaf in half by hash into a new block, and return the block
+ * where hinfo->hash goes. *pagep is switched to the page of that block.
+ */
+static char*
+do_split(struct inode *dir,
+         struct page **pagep,
+         char *data,
+         struct dx_frame *frame,
+         struct zarufs_dx_hash_info *hinfo,
+         int *err) {
+  struct zarufs_dx_hash_info h;
+  struct dx_map_entry        *map;
+  struct ext2_dir_entry      *dent;
+  struct page                *page2;
+  unsigned long              blocksize;
+  unsigned long              block2;
+  unsigned int               size;
+  unsigned int               rec_len;
+  __u32                      hash2;
+  char                       *buf;
+  char                       *data2;
+  char                       *end;
+  int                        count;
+  int                        split;
+  int                        continued;
+
+  *err      = 0;
+  blocksize = dir->i_sb->s_blocksize;
+  map = kmalloc((blocksize / ZARUFS_DIR_REC_LEN(1)) * sizeof(*map), GFP_NOFS);
+  buf = kmalloc(2 * blocksize, GFP_NOFS);
+  if (!map || !buf) {
+    *err = -ENOMEM;
+    goto out_free;
+  }
+
+  /* hash the live entries. */
+  count = 0;
+  dent  = (struct ext2_dir_entry*) data;
+  end   = data + blocksize;
+  while ((char*) dent < end) {
+    rec_len = zarufs_rec_len_from_disk(dent->rec_len);
+    if (!rec_len || (end < (char*) dent + rec_len)) {
+      *err = -EIO;
+      goto out_free;
+    }
+    if (dent->inode) {
+      h = *hinfo;
+      zarufs_dirhash(dent->name, dent->name_len, &h);
+      map[count].hash = h.hash;
+      map[count].offs = (char*) dent - data;
+      map[count].size = ZARUFS_DIR_REC_LEN(dent->name_len);
+      count++;
+    }
+    dent = (struct ext2_dir_entry*) ((char*) dent + rec_len);
+  }
+  if (count < 2) {
+    /* nothing to split. the leaf is only fragmented. */
+    dx_pack_entries(dir, buf, data, map, count);
+    if ((*err = dx_write_block(dir, *pagep, data, buf))) {
+      data = NULL;
+    }
+    goto out_free;
+  }
+  sort(map, count, sizeof(*map), dx_map_cmp, NULL);
+
+  /* move the upper half by size to the new block. */
+  size = 0;
+  for (split = count; 1 < split; split--) {
+    if (blocksize / 2 < size + map[split - 1].size / 2) {
+      break;
+    }
+    size += map[split - 1].size;
+  }
+  if (split == count) {
+    split--;
+  }
+  hash2     = map[split].hash;
+  continued = (hash2 == map[split - 1].hash);
+
+  dx_pack_entries(dir, buf, data, map, split);
+  dx_pack_entries(dir, buf + blocksize, data, map + split, count - split);
+
+  data2 = dx_append_block(dir, &block2, &page2);
+  if (IS_ERR(data2)) {
+    *err = PTR_ERR(data2);
+    data = NULL;
+    goto out_free;
+  }
+  if ((*err = dx_write_block(dir, page2, data2, buf + blocksize)) ||
+      (*err = dx_write_block(dir, *pagep, data, buf))) {
+    zarufs_put_dir_page_cache(page2);
+    data = NULL;
+    goto out_free;
+  }
+
+  dx_insert_block(frame, hash2 + continued, block2);
+  if ((*err = dx_write_block(dir, frame->page, frame->data, NULL))) {
+    zarufs_put_dir_page_cache(page2);
+    data = NULL;
+    goto out_free;
+  }
+
+  if (hash2 <= hinfo->hash) {
+    zarufs_put_dir_page_cache(*pagep);
+    *pagep = page2;
+    data   = data2;
+  } else {
+    zarufs_put_dir_page_cache(page2);
+  }
+
+ out_free:
+  kfree(buf);
+  kfree(map);
+  if (*err) {
+    return (NULL);
+  }
+  return (data);
+}
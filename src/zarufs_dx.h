@@ -0,0 +1,26 @@
+/* zarufs_dx.h */
+#ifndef _ZARUFS_DX_H_
+#define _ZARUFS_DX_H_
+
+/* the index is unusable. callers fall back to the linear format. */
+#define ZARUFS_ERR_BAD_DX_DIR (-75000)
+
+int
+zarufs_is_dx_dir(struct inode *dir);
+
+int
+zarufs_dx_can_index(struct inode *dir, char *block0);
+
+struct ext2_dir_entry*
+zarufs_dx_find_entry(struct inode *dir,
+                     struct qstr  *child,
+                     struct page  **res_page,
+                     int          *err);
+
+int
+zarufs_dx_add_link(struct dentry *dentry, struct inode *inode, int exclusive);
+
+int
+zarufs_dx_make_indexed_dir(struct dentry *dentry, struct inode *inode);
+
+#endif
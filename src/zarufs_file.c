@@ -1,18 +1,81 @@
 #include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/buffer_head.h>
+#include <linux/xattr.h>
 
 #include "../include/zarufs.h"
 #include "zarufs_utils.h"
+#include "zarufs_inode.h"
+#include "zarufs_ioctl.h"
+#include "zarufs_compress.h"
+#include "zarufs_xattr.h"
+#include "zarufs_acl.h"
+
+/*
+ * a page of a compressed cluster has no buffers behind it. the cluster
+ * is expanded before the page is made writable, as write() does in
+ * write_begin. the page is dropped meanwhile, and the fault is retried.
+ */
+static int
+zarufs_page_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf) {
+  struct inode *inode;
+  int          err;
+
+  inode = file_inode(vma->vm_file);
+  sb_start_pagefault(inode->i_sb);
+  file_update_time(vma->vm_file);
+  zarufs_compress_mark_dirty(inode, page_offset(vmf->page), PAGE_CACHE_SIZE);
+  err = zarufs_uncompress_cluster(inode,
+                                  page_offset(vmf->page) >> ZARUFS_CLUSTER_BITS);
+  if (!err) {
+    err = block_page_mkwrite(vma, vmf, zarufs_get_block);
+  }
+  sb_end_pagefault(inode->i_sb);
+  return (block_page_mkwrite_return(err));
+}
+
+static const struct vm_operations_struct zarufs_file_vm_ops = {
+  .fault        = filemap_fault,
+  .map_pages    = filemap_map_pages,
+  .page_mkwrite = zarufs_page_mkwrite,
+};
+
+static int
+zarufs_file_mmap(struct file *file, struct vm_area_struct *vma) {
+  file_accessed(file);
+  vma->vm_ops = &zarufs_file_vm_ops;
+  return (0);
+}
+
+static int
+zarufs_release_file(struct inode *inode, struct file *filp) {
+  /* compress written clusters when the last writer goes away. */
+  if ((filp->f_mode & FMODE_WRITE) &&
+      (atomic_read(&inode->i_writecount) == 1)) {
+    zarufs_queue_compress(inode);
+  }
+  return (0);
+}
 
 const struct file_operations  zarufs_file_operations = {
-  .llseek       = generic_file_llseek,
-  .read         = new_sync_read,
-  .write        = new_sync_write,
-  .read_iter    = generic_file_read_iter,
-  .write_iter   = generic_file_write_iter,
-  .mmap         = generic_file_mmap,
-  .open         = generic_file_open,
-  .fsync        = generic_file_fsync,
-  .splice_read  = generic_file_splice_read,
-  .splice_write = iter_file_splice_write,
+  .llseek         = generic_file_llseek,
+  .read           = new_sync_read,
+  .write          = new_sync_write,
+  .read_iter      = generic_file_read_iter,
+  .write_iter     = generic_file_write_iter,
+  .unlocked_ioctl = zarufs_ioctl,
+  .mmap           = zarufs_file_mmap,
+  .open           = generic_file_open,
+  .release        = zarufs_release_file,
+  .fsync          = generic_file_fsync,
+  .splice_read    = generic_file_splice_read,
+  .splice_write   = iter_file_splice_write,
+};
+const struct inode_operations zarufs_file_inode_operations = {
+  .setxattr    = generic_setxattr,
+  .getxattr    = generic_getxattr,
+  .listxattr   = zarufs_listxattr,
+  .removexattr = generic_removexattr,
+  .get_acl     = zarufs_get_acl,
+  .set_acl     = zarufs_set_acl,
 };
-const struct inode_operations zarufs_file_inode_operations;
@@ -0,0 +1,247 @@
+/* zarufs_hash.c */
+#include <linux/fs.h>
+#include <linux/cryptohash.h>
+
+#include "../include/zarufs.h"
+#include "zarufs_hash.h"
+
+/*
+ * name hashes of the directory index. they must give the same values as
+ * ext2/3/4 so that indexed directories can be shared with them.
+ */
+
+#define TEA_DELTA (0x9E3779B9)
+
+/* the largest hash, which is reserved for the end of directory. */
+#define ZARUFS_HTREE_EOF (0x7FFFFFFFU)
+
+static void
+tea_transform(__u32 buf[4], __u32 const in[]);
+
+static __u32
+dx_hack_hash_signed(const char *name, int len);
+
+static __u32
+dx_hack_hash_unsigned(const char *name, int len);
+
+static void
+str2hashbuf_signed(const char *msg, int len, __u32 *buf, int num);
+
+static void
+str2hashbuf_unsigned(const char *msg, int len, __u32 *buf, int num);
+
+int
+zarufs_dirhash(const char *name, int len, struct zarufs_dx_hash_info *hinfo) {
+  __u32      hash;
+  __u32      minor_hash;
+  __u32      buf[4];
+  __u32      in[8];
+  const char *p;
+  int        i;
+  int        is_unsigned;
+
+  minor_hash  = 0;
+  is_unsigned = 0;
+
+  /* initialize the default seed for the hash checksum functions. */
+  buf[0] = 0x67452301;
+  buf[1] = 0xefcdab89;
+  buf[2] = 0x98badcfe;
+  buf[3] = 0x10325476;
+
+  /* an all zero seed means the default one. */
+  if (hinfo->seed) {
+    for (i = 0; i < 4; i++) {
+      if (hinfo->seed[i]) {
+        memcpy(buf, hinfo->seed, sizeof(buf));
+        break;
+      }
+    }
+  }
+
+  switch (hinfo->hash_version) {
+  case ZARUFS_DX_HASH_LEGACY_UNSIGNED:
+    hash = dx_hack_hash_unsigned(name, len);
+    break;
+  case ZARUFS_DX_HASH_LEGACY:
+    hash = dx_hack_hash_signed(name, len);
+    break;
+  case ZARUFS_DX_HASH_HALF_MD4_UNSIGNED:
+    is_unsigned = 1;
+    /* fall through. */
+  case ZARUFS_DX_HASH_HALF_MD4:
+    for (p = name; 0 < len; len -= 32, p += 32) {
+      if (is_unsigned) {
+        str2hashbuf_unsigned(p, len, in, 8);
+      } else {
+        str2hashbuf_signed(p, len, in, 8);
+      }
+      half_md4_transform(buf, in);
+    }
+    minor_hash = buf[2];
+    hash       = buf[1];
+    break;
+  case ZARUFS_DX_HASH_TEA_UNSIGNED:
+    is_unsigned = 1;
+    /* fall through. */
+  case ZARUFS_DX_HASH_TEA:
+    for (p = name; 0 < len; len -= 16, p += 16) {
+      if (is_unsigned) {
+        str2hashbuf_unsigned(p, len, in, 4);
+      } else {
+        str2hashbuf_signed(p, len, in, 4);
+      }
+      tea_transform(buf, in);
+    }
+    hash       = buf[0];
+    minor_hash = buf[1];
+    break;
+  default:
+    hinfo->hash = 0;
+    return (-1);
+  }
+
+  /* the lowest bit marks a continued hash in index entries. */
+  hash &= ~1;
+  if (hash == (ZARUFS_HTREE_EOF << 1)) {
+    hash = (ZARUFS_HTREE_EOF - 1) << 1;
+  }
+  hinfo->hash       = hash;
+  hinfo->minor_hash = minor_hash;
+  return (0);
+}
+
+static void
+tea_transform(__u32 buf[4], __u32 const in[]) {
+  __u32 sum;
+  __u32 b0;
+  __u32 b1;
+  __u32 a;
+  __u32 b;
+  __u32 c;
+  __u32 d;
+  int   n;
+
+  sum = 0;
+  b0  = buf[0];
+  b1  = buf[1];
+  a   = in[0];
+  b   = in[1];
+  c   = in[2];
+  d   = in[3];
+
+  for (n = 0; n < 16; n++) {
+    sum += TEA_DELTA;
+    b0  += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+    b1  += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+  }
+
+  buf[0] += b0;
+  buf[1] += b1;
+}
+
+/* the old legacy hash. */
+static __u32
+dx_hack_hash_signed(const char *name, int len) {
+  const signed char *scp;
+  __u32             hash;
+  __u32             hash0;
+  __u32             hash1;
+
+  scp   = (const signed char*) name;
+  hash0 = 0x12a3fe2d;
+  hash1 = 0x37abe8f9;
+  while (len--) {
+    hash = hash1 + (hash0 ^ (((int) *scp++) * 7152373));
+    if (hash & 0x80000000) {
+      hash -= 0x7fffffff;
+    }
+    hash1 = hash0;
+    hash0 = hash;
+  }
+  return (hash0 << 1);
+}
+
+static __u32
+dx_hack_hash_unsigned(const char *name, int len) {
+  const unsigned char *ucp;
+  __u32               hash;
+  __u32               hash0;
+  __u32               hash1;
+
+  ucp   = (const unsigned char*) name;
+  hash0 = 0x12a3fe2d;
+  hash1 = 0x37abe8f9;
+  while (len--) {
+    hash = hash1 + (hash0 ^ (((int) *ucp++) * 7152373));
+    if (hash & 0x80000000) {
+      hash -= 0x7fffffff;
+    }
+    hash1 = hash0;
+    hash0 = hash;
+  }
+  return (hash0 << 1);
+}
+
+/* pack a name into num words, padded with its length. */
+static void
+str2hashbuf_signed(const char *msg, int len, __u32 *buf, int num) {
+  const signed char *scp;
+  __u32             pad;
+  __u32             val;
+  int               i;
+
+  scp = (const signed char*) msg;
+  pad = (__u32) len | ((__u32) len << 8);
+  pad |= pad << 16;
+
+  val = pad;
+  if (num * 4 < len) {
+    len = num * 4;
+  }
+  for (i = 0; i < len; i++) {
+    val = ((int) scp[i]) + (val << 8);
+    if ((i % 4) == 3) {
+      *buf++ = val;
+      val    = pad;
+      num--;
+    }
+  }
+  if (0 <= --num) {
+    *buf++ = val;
+  }
+  while (0 <= --num) {
+    *buf++ = pad;
+  }
+}
+
+static void
+str2hashbuf_unsigned(const char *msg, int len, __u32 *buf, int num) {
+  const unsigned char *ucp;
+  __u32               pad;
+  __u32               val;
+  int                 i;
+
+  ucp = (const unsigned char*) msg;
+  pad = (__u32) len | ((__u32) len << 8);
+  pad |= pad << 16;
+
+  val = pad;
+  if (num * 4 < len) {
+    len = num * 4;
+  }
+  for (i = 0; i < len; i++) {
+    val = ((int) ucp[i]) + (val << 8);
+    if ((i % 4) == 3) {
+      *buf++ = val;
+      val    = pad;
+      num--;
+    }
+  }
+  if (0 <= --num) {
+    *buf++ = val;
+  }
+  while (0 <= --num) {
+    *buf++ = pad;
+  }
+}
@@ -0,0 +1,15 @@
+/* zarufs_hash.h */
+#ifndef _ZARUFS_HASH_H_
+#define _ZARUFS_HASH_H_
+
+struct zarufs_dx_hash_info {
+  __u32 hash;
+  __u32 minor_hash;
+  int   hash_version;
+  __u32 *seed;
+};
+
+int
+zarufs_dirhash(const char *name, int len, struct zarufs_dx_hash_info *hinfo);
+
+#endif
@@ -1,12 +1,17 @@
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
 #include <linux/random.h>
+#include <linux/blkdev.h>
+#include <linux/kthread.h>
 
 #include "../include/zarufs.h"
 #include "zarufs_utils.h"
 #include "zarufs_inode.h"
 #include "zarufs_block.h"
+#include "zarufs_bitmap.h"
 #include "zarufs_ialloc.h"
+#include "zarufs_xattr.h"
+#include "zarufs_acl.h"
 
 static long
 find_group_other(struct super_block *sb, struct inode *parent);
@@ -17,15 +22,41 @@ find_dir_group_orlov(struct super_block *sb, struct inode *parent);
 struct buffer_head*
 read_inode_bitmap(struct super_block *sb, unsigned long block_group);
 
+static int
+zero_inode_table(struct super_block *sb, unsigned long block_group);
+
+static int
+lazyinit_thread(void *data);
+
+static int
+claim_inodes(struct super_block *sb,
+             unsigned long block_group,
+             unsigned long first,
+             unsigned long count,
+             int is_dir);
+
+static struct buffer_head*
+take_reserved_inode(struct super_block *sb,
+                    struct inode       *dir,
+                    unsigned long      *group,
+                    ino_t              *ino);
+
+static int
+reserve_inodes(struct super_block *sb, struct inode *dir);
+
+/* the zeroing thread sleeps this many times as long as a group took. */
+#define ZARUFS_LAZYINIT_WAIT_MULT (10)
+
+/* inodes a directory looks ahead at for its files. */
+#define ZARUFS_INO_RSV_BATCH (16)
+
 struct inode*
 zarufs_alloc_new_inode(struct inode *dir, umode_t mode, const struct qstr *qstr) {
   struct super_block        *sb;
   struct buffer_head        *bitmap_bh;
-  struct buffer_head        *bh_gdesc;
 
   struct inode              *inode;    /* new inode */
   ino_t                     ino;
-  struct ext2_group_desc    *gdesc;
   struct zarufs_super_block *zsb;
   struct zarufs_inode_info  *zi;
   struct zarufs_sb_info     *zsi;
@@ -44,7 +75,15 @@ zarufs_alloc_new_inode(struct inode *dir, umode_t mode, const struct qstr *qstr)
   bitmap_bh = NULL;
   ino       = 0;
   zsi       = ZARUFS_SB(sb);
-  if (S_ISDIR(mode)) {
+
+  /* a file takes the next free inode its directory has looked at. */
+  if (!S_ISDIR(mode) && (zsi->s_mount_opt & EXT2_MOUNT_RESERVATION)) {
+    if ((bitmap_bh = take_reserved_inode(sb, dir, &group, &ino))) {
+      goto got;
+    }
+  }
+
+  if (S_ISDIR(mode) && !(zsi->s_mount_opt & EXT2_MOUNT_OLDALLOC)) {
     /* group = find_directory_group(sb, dir); */
     group = find_dir_group_orlov(sb, dir);
   } else {
@@ -73,8 +112,9 @@ zarufs_alloc_new_inode(struct inode *dir, umode_t mode, const struct qstr *qstr)
                                 ino);
     if (ZARUFS_SB(sb)->s_inodes_per_group <= ino) {
       /* cannot find ino. bitmap is already full. */
+      zarufs_bitmap_readahead(sb, group, ZARUFS_INODE_BITMAP);
       group++;
-      if (group <= zsi->s_groups_count) {
+      if (zsi->s_groups_count <= group) {
         group = 0;
       }
       continue;
@@ -104,13 +144,7 @@ zarufs_alloc_new_inode(struct inode *dir, umode_t mode, const struct qstr *qstr)
 
   /* found free inode. */
  got:
-  zi  = ZARUFS_I(inode);
   zsb = zsi->s_zsb;
-  mark_buffer_dirty(bitmap_bh);
-  if (sb->s_flags & MS_SYNCHRONOUS) {
-    sync_dirty_buffer(bitmap_bh);
-  }
-  brelse(bitmap_bh);
 
   /* get absolute inode number. */
   ino += (group * ZARUFS_SB(sb)->s_inodes_per_group) + 1;
@@ -119,29 +153,31 @@ zarufs_alloc_new_inode(struct inode *dir, umode_t mode, const struct qstr *qstr)
     ZARUFS_ERROR("[ZARUFS] %s: insane inode number. ino=%lu, group=%lu\n",
                  __func__, (unsigned long) ino, group);
     err = -EIO;
-    goto fail;
+    goto fail_clear;
   }
 
   /* update group descriptor. */
-  gdesc    = zarufs_get_group_descriptor(sb, group);
-  bh_gdesc = zarufs_get_gdesc_buffer_cache(sb, group);
-  percpu_counter_add(&zsi->s_freeinodes_counter, -1);
-  if (S_ISDIR(mode)) {
-    percpu_counter_inc(&zsi->s_dirs_counter);
+  if ((err = claim_inodes(sb, group, (ino - 1) % zsi->s_inodes_per_group,
+                          1, S_ISDIR(mode)))) {
+    goto fail_clear;
   }
-
-  spin_lock(get_sb_blockgroup_lock(zsi, group));
-  {
-    le16_add_cpu(&gdesc->bg_free_inodes_count, -1);
-    if (S_ISDIR(mode)) {
-      le16_add_cpu(&gdesc->bg_used_dirs_count, 1);
-    }
+  mark_buffer_dirty(bitmap_bh);
+  if (sb->s_flags & MS_SYNCHRONOUS) {
+    sync_dirty_buffer(bitmap_bh);
   }
-  spin_unlock(get_sb_blockgroup_lock(zsi, group));
-  mark_buffer_dirty(bh_gdesc);
+  brelse(bitmap_bh);
+
+  zi = ZARUFS_I(inode);
 
   /* initialize vfs inode. */
-  inode_init_owner(inode, dir, mode);
+  if (zsi->s_mount_opt & EXT2_MOUNT_GRPID) {
+    /* bsd semantics: the group always comes from the parent. */
+    inode->i_mode = mode;
+    inode->i_uid  = current_fsuid();
+    inode->i_gid  = dir->i_gid;
+  } else {
+    inode_init_owner(inode, dir, mode);
+  }
   inode->i_ino = ino;
   inode->i_blocks = 0;
   inode->i_mtime = CURRENT_TIME_SEC;
@@ -165,8 +201,14 @@ zarufs_alloc_new_inode(struct inode *dir, umode_t mode, const struct qstr *qstr)
   zi->i_file_acl  = 0;
   zi->i_dir_acl   = 0;
   zi->i_dtime     = 0;
+  zi->i_dir_start_lookup = 0;
+  zi->i_block_group = (ino - 1) / zsi->s_inodes_per_group;
   /* zi->i_block_allock_info = NULL; */
   zi->i_state     = EXT2_STATE_NEW;
+  zi->i_extra_isize = 0;
+  if (EXT2_GOOD_OLD_INODE_SIZE < zsi->s_inode_size) {
+    zi->i_extra_isize = zarufs_want_extra_isize(sb);
+  }
 
   zarufs_set_vfs_inode_flags(inode);
   /* insert vfs inode to hash table. */
@@ -176,11 +218,33 @@ zarufs_alloc_new_inode(struct inode *dir, umode_t mode, const struct qstr *qstr)
     err = -EIO;
     goto fail;
   }
+
+  /* inherit default acls and set up security label. */
+  if ((err = zarufs_init_acl(inode, dir))) {
+    goto fail_drop;
+  }
+  if ((err = zarufs_init_security(inode, dir, qstr))) {
+    goto fail_drop;
+  }
+
   mark_inode_dirty(inode);
   DBGPRINT("[ZARUFS] allocating new inode %lu\n",
            (unsigned long) inode->i_ino);
   return (inode);
 
+ fail_drop:
+  clear_nlink(inode);
+  unlock_new_inode(inode);
+  iput(inode);
+  return (ERR_PTR(err));
+
+  /* the inode was taken in the bitmap only. */
+ fail_clear:
+  ext2_clear_bit_atomic(get_sb_blockgroup_lock(zsi, group),
+                        (int) ((ino - 1) % zsi->s_inodes_per_group),
+                        bitmap_bh->b_data);
+  brelse(bitmap_bh);
+
   /* allocation of new inode is failed. */
  fail:
   make_bad_inode(inode);
@@ -188,51 +252,18 @@ zarufs_alloc_new_inode(struct inode *dir, umode_t mode, const struct qstr *qstr)
   return(ERR_PTR(err));
 }
 
-unsigned long
-zarufs_count_free_inodes(struct super_block *sb) {
-  unsigned long freei;
-  int           group;
-
-  freei = 0;
-  for (group = 0; group < ZARUFS_SB(sb)->s_groups_count; group++) {
-    struct ext2_group_desc *cur_desc;
-    cur_desc = zarufs_get_group_descriptor(sb, group);
-    if (!cur_desc) {
-      continue;
-    }
-    freei += le16_to_cpu(cur_desc->bg_free_inodes_count);
-  }
-  return (freei);
-}
-
-unsigned long
-zarufs_count_directories(struct super_block *sb) {
-  unsigned long dir_count;
-  int           i;
-
-  dir_count = 0;
-  for (i = 0; i < ZARUFS_SB(sb)->s_groups_count; i++) {
-    struct ext2_group_desc *gdesc;
-    if (!(gdesc = zarufs_get_group_descriptor(sb, i))) {
-      continue;
-    }
-    dir_count += le16_to_cpu(gdesc->bg_used_dirs_count);
-  }
-  return(dir_count);
-}
-
 
 static long
 find_group_other(struct super_block *sb, struct inode *parent) {
-  int                    parent_group = ZARUFS_I(parent)->i_block_group;
-  int                    ngroups      = ZARUFS_SB(sb)->s_groups_count;
-  struct ext2_group_desc *desc;
-  int                    group;
-  int                    i;
+  int                      parent_group = ZARUFS_I(parent)->i_block_group;
+  int                      ngroups      = ZARUFS_SB(sb)->s_groups_count;
+  struct zarufs_group_info *gi;
+  int                      group;
+  int                      i;
 
   group = parent_group;
-  desc = zarufs_get_group_descriptor(sb, group);
-  if (desc && le16_to_cpu(desc->bg_free_inodes_count) && le16_to_cpu(desc->bg_free_blocks_count)) {
+  gi    = zarufs_group_info(sb, group);
+  if (gi->free_inodes && gi->free_blocks) {
     goto found;
   }
 
@@ -242,8 +273,8 @@ find_group_other(struct super_block *sb, struct inode *parent) {
     if (group >= ngroups) {
       group -= ngroups;
     }
-    desc = zarufs_get_group_descriptor(sb, group);
-    if (desc && le16_to_cpu(desc->bg_free_inodes_count) && le16_to_cpu(desc->bg_free_blocks_count)) {
+    gi = zarufs_group_info(sb, group);
+    if (gi->free_inodes && gi->free_blocks) {
       goto found;
     }
   }
@@ -253,8 +284,8 @@ find_group_other(struct super_block *sb, struct inode *parent) {
     if (++group >= ngroups) {
       group = 0;
     }
-    desc = zarufs_get_group_descriptor(sb, group);
-    if (desc && le16_to_cpu(desc->bg_free_inodes_count) && le16_to_cpu(desc->bg_free_blocks_count)) {
+    gi = zarufs_group_info(sb, group);
+    if (gi->free_inodes && gi->free_blocks) {
       goto found;
     }
   }
@@ -271,15 +302,15 @@ find_dir_group_orlov(struct super_block *sb, struct inode *parent) {
   int                   ngroups;
   int                   inodes_per_group;
 
-  struct ext2_group_desc *gdesc;
+  struct zarufs_group_info *gi;
   unsigned int           freei;
   unsigned int           avefreei;
   unsigned long          freeb;
   unsigned long          avefreeb;
   unsigned int           ndirs;
   int                    max_dirs;
-  int                    min_inodes;
-  unsigned long          min_blocks;
+  long                   min_inodes;
+  long                   min_blocks;
   int                    group;
   int                    i;
 
@@ -307,22 +338,22 @@ find_dir_group_orlov(struct super_block *sb, struct inode *parent) {
     parent_group = (unsigned) group % ngroups;
 
     for (i = 0; i < ngroups; i++) {
-      group = (parent_group + 1) % ngroups;
-      gdesc = zarufs_get_group_descriptor(sb, group);
-      if (!gdesc || !gdesc->bg_free_inodes_count) {
+      group = (parent_group + i) % ngroups;
+      gi    = zarufs_group_info(sb, group);
+      if (!gi->free_inodes) {
         continue;
       }
-      if (best_ndir <= le16_to_cpu(gdesc->bg_used_dirs_count)) {
+      if (best_ndir <= gi->used_dirs) {
         continue;
       }
-      if (le16_to_cpu(gdesc->bg_free_inodes_count) < avefreei) {
+      if (gi->free_inodes < avefreei) {
         continue;
       }
-      if (le16_to_cpu(gdesc->bg_free_blocks_count) <= avefreeb) {
+      if (gi->free_blocks <= avefreeb) {
         continue;
       }
       best_group = group;
-      best_ndir  = le16_to_cpu(gdesc->bg_used_dirs_count);
+      best_ndir  = gi->used_dirs;
     }
     if (0 <= best_group) {
       return (best_group);
@@ -331,22 +362,25 @@ find_dir_group_orlov(struct super_block *sb, struct inode *parent) {
   }
 
   max_dirs = (ndirs / ngroups) + (inodes_per_group / 16);
-  min_inodes = avefreei - (inodes_per_group / 4);
-  min_blocks = avefreeb - (zsi->s_blocks_per_group / 4);
+  /* on a nearly full volume the bars drop to 0 instead of wrapping. */
+  min_inodes = max_t(long, 0, (long) avefreei - (inodes_per_group / 4));
+  /* free block counts are kept in clusters. */
+  min_blocks = max_t(long, 0,
+                     (long) avefreeb - (long) (zsi->s_clusters_per_group / 4));
 
   for (i = 0; i < ngroups; i++) {
     group = (parent_group + i) % ngroups;
-    gdesc = zarufs_get_group_descriptor(sb, group);
-    if (!gdesc || !gdesc->bg_free_inodes_count) {
+    gi    = zarufs_group_info(sb, group);
+    if (!gi->free_inodes) {
       continue;
     }
-    if (max_dirs < le16_to_cpu(gdesc->bg_used_dirs_count)) {
+    if (max_dirs < gi->used_dirs) {
       continue;
     }
-    if (le16_to_cpu(gdesc->bg_free_inodes_count) < min_inodes) {
+    if ((long) gi->free_inodes < min_inodes) {
       continue;
     }
-    if (le16_to_cpu(gdesc->bg_free_blocks_count) < min_blocks) {
+    if ((long) gi->free_blocks < min_blocks) {
       continue;
     }
     return (group);
@@ -355,11 +389,11 @@ find_dir_group_orlov(struct super_block *sb, struct inode *parent) {
  fallback:
   for (i = 0; i < ngroups; i++) {
     group = (parent_group + i) % ngroups;
-    gdesc = zarufs_get_group_descriptor(sb, group);
-    if (!gdesc || !gdesc->bg_free_inodes_count) {
+    gi    = zarufs_group_info(sb, group);
+    if (!gi->free_inodes) {
       continue;
     }
-    if (avefreei <= le16_to_cpu(gdesc->bg_free_inodes_count)) {
+    if (avefreei <= gi->free_inodes) {
       return (group);
     }
   }
@@ -375,16 +409,335 @@ find_dir_group_orlov(struct super_block *sb, struct inode *parent) {
 struct buffer_head*
 read_inode_bitmap(struct super_block *sb, unsigned long block_group) {
   struct ext2_group_desc *gdesc;
+  struct buffer_head     *gdesc_bh;
   struct buffer_head     *bh;
+  unsigned long          i;
+
+  if ((bh = zarufs_bitmap_cache_get(sb, block_group, ZARUFS_INODE_BITMAP))) {
+    return (bh);
+  }
 
-  if (!(gdesc = zarufs_get_group_descriptor(sb, block_group))) {
+  if (!(gdesc = zarufs_get_group_descriptor(sb, block_group, &gdesc_bh))) {
     return(NULL);
   }
+  bh = NULL;
+  if (!zarufs_valid_group_desc(sb, block_group, gdesc)) {
+    goto out;
+  }
 
-  if (!(bh = sb_bread(sb, le32_to_cpu(gdesc->bg_inode_bitmap)))) {
+  /* no inode of an uninitialized group is in use. skip reading it. */
+  if (zarufs_has_gdt_csum(sb) &&
+      (gdesc->bg_flags & cpu_to_le16(EXT2_BG_INODE_UNINIT))) {
+    if (!(bh = sb_getblk(sb, zarufs_inode_bitmap(sb, gdesc)))) {
+      goto out;
+    }
+    if (!bh_uptodate_or_lock(bh)) {
+      memset(bh->b_data, 0, sb->s_blocksize);
+      for (i = ZARUFS_SB(sb)->s_inodes_per_group;
+           i < sb->s_blocksize * 8;
+           i++) {
+        set_bit_le(i, bh->b_data);
+      }
+      set_buffer_uptodate(bh);
+      unlock_buffer(bh);
+    }
+    goto out;
+  }
+
+  if (!(bh = sb_bread(sb, zarufs_inode_bitmap(sb, gdesc)))) {
     ZARUFS_ERROR("[ZARUFS] %s: cannot read inode bitmap.\n", __func__);
-    ZARUFS_ERROR("[ZARUFS] block_group=%lu, inode_bitmap=%u\n",
-                 block_group, le32_to_cpu(gdesc->bg_inode_bitmap));
+    ZARUFS_ERROR("[ZARUFS] block_group=%lu, inode_bitmap=%lu\n",
+                 block_group, zarufs_inode_bitmap(sb, gdesc));
+  }
+
+ out:
+  brelse(gdesc_bh);
+  if (bh) {
+    zarufs_bitmap_cache_add(sb, block_group, ZARUFS_INODE_BITMAP, bh);
   }
   return(bh);
 }
+
+/*
+ * a directory looks ahead at a run of inodes which were free in one
+ * group, next up to end, so that its files skip the search for a group
+ * and a free bit. the run is held in memory only: each inode is taken in
+ * the bitmap as it is handed out, and one taken meanwhile is skipped.
+ * creations in a directory are serialized by its i_mutex. returns the
+ * bitmap with the bit set, and the group and the index in it.
+ */
+static struct buffer_head*
+take_reserved_inode(struct super_block *sb,
+                    struct inode       *dir,
+                    unsigned long      *group,
+                    ino_t              *ino) {
+  struct zarufs_sb_info    *zsi;
+  struct zarufs_inode_info *zi;
+  struct buffer_head       *bitmap_bh;
+  unsigned long            ipg;
+  int                      reserved;
+
+  zsi      = ZARUFS_SB(sb);
+  zi       = ZARUFS_I(dir);
+  ipg      = zsi->s_inodes_per_group;
+  reserved = 0;
+  for (;;) {
+    if (zi->i_ino_rsv_next == zi->i_ino_rsv_end) {
+      /* a run just looked at which is all taken is left to the search. */
+      if (reserved++ || !reserve_inodes(sb, dir)) {
+        return (NULL);
+      }
+    }
+    *group = (zi->i_ino_rsv_next - 1) / ipg;
+    if (!(bitmap_bh = read_inode_bitmap(sb, *group))) {
+      zi->i_ino_rsv_next = zi->i_ino_rsv_end = 0;
+      return (NULL);
+    }
+    while (zi->i_ino_rsv_next < zi->i_ino_rsv_end) {
+      *ino = (zi->i_ino_rsv_next++ - 1) % ipg;
+      if (!ext2_set_bit_atomic(get_sb_blockgroup_lock(zsi, *group),
+                               (int) *ino,
+                               bitmap_bh->b_data)) {
+        return (bitmap_bh);
+      }
+    }
+    brelse(bitmap_bh);
+  }
+}
+
+/* look ahead at the first free inodes of a group for the files of dir. */
+static int
+reserve_inodes(struct super_block *sb, struct inode *dir) {
+  struct zarufs_sb_info    *zsi;
+  struct zarufs_inode_info *zi;
+  struct buffer_head       *bitmap_bh;
+  unsigned long            group;
+  unsigned long            first;
+  unsigned long            ino;
+
+  zsi = ZARUFS_SB(sb);
+  zi  = ZARUFS_I(dir);
+  if ((group = find_group_other(sb, dir)) == -1) {
+    return (0);
+  }
+  if (!(bitmap_bh = read_inode_bitmap(sb, group))) {
+    return (0);
+  }
+  first = find_next_zero_bit_le((unsigned long*) bitmap_bh->b_data,
+                                zsi->s_inodes_per_group,
+                                0);
+  brelse(bitmap_bh);
+  ino   = group * zsi->s_inodes_per_group + first + 1;
+  if ((zsi->s_inodes_per_group <= first) || (ino < zsi->s_first_ino)) {
+    /* left to the allocation of a single inode. */
+    return (0);
+  }
+
+  zi->i_ino_rsv_next = ino;
+  zi->i_ino_rsv_end  = ino + min_t(unsigned long,
+                                   ZARUFS_INO_RSV_BATCH,
+                                   zsi->s_inodes_per_group - first);
+  return (1);
+}
+
+/*
+ * take count inodes from first on, which are set in the bitmap already,
+ * off the descriptor, the group summary and the counters.
+ */
+static int
+claim_inodes(struct super_block *sb,
+             unsigned long block_group,
+             unsigned long first,
+             unsigned long count,
+             int is_dir) {
+  struct zarufs_sb_info    *zsi;
+  struct zarufs_group_info *gi;
+  struct ext2_group_desc   *gdesc;
+  struct buffer_head       *gdesc_bh;
+  unsigned long            top;
+  int                      zeroed;
+
+  zsi = ZARUFS_SB(sb);
+  if (!(gdesc = zarufs_get_group_descriptor(sb, block_group, &gdesc_bh))) {
+    return (-EIO);
+  }
+  percpu_counter_add(&zsi->s_freeinodes_counter, -(s64) count);
+  if (is_dir) {
+    percpu_counter_inc(&zsi->s_dirs_counter);
+  }
+
+  /* the table may be under zeroing above its watermark. */
+  zeroed = !zarufs_has_gdt_csum(sb) ||
+    (gdesc->bg_flags & cpu_to_le16(EXT2_BG_INODE_ZEROED));
+  if (!zeroed) {
+    down_read(&zsi->s_itable_sem);
+  }
+  gi = zarufs_group_info(sb, block_group);
+  spin_lock(get_sb_blockgroup_lock(zsi, block_group));
+  {
+    zarufs_free_inodes_count_set(sb, gdesc,
+                                 zarufs_free_inodes_count(sb, gdesc) - count);
+    gi->free_inodes = zarufs_free_inodes_count(sb, gdesc);
+    if (is_dir) {
+      zarufs_used_dirs_count_set(sb, gdesc,
+                                 zarufs_used_dirs_count(sb, gdesc) + 1);
+      gi->used_dirs = zarufs_used_dirs_count(sb, gdesc);
+    }
+    if (zarufs_has_gdt_csum(sb)) {
+      /* inodes up to the last one are in use from now on. */
+      top = first + count;
+      gdesc->bg_flags &= cpu_to_le16(~EXT2_BG_INODE_UNINIT);
+      if (zsi->s_inodes_per_group - zarufs_itable_unused(sb, gdesc) < top) {
+        zarufs_itable_unused_set(sb, gdesc, zsi->s_inodes_per_group - top);
+      }
+      zarufs_group_desc_csum_set(sb, block_group, gdesc);
+      gi->flags = le16_to_cpu(gdesc->bg_flags);
+    }
+  }
+  spin_unlock(get_sb_blockgroup_lock(zsi, block_group));
+  if (!zeroed) {
+    up_read(&zsi->s_itable_sem);
+  }
+  mark_buffer_dirty(gdesc_bh);
+  brelse(gdesc_bh);
+  return (0);
+}
+
+/*
+ * under gdt_csum feature, mkfs may leave inode tables unwritten. they are
+ * zeroed after mount by a thread of the lowest priority, which pauses
+ * between groups so that it yields to foreground i/o.
+ */
+void
+zarufs_start_lazyinit(struct super_block *sb) {
+  struct zarufs_sb_info *zsi;
+  struct task_struct    *task;
+
+  zsi = ZARUFS_SB(sb);
+  if (!zarufs_has_gdt_csum(sb) || zsi->s_lazyinit_task) {
+    return;
+  }
+  task = kthread_run(lazyinit_thread, sb, "zarufs_lazyinit/%s", sb->s_id);
+  if (IS_ERR(task)) {
+    ZARUFS_ERROR("[ZARUFS] %s: cannot start zeroing inode tables (%ld)\n",
+                 __func__, PTR_ERR(task));
+    return;
+  }
+  zsi->s_lazyinit_task = task;
+}
+
+void
+zarufs_stop_lazyinit(struct super_block *sb) {
+  struct zarufs_sb_info *zsi;
+
+  zsi = ZARUFS_SB(sb);
+  if (zsi->s_lazyinit_task) {
+    kthread_stop(zsi->s_lazyinit_task);
+    zsi->s_lazyinit_task = NULL;
+  }
+}
+
+static int
+lazyinit_thread(void *data) {
+  struct super_block    *sb;
+  struct zarufs_sb_info *zsi;
+  unsigned long         group;
+  unsigned long         start;
+
+  sb  = (struct super_block*) data;
+  zsi = ZARUFS_SB(sb);
+  set_user_nice(current, MAX_NICE);
+
+  group = 0;
+  while ((group < zsi->s_groups_count) && !kthread_should_stop()) {
+    start = jiffies;
+    /* a frozen volume is left alone until it is thawed. */
+    if (!sb_start_write_trylock(sb)) {
+      schedule_timeout_interruptible(HZ);
+      continue;
+    }
+    if (zero_inode_table(sb, group)) {
+      sb_end_write(sb);
+      break;
+    }
+    sb_end_write(sb);
+    group++;
+    schedule_timeout_interruptible((jiffies - start)
+                                   * ZARUFS_LAZYINIT_WAIT_MULT);
+  }
+
+  /* the task is reaped by kthread_stop. */
+  while (!kthread_should_stop()) {
+    set_current_state(TASK_INTERRUPTIBLE);
+    if (!kthread_should_stop()) {
+      schedule();
+    }
+    __set_current_state(TASK_RUNNING);
+  }
+  return (0);
+}
+
+/*
+ * zero the inode table above the itable_unused watermark. allocation,
+ * which raises the watermark, is held off meanwhile so that no inode can
+ * be placed in a block being zeroed.
+ */
+static int
+zero_inode_table(struct super_block *sb, unsigned long block_group) {
+  struct zarufs_sb_info  *zsi;
+  struct ext2_group_desc *gdesc;
+  struct buffer_head     *gdesc_bh;
+  struct address_space   *mapping;
+  unsigned long          used_blks;
+  unsigned long          block;
+  unsigned int           shift;
+  int                    err;
+
+  zsi = ZARUFS_SB(sb);
+  if (!(gdesc = zarufs_get_group_descriptor(sb, block_group, &gdesc_bh))) {
+    return (-EIO);
+  }
+  err = 0;
+  if (gdesc->bg_flags & cpu_to_le16(EXT2_BG_INODE_ZEROED)) {
+    goto out;
+  }
+  if (!zarufs_valid_group_desc(sb, block_group, gdesc)) {
+    err = -EIO;
+    goto out;
+  }
+
+  down_write(&zsi->s_itable_sem);
+  used_blks = DIV_ROUND_UP(zsi->s_inodes_per_group
+                           - zarufs_itable_unused(sb, gdesc),
+                           zsi->s_inodes_per_block);
+  if (used_blks < zsi->s_itb_per_group) {
+    block = zarufs_inode_table(sb, gdesc) + used_blks;
+    err   = sb_issue_zeroout(sb, block, zsi->s_itb_per_group - used_blks,
+                             GFP_NOFS);
+    if (err) {
+      ZARUFS_ERROR("[ZARUFS] %s: cannot zero inode table of group %lu\n",
+                   __func__, block_group);
+      goto out_unlock;
+    }
+    /* cached copies, which were never used, would hide the zeros. */
+    mapping = sb->s_bdev->bd_inode->i_mapping;
+    shift   = PAGE_CACHE_SHIFT - sb->s_blocksize_bits;
+    invalidate_mapping_pages(mapping,
+                             block >> shift,
+                             (block + zsi->s_itb_per_group - used_blks - 1)
+                             >> shift);
+  }
+
+  spin_lock(get_sb_blockgroup_lock(zsi, block_group));
+  gdesc->bg_flags |= cpu_to_le16(EXT2_BG_INODE_ZEROED);
+  zarufs_group_desc_csum_set(sb, block_group, gdesc);
+  zarufs_group_info(sb, block_group)->flags = le16_to_cpu(gdesc->bg_flags);
+  spin_unlock(get_sb_blockgroup_lock(zsi, block_group));
+  mark_buffer_dirty(gdesc_bh);
+
+ out_unlock:
+  up_write(&zsi->s_itable_sem);
+ out:
+  brelse(gdesc_bh);
+  return (err);
+}
@@ -4,10 +4,10 @@
 struct inode*
 zarufs_alloc_new_inode(struct inode *dir, umode_t mode, const struct qstr *qstr);
 
-unsigned long
-zarufs_count_free_inodes(struct super_block *sb);
+void
+zarufs_start_lazyinit(struct super_block *sb);
 
-unsigned long
-zarufs_count_directories(struct super_block *sb);
+void
+zarufs_stop_lazyinit(struct super_block *sb);
 
 #endif
@@ -4,6 +4,8 @@
 #include <linux/mpage.h>
 #include <linux/sched.h>
 #include <linux/writeback.h>
+#include <linux/blkdev.h>
+#include <linux/sort.h>
 
 #include "../include/zarufs.h"
 #include "zarufs_utils.h"
@@ -12,18 +14,16 @@
 #include "zarufs_dir.h"
 #include "zarufs_namei.h"
 #include "zarufs_file.h"
+#include "zarufs_compress.h"
 
+/* p points a __le64 slot when wide, otherwise a __le32 slot. */
 typedef struct {
-  __le32             *p;
-  __le32             key;
+  void               *p;
+  unsigned long      key;
   struct buffer_head *bh;
+  int                wide;
 } indirect;
 
-static struct ext2_inode*
-zarufs_get_ext2_inode(struct super_block *sb,
-                      unsigned long ino,
-                      struct buffer_head **bhp);
-
 static int
 zarufs_get_blocks(struct inode *inode,
                   sector_t iblock,
@@ -40,14 +40,30 @@ zarufs_block_to_path(struct inode *inode,
 static int
 zarufs_read_page(struct file *filp, struct page *page);
 
+static int
+cmp_inode_block(const void *a, const void *b);
+
+static int
+free_tail_branch(struct inode *inode,
+                 unsigned long blk,
+                 int depth,
+                 u64 first,
+                 unsigned long from);
+
 static int
 zarufs_read_pages(struct file *filp,
                   struct address_space *mapping,
                   struct list_head *pages,
                   unsigned nr_pages);
 
+static inline unsigned long
+read_slot(void *base, int wide, long n);
+
+static inline void
+write_slot(void *base, int wide, long n, unsigned long blk);
+
 static inline void
-add_chain(indirect *p, struct buffer_head *bh, __le32 *v);
+add_chain(indirect *p, struct buffer_head *bh, void *v, int wide);
 
 static indirect*
 zarufs_get_branch(struct inode *inode,
@@ -96,11 +112,15 @@ find_goal(struct inode *inode, long block, indirect *partial);
 static inline unsigned long
 find_near(struct inode *inode, indirect *ind);
 
+static unsigned long
+find_cluster_sibling(struct inode *inode, indirect *leaf, sector_t iblock);
+
 static int
 alloc_branch(struct inode *inode,
              int indirect_blks,
              int *blks,
              unsigned long goal,
+             unsigned long offset,
              int *offsets,
              indirect *branch);
 
@@ -114,6 +134,23 @@ splice_branch(struct inode *inode,
 static inline int
 verify_indirect_chain(indirect *from, indirect *to);
 
+static void
+get_alloc_range(struct inode *inode,
+                sector_t iblock,
+                int *offsets,
+                int depth,
+                int level,
+                unsigned long count,
+                unsigned long *start,
+                unsigned long *end);
+
+static int
+count_free_slots(indirect *leaf, int count);
+
+static int
+block_range_conflict(struct zarufs_inode_info *zi,
+                     struct zarufs_block_range *range);
+
 const struct address_space_operations zarufs_aops = {
   .readpage              = zarufs_read_page,
   .readpages             = zarufs_read_pages,
@@ -129,11 +166,12 @@ const struct address_space_operations zarufs_aops = {
 
 /* -------------------------------------------------------------------------- */
 
-static struct ext2_inode*
+struct ext2_inode*
 zarufs_get_ext2_inode(struct super_block *sb,
                       unsigned long ino,
                       struct buffer_head **bhp) {
   struct ext2_group_desc *gdesc;
+  struct buffer_head     *gdesc_bh;
   unsigned long          block_group;
   unsigned long          block_offset;
   unsigned long          inode_index;
@@ -155,9 +193,10 @@ zarufs_get_ext2_inode(struct super_block *sb,
 
   /* get group descriptor. */
   block_group = (ino - 1) / ZARUFS_SB(sb)->s_inodes_per_group;
-  gdesc = (struct ext2_group_desc*) zarufs_get_group_descriptor(sb, block_group);
-  if (!gdesc) {
+  gdesc = zarufs_get_group_descriptor(sb, block_group, &gdesc_bh);
+  if (!gdesc || !zarufs_valid_group_desc(sb, block_group, gdesc)) {
     ZARUFS_ERROR("[ZARUFS] Error: cannot find group descriptor(ino=%lu)\n", ino);
+    brelse(gdesc_bh);
     return (ERR_PTR(-EIO));
   }
 
@@ -165,7 +204,8 @@ zarufs_get_ext2_inode(struct super_block *sb,
   block_offset = ((ino - 1) % ZARUFS_SB(sb)->s_inodes_per_group)
     * ZARUFS_SB(sb)->s_inode_size;
   inode_index = block_offset >> sb->s_blocksize_bits;
-  inode_block = le32_to_cpu(gdesc->bg_inode_table) + inode_index;
+  inode_block = zarufs_inode_table(sb, gdesc) + inode_index;
+  brelse(gdesc_bh);
   if (!(*bhp = sb_bread(sb, inode_block))) {
     ZARUFS_ERROR("[ZARUFS] Error: unable to read inode block[1].\n");
     ZARUFS_ERROR("[ZARUFS] (ino=%lu)\n", ino);
@@ -175,6 +215,91 @@ zarufs_get_ext2_inode(struct super_block *sb,
   return ((struct ext2_inode*)((*bhp)->b_data + block_offset));
 }
 
+/*
+ * start reading the inode table blocks of inos, which are likely to be
+ * looked up soon. the blocks are sorted and issued under a plug, so that
+ * adjacent ones are merged into one request.
+ */
+void
+zarufs_prefetch_inodes(struct super_block *sb, unsigned long *inos, int count) {
+  struct zarufs_sb_info  *zsi;
+  struct ext2_group_desc *gdesc;
+  struct buffer_head     *gdesc_bh;
+  struct buffer_head     *bhs[ZARUFS_PREFETCH_INODES];
+  struct blk_plug        plug;
+  unsigned long          blocks[ZARUFS_PREFETCH_INODES];
+  unsigned long          table;
+  unsigned long          group;
+  unsigned long          last_group;
+  unsigned long          offset;
+  int                    nr_blocks;
+  int                    nr_bhs;
+  int                    i;
+
+  zsi        = ZARUFS_SB(sb);
+  table      = 0;
+  last_group = ~0UL;
+  nr_blocks  = 0;
+  count      = min_t(int, count, zsi->s_inode_prefetch);
+  count      = min(count, ZARUFS_PREFETCH_INODES);
+  if (count <= 0) {
+    return;
+  }
+
+  for (i = 0; i < count; i++) {
+    if (((inos[i] != ZARUFS_EXT2_ROOT_INO) && (inos[i] < zsi->s_first_ino)) ||
+        (le32_to_cpu(zsi->s_zsb->s_inodes_count) < inos[i])) {
+      continue;
+    }
+
+    group = (inos[i] - 1) / zsi->s_inodes_per_group;
+    if (group != last_group) {
+      /* 0 marks a group whose descriptor is unusable. */
+      table      = 0;
+      last_group = group;
+      gdesc      = zarufs_get_group_descriptor(sb, group, &gdesc_bh);
+      if (gdesc && zarufs_valid_group_desc(sb, group, gdesc)) {
+        table = zarufs_inode_table(sb, gdesc);
+      }
+      brelse(gdesc_bh);
+    }
+    if (!table) {
+      continue;
+    }
+
+    offset = ((inos[i] - 1) % zsi->s_inodes_per_group) * zsi->s_inode_size;
+    blocks[nr_blocks++] = table + (offset >> sb->s_blocksize_bits);
+  }
+
+  sort(blocks, nr_blocks, sizeof(blocks[0]), cmp_inode_block, NULL);
+  nr_bhs = 0;
+  for (i = 0; i < nr_blocks; i++) {
+    struct buffer_head *bh;
+
+    if (i && (blocks[i] == blocks[i - 1])) {
+      continue;
+    }
+    if (!(bh = sb_getblk(sb, blocks[i]))) {
+      continue;
+    }
+    if (buffer_uptodate(bh)) {
+      brelse(bh);
+      continue;
+    }
+    bhs[nr_bhs++] = bh;
+  }
+  if (!nr_bhs) {
+    return;
+  }
+
+  blk_start_plug(&plug);
+  ll_rw_block(READA, nr_bhs, bhs);
+  blk_finish_plug(&plug);
+  for (i = 0; i < nr_bhs; i++) {
+    brelse(bhs[i]);
+  }
+}
+
 struct inode
 *zarufs_get_vfs_inode(struct super_block *sb, unsigned int ino) {
   struct inode             *inode;
@@ -241,6 +366,9 @@ struct inode
   zi->i_frag_no   = ext2_inode->osd2.linux2.l_i_frag;
   zi->i_frag_size = ext2_inode->osd2.linux2.l_i_fsize;
   zi->i_file_acl  = le32_to_cpu(ext2_inode->i_file_acl);
+  if (zarufs_has_64bit(sb)) {
+    zi->i_file_acl |= (u64) le16_to_cpu(ext2_inode->osd2.linux2.l_i_file_acl_high) << 32;
+  }
   zi->i_dir_acl = 0;
   if (S_ISREG(inode->i_mode)) {
     inode->i_size |= ((__u64)le32_to_cpu(ext2_inode->i_dir_acl)) << 32;
@@ -253,8 +381,44 @@ struct inode
   zi->i_block_group      = (ino - 1) / ZARUFS_SB(sb)->s_inodes_per_group;
   zi->i_dir_start_lookup = 0;
 
+  /* large inodes carry an extra header in front of in-inode attributes. */
+  zi->i_extra_isize = 0;
+  if (EXT2_GOOD_OLD_INODE_SIZE < ZARUFS_SB(sb)->s_inode_size) {
+    struct zarufs_inode_extra *extra;
+
+    extra = (struct zarufs_inode_extra*)(ext2_inode + 1);
+    zi->i_extra_isize = le16_to_cpu(extra->i_extra_isize);
+    if ((zi->i_extra_isize < ZARUFS_MIN_EXTRA_ISIZE) ||
+        ((EXT2_GOOD_OLD_INODE_SIZE + zi->i_extra_isize) >
+         ZARUFS_SB(sb)->s_inode_size) ||
+        (zi->i_extra_isize & 3)) {
+      zi->i_extra_isize = 0;
+    }
+  }
+
   for (i = 0; i < ZARUFS_NR_BLOCKS; i++) {
-    zi->i_data[i] = ext2_inode->i_block[i];
+    u64 blk;
+
+    blk = le32_to_cpu(ext2_inode->i_block[i]);
+    if (zarufs_has_64bit(sb) &&
+        (ZARUFS_64BIT_EXTRA_ISIZE <= zi->i_extra_isize)) {
+      struct zarufs_inode_extra *extra;
+
+      extra = (struct zarufs_inode_extra*)(ext2_inode + 1);
+      blk  |= (u64) le16_to_cpu(extra->i_block_hi[i]) << 32;
+    }
+    zi->i_data[i] = cpu_to_le64(blk);
+  }
+
+  /* take room for the high bits of i_block[] unless attributes live there. */
+  if (zarufs_has_64bit(sb) && (zi->i_extra_isize < ZARUFS_64BIT_EXTRA_ISIZE)) {
+    __le32 *magic;
+
+    magic = (__le32*)((char*) ext2_inode
+                      + EXT2_GOOD_OLD_INODE_SIZE + zi->i_extra_isize);
+    if (!zi->i_extra_isize || (*magic != cpu_to_le32(ZARUFS_XATTR_MAGIC))) {
+      zi->i_extra_isize = ZARUFS_64BIT_EXTRA_ISIZE;
+    }
   }
 
   if (S_ISREG(inode->i_mode)) {
@@ -265,6 +429,8 @@ struct inode
     DBGPRINT("[ZARUFS] get directory inode!\n");
     inode->i_fop = &zarufs_dir_operations;
     inode->i_op  = &zarufs_dir_inode_operations;
+    /* readahead may reach the mapping before any page is read. */
+    inode->i_mapping->a_ops = &zarufs_aops;
   } else if (S_ISLNK(inode->i_mode)) {
   } else {
   }
@@ -329,16 +495,35 @@ zarufs_set_vfs_inode_flags(struct inode *inode) {
 
 static int
 zarufs_read_page(struct file *filp, struct page *page) {
+  struct inode *inode;
+  int          ret;
+
   DBGPRINT("[ZARUFS] read page\n");
+  inode = page->mapping->host;
+  if (ZARUFS_I(inode)->i_flags & EXT2_COMPRBLK_FL) {
+    /* 0 or error: the page is filled from a compressed cluster. */
+    if ((ret = zarufs_read_compressed_page(inode, page)) <= 0) {
+      return (ret);
+    }
+  }
   return(mpage_readpage(page, zarufs_get_block));
 }
 
+static int
+zarufs_read_page_filler(void *data, struct page *page) {
+  return (zarufs_read_page((struct file*) data, page));
+}
+
 static int
 zarufs_read_pages(struct file *filp,
                   struct address_space *mapping,
                   struct list_head *pages,
                   unsigned nr_pages) {
   DBGPRINT("[ZARUFS] read page[s]\n");
+  if (ZARUFS_I(mapping->host)->i_flags & EXT2_COMPRBLK_FL) {
+    /* compressed clusters cannot be mapped by mpage. read page by page. */
+    return (read_cache_pages(mapping, pages, zarufs_read_page_filler, filp));
+  }
   return (mpage_readpages(mapping, pages, nr_pages, zarufs_get_block));
 }
 
@@ -380,7 +565,7 @@ zarufs_block_to_path(struct inode *inode,
   unsigned long final;
   int           depth;
 
-  ind_blk_entries = inode->i_sb->s_blocksize / sizeof(__le32);
+  ind_blk_entries = zarufs_addr_per_block(inode->i_sb);
   direct_blocks   = ZARUFS_NDIR_BLOCKS;
   final = 0;
   depth = 0;
@@ -449,14 +634,223 @@ zarufs_block_to_path(struct inode *inode,
   return (depth);
 }
 
+static inline unsigned long
+read_slot(void *base, int wide, long n) {
+  if (wide) {
+    return (le64_to_cpu(((__le64*) base)[n]));
+  }
+  return (le32_to_cpu(((__le32*) base)[n]));
+}
+
 static inline void
-add_chain(indirect *p, struct buffer_head *bh, __le32 *v) {
-  p->p   = v;
-  p->key = *v;
-  p->bh  = bh;
+write_slot(void *base, int wide, long n, unsigned long blk) {
+  if (wide) {
+    ((__le64*) base)[n] = cpu_to_le64(blk);
+  } else {
+    ((__le32*) base)[n] = cpu_to_le32(blk);
+  }
+}
+
+static inline void
+add_chain(indirect *p, struct buffer_head *bh, void *v, int wide) {
+  p->p    = v;
+  p->wide = wide;
+  p->key  = read_slot(v, wide, 0);
+  p->bh   = bh;
+}
+
+
+int
+zarufs_get_block_ptr(struct inode *inode,
+                     unsigned long iblock,
+                     unsigned long *blk) {
+  indirect chain[4];
+  indirect *partial;
+  int      offsets[4];
+  int      depth;
+  int      err;
+
+  *blk = 0;
+  if (!(depth = zarufs_block_to_path(inode, iblock, offsets, NULL))) {
+    return (-EIO);
+  }
+
+  partial = zarufs_get_branch(inode, depth, offsets, chain, &err);
+  if (!partial) {
+    *blk    = chain[depth - 1].key;
+    partial = chain + depth - 1;
+  }
+
+  while (chain < partial) {
+    brelse(partial->bh);
+    partial--;
+  }
+  return (err);
+}
+
+int
+zarufs_set_block_ptr(struct inode *inode,
+                     unsigned long iblock,
+                     unsigned long blk) {
+  struct zarufs_inode_info *zi;
+  indirect                 chain[4];
+  indirect                 *partial;
+  int                      offsets[4];
+  int                      depth;
+  int                      err;
+
+  if (!(depth = zarufs_block_to_path(inode, iblock, offsets, NULL))) {
+    return (-EIO);
+  }
+
+  partial = zarufs_get_branch(inode, depth, offsets, chain, &err);
+  if (partial) {
+    /* indirect blocks leading to iblock do not exist. */
+    if (!err) {
+      err = -ENOENT;
+    }
+    goto cleanup;
+  }
+
+  zi      = ZARUFS_I(inode);
+  partial = chain + depth - 1;
+  write_seqlock(&zi->i_meta_lock);
+  write_slot(partial->p, partial->wide, 0, blk);
+  write_sequnlock(&zi->i_meta_lock);
+
+  if (partial->bh) {
+    mark_buffer_dirty_inode(partial->bh, inode);
+  }
+  mark_inode_dirty(inode);
+
+ cleanup:
+  while (chain < partial) {
+    brelse(partial->bh);
+    partial--;
+  }
+  return (err);
+}
+
+/*
+ * free the blocks which map iblocks from 'from' on, together with the
+ * indirect blocks left mapping nothing. the caller has cut i_size and
+ * the page cache beforehand.
+ */
+int
+zarufs_truncate_blocks(struct inode *inode, unsigned long from) {
+  struct zarufs_inode_info  *zi;
+  struct zarufs_block_range range;
+  unsigned long             blk;
+  u64                       first;
+  u64                       span;
+  int                       depth;
+  int                       n;
+
+  /* a cluster may still be shared with blocks below 'from'. */
+  if (zarufs_has_bigalloc(inode->i_sb)) {
+    return (-EOPNOTSUPP);
+  }
+
+  zi = ZARUFS_I(inode);
+  zarufs_lock_block_range(inode, &range, from, ULONG_MAX);
+  for (n = min(from, (unsigned long) ZARUFS_NDIR_BLOCKS);
+       n < ZARUFS_NDIR_BLOCKS;
+       n++) {
+    if ((blk = le64_to_cpu(zi->i_data[n]))) {
+      write_seqlock(&zi->i_meta_lock);
+      zi->i_data[n] = 0;
+      write_sequnlock(&zi->i_meta_lock);
+      zarufs_free_blocks(inode, blk, 1);
+    }
+  }
+
+  first = ZARUFS_NDIR_BLOCKS;
+  span  = zarufs_addr_per_block(inode->i_sb);
+  for (depth = 1; depth <= 3; depth++) {
+    n = ZARUFS_IND_BLOCK + depth - 1;
+    blk = le64_to_cpu(zi->i_data[n]);
+    if (blk && (from < first + span) &&
+        free_tail_branch(inode, blk, depth, first, from)) {
+      write_seqlock(&zi->i_meta_lock);
+      zi->i_data[n] = 0;
+      write_sequnlock(&zi->i_meta_lock);
+    }
+    first += span;
+    span  *= zarufs_addr_per_block(inode->i_sb);
+  }
+  zarufs_unlock_block_range(inode, &range);
+
+  mark_inode_dirty(inode);
+  return (0);
 }
 
+/* free a branch mapping iblocks from first on. returns 1 if it is gone. */
+static int
+free_tail_branch(struct inode *inode,
+                 unsigned long blk,
+                 int depth,
+                 u64 first,
+                 unsigned long from) {
+  struct zarufs_inode_info *zi;
+  struct buffer_head       *bh;
+  unsigned long            nr;
+  unsigned long            child;
+  u64                      child_span;
+  int                      wide;
+  int                      freed;
+  int                      i;
+
+  zi = ZARUFS_I(inode);
+  if (!(bh = sb_bread(inode->i_sb, blk))) {
+    ZARUFS_ERROR("[ZARUFS] %s: failed to read indirect block %lu\n",
+                 __func__, blk);
+    return (0);
+  }
+
+  nr         = zarufs_addr_per_block(inode->i_sb);
+  wide       = zarufs_has_64bit(inode->i_sb);
+  child_span = 1;
+  for (i = 1; i < depth; i++) {
+    child_span *= nr;
+  }
+
+  for (i = 0; i < nr; i++) {
+    if (first + (i + 1) * child_span <= from) {
+      continue;
+    }
+    if (!(child = read_slot(bh->b_data, wide, i))) {
+      continue;
+    }
+
+    if (depth == 1) {
+      zarufs_free_blocks(inode, child, 1);
+      freed = 1;
+    } else {
+      freed = free_tail_branch(inode, child, depth - 1,
+                               first + i * child_span, from);
+    }
+    if (freed) {
+      write_seqlock(&zi->i_meta_lock);
+      write_slot(bh->b_data, wide, i, 0);
+      write_sequnlock(&zi->i_meta_lock);
+    }
+  }
+
+  if (from <= first) {
+    bforget(bh);
+    zarufs_free_blocks(inode, blk, 1);
+    return (1);
+  }
+  mark_buffer_dirty_inode(bh, inode);
+  brelse(bh);
+  return (0);
+}
 
+/*
+ * the read side takes no lock. a slot read while a writer of i_meta_lock
+ * was at work is read again, and a chain found changed is given up with
+ * -EAGAIN, so that the caller retries it under a range lock.
+ */
 static indirect*
 zarufs_get_branch(struct inode *inode,
                   int          depth,
@@ -466,35 +860,47 @@ zarufs_get_branch(struct inode *inode,
   struct zarufs_inode_info *zi;
   struct buffer_head       *bh;
   indirect                 *p;
+  unsigned                 seq;
+  int                      wide;
 
   zi   = ZARUFS_I(inode);
   p    = chain;
+  wide = zarufs_has_64bit(inode->i_sb);
   *err = 0;
 
-  add_chain(chain, NULL, ZARUFS_I(inode)->i_data + *offsets);
+  /* the in-memory copy of i_block[] is always 64bit wide. */
+  do {
+    seq = read_seqbegin(&zi->i_meta_lock);
+    add_chain(chain, NULL, zi->i_data + *offsets, 1);
+  } while (read_seqretry(&zi->i_meta_lock, seq));
   if (!p->key) {
     goto no_block;
   }
   while (--depth) {
-    if (!(bh = sb_bread(inode->i_sb, le32_to_cpu(p->key)))) {
+    if (!(bh = sb_bread(inode->i_sb, p->key))) {
       *err = -EIO;
       goto no_block;
     }
-    read_lock(&ZARUFS_I(inode)->i_meta_lock);
-    if (!verify_indirect_chain(chain, p)) {
-      goto truncated;
-    }
 
-    add_chain(++p, bh, (__le32*) bh->b_data + *(++offsets));
-    read_unlock(&ZARUFS_I(inode)->i_meta_lock);
-    if (!p->key) {
+    ++offsets;
+    do {
+      seq = read_seqbegin(&zi->i_meta_lock);
+      if (!verify_indirect_chain(chain, p)) {
+        goto truncated;
+      }
+      if (wide) {
+        add_chain(p + 1, bh, (__le64*) bh->b_data + *offsets, wide);
+      } else {
+        add_chain(p + 1, bh, (__le32*) bh->b_data + *offsets, wide);
+      }
+    } while (read_seqretry(&zi->i_meta_lock, seq));
+    if (!(++p)->key) {
       goto no_block;
     }
   }
   return (NULL);
 
  truncated:
-  read_unlock(&(zi->i_meta_lock));
   brelse(bh);
   *err = -EAGAIN;
 
@@ -508,16 +914,20 @@ zarufs_get_blocks(struct inode *inode,
                   unsigned long maxblocks,
                   struct buffer_head *bh_result,
                   int create) {
-  struct zarufs_inode_info *zi;
-  indirect                 chain[4];
-  indirect                 *partial;
-  int                      offsets[4];
-  int                      blocks_to_boundary;
-  int                      count;
-  int                      depth;
-  int                      err;
-  int                      indirect_blks;
-  unsigned long            goal;
+  struct zarufs_sb_info     *zsi;
+  struct zarufs_block_range range;
+  indirect                  chain[4];
+  indirect                  *partial;
+  int                       offsets[4];
+  int                       blocks_to_boundary;
+  int                       count;
+  int                       depth;
+  int                       err;
+  int                       indirect_blks;
+  int                       level;
+  unsigned long             goal;
+  unsigned long             start;
+  unsigned long             end;
 
   /* translate block number to its reference path. */
   if (!(depth = zarufs_block_to_path(inode,
@@ -535,7 +945,16 @@ zarufs_get_blocks(struct inode *inode,
   if (!partial) {
     unsigned long first_block;
 
-    first_block = le32_to_cpu(chain[depth - 1].key);
+    partial     = chain + depth - 1;
+    first_block = chain[depth - 1].key;
+    if (first_block == ZARUFS_COMPRESSED_BLKADDR) {
+      /* compressed cluster must be expanded before mapping its blocks. */
+      ZARUFS_ERROR("[ZARUFS] %s: block in compressed cluster\n", __func__);
+      ZARUFS_ERROR("[ZARUFS] ino=%lu, iblock=%lu\n",
+                   inode->i_ino, (unsigned long) iblock);
+      err = -EIO;
+      goto cleanup;
+    }
     clear_buffer_new(bh_result);
     count++;
     while ((count < maxblocks) && (count <= blocks_to_boundary)) {
@@ -550,7 +969,7 @@ zarufs_get_blocks(struct inode *inode,
         break;
       }
 
-      cur_blk = le32_to_cpu(*(chain[depth - 1].p + count));
+      cur_blk = read_slot(chain[depth - 1].p, chain[depth - 1].wide, count);
       if (cur_blk == first_block + count) {
         count++;
       } else {
@@ -567,53 +986,91 @@ zarufs_get_blocks(struct inode *inode,
     goto cleanup;
   }
 
-  zi = ZARUFS_I(inode);
-  mutex_lock(&zi->truncate_mutex);
-  if ((err == -EAGAIN) || !verify_indirect_chain(chain, partial)) {
+  /*
+   * lock the iblocks under the highest missing slot. allocations under
+   * other subtrees of the file go on at the same time. a subtree cut
+   * meanwhile leaves a higher slot missing, and asks for a wider range.
+   */
+  count = min_t(unsigned long, maxblocks, blocks_to_boundary + 1);
+  level = partial - chain;
+  for (;;) {
+    get_alloc_range(inode, iblock, offsets, depth, level, count, &start, &end);
+    zarufs_lock_block_range(inode, &range, start, end);
+    if ((err != -EAGAIN) && verify_indirect_chain(chain, partial)) {
+      break;
+    }
+
     while (chain < partial) {
       brelse(partial->bh);
       partial--;
     }
     partial = zarufs_get_branch(inode, depth, offsets, chain, &err);
     if (!partial) {
-      count++;
-      mutex_unlock(&zi->truncate_mutex);
+      partial = chain + depth - 1;
+      zarufs_unlock_block_range(inode, &range);
       if (err) {
         goto cleanup;
       }
       clear_buffer_new(bh_result);
+      count = 1;
       goto found;
     }
+    if ((err != -EAGAIN) && (level <= partial - chain)) {
+      break;
+    }
+    zarufs_unlock_block_range(inode, &range);
+    if (err == -EIO) {
+      goto cleanup;
+    }
+    level = min_t(int, level, partial - chain);
   }
-  
+
+  /* a block of a logical cluster already mapped shares its cluster. */
+  zsi = ZARUFS_SB(inode->i_sb);
+  if (zsi->s_cluster_bits && (partial == chain + depth - 1)) {
+    unsigned long blk;
+
+    if ((blk = find_cluster_sibling(inode, partial, iblock))) {
+      partial->key = blk;
+      splice_branch(inode, iblock, partial, 0, 1);
+      zarufs_unlock_block_range(inode, &range);
+      set_buffer_new(bh_result);
+      count = 1;
+      goto found;
+    }
+  }
+
   /* now allocate block. */
   goal = find_goal(inode, iblock, partial);
 
   /* the number of blocks need to allocte for [d,t] indrect blocks. */
   indirect_blks = (chain + depth) - partial - 1;
 
-  /* next, lookup the indirect map to count the total number of direct blocks */
-  /* to allocate for this branch. */
-  count = maxblocks;
+  /* direct blocks are mapped up to the end of the leaf, or the next block */
+  /* mapped already. */
+  if (!indirect_blks) {
+    count = count_free_slots(partial, count);
+  }
   err = alloc_branch(inode,
                      indirect_blks,
                      &count,
                      goal,
+                     ZARUFS_CLUSTER_OFFSET(zsi, iblock),
                      offsets + (partial - chain),
                      partial);
   if (err) {
     DBGPRINT("[ZARUFS] %s: cannot allocate blocks in alloc_branch.\n",
              __func__);
-    mutex_unlock(&zi->truncate_mutex);
+    zarufs_unlock_block_range(inode, &range);
     goto cleanup;
   }
 
   splice_branch(inode, iblock, partial, indirect_blks, count);
-  mutex_unlock(&zi->truncate_mutex);
+  zarufs_unlock_block_range(inode, &range);
   set_buffer_new(bh_result);
 
  found:
-  map_bh(bh_result, inode->i_sb, le32_to_cpu(chain[depth - 1].key));
+  map_bh(bh_result, inode->i_sb, chain[depth - 1].key);
   err = count;
 
  cleanup:
@@ -649,6 +1106,12 @@ zarufs_write_begin(struct file          *file,
                    void                 **fsdata) {
   int ret = 0;
   DBGPRINT("[ZARUFS] write begin.\n");
+  if (ZARUFS_I(mapping->host)->i_flags & EXT2_COMPRBLK_FL) {
+    ret = zarufs_uncompress_cluster(mapping->host, pos >> ZARUFS_CLUSTER_BITS);
+    if (ret < 0) {
+      return (ret);
+    }
+  }
   ret = block_write_begin(mapping, pos, len, flags, pagep, zarufs_get_block);
   if (ret < 0) {
     /* zarufs_write_failed(mapping, pos + len); */
@@ -668,6 +1131,9 @@ zarufs_write_end(struct file          *file,
 
   DBGPRINT("[ZARUFS] write end.\n");
   ret = generic_write_end(file, mapping, pos, len, copied, pagep, fsdata);
+  if (0 < ret) {
+    zarufs_compress_mark_dirty(mapping->host, pos, ret);
+  }
   if (ret < len) {
     /* zarufs_write_failed(mapping, pos + len); */
   }
@@ -683,22 +1149,26 @@ static inline unsigned long
 find_near(struct inode *inode, indirect *ind) {
   struct zarufs_inode_info  *zi;
   struct zarufs_sb_info     *zsb;
-  __le32                    *start;
-  __le32                    *cur;
+  void                      *start;
+  long                      cur;
   unsigned long             bg_start;
   unsigned long             color;
+  unsigned int              colors;
 
   zi = ZARUFS_I(inode);
   if (ind->bh) {
-    start = (__le32*) ind->bh->b_data;
+    start = ind->bh->b_data;
   } else {
     start = zi->i_data;
   }
 
   /* try to find previous block. */
-  for (cur = ind->p - 1; start <= cur; cur--) {
-    if (*cur) {
-      return (le32_to_cpu(*cur));
+  cur = ((char*) ind->p - (char*) start) >> (ind->wide ? 3 : 2);
+  while (0 <= --cur) {
+    unsigned long blk;
+
+    if ((blk = read_slot(start, ind->wide, cur))) {
+      return (blk);
     }
   }
 
@@ -711,65 +1181,114 @@ find_near(struct inode *inode, indirect *ind) {
   /* the same cylinder group. */
   zsb      = ZARUFS_SB(inode->i_sb);
   bg_start = zarufs_get_first_block_num(inode->i_sb, zi->i_block_group);
-  color    = (current->pid % 16) * (zsb->s_blocks_per_group / 16);
+  colors   = zsb->s_alloc_colors;
+  color    = (current->pid % colors) * (zsb->s_blocks_per_group / colors);
   return(bg_start + color);
 }
 
+/*
+ * under bigalloc, find a slot of the leaf mapping the same logical cluster
+ * as iblock and return the block of iblock in that physical cluster.
+ */
+static unsigned long
+find_cluster_sibling(struct inode *inode, indirect *leaf, sector_t iblock) {
+  struct zarufs_sb_info *zsi;
+  void                  *start;
+  long                  cur;
+  long                  first;
+  long                  nr;
+  long                  i;
+
+  zsi = ZARUFS_SB(inode->i_sb);
+  if (leaf->bh) {
+    start = leaf->bh->b_data;
+    nr    = zarufs_addr_per_block(inode->i_sb);
+  } else {
+    start = ZARUFS_I(inode)->i_data;
+    nr    = ZARUFS_NDIR_BLOCKS;
+  }
+
+  cur   = ((char*) leaf->p - (char*) start) >> (leaf->wide ? 3 : 2);
+  first = cur - (long) ZARUFS_CLUSTER_OFFSET(zsi, iblock);
+  for (i = max(first, 0L); (i < first + (long) zsi->s_cluster_ratio) && (i < nr); i++) {
+    unsigned long blk;
+
+    if (i == cur) {
+      continue;
+    }
+    blk = read_slot(start, leaf->wide, i);
+    if (blk && (blk != ZARUFS_COMPRESSED_BLKADDR)) {
+      return (blk - i + cur);
+    }
+  }
+  return (0);
+}
+
+/*
+ * allocate indirect_blks indirect blocks and the data blocks behind them.
+ * offset is the place of the first data block in its cluster.
+ */
 static int
 alloc_branch(struct inode *inode,
              int indirect_blks,
              int *blks,
              unsigned long goal,
+             unsigned long offset,
              int *offsets,
              indirect *branch) {
-  int blocksize;
-  int i;
-  int ind_num;
-  int err;
-
   struct buffer_head *bh;
-  int                num;
   unsigned long      new_blocks[4];
   unsigned long      count;
-
-  new_blocks[0] = zarufs_new_blocks(inode, goal, &count, &err);
-  if (err) {
-    return (err);
+  int                blocksize;
+  int                allocated;
+  int                num;
+  int                wide;
+  int                err;
+  int                i;
+  int                n;
+
+  blocksize = inode->i_sb->s_blocksize;
+  wide      = zarufs_has_64bit(inode->i_sb);
+
+  /* allocate metadata blocks, then data blocks. */
+  for (allocated = 0; allocated <= indirect_blks; allocated++) {
+    count = 1;
+    new_blocks[allocated] = zarufs_new_blocks(inode, goal, &count, &err);
+    if (err) {
+      goto failed;
+    }
+    goal = new_blocks[allocated] + count;
   }
 
-  num = count;
-  branch[0].key = cpu_to_le32(new_blocks[0]);
-  blocksize     = inode->i_sb->s_blocksize;
+  /* a data block keeps its offset in the logical cluster. */
+  new_blocks[indirect_blks] += offset;
+  num = min_t(unsigned long, count - offset, *blks);
 
-  /* allocate metadata blocsk and data blocks. */
-  for (ind_num = 1; ind_num < indirect_blks; ind_num++) {
-    new_blocks[ind_num] = zarufs_new_blocks(inode, goal, &count, &err);
-    if (err) {
-      err = -ENOMEM;
-      goto failed_new_blocks;
-    }
-    num++;
+  branch[0].key = new_blocks[0];
+  for (n = 1; n <= indirect_blks; n++) {
     /* get buffer head for parent block, zero it out and set the pointer */
     /* to the new one, then send parent to disc. */
-    bh = sb_getblk(inode->i_sb, new_blocks[ind_num - 1]);
+    bh = sb_getblk(inode->i_sb, new_blocks[n - 1]);
     if (unlikely(!bh)) {
       err = -ENOMEM;
-      goto failed;
+      goto failed_bh;
     }
-    branch[ind_num].bh = bh;
+    branch[n].bh = bh;
     lock_buffer(bh);
     memset(bh->b_data, 0, blocksize);
-    branch[ind_num].p   = (__le32*) bh->b_data + offsets[ind_num];
-    branch[ind_num].key = cpu_to_le32(new_blocks[ind_num]);
-    *branch[ind_num].p  = branch[ind_num].key;
-    if (ind_num == indirect_blks) {
-      unsigned long current_block;
-
-      current_block = new_blocks[ind_num];
+    if (wide) {
+      branch[n].p = (__le64*) bh->b_data + offsets[n];
+    } else {
+      branch[n].p = (__le32*) bh->b_data + offsets[n];
+    }
+    branch[n].wide = wide;
+    branch[n].key  = new_blocks[n];
+    write_slot(branch[n].p, wide, 0, branch[n].key);
+    if (n == indirect_blks) {
       /* end of chain, update the last new metablock of the chain to */
       /* point to the new allocated data blocks numbers. */
       for (i = 1; i < num; i++) {
-        *(branch[ind_num].p + i) = cpu_to_le32(++current_block);
+        write_slot(branch[n].p, wide, i, new_blocks[n] + i);
       }
     }
 
@@ -784,21 +1303,17 @@ alloc_branch(struct inode *inode,
   }
 
   *blks = num;
-  return(err);
-
- failed_new_blocks:
-  ind_num--;
+  return (0);
 
- failed:
-  for (i = 1; i < ind_num; i++) {
+ failed_bh:
+  for (i = 1; i < n; i++) {
     bforget(branch[i].bh);
   }
-  for (i = 0; i < indirect_blks; i++) {
-    /* as for now, i don't implement free blocks. */
-    /* zarufs_free_blocks(inode, new_blocks[i]); */
+
+ failed:
+  for (i = 0; i < allocated; i++) {
+    zarufs_free_blocks(inode, new_blocks[i], 1);
   }
-  /* as for now, i don't implement free blocks. */
-  /* zarufs_free_blocks(inode, new_blocks[i], num); */
   return (err);
 }
 
@@ -807,18 +1322,22 @@ static void splice_branch(struct inode *inode,
                           indirect *where,
                           int num,
                           int blks) {
-  int           i;
-  unsigned long current_block;
-  
-  *where->p = where->key;
+  struct zarufs_inode_info *zi;
+  int                      i;
+  unsigned long            current_block;
+
+  zi = ZARUFS_I(inode);
+  write_seqlock(&zi->i_meta_lock);
+  write_slot(where->p, where->wide, 0, where->key);
   /* update the host buffer_head or inode to point to more just allocated */
   /* blocks of direct blocks. */
   if ((num == 0) && (1 < blks)) {
-    current_block = le32_to_cpu(where->key) + 1;
-    for (i = 0; i < blks; i++) {
-      *(where->p + i) = cpu_to_le32(current_block++);
+    current_block = where->key + 1;
+    for (i = 1; i < blks; i++) {
+      write_slot(where->p, where->wide, i, current_block++);
     }
   }
+  write_sequnlock(&zi->i_meta_lock);
 
   if (where->bh) {
     mark_buffer_dirty_inode(where->bh, inode);
@@ -830,12 +1349,117 @@ static void splice_branch(struct inode *inode,
 
 static inline int
 verify_indirect_chain(indirect *from, indirect *to) {
-  while ((from <= to) && (from->key == *from->p)) {
+  while ((from <= to) && (from->key == read_slot(from->p, from->wide, 0))) {
     from++;
   }
   return(to < from);
 }
 
+/*
+ * the iblocks mapped under the slot of the chain at 'level' on the path to
+ * iblock, which is what an allocation from that slot may write. the leaf
+ * level covers the count blocks mapped at once. under bigalloc, blocks of
+ * a cluster are placed together, so whole clusters are taken.
+ */
+static void
+get_alloc_range(struct inode *inode,
+                sector_t iblock,
+                int *offsets,
+                int depth,
+                int level,
+                unsigned long count,
+                unsigned long *start,
+                unsigned long *end) {
+  struct zarufs_sb_info *zsi;
+  u64                   first;
+  u64                   span;
+  u64                   last;
+  int                   k;
+
+  zsi   = ZARUFS_SB(inode->i_sb);
+  first = iblock;
+  span  = 1;
+  for (k = depth - 1; level < k; k--) {
+    first -= offsets[k] * span;
+    span  *= zarufs_addr_per_block(inode->i_sb);
+  }
+  last = max(first + span, (u64) iblock + count);
+
+  if (zsi->s_cluster_bits) {
+    first = round_down(first, (u64) zsi->s_cluster_ratio);
+    last  = round_up(last, (u64) zsi->s_cluster_ratio);
+  }
+  *start = first;
+  *end   = min(last, (u64) ULONG_MAX);
+}
+
+/* the number of unmapped slots of a leaf from the one to be mapped. */
+static int
+count_free_slots(indirect *leaf, int count) {
+  int i;
+
+  for (i = 1; i < count; i++) {
+    if (read_slot(leaf->p, leaf->wide, i)) {
+      break;
+    }
+  }
+  return (i);
+}
+
+/*
+ * hold iblocks [start, end) of the inode against allocating writers and
+ * truncate. ranges held are listed in i_ranges, and a range waits for the
+ * ones it overlaps.
+ */
+void
+zarufs_lock_block_range(struct inode *inode,
+                        struct zarufs_block_range *range,
+                        unsigned long start,
+                        unsigned long end) {
+  struct zarufs_inode_info *zi;
+  DEFINE_WAIT(wait);
+
+  zi           = ZARUFS_I(inode);
+  range->start = start;
+  range->end   = end;
+
+  spin_lock(&zi->i_range_lock);
+  while (block_range_conflict(zi, range)) {
+    prepare_to_wait(&zi->i_range_wait, &wait, TASK_UNINTERRUPTIBLE);
+    spin_unlock(&zi->i_range_lock);
+    schedule();
+    finish_wait(&zi->i_range_wait, &wait);
+    spin_lock(&zi->i_range_lock);
+  }
+  list_add(&range->list, &zi->i_ranges);
+  spin_unlock(&zi->i_range_lock);
+}
+
+void
+zarufs_unlock_block_range(struct inode *inode,
+                          struct zarufs_block_range *range) {
+  struct zarufs_inode_info *zi;
+
+  zi = ZARUFS_I(inode);
+  spin_lock(&zi->i_range_lock);
+  list_del(&range->list);
+  spin_unlock(&zi->i_range_lock);
+  wake_up_all(&zi->i_range_wait);
+}
+
+static int
+block_range_conflict(struct zarufs_inode_info *zi,
+                     struct zarufs_block_range *range) {
+  struct zarufs_block_range *held;
+
+  list_for_each_entry(held, &zi->i_ranges, list) {
+    if ((held->start < range->end) && (range->start < held->end)) {
+      return (1);
+    }
+  }
+  return (0);
+}
+
 static int
 __zarufs_write_inode(struct inode *inode, int do_sync) {
   struct zarufs_inode_info *zi;
@@ -903,6 +1527,17 @@ __zarufs_write_inode(struct inode *inode, int do_sync) {
   ext2_inode->i_flags       = cpu_to_le32(zi->i_flags);
   ext2_inode->i_faddr       = cpu_to_le32(zi->i_faddr);
   ext2_inode->i_file_acl    = cpu_to_le32(zi->i_file_acl);
+  if (zarufs_has_64bit(sb)) {
+    ext2_inode->osd2.linux2.l_i_file_acl_high
+      = cpu_to_le16((u64) zi->i_file_acl >> 32);
+  }
+
+  if (zi->i_extra_isize) {
+    struct zarufs_inode_extra *extra;
+
+    extra = (struct zarufs_inode_extra*)(ext2_inode + 1);
+    extra->i_extra_isize = cpu_to_le16(zi->i_extra_isize);
+  }
 
   ext2_inode->osd2.linux2.l_i_frag  = zi->i_frag_no;
   ext2_inode->osd2.linux2.l_i_fsize = zi->i_frag_size;
@@ -916,9 +1551,27 @@ __zarufs_write_inode(struct inode *inode, int do_sync) {
   if (S_ISCHR(inode->i_mode) || S_ISBLK(inode->i_mode)) {
     /* do not implement character/block device. */
   } else {
-    int n;
+    struct zarufs_inode_extra *extra;
+    int                       n;
+
+    extra = NULL;
+    if (zarufs_has_64bit(sb) &&
+        (ZARUFS_64BIT_EXTRA_ISIZE <= zi->i_extra_isize)) {
+      extra = (struct zarufs_inode_extra*)(ext2_inode + 1);
+    }
     for (n = 0; n < ZARUFS_NR_BLOCKS; n++) {
-      ext2_inode->i_block[n] = zi->i_data[n];
+      u64 blk;
+
+      blk = le64_to_cpu(zi->i_data[n]);
+      ext2_inode->i_block[n] = cpu_to_le32((u32) blk);
+      if (extra) {
+        extra->i_block_hi[n] = cpu_to_le16(blk >> 32);
+      } else if (blk >> 32) {
+        ZARUFS_ERROR("[ZARUFS] %s: no room for block number %llu",
+                     __func__, blk);
+        ZARUFS_ERROR("(ino=%lu)\n", (unsigned long) ino);
+        err = -EIO;
+      }
     }
   }
 
@@ -937,3 +1590,16 @@ __zarufs_write_inode(struct inode *inode, int do_sync) {
 
   return(err);
 }
+
+static int
+cmp_inode_block(const void *a, const void *b) {
+  unsigned long x;
+  unsigned long y;
+
+  x = *(const unsigned long*) a;
+  y = *(const unsigned long*) b;
+  if (x < y) {
+    return (-1);
+  }
+  return (y < x);
+}
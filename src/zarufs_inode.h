@@ -8,6 +8,17 @@ zarufs_get_block(struct inode *inode,
                  struct buffer_head *bh_result,
                  int create);
 
+struct ext2_inode*
+zarufs_get_ext2_inode(struct super_block *sb,
+                      unsigned long ino,
+                      struct buffer_head **bhp);
+
+/* inodes read ahead by zarufs_prefetch_inodes() at a time. */
+#define ZARUFS_PREFETCH_INODES (32)
+
+void
+zarufs_prefetch_inodes(struct super_block *sb, unsigned long *inos, int count);
+
 void
 zarufs_set_vfs_inode_flags(struct inode *inode);
 
@@ -20,4 +31,34 @@ zarufs_write_inode(struct inode *inode, struct writeback_control *wbc);
 void
 zarufs_set_zarufs_inode_flags(struct zarufs_inode_info *zi);
 
+int
+zarufs_get_block_ptr(struct inode *inode,
+                     unsigned long iblock,
+                     unsigned long *blk);
+
+int
+zarufs_set_block_ptr(struct inode *inode,
+                     unsigned long iblock,
+                     unsigned long blk);
+
+int
+zarufs_truncate_blocks(struct inode *inode, unsigned long from);
+
+/* iblocks [start, end) held by zarufs_lock_block_range(). */
+struct zarufs_block_range {
+  struct list_head list;
+  unsigned long    start;
+  unsigned long    end;
+};
+
+void
+zarufs_lock_block_range(struct inode *inode,
+                        struct zarufs_block_range *range,
+                        unsigned long start,
+                        unsigned long end);
+
+void
+zarufs_unlock_block_range(struct inode *inode,
+                          struct zarufs_block_range *range);
+
 #endif
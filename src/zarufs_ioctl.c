@@ -0,0 +1,135 @@
+/* zarufs_ioctl.c */
+#include <linux/fs.h>
+#include <linux/mount.h>
+#include <linux/capability.h>
+#include <linux/uaccess.h>
+
+#include "../include/zarufs.h"
+#include "zarufs_utils.h"
+#include "zarufs_inode.h"
+#include "zarufs_ioctl.h"
+#include "zarufs_dir.h"
+#include "zarufs_compress.h"
+
+static long
+zarufs_ioctl_setflags(struct file *filp, unsigned long arg);
+
+static long
+zarufs_ioctl_compact_dir(struct file *filp);
+
+long
+zarufs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+  struct inode             *inode;
+  struct zarufs_inode_info *zi;
+  unsigned int             flags;
+
+  inode = file_inode(filp);
+  zi    = ZARUFS_I(inode);
+
+  DBGPRINT("[ZARUFS] %s: ino=%lu, cmd=0x%x\n", __func__, inode->i_ino, cmd);
+  switch (cmd) {
+  case FS_IOC_GETFLAGS:
+    zarufs_set_zarufs_inode_flags(zi);
+    flags = zi->i_flags & EXT2_FL_USER_VISIBLE;
+    return (put_user(flags, (int __user*) arg));
+  case FS_IOC_SETFLAGS:
+    return (zarufs_ioctl_setflags(filp, arg));
+  case ZARUFS_IOC_COMPACT_DIR:
+    return (zarufs_ioctl_compact_dir(filp));
+  default:
+    return (-ENOTTY);
+  }
+}
+
+static long
+zarufs_ioctl_setflags(struct file *filp, unsigned long arg) {
+  struct inode             *inode;
+  struct zarufs_inode_info *zi;
+  unsigned int             flags;
+  unsigned int             old_flags;
+  int                      ret;
+
+  inode = file_inode(filp);
+  zi    = ZARUFS_I(inode);
+
+  if ((ret = mnt_want_write_file(filp))) {
+    return (ret);
+  }
+
+  if (!inode_owner_or_capable(inode)) {
+    ret = -EACCES;
+    goto out;
+  }
+
+  if (get_user(flags, (int __user*) arg)) {
+    ret = -EFAULT;
+    goto out;
+  }
+
+  flags = zarufs_mask_flags(inode->i_mode, flags);
+
+  mutex_lock(&inode->i_mutex);
+  old_flags = zi->i_flags;
+
+  /* the IMMUTABLE and APPEND_ONLY flags can only be changed by */
+  /* the relevant capability. */
+  if ((flags ^ old_flags) & (EXT2_APPEND_FL | EXT2_IMMUTABLE_FL)) {
+    if (!capable(CAP_LINUX_IMMUTABLE)) {
+      mutex_unlock(&inode->i_mutex);
+      ret = -EPERM;
+      goto out;
+    }
+  }
+
+  flags  = flags & EXT2_FL_USER_MODIFIABLE;
+  flags |= old_flags & ~EXT2_FL_USER_MODIFIABLE;
+  zi->i_flags = flags;
+  /* clusters written before are compressed at the next close. */
+  if ((flags & ~old_flags) & EXT2_COMPR_FL) {
+    zarufs_compress_mark_dirty(inode, 0, i_size_read(inode));
+  }
+
+  zarufs_set_vfs_inode_flags(inode);
+  inode->i_ctime = CURRENT_TIME_SEC;
+  mutex_unlock(&inode->i_mutex);
+
+  mark_inode_dirty(inode);
+  ret = 0;
+
+ out:
+  mnt_drop_write_file(filp);
+  return (ret);
+}
+
+static long
+zarufs_ioctl_compact_dir(struct file *filp) {
+  struct inode *inode;
+  int          ret;
+
+  inode = file_inode(filp);
+  if (!S_ISDIR(inode->i_mode)) {
+    return (-ENOTDIR);
+  }
+
+  if ((ret = mnt_want_write_file(filp))) {
+    return (ret);
+  }
+
+  if (!inode_owner_or_capable(inode)) {
+    ret = -EACCES;
+    goto out;
+  }
+
+  /* lookups and changes of the directory wait on i_mutex. */
+  mutex_lock(&inode->i_mutex);
+  if (IS_DEADDIR(inode)) {
+    ret = -ENOENT;
+  } else {
+    ret = zarufs_compact_dir(inode);
+  }
+  mutex_unlock(&inode->i_mutex);
+
+ out:
+  mnt_drop_write_file(filp);
+  return (ret);
+}
@@ -0,0 +1,7 @@
+#ifndef _ZARUFS_IOCTL_H_
+#define _ZARUFS_IOCTL_H_
+
+long
+zarufs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+
+#endif
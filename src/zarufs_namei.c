@@ -1,4 +1,5 @@
 #include <linux/pagemap.h>
+#include <linux/xattr.h>
 
 #include "../include/zarufs.h"
 #include "zarufs_utils.h"
@@ -7,6 +8,8 @@
 #include "zarufs_namei.h"
 #include "zarufs_ialloc.h"
 #include "zarufs_file.h"
+#include "zarufs_xattr.h"
+#include "zarufs_acl.h"
 
 static int
 zarufs_rmdir(struct inode *dir, struct dentry *dentry);
@@ -90,12 +93,6 @@ zarufs_set_attr(struct dentry *dentry, struct iattr *attr) {
   return (0);
 }
 
-static struct posix_acl*
-zarufs_get_acl(struct inode *inode, int flags) {
-  DBGPRINT("[ZARUFS] inode ops:get_acl!\n");
-  return (0);
-}
-
 static int
 zarufs_tmp_file(struct inode *inode, struct dentry *d, umode_t mode) {
   DBGPRINT("[ZARUFS] inode ops:tmp_file!\n");
@@ -128,18 +125,23 @@ zarufs_lookup(struct inode *dir, struct dentry *dentry, unsigned int flags) {
 }
 
 const struct inode_operations zarufs_dir_inode_operations = {
-  .create  = zarufs_create,
-  .lookup  = zarufs_lookup,
-  .link    = zarufs_link,
-  .unlink  = zarufs_unlink,
-  .symlink = zarufs_symlink,
-  .mkdir   = zarufs_mkdir,
-  .rmdir   = zarufs_rmdir,
-  .mknod   = zarufs_mknod,
-  .rename  = zarufs_rename,
-  .setattr = zarufs_set_attr,
-  .get_acl = zarufs_get_acl,
-  .tmpfile = zarufs_tmp_file,
+  .create      = zarufs_create,
+  .lookup      = zarufs_lookup,
+  .link        = zarufs_link,
+  .unlink      = zarufs_unlink,
+  .symlink     = zarufs_symlink,
+  .mkdir       = zarufs_mkdir,
+  .rmdir       = zarufs_rmdir,
+  .mknod       = zarufs_mknod,
+  .rename      = zarufs_rename,
+  .setattr     = zarufs_set_attr,
+  .setxattr    = generic_setxattr,
+  .getxattr    = generic_getxattr,
+  .listxattr   = zarufs_listxattr,
+  .removexattr = generic_removexattr,
+  .get_acl     = zarufs_get_acl,
+  .set_acl     = zarufs_set_acl,
+  .tmpfile     = zarufs_tmp_file,
 };
 
 
@@ -0,0 +1,266 @@
+/* zarufs_prefetch.c */
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/kthread.h>
+#include <linux/sort.h>
+#include <linux/vmalloc.h>
+
+#include "../include/zarufs.h"
+#include "zarufs_block.h"
+#include "zarufs_prefetch.h"
+#include "zarufs_utils.h"
+
+/*
+ * after mount, the bitmaps and inode tables of the busiest groups are read
+ * ahead by a thread of the lowest priority, so that the first requests do
+ * not wait on them one block at a time. groups are taken in the order of
+ * their used inodes, as the group summaries filled at mount tell.
+ * the reads are readahead, which the block layer may drop under load, and
+ * the thread pauses after each batch for twice the time the batch took.
+ */
+
+/* blocks read ahead at once. */
+#define ZARUFS_PREFETCH_BATCH     (64)
+/* the pause after a batch, by the time the batch took. */
+#define ZARUFS_PREFETCH_WAIT_MULT (2)
+/* no more than this part of memory is filled. */
+#define ZARUFS_PREFETCH_MEM_SHIFT (3)
+
+struct zarufs_hot_group {
+  __u32 used_inodes;
+  __u32 group;
+};
+
+struct zarufs_prefetch_batch {
+  struct buffer_head *bhs[ZARUFS_PREFETCH_BATCH];
+  int                nr;
+};
+
+static int
+prefetch_thread(void *data);
+
+static int
+cmp_hot_group(const void *a, const void *b);
+
+static unsigned long
+prefetch_group(struct super_block *sb,
+               unsigned long block_group,
+               struct zarufs_prefetch_batch *batch);
+
+static void
+queue_block(struct super_block *sb,
+            unsigned long block,
+            struct zarufs_prefetch_batch *batch);
+
+static void
+submit_batch(struct zarufs_prefetch_batch *batch);
+
+void
+zarufs_start_prefetch(struct super_block *sb) {
+  struct zarufs_sb_info *zsi;
+  struct task_struct    *task;
+
+  zsi = ZARUFS_SB(sb);
+  task = kthread_run(prefetch_thread, sb, "zarufs_prefetch/%s", sb->s_id);
+  if (IS_ERR(task)) {
+    ZARUFS_ERROR("[ZARUFS] %s: cannot start prefetching metadata (%ld)\n",
+                 __func__, PTR_ERR(task));
+    return;
+  }
+  zsi->s_prefetch_task = task;
+}
+
+void
+zarufs_stop_prefetch(struct super_block *sb) {
+  struct zarufs_sb_info *zsi;
+
+  zsi = ZARUFS_SB(sb);
+  if (zsi->s_prefetch_task) {
+    kthread_stop(zsi->s_prefetch_task);
+    zsi->s_prefetch_task = NULL;
+  }
+}
+
+static int
+prefetch_thread(void *data) {
+  struct super_block           *sb;
+  struct zarufs_sb_info        *zsi;
+  struct zarufs_hot_group      *hot;
+  struct zarufs_prefetch_batch batch;
+  __u32                        free_inodes;
+  unsigned long                nr_hot;
+  unsigned long                budget;
+  unsigned long                queued;
+  unsigned long                i;
+
+  sb  = (struct super_block*) data;
+  zsi = ZARUFS_SB(sb);
+  set_user_nice(current, MAX_NICE);
+
+  hot = vmalloc(zsi->s_groups_count * sizeof(struct zarufs_hot_group));
+  if (!hot) {
+    goto out;
+  }
+  nr_hot = 0;
+  for (i = 0; i < zsi->s_groups_count; i++) {
+    free_inodes = zarufs_group_info(sb, i)->free_inodes;
+    if (free_inodes < zsi->s_inodes_per_group) {
+      hot[nr_hot].used_inodes = zsi->s_inodes_per_group - free_inodes;
+      hot[nr_hot].group       = i;
+      nr_hot++;
+    }
+  }
+  sort(hot, nr_hot, sizeof(struct zarufs_hot_group), cmp_hot_group, NULL);
+
+  budget = (totalram_pages >> ZARUFS_PREFETCH_MEM_SHIFT)
+    << (PAGE_CACHE_SHIFT - sb->s_blocksize_bits);
+  batch.nr = 0;
+  for (i = 0; (i < nr_hot) && !kthread_should_stop(); i++) {
+    queued = prefetch_group(sb, hot[i].group, &batch);
+    if (budget <= queued) {
+      break;
+    }
+    budget -= queued;
+  }
+  submit_batch(&batch);
+  vfree(hot);
+
+ out:
+  /* the task is reaped by kthread_stop. */
+  while (!kthread_should_stop()) {
+    set_current_state(TASK_INTERRUPTIBLE);
+    if (!kthread_should_stop()) {
+      schedule();
+    }
+    __set_current_state(TASK_RUNNING);
+  }
+  return (0);
+}
+
+/* the group of the most used inodes first. */
+static int
+cmp_hot_group(const void *a, const void *b) {
+  const struct zarufs_hot_group *ga;
+  const struct zarufs_hot_group *gb;
+
+  ga = (const struct zarufs_hot_group*) a;
+  gb = (const struct zarufs_hot_group*) b;
+  if (ga->used_inodes != gb->used_inodes) {
+    return ((ga->used_inodes < gb->used_inodes) ? 1 : -1);
+  }
+  return ((ga->group < gb->group) ? -1 : (ga->group > gb->group));
+}
+
+/*
+ * an uninitialized bitmap or inode table is never read, and a cached copy
+ * of it from disk would be taken for the real one. under gdt_csum, only
+ * the inode table below the itable_unused watermark is read, which lazy
+ * zeroing does not touch. returns the number of blocks queued.
+ */
+static unsigned long
+prefetch_group(struct super_block *sb,
+               unsigned long block_group,
+               struct zarufs_prefetch_batch *batch) {
+  struct zarufs_sb_info  *zsi;
+  struct ext2_group_desc *gdesc;
+  struct buffer_head     *gdesc_bh;
+  unsigned long          block_bitmap;
+  unsigned long          inode_bitmap;
+  unsigned long          table;
+  unsigned long          table_blks;
+  unsigned long          queued;
+  unsigned long          i;
+
+  zsi = ZARUFS_SB(sb);
+  if (!(gdesc = zarufs_get_group_descriptor(sb, block_group, &gdesc_bh))) {
+    return (0);
+  }
+  if (!zarufs_valid_group_desc(sb, block_group, gdesc)) {
+    brelse(gdesc_bh);
+    return (0);
+  }
+
+  block_bitmap = zarufs_block_bitmap(sb, gdesc);
+  inode_bitmap = zarufs_inode_bitmap(sb, gdesc);
+  table        = zarufs_inode_table(sb, gdesc);
+  table_blks   = zsi->s_itb_per_group;
+  if (zarufs_has_gdt_csum(sb)) {
+    if (gdesc->bg_flags & cpu_to_le16(EXT2_BG_BLOCK_UNINIT)) {
+      block_bitmap = 0;
+    }
+    if (gdesc->bg_flags & cpu_to_le16(EXT2_BG_INODE_UNINIT)) {
+      inode_bitmap = 0;
+      table_blks   = 0;
+    } else {
+      table_blks = DIV_ROUND_UP(zsi->s_inodes_per_group
+                                - zarufs_itable_unused(sb, gdesc),
+                                zsi->s_inodes_per_block);
+    }
+  }
+  brelse(gdesc_bh);
+
+  queued = 0;
+  if (block_bitmap) {
+    queue_block(sb, block_bitmap, batch);
+    queued++;
+  }
+  if (inode_bitmap) {
+    queue_block(sb, inode_bitmap, batch);
+    queued++;
+  }
+  for (i = 0; (i < table_blks) && !kthread_should_stop(); i++) {
+    queue_block(sb, table + i, batch);
+    queued++;
+  }
+  return (queued);
+}
+
+static void
+queue_block(struct super_block *sb,
+            unsigned long block,
+            struct zarufs_prefetch_batch *batch) {
+  struct buffer_head *bh;
+
+  if (!(bh = sb_getblk(sb, block))) {
+    return;
+  }
+  if (buffer_uptodate(bh)) {
+    brelse(bh);
+    return;
+  }
+  batch->bhs[batch->nr++] = bh;
+  if (batch->nr == ZARUFS_PREFETCH_BATCH) {
+    submit_batch(batch);
+  }
+}
+
+/*
+ * the blocks of a batch go out in one plug, so that neighbours merge into
+ * large requests. a single batch is in flight at a time.
+ */
+static void
+submit_batch(struct zarufs_prefetch_batch *batch) {
+  struct blk_plug plug;
+  unsigned long   start;
+  int             i;
+
+  if (!batch->nr) {
+    return;
+  }
+  start = jiffies;
+  blk_start_plug(&plug);
+  ll_rw_block(READA, batch->nr, batch->bhs);
+  blk_finish_plug(&plug);
+  for (i = 0; i < batch->nr; i++) {
+    wait_on_buffer(batch->bhs[i]);
+    brelse(batch->bhs[i]);
+  }
+  batch->nr = 0;
+
+  if (!kthread_should_stop()) {
+    schedule_timeout_interruptible((jiffies - start)
+                                   * ZARUFS_PREFETCH_WAIT_MULT);
+  }
+}
@@ -0,0 +1,11 @@
+/* zarufs_prefetch.h */
+#ifndef _ZARUFS_PREFETCH_H_
+#define _ZARUFS_PREFETCH_H_
+
+void
+zarufs_start_prefetch(struct super_block *sb);
+
+void
+zarufs_stop_prefetch(struct super_block *sb);
+
+#endif
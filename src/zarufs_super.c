@@ -2,6 +2,11 @@
 #include <linux/fs.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/mbcache.h>
+#include <linux/statfs.h>
+#include <linux/workqueue.h>
+#include <linux/parser.h>
+#include <linux/seq_file.h>
 
 #include "../include/zarufs.h"
 #include "zarufs_super.h"
@@ -9,10 +14,86 @@
 #include "zarufs_block.h"
 #include "zarufs_inode.h"
 #include "zarufs_ialloc.h"
+#include "zarufs_xattr.h"
+#include "zarufs_dir_cache.h"
+#include "zarufs_sysfs.h"
+#include "zarufs_prefetch.h"
+#include "zarufs_bitmap.h"
+#include "zarufs_compress.h"
 
 /* inode cache. */
 static struct kmem_cache *zarufs_inode_cachep;
 
+/* the free counters are checked against the descriptors this often. */
+#define ZARUFS_COUNTER_INTERVAL (60 * HZ)
+
+/* dirty metadata is written back this often by default. */
+#define ZARUFS_DEFAULT_COMMIT_INTERVAL (5 * HZ)
+
+/* blocks of a group are striped among writers by pid. */
+#define ZARUFS_DEFAULT_ALLOC_COLORS (16)
+
+/* bitmaps kept cached by default, 4MiB with 4KiB blocks. */
+#define ZARUFS_DEFAULT_BITMAP_CACHE (1024)
+
+/* what mount and remount options set, applied only if all are valid. */
+struct zarufs_mount_options {
+  unsigned long mount_opt;
+  kuid_t        resuid;
+  kgid_t        resgid;
+  unsigned long commit_interval;
+  unsigned int  dir_ra_pages;
+  unsigned int  inode_prefetch;
+  unsigned int  alloc_colors;
+  unsigned int  bitmap_cache_max;
+};
+
+enum {
+  Opt_bsd_df, Opt_minix_df, Opt_grpid, Opt_nogrpid,
+  Opt_resgid, Opt_resuid, Opt_err_cont, Opt_err_panic, Opt_err_ro,
+  Opt_nouid32, Opt_check, Opt_nocheck, Opt_debug, Opt_oldalloc, Opt_orlov,
+  Opt_nobh, Opt_user_xattr, Opt_nouser_xattr, Opt_acl, Opt_noacl,
+  Opt_reservation, Opt_noreservation, Opt_commit, Opt_dir_readahead,
+  Opt_inode_prefetch, Opt_alloc_colors, Opt_prefetch, Opt_noprefetch,
+  Opt_bitmap_cache, Opt_err,
+};
+
+static const match_table_t zarufs_tokens = {
+  {Opt_bsd_df,         "bsddf"},
+  {Opt_minix_df,       "minixdf"},
+  {Opt_grpid,          "grpid"},
+  {Opt_grpid,          "bsdgroups"},
+  {Opt_nogrpid,        "nogrpid"},
+  {Opt_nogrpid,        "sysvgroups"},
+  {Opt_resgid,         "resgid=%u"},
+  {Opt_resuid,         "resuid=%u"},
+  {Opt_err_cont,       "errors=continue"},
+  {Opt_err_panic,      "errors=panic"},
+  {Opt_err_ro,         "errors=remount-ro"},
+  {Opt_nouid32,        "nouid32"},
+  {Opt_check,          "check"},
+  {Opt_nocheck,        "check=none"},
+  {Opt_nocheck,        "nocheck"},
+  {Opt_debug,          "debug"},
+  {Opt_oldalloc,       "oldalloc"},
+  {Opt_orlov,          "orlov"},
+  {Opt_nobh,           "nobh"},
+  {Opt_user_xattr,     "user_xattr"},
+  {Opt_nouser_xattr,   "nouser_xattr"},
+  {Opt_acl,            "acl"},
+  {Opt_noacl,          "noacl"},
+  {Opt_reservation,    "reservation"},
+  {Opt_noreservation,  "noreservation"},
+  {Opt_commit,         "commit=%u"},
+  {Opt_dir_readahead,  "dir_readahead=%u"},
+  {Opt_inode_prefetch, "inode_prefetch=%u"},
+  {Opt_alloc_colors,   "alloc_colors=%u"},
+  {Opt_prefetch,       "prefetch"},
+  {Opt_noprefetch,     "noprefetch"},
+  {Opt_bitmap_cache,   "bitmap_cache=%u"},
+  {Opt_err,            NULL},
+};
+
 static int zarufs_fill_super_block(struct super_block *sb,
                                    void *data,
                                    int silent);
@@ -25,25 +106,55 @@ zarufs_destroy_inode(struct inode *inode);
 static void
 zarufs_put_super_block(struct super_block *sb);
 
+static void
+zarufs_init_inode_once(void *object);
+
 static unsigned long
-zarufs_get_descriptor_location(struct super_block *sb,
-                               unsigned long logic_sb_block,
-                               int num_bg);
+zarufs_count_overhead(struct super_block *sb);
 
 static void
-zarufs_init_inode_once(void *object);
+zarufs_reconcile_counters(struct work_struct *work);
+
+static void
+reconcile_counter(struct percpu_counter *counter, s64 sum, s64 *drift);
+
+static void
+zarufs_update_super(struct super_block *sb);
+
+static int
+zarufs_flush_metadata(struct super_block *sb, int wait);
+
+static void
+zarufs_flush_work(struct work_struct *work);
+
+static void
+get_mount_options(struct zarufs_sb_info *zsi,
+                  struct zarufs_mount_options *opts);
+
+static void
+set_mount_options(struct super_block *sb,
+                  struct zarufs_mount_options *opts);
+
+static int
+parse_options(char *options,
+              struct super_block *sb,
+              struct zarufs_mount_options *opts);
 
 static loff_t zarufs_max_file_size(struct super_block *sb) {
-  int    file_blocks;
-  int    nr_blocks;
+  u64    file_blocks;
+  u64    nr_blocks;
   loff_t max_size;
 
   file_blocks = ZARUFS_NDIR_BLOCKS;
-  nr_blocks = sb->s_blocksize / sizeof(u32);
+  nr_blocks = zarufs_addr_per_block(sb);
   file_blocks += nr_blocks;
   file_blocks += nr_blocks * nr_blocks;
   file_blocks += nr_blocks * nr_blocks * nr_blocks;
   max_size = file_blocks * sb->s_blocksize;
+  /* i_blocks counts 512-byte sectors in 32 bits. */
+  if ((((u64) 1 << 32) - 1) << 9 < max_size) {
+    max_size = (((u64) 1 << 32) - 1) << 9;
+  }
   if (MAX_LFS_FILESIZE < max_size) {
     max_size = MAX_LFS_FILESIZE;
   }
@@ -58,11 +169,20 @@ static struct inode
     return (NULL);
   }
   zi->vfs_inode.i_version = 1;
+  zi->i_dir_cache         = NULL;
+  zi->i_dir_gaps          = NULL;
+  zi->i_dir_nr_gaps       = 0;
+  zi->i_ino_rsv_next      = 0;
+  zi->i_ino_rsv_end       = 0;
+  zi->i_compr_start       = 0;
+  zi->i_compr_end         = 0;
   return (&zi->vfs_inode);
 }
 
 static void zarufs_destroy_inode(struct inode* inode) {
   struct zarufs_inode_info *zi = ZARUFS_I(inode);
+  zarufs_dir_cache_drop(inode);
+  kfree(zi->i_dir_gaps);
   kmem_cache_free(zarufs_inode_cachep, zi);
 }
 
@@ -73,31 +193,213 @@ static void zarufs_destroy_inode(struct inode* inode) {
 
 static int zarufs_sync_fs(struct super_block *sb, int wait) {
   DBGPRINT("[ZARUFS] sync_fs\n");
-  return 0;
+  return (zarufs_flush_metadata(sb, wait));
 }
 
+/*
+ * freeze_super() has synced the filesystem and blocked writers already.
+ * the flusher is stopped so that nothing reaches the device, and the
+ * super block is written last with the final counters.
+ */
 static int zarufs_freeze_fs(struct super_block *sb) {
   DBGPRINT("[ZARUFS] freeze_fs\n");
-  return 0;
+  cancel_delayed_work_sync(&ZARUFS_SB(sb)->s_flush_work);
+  return (zarufs_flush_metadata(sb, 1));
 }
 
 static int zarufs_unfreeze_fs(struct super_block *sb) {
+  struct zarufs_sb_info *zsi;
+
   DBGPRINT("[ZARUFS] unfreeze_fs\n");
+  zsi = ZARUFS_SB(sb);
+  if (!(sb->s_flags & MS_RDONLY)) {
+    queue_delayed_work(system_long_wq,
+                       &zsi->s_flush_work,
+                       zsi->s_commit_interval);
+  }
   return 0;
 }
 
+/*
+ * answered from the counters and the overhead taken at mount, without
+ * reading a descriptor. the sum of the percpu counters costs a walk of
+ * the cpus, but not of the groups.
+ */
 static int zarufs_statfs(struct dentry *dentry, struct kstatfs *buf) {
-  DBGPRINT("[ZARUFS] statfs\n");
+  struct super_block        *sb;
+  struct zarufs_sb_info     *zsi;
+  struct zarufs_super_block *zsb;
+  unsigned long             r_blocks;
+  u64                       fsid;
+
+  sb       = dentry->d_sb;
+  zsi      = ZARUFS_SB(sb);
+  zsb      = zsi->s_zsb;
+  r_blocks = zarufs_r_blocks_count(sb);
+
+  buf->f_type   = ZARUFS_SUPER_MAGIC;
+  buf->f_bsize  = sb->s_blocksize;
+  buf->f_blocks = zarufs_blocks_count(sb);
+  if (!(zsi->s_mount_opt & EXT2_MOUNT_MINIX_DF)) {
+    buf->f_blocks -= zsi->s_overhead;
+  }
+  buf->f_bfree  = ZARUFS_C2B(zsi, (unsigned long) percpu_counter_sum_positive(
+                                 &zsi->s_freeblocks_counter));
+  buf->f_bavail = (r_blocks < buf->f_bfree) ? buf->f_bfree - r_blocks : 0;
+  buf->f_files  = le32_to_cpu(zsb->s_inodes_count);
+  buf->f_ffree  = percpu_counter_sum_positive(&zsi->s_freeinodes_counter);
+  buf->f_namelen = ZARUFS_NAME_LEN;
+
+  fsid = le64_to_cpup((void*) zsb->s_uuid)
+    ^ le64_to_cpup((void*) zsb->s_uuid + sizeof(u64));
+  buf->f_fsid.val[0] = fsid & 0xFFFFFFFFUL;
+  buf->f_fsid.val[1] = (fsid >> 32) & 0xFFFFFFFFUL;
   return 0;
 }
 
-static int zarufs_remount_fs(struct super_block* sb, int *len, char *buf) {
+/*
+ * options not given keep their values. the flusher follows the change
+ * between read-only and read-write. prefetch acts only at mount.
+ */
+static int zarufs_remount_fs(struct super_block* sb, int *flags, char *data) {
+  struct zarufs_sb_info       *zsi;
+  struct zarufs_mount_options opts;
+
   DBGPRINT("[ZARUFS] remount_fs\n");
+  zsi = ZARUFS_SB(sb);
+  /* pending compression reaches the disk with the sync. */
+  flush_workqueue(zsi->s_compr_wq);
+  sync_filesystem(sb);
+
+  get_mount_options(zsi, &opts);
+  if (!parse_options(data, sb, &opts)) {
+    return (-EINVAL);
+  }
+  if (!(*flags & MS_RDONLY) && (sb->s_flags & MS_RDONLY) &&
+      (le32_to_cpu(zsi->s_zsb->s_feature_ro_compat)
+       & EXT2_FEATURE_RO_COMPAT_UNSUPPORTED)) {
+    ZARUFS_ERROR("[ZARUFS] Error: unsupported ro_compat features (%x)",
+                 le32_to_cpu(zsi->s_zsb->s_feature_ro_compat)
+                 & EXT2_FEATURE_RO_COMPAT_UNSUPPORTED);
+    ZARUFS_ERROR(", cannot remount read-write\n");
+    return (-EROFS);
+  }
+  set_mount_options(sb, &opts);
+  zarufs_trim_bitmap_cache(sb);
+
+  if ((*flags & MS_RDONLY) && !(sb->s_flags & MS_RDONLY)) {
+    zarufs_stop_lazyinit(sb);
+    cancel_delayed_work_sync(&zsi->s_flush_work);
+    zarufs_flush_metadata(sb, 1);
+  } else if (!(*flags & MS_RDONLY) && (sb->s_flags & MS_RDONLY)) {
+    queue_delayed_work(system_long_wq,
+                       &zsi->s_flush_work,
+                       zsi->s_commit_interval);
+    zarufs_start_lazyinit(sb);
+  }
   return 0;
 }
 
+/* only what differs from the defaults of the volume is shown. */
 static int zarufs_show_options(struct seq_file *seq_file, struct dentry *dentry) {
+  struct super_block        *sb;
+  struct zarufs_sb_info     *zsi;
+  struct zarufs_super_block *zsb;
+  unsigned long             def_mount_opts;
+  unsigned long             opt;
+
   DBGPRINT("[ZARUFS] show_options\n");
+  sb             = dentry->d_sb;
+  zsi            = ZARUFS_SB(sb);
+  zsb            = zsi->s_zsb;
+  def_mount_opts = le32_to_cpu(zsb->s_default_mount_opts);
+  opt            = zsi->s_mount_opt;
+
+  if (opt & EXT2_MOUNT_MINIX_DF) {
+    seq_puts(seq_file, ",minixdf");
+  }
+  if ((opt & EXT2_MOUNT_GRPID) && !(def_mount_opts & EXT2_DEFM_BSDGROUPS)) {
+    seq_puts(seq_file, ",grpid");
+  }
+  if (!(opt & EXT2_MOUNT_GRPID) && (def_mount_opts & EXT2_DEFM_BSDGROUPS)) {
+    seq_puts(seq_file, ",nogrpid");
+  }
+  if (!uid_eq(zsi->s_resuid, make_kuid(&init_user_ns, EXT2_DEF_RESUID)) ||
+      (le16_to_cpu(zsb->s_def_resuid) != EXT2_DEF_RESUID)) {
+    seq_printf(seq_file, ",resuid=%u",
+               from_kuid_munged(&init_user_ns, zsi->s_resuid));
+  }
+  if (!gid_eq(zsi->s_resgid, make_kgid(&init_user_ns, EXT2_DEF_RESGID)) ||
+      (le16_to_cpu(zsb->s_def_resgid) != EXT2_DEF_RESGID)) {
+    seq_printf(seq_file, ",resgid=%u",
+               from_kgid_munged(&init_user_ns, zsi->s_resgid));
+  }
+  if (opt & EXT2_MOUNT_ERRORS_RO) {
+    if ((le16_to_cpu(zsb->s_errors) == EXT2_ERRORS_CONTINUE) ||
+        (le16_to_cpu(zsb->s_errors) == EXT2_ERRORS_PANIC)) {
+      seq_puts(seq_file, ",errors=remount-ro");
+    }
+  }
+  if ((opt & EXT2_MOUNT_ERRORS_CONT) &&
+      (le16_to_cpu(zsb->s_errors) != EXT2_ERRORS_CONTINUE)) {
+    seq_puts(seq_file, ",errors=continue");
+  }
+  if ((opt & EXT2_MOUNT_ERRORS_PANIC) &&
+      (le16_to_cpu(zsb->s_errors) != EXT2_ERRORS_PANIC)) {
+    seq_puts(seq_file, ",errors=panic");
+  }
+  if ((opt & EXT2_MOUNT_NO_UID32) && !(def_mount_opts & EXT2_DEFM_UID16)) {
+    seq_puts(seq_file, ",nouid32");
+  }
+  if ((opt & EXT2_MOUNT_DEBUG) && !(def_mount_opts & EXT2_DEFM_DEBUG)) {
+    seq_puts(seq_file, ",debug");
+  }
+  if (opt & EXT2_MOUNT_CHECK) {
+    seq_puts(seq_file, ",check");
+  }
+  if (opt & EXT2_MOUNT_OLDALLOC) {
+    seq_puts(seq_file, ",oldalloc");
+  }
+  if (opt & EXT2_MOUNT_NOBH) {
+    seq_puts(seq_file, ",nobh");
+  }
+  if ((opt & EXT2_MOUNT_XATTR_USER) &&
+      !(def_mount_opts & EXT2_DEFM_XATTR_USER)) {
+    seq_puts(seq_file, ",user_xattr");
+  }
+  if (!(opt & EXT2_MOUNT_XATTR_USER) &&
+      (def_mount_opts & EXT2_DEFM_XATTR_USER)) {
+    seq_puts(seq_file, ",nouser_xattr");
+  }
+  if ((opt & EXT2_MOUNT_POSIX_ACL) && !(def_mount_opts & EXT2_DEFM_ACL)) {
+    seq_puts(seq_file, ",acl");
+  }
+  if (!(opt & EXT2_MOUNT_POSIX_ACL) && (def_mount_opts & EXT2_DEFM_ACL)) {
+    seq_puts(seq_file, ",noacl");
+  }
+  if (opt & EXT2_MOUNT_RESERVATION) {
+    seq_puts(seq_file, ",reservation");
+  }
+  if (opt & EXT2_MOUNT_PREFETCH) {
+    seq_puts(seq_file, ",prefetch");
+  }
+
+  if (zsi->s_commit_interval != ZARUFS_DEFAULT_COMMIT_INTERVAL) {
+    seq_printf(seq_file, ",commit=%u",
+               jiffies_to_msecs(zsi->s_commit_interval) / MSEC_PER_SEC);
+  }
+  if (zsi->s_dir_ra_pages) {
+    seq_printf(seq_file, ",dir_readahead=%u", zsi->s_dir_ra_pages);
+  }
+  if (zsi->s_inode_prefetch != ZARUFS_PREFETCH_INODES) {
+    seq_printf(seq_file, ",inode_prefetch=%u", zsi->s_inode_prefetch);
+  }
+  if (zsi->s_alloc_colors != ZARUFS_DEFAULT_ALLOC_COLORS) {
+    seq_printf(seq_file, ",alloc_colors=%u", zsi->s_alloc_colors);
+  }
+  if (zsi->s_bitmap_cache_max != ZARUFS_DEFAULT_BITMAP_CACHE) {
+    seq_printf(seq_file, ",bitmap_cache=%u", zsi->s_bitmap_cache_max);
+  }
   return 0;
 }
 
@@ -135,12 +437,18 @@ static int zarufs_fill_super_block(struct super_block *sb,
   struct buffer_head        *bh;
   struct zarufs_super_block *zsb;
   struct zarufs_sb_info     *zsi;
+  struct zarufs_mount_options opts;
   struct inode              *root;
   int                       block_size;
   int                       ret = -EINVAL;
   int                       i;
   int                       err;
   unsigned long             sb_block = 1;
+  unsigned long             logic_sb_block;
+  unsigned long             offset;
+  unsigned long             free_blocks;
+  unsigned long             free_inodes;
+  unsigned long             ndirs;
 
   // allocate memory to zarufs_sb_info.
   zsi = kzalloc(sizeof(struct zarufs_sb_info), GFP_KERNEL);
@@ -150,6 +458,7 @@ static int zarufs_fill_super_block(struct super_block *sb,
     return ret;
   }
   sb->s_fs_info = (void*) zsi;
+  zsi->s_sb     = sb;
 
   /* allocate memory to spin locks for block group. */
   zsi->s_blockgroup_lock = kzalloc(sizeof(struct blockgroup_lock),
@@ -161,6 +470,8 @@ static int zarufs_fill_super_block(struct super_block *sb,
   }
 
   // set device's block size and size bits to super block.
+  /* the super block always lives at byte offset 1024, so look it up */
+  /* with the minimum block size first. */
   block_size = sb_min_blocksize(sb, BLOCK_SIZE);
   DBGPRINT("[ZARUFS] Fill super block. block_size=%d\n", block_size);
   DBGPRINT("[ZARUFS] default block_size=%d\n", BLOCK_SIZE);
@@ -170,34 +481,129 @@ static int zarufs_fill_super_block(struct super_block *sb,
     DBGPRINT("[ZARUFS] Error: unable to set block_size.\n");
     goto error_read_sb;
   }
-  
+
+  if (block_size != BLOCK_SIZE) {
+    logic_sb_block = (sb_block * BLOCK_SIZE) / block_size;
+    offset         = (sb_block * BLOCK_SIZE) % block_size;
+  } else {
+    logic_sb_block = sb_block;
+    offset         = 0;
+  }
+
   /* read super block. */
-  if (!(bh = sb_bread(sb, 1))) {
+  if (!(bh = sb_bread(sb, logic_sb_block))) {
     DBGPRINT("[ZARUFS] Error: failed to bread super block.\n");
     goto error_read_sb;
   }
 
-  zsb = (struct zarufs_super_block*)(bh->b_data);
+  zsb = (struct zarufs_super_block*)(bh->b_data + offset);
   /* check magic number. */
   sb->s_magic = le16_to_cpu(zsb->s_magic);
   if (sb->s_magic != ZARUFS_SUPER_MAGIC) {
     DBGPRINT("[ZARUFS] Error: magic of super block is %lu.\n", sb->s_magic);
-    goto error_read_sb;
+    goto error_mount;
   }
 
+  /* switch to the block size of the file system and re-read. */
+  if (ZARUFS_MAX_BLOCK_LOG_SIZE - ZARUFS_MIN_BLOCK_LOG_SIZE
+      < le32_to_cpu(zsb->s_log_block_size)) {
+    DBGPRINT("[ZARUFS] Error: bad block size (log=%u)\n",
+             le32_to_cpu(zsb->s_log_block_size));
+    goto error_mount;
+  }
+  block_size = BLOCK_SIZE << le32_to_cpu(zsb->s_log_block_size);
+  if (sb->s_blocksize != block_size) {
+    brelse(bh);
+    bh = NULL;
+
+    if (!sb_set_blocksize(sb, block_size)) {
+      ZARUFS_ERROR("[ZARUFS] Error: unsupported block size %d\n", block_size);
+      goto error_read_sb;
+    }
+
+    logic_sb_block = (sb_block * BLOCK_SIZE) / block_size;
+    offset         = (sb_block * BLOCK_SIZE) % block_size;
+    if (!(bh = sb_bread(sb, logic_sb_block))) {
+      ZARUFS_ERROR("[ZARUFS] Error: failed to re-read super block.\n");
+      goto error_read_sb;
+    }
+    zsb = (struct zarufs_super_block*)(bh->b_data + offset);
+    if (le16_to_cpu(zsb->s_magic) != ZARUFS_SUPER_MAGIC) {
+      ZARUFS_ERROR("[ZARUFS] Error: magic mismatch on re-read.\n");
+      goto error_mount;
+    }
+  }
+  DBGPRINT("[ZARUFS] block_size=%lu\n", sb->s_blocksize);
+
   /* check revision. */
   if (EXT2_GOOD_OLD_REV == le32_to_cpu(zsb->s_rev_level)) {
     DBGPRINT("[ZARUFS] Error: cannot mount old revision\n");
     goto error_mount;
   }
 
+  /* features unknown to us change the layout, or only its updates. */
+  if (le32_to_cpu(zsb->s_feature_incompat)
+      & EXT2_FEATURE_INCOMPAT_UNSUPPORTED) {
+    ZARUFS_ERROR("[ZARUFS] Error: unsupported incompat features (%x)\n",
+                 le32_to_cpu(zsb->s_feature_incompat)
+                 & EXT2_FEATURE_INCOMPAT_UNSUPPORTED);
+    goto error_mount;
+  }
+  if (!(sb->s_flags & MS_RDONLY) &&
+      (le32_to_cpu(zsb->s_feature_ro_compat)
+       & EXT2_FEATURE_RO_COMPAT_UNSUPPORTED)) {
+    ZARUFS_ERROR("[ZARUFS] Error: unsupported ro_compat features (%x)",
+                 le32_to_cpu(zsb->s_feature_ro_compat)
+                 & EXT2_FEATURE_RO_COMPAT_UNSUPPORTED);
+    ZARUFS_ERROR(", mount read-only\n");
+    goto error_mount;
+  }
+
   /* setup the super block information. */
   zsi->s_zsb = zsb;
   zsi->s_sbh = bh;
   zsi->s_sb_block    = sb_block;
-  zsi->s_mount_opt   = le32_to_cpu(zsb->s_default_mount_opts);
+  zsi->s_mount_opt   = 0;
   zsi->s_mount_state = le16_to_cpu(zsb->s_state);
 
+  /* translate default mount options into mount options. */
+  if (le32_to_cpu(zsb->s_default_mount_opts) & EXT2_DEFM_DEBUG) {
+    zsi->s_mount_opt |= EXT2_MOUNT_DEBUG;
+  }
+  if (le32_to_cpu(zsb->s_default_mount_opts) & EXT2_DEFM_BSDGROUPS) {
+    zsi->s_mount_opt |= EXT2_MOUNT_GRPID;
+  }
+  if (le32_to_cpu(zsb->s_default_mount_opts) & EXT2_DEFM_UID16) {
+    zsi->s_mount_opt |= EXT2_MOUNT_NO_UID32;
+  }
+  if (le32_to_cpu(zsb->s_default_mount_opts) & EXT2_DEFM_XATTR_USER) {
+    zsi->s_mount_opt |= EXT2_MOUNT_XATTR_USER;
+  }
+  if (le32_to_cpu(zsb->s_default_mount_opts) & EXT2_DEFM_ACL) {
+    zsi->s_mount_opt |= EXT2_MOUNT_POSIX_ACL;
+  }
+
+  /* directory index. */
+  for (i = 0; i < 4; i++) {
+    zsi->s_hash_seed[i] = le32_to_cpu((__force __le32) zsb->s_hash_seed[i]);
+  }
+  zsi->s_def_hash_version = zsb->s_def_hash_version;
+  if (ZARUFS_DX_HASH_TEA < zsi->s_def_hash_version) {
+    zsi->s_def_hash_version = ZARUFS_DX_HASH_HALF_MD4;
+  }
+  if (le32_to_cpu(zsb->s_flags) & EXT2_FLAGS_UNSIGNED_HASH) {
+    zsi->s_hash_unsigned = 3;
+  } else if (le32_to_cpu(zsb->s_flags) & EXT2_FLAGS_SIGNED_HASH) {
+    zsi->s_hash_unsigned = 0;
+  } else {
+    /* neither is recorded. follow the char of this machine. */
+#ifdef __CHAR_UNSIGNED__
+    zsi->s_hash_unsigned = 3;
+#else
+    zsi->s_hash_unsigned = 0;
+#endif
+  }
+
   if (zsi->s_mount_state != EXT2_VALID_FS) {
     DBGPRINT("[ZARUFS] Error: cannot mount invalid filesystems\n");
     goto error_mount;
@@ -205,10 +611,13 @@ static int zarufs_fill_super_block(struct super_block *sb,
 
   if (le16_to_cpu(zsb->s_errors) == EXT2_ERRORS_CONTINUE) {
     DBGPRINT("[ZARUFS] Error: CONTNUE\n");
+    zsi->s_mount_opt |= EXT2_MOUNT_ERRORS_CONT;
   } else if (le16_to_cpu(zsb->s_errors) == EXT2_ERRORS_PANIC) {
     DBGPRINT("[ZARUFS] Error: PANIC\n");
+    zsi->s_mount_opt |= EXT2_MOUNT_ERRORS_PANIC;
   } else {
     DBGPRINT("[ZARUFS] Error: READ ONLY\n");
+    zsi->s_mount_opt |= EXT2_MOUNT_ERRORS_RO;
   }
 
   if (le32_to_cpu(zsb->s_rev_level) != EXT2_DYNAMIC_REV) {
@@ -242,11 +651,98 @@ static int zarufs_fill_super_block(struct super_block *sb,
     goto error_mount;
   }
 
-  zsi->s_groups_count = ((le32_to_cpu(zsb->s_blocks_count)
+  /* a bit of block bitmap covers a cluster of 2^n blocks under bigalloc. */
+  if (zarufs_has_bigalloc(sb)) {
+    unsigned int log_cluster_size;
+
+    log_cluster_size = le32_to_cpu(zsb->s_log_frag_size);
+    if ((log_cluster_size < le32_to_cpu(zsb->s_log_block_size)) ||
+        ((ZARUFS_MAX_CLUSTER_LOG_SIZE - ZARUFS_MIN_BLOCK_LOG_SIZE)
+         < log_cluster_size)) {
+      DBGPRINT("[ZARUFS] Error: bad cluster size %u\n", log_cluster_size);
+      goto error_mount;
+    }
+    zsi->s_cluster_bits       = log_cluster_size
+      - le32_to_cpu(zsb->s_log_block_size);
+    zsi->s_clusters_per_group = le32_to_cpu(zsb->s_frags_per_group);
+    if (zsi->s_blocks_per_group
+        != (zsi->s_clusters_per_group << zsi->s_cluster_bits)) {
+      DBGPRINT("[ZARUFS] Error: #clusters per group (%lu) mismatch\n",
+               zsi->s_clusters_per_group);
+      goto error_mount;
+    }
+  } else {
+    zsi->s_cluster_bits       = 0;
+    zsi->s_clusters_per_group = zsi->s_blocks_per_group;
+  }
+  zsi->s_cluster_ratio = 1 << zsi->s_cluster_bits;
+  if ((zsi->s_clusters_per_group == 0) ||
+      (sb->s_blocksize * 8 < zsi->s_clusters_per_group)) {
+    DBGPRINT("[ZARUFS] Error: #clusters per group too big: %lu\n",
+             zsi->s_clusters_per_group);
+    goto error_mount;
+  }
+  if (sb->s_blocksize * 8 < zsi->s_inodes_per_group) {
+    DBGPRINT("[ZARUFS] Error: #inodes per group too big: %lu\n",
+             zsi->s_inodes_per_group);
+    goto error_mount;
+  }
+
+  /* 64bit volumes. */
+  if (zarufs_has_64bit(sb)) {
+    zsi->s_desc_size = le16_to_cpu(zsb->s_desc_size);
+    if ((zsi->s_desc_size < ZARUFS_MIN_DESC_SIZE_64BIT) ||
+        (ZARUFS_MAX_DESC_SIZE < zsi->s_desc_size) ||
+        !is_power_of_2(zsi->s_desc_size)) {
+      DBGPRINT("[ZARUFS] Error: unsupported descriptor size %lu\n",
+               zsi->s_desc_size);
+      goto error_mount;
+    }
+    /* high bits of i_block[] are kept in the large inode. */
+    if (zsi->s_inode_size
+        < EXT2_GOOD_OLD_INODE_SIZE + ZARUFS_64BIT_EXTRA_ISIZE) {
+      DBGPRINT("[ZARUFS] Error: 64bit needs inodes of %lu bytes\n",
+               (unsigned long) (EXT2_GOOD_OLD_INODE_SIZE
+                                + ZARUFS_64BIT_EXTRA_ISIZE));
+      goto error_mount;
+    }
+    /* block numbers are held in unsigned long and sector_t. */
+    if ((le32_to_cpu(zsb->s_blocks_count_hi) && (sizeof(long) < 8)) ||
+        ((u64) zarufs_blocks_count(sb)
+         > ((u64) (sector_t) ~0ULL >> (sb->s_blocksize_bits - 9)))) {
+      DBGPRINT("[ZARUFS] Error: too large to mount on this system\n");
+      goto error_mount;
+    }
+    /* the marker of a compressed cluster is a valid 48bit block. */
+    if (le32_to_cpu(zsb->s_feature_incompat)
+        & EXT2_FEATURE_INCOMPAT_COMPRESSION) {
+      DBGPRINT("[ZARUFS] Error: cannot mount compressed 64bit volumes\n");
+      goto error_mount;
+    }
+  } else {
+    zsi->s_desc_size = EXT2_MIN_DESC_SIZE;
+  }
+
+  /* a compressed cluster must hold at least one block. */
+  if ((le32_to_cpu(zsb->s_feature_incompat)
+       & EXT2_FEATURE_INCOMPAT_COMPRESSION) &&
+      (ZARUFS_CLUSTER_BITS < sb->s_blocksize_bits)) {
+    DBGPRINT("[ZARUFS] Error: cannot mount compressed volumes of %lu blocks\n",
+             sb->s_blocksize);
+    goto error_mount;
+  }
+
+  zsi->s_groups_count = ((zarufs_blocks_count(sb)
                           - le32_to_cpu(zsb->s_first_data_block) - 1)
                          / zsi->s_blocks_per_group) + 1;
-  zsi->s_desc_per_block = sb->s_blocksize / sizeof(struct ext2_group_desc);
+  zsi->s_desc_per_block = sb->s_blocksize / zsi->s_desc_size;
   zsi->s_gdb_count = (zsi->s_groups_count + zsi->s_desc_per_block - 1) / zsi->s_desc_per_block;
+  if (zarufs_has_meta_bg(sb) &&
+      (zsi->s_gdb_count < le32_to_cpu(zsb->s_first_meta_bg))) {
+    ZARUFS_ERROR("[ZARUFS] Error: first meta block group too large: %u\n",
+                 le32_to_cpu(zsb->s_first_meta_bg));
+    goto error_mount;
+  }
 
   /* fragment disc information cache. */
   zsi->s_frag_size = 1024 << le32_to_cpu(zsb->s_log_frag_size);
@@ -255,65 +751,50 @@ static int zarufs_fill_super_block(struct super_block *sb,
     goto error_mount;
   }
 
-  zsi->s_frags_per_block = sb->s_blocksize / zsi->s_frag_size;
+  /* a cluster is never smaller than a block. */
+  zsi->s_frags_per_block = (sb->s_blocksize < zsi->s_frag_size) ?
+    1 : sb->s_blocksize / zsi->s_frag_size;
   zsi->s_frags_per_group = le32_to_cpu(zsb->s_frags_per_group);
 
   /* default disc information cache. */
   zsi->s_resuid = make_kuid(&init_user_ns, le16_to_cpu(zsb->s_def_resuid));
   zsi->s_resgid = make_kgid(&init_user_ns, le16_to_cpu(zsb->s_def_resgid));
 
-  /* read block group descriptor table. */
-  zsi->s_group_desc = kmalloc(zsi->s_gdb_count * sizeof(struct buffer_head*), GFP_KERNEL);
-  if (!zsi->s_group_desc) {
-    ZARUFS_ERROR("[ZARUFS] Error: alloc memery for group desc is failed.\n");
+  /* tunables, which mount options and sysfs may change. */
+  zsi->s_commit_interval = ZARUFS_DEFAULT_COMMIT_INTERVAL;
+  zsi->s_dir_ra_pages    = 0;
+  zsi->s_inode_prefetch  = ZARUFS_PREFETCH_INODES;
+  zsi->s_alloc_colors    = ZARUFS_DEFAULT_ALLOC_COLORS;
+  zsi->s_bitmap_cache_max = ZARUFS_DEFAULT_BITMAP_CACHE;
+
+  get_mount_options(zsi, &opts);
+  if (!parse_options((char*) data, sb, &opts)) {
     goto error_mount;
   }
-  for (i = 0; i < zsi->s_gdb_count; i++) {
-    unsigned long block;
-    block = zarufs_get_descriptor_location(sb, sb_block, i);
-    if (!(zsi->s_group_desc[i] = sb_bread(sb, block))) {
-      ZARUFS_ERROR("[ZARUFS] Error: cannot read block group descriptor[group=%i]\n", i);
-      goto error_mount_phase2;
-    }
-  }
+  set_mount_options(sb, &opts);
 
-  /* sanity check for group descriptors. */
-  for (i = 0; i < zsi->s_groups_count; i++) {
-    struct ext2_group_desc *gdesc;
-    unsigned long first_block;
-    unsigned long last_block;
-    unsigned long ar_block;
-    DBGPRINT("[ZARUFS] Block count %d.\n", i);
-    if (!(gdesc = zarufs_get_group_descriptor(sb, i))) {
-      goto error_mount_phase2;
-    }
-
-    first_block = zarufs_get_first_block_num(sb, i);
-    if (i == (zsi->s_groups_count - 1)) {
-      last_block = le32_to_cpu(zsb->s_blocks_count) - 1;
-    } else {
-      last_block = first_block + (zsb->s_blocks_per_group - 1);
-    }
-    DBGPRINT("[ZARUFS] first: %lu, last = %lu\n", first_block, last_block);
-    ar_block = le32_to_cpu(gdesc->bg_block_bitmap);
-    if ((ar_block < first_block) || (last_block < ar_block)) {
-      ZARUFS_ERROR("[ZARUFS] Error: block num of block bitmap is");
-      ZARUFS_ERROR(" insanity [ group=%d, first=%lu, block=%lu, last=%lu ]\n", i, first_block, ar_block, last_block);
-      goto error_mount_phase2;
-    }
-
-    ar_block = le32_to_cpu(gdesc->bg_inode_table);
-    if ((ar_block < first_block) || (last_block < ar_block)) {
-      ZARUFS_ERROR("[ZARUFS] Error: block num of inode table is");
-      ZARUFS_ERROR(" insanity [ group=%d, first=%lu, block=%lu, last=%lu ]\n", i, first_block, ar_block, last_block);
-      goto error_mount_phase2;
-    }
+  /* read block group descriptor table, which is reclaimable later. */
+  if ((err = zarufs_init_gdesc_cache(sb))) {
+    ret = err;
+    goto error_mount;
+  }
+  if (zarufs_read_group_descriptors(sb)) {
+    goto error_mount_phase2;
   }
 
   /* initialize exclusive locks. */
   bgl_lock_init(zsi->s_blockgroup_lock);
+  if ((err = zarufs_init_group_info(sb, &free_blocks, &free_inodes, &ndirs))) {
+    ret = err;
+    goto error_mount_phase2;
+  }
+  if ((err = zarufs_init_bitmap_cache(sb))) {
+    zarufs_destroy_group_info(sb);
+    ret = err;
+    goto error_mount_phase2;
+  }
   err = percpu_counter_init(&zsi->s_freeblocks_counter,
-                            zarufs_count_free_blocks(sb),
+                            free_blocks,
                             GFP_KERNEL);
   if (err) {
     ZARUFS_ERROR("[ZARUFS] cannot allocate memory for percpu counter.");
@@ -322,7 +803,7 @@ static int zarufs_fill_super_block(struct super_block *sb,
   }
 
   err = percpu_counter_init(&zsi->s_freeinodes_counter,
-                            zarufs_count_free_blocks(sb),
+                            free_inodes,
                             GFP_KERNEL);
   if (err) {
     ZARUFS_ERROR("[ZARUFS] cannot allocate memory for percpu counter.");
@@ -331,17 +812,33 @@ static int zarufs_fill_super_block(struct super_block *sb,
   }
 
   err = percpu_counter_init(&zsi->s_dirs_counter,
-                            zarufs_count_free_blocks(sb),
+                            ndirs,
                             GFP_KERNEL);
   if (err) {
     ZARUFS_ERROR("[ZARUFS] cannot allocate memory for percpu counter.");
     ZARUFS_ERROR("[s_dirs_counter]\n");
     goto error_mount_phase3;
   }
+  zsi->s_overhead = zarufs_count_overhead(sb);
+  INIT_DELAYED_WORK(&zsi->s_counter_work, zarufs_reconcile_counters);
+  INIT_DELAYED_WORK(&zsi->s_flush_work, zarufs_flush_work);
+  init_rwsem(&zsi->s_itable_sem);
+  zsi->s_compr_wq = alloc_workqueue("zarufs_compr/%s", WQ_UNBOUND, 0,
+                                    sb->s_id);
+  if (!zsi->s_compr_wq) {
+    ZARUFS_ERROR("[ZARUFS] cannot allocate compression workqueue.\n");
+    ret = -ENOMEM;
+    goto error_mount_phase3;
+  }
 
+  if ((err = zarufs_register_sysfs(sb))) {
+    ret = err;
+    goto error_mount_phase3;
+  }
 
   // setup vfs super block.
   sb->s_op = &zarufs_super_ops;
+  sb->s_xattr = zarufs_xattr_handlers;
   sb->s_maxbytes = zarufs_max_file_size(sb);
   sb->s_max_links = ZARUFS_LINK_MAX;
 
@@ -350,7 +847,7 @@ static int zarufs_fill_super_block(struct super_block *sb,
   if (IS_ERR(root)) {
     DBGPRINT("[ZARUFS] Error: failed to get root inode.\n");
     ret = PTR_ERR(root);
-    goto error_mount_phase3;
+    goto error_mount_phase4;
   }
 
   /* unlock_new_inode(root); */
@@ -365,24 +862,41 @@ static int zarufs_fill_super_block(struct super_block *sb,
   if (!sb->s_root) {
     DBGPRINT("[ZARUFS] Error: failed to make root.\n");
     ret = -ENOMEM;
-    goto error_mount_phase3;
+    goto error_mount_phase4;
   }
   le16_add_cpu(&zsb->s_mnt_count, 1);
+  queue_delayed_work(system_long_wq,
+                     &zsi->s_counter_work,
+                     ZARUFS_COUNTER_INTERVAL);
+  if (!(sb->s_flags & MS_RDONLY)) {
+    queue_delayed_work(system_long_wq,
+                       &zsi->s_flush_work,
+                       zsi->s_commit_interval);
+    zarufs_start_lazyinit(sb);
+  }
+  if (zsi->s_mount_opt & EXT2_MOUNT_PREFETCH) {
+    zarufs_start_prefetch(sb);
+  }
   DBGPRINT("[ZARUFS] zarufs is mounted!\n");
 
   /* debug_print_zarufs_sb(zsb); */
   return 0;
 
+ error_mount_phase4:
+  zarufs_unregister_sysfs(sb);
+
  error_mount_phase3:
+  if (zsi->s_compr_wq) {
+    destroy_workqueue(zsi->s_compr_wq);
+  }
   percpu_counter_destroy(&zsi->s_freeblocks_counter);
   percpu_counter_destroy(&zsi->s_freeinodes_counter);
   percpu_counter_destroy(&zsi->s_dirs_counter);
-  
+  zarufs_destroy_bitmap_cache(sb);
+  zarufs_destroy_group_info(sb);
+
  error_mount_phase2:
-  for (i = 0; i < zsi->s_gdb_count; i++) {
-    brelse(zsi->s_group_desc[i]);
-  }
-  kfree(zsi->s_group_desc);
+  zarufs_destroy_gdesc_cache(sb);
 
  error_mount:
   brelse(bh);
@@ -398,22 +912,33 @@ static int zarufs_fill_super_block(struct super_block *sb,
 
 static void zarufs_put_super_block(struct super_block *sb) {
   struct zarufs_sb_info *zsi;
-  int                   i;
 
   zsi = ZARUFS_SB(sb);
 
+  /* drop shared attribute blocks of this device from mbcache. */
+  mb_cache_shrink(sb->s_bdev);
+
+  /* write back the last metadata with the final counters. */
+  zarufs_stop_prefetch(sb);
+  zarufs_stop_lazyinit(sb);
+  cancel_delayed_work_sync(&zsi->s_flush_work);
+  if (!(sb->s_flags & MS_RDONLY)) {
+    zarufs_flush_metadata(sb, 1);
+  }
+
+  zarufs_unregister_sysfs(sb);
+  destroy_workqueue(zsi->s_compr_wq);
+
   /* destroy percpu counter. */
+  cancel_delayed_work_sync(&zsi->s_counter_work);
   percpu_counter_destroy(&zsi->s_freeblocks_counter);
   percpu_counter_destroy(&zsi->s_freeinodes_counter);
   percpu_counter_destroy(&zsi->s_dirs_counter);
 
-  /* release buffer cache for block group descripter. */
-  for (i = 0; i < zsi->s_gdb_count; i++) {
-    if (zsi->s_group_desc[i]) {
-      brelse(zsi->s_group_desc[i]);
-    }
-  }
-  kfree(zsi->s_group_desc);
+  /* release buffer cache for bitmaps and block group descripter. */
+  zarufs_destroy_bitmap_cache(sb);
+  zarufs_destroy_group_info(sb);
+  zarufs_destroy_gdesc_cache(sb);
 
   /* release buffer cache for super block. */
   brelse(zsi->s_sbh);
@@ -431,36 +956,157 @@ static void zarufs_put_super_block(struct super_block *sb) {
 /*   DBGPRINT("[ZARUFS] s_inodes_count = %d\n", value); */
 /*   return; */
 /* } */
+/* blocks of metadata, which statfs leaves out of f_blocks. */
 static unsigned long
-zarufs_get_descriptor_location(struct super_block *sb,
-                               unsigned long logic_sb_block,
-                               int num_bg) {
+zarufs_count_overhead(struct super_block *sb) {
   struct zarufs_sb_info *zsi;
-  unsigned long         bg;
-  unsigned long         first_meta_bg;
-  int                   has_super;
+  unsigned long         overhead;
+  int                   i;
 
-  zsi = ZARUFS_SB(sb);
-  has_super = 0;
-  first_meta_bg = le32_to_cpu(zsi->s_zsb->s_first_meta_bg);
-  if ((zsi->s_zsb->s_feature_compat &
-       cpu_to_le32(EXT2_FEATURE_INCOMPAT_META_BG)) ||
-      (num_bg < first_meta_bg)) {
-    return(logic_sb_block + 1);
-  }
-  bg = zsi->s_desc_per_block * num_bg;
-  if (zarufs_has_bg_super(sb, bg)) {
-    has_super = 1;
-  }
-  return(zarufs_get_first_block_num(sb, bg) + has_super);
+  zsi      = ZARUFS_SB(sb);
+  overhead = le32_to_cpu(zsi->s_zsb->s_first_data_block);
+  for (i = 0; i < zsi->s_groups_count; i++) {
+    overhead += zarufs_bg_meta_blocks(sb, i);
+  }
+  /* two bitmaps and the inode table in every group. */
+  overhead += zsi->s_groups_count * (2 + zsi->s_itb_per_group);
+  return (overhead);
+}
+
+/*
+ * the counters follow every allocation, and the descriptors are what is
+ * written. a drift between them is corrected here now and then, from the
+ * group summaries which mirror the descriptors. an allocation moves the
+ * counter and its group one after the other, so a pass may catch a gap
+ * which is about to close. only a gap found the same by two passes in a
+ * row is taken for a drift, and it is added, so that nothing counted
+ * meanwhile is lost.
+ */
+static void
+zarufs_reconcile_counters(struct work_struct *work) {
+  struct zarufs_sb_info *zsi;
+  struct super_block    *sb;
+  unsigned long         free_blocks;
+  unsigned long         free_inodes;
+  unsigned long         ndirs;
+
+  zsi = container_of(to_delayed_work(work),
+                     struct zarufs_sb_info,
+                     s_counter_work);
+  sb  = zsi->s_sb;
+
+  zarufs_count_groups(sb, &free_blocks, &free_inodes, &ndirs);
+  reconcile_counter(&zsi->s_freeblocks_counter, free_blocks,
+                    &zsi->s_blocks_drift);
+  reconcile_counter(&zsi->s_freeinodes_counter, free_inodes,
+                    &zsi->s_inodes_drift);
+  reconcile_counter(&zsi->s_dirs_counter, ndirs, &zsi->s_dirs_drift);
+
+  queue_delayed_work(system_long_wq,
+                     &zsi->s_counter_work,
+                     ZARUFS_COUNTER_INTERVAL);
+}
+
+/* *drift holds the gap the last pass found. */
+static void
+reconcile_counter(struct percpu_counter *counter, s64 sum, s64 *drift) {
+  s64 delta;
+
+  delta = sum - percpu_counter_sum(counter);
+  if (delta && (delta == *drift)) {
+    percpu_counter_add(counter, delta);
+    delta = 0;
+  }
+  *drift = delta;
+}
+
+/*
+ * bring the counters and the write time into the super block. an idle
+ * volume is left alone, so that the flusher does not write it for nothing.
+ */
+static void
+zarufs_update_super(struct super_block *sb) {
+  struct zarufs_sb_info     *zsi;
+  struct zarufs_super_block *zsb;
+  u64                       free_blocks;
+  u32                       free_inodes;
+
+  zsi         = ZARUFS_SB(sb);
+  zsb         = zsi->s_zsb;
+  free_blocks = ZARUFS_C2B(zsi, (u64) percpu_counter_sum_positive(
+                               &zsi->s_freeblocks_counter));
+  free_inodes = percpu_counter_sum_positive(&zsi->s_freeinodes_counter);
+
+  lock_buffer(zsi->s_sbh);
+  if ((le32_to_cpu(zsb->s_free_blocks_count) == (u32) free_blocks) &&
+      (!zarufs_has_64bit(sb) ||
+       (le32_to_cpu(zsb->s_free_blocks_count_hi) == (free_blocks >> 32))) &&
+      (le32_to_cpu(zsb->s_free_inodes_count) == free_inodes)) {
+    unlock_buffer(zsi->s_sbh);
+    return;
+  }
+  zsb->s_free_blocks_count = cpu_to_le32(free_blocks);
+  if (zarufs_has_64bit(sb)) {
+    zsb->s_free_blocks_count_hi = cpu_to_le32(free_blocks >> 32);
+  }
+  zsb->s_free_inodes_count = cpu_to_le32(free_inodes);
+  zsb->s_wtime             = cpu_to_le32(get_seconds());
+  unlock_buffer(zsi->s_sbh);
+  mark_buffer_dirty(zsi->s_sbh);
+}
+
+/*
+ * write back the super block, the descriptors, the bitmaps and the other
+ * metadata buffers dirtied since the last flush. they all live in the
+ * page cache of the device, so a single writeback of it submits them in
+ * block order, merged under one plug.
+ */
+static int
+zarufs_flush_metadata(struct super_block *sb, int wait) {
+  struct address_space *mapping;
+  struct blk_plug      plug;
+  int                  err;
+
+  mapping = sb->s_bdev->bd_inode->i_mapping;
+  zarufs_update_super(sb);
+
+  blk_start_plug(&plug);
+  err = filemap_fdatawrite(mapping);
+  blk_finish_plug(&plug);
+  if (!err && wait) {
+    err = filemap_fdatawait(mapping);
+  }
+  return (err);
+}
+
+static void
+zarufs_flush_work(struct work_struct *work) {
+  struct zarufs_sb_info *zsi;
+
+  zsi = container_of(to_delayed_work(work),
+                     struct zarufs_sb_info,
+                     s_flush_work);
+  zarufs_flush_metadata(zsi->s_sb, 0);
+  queue_delayed_work(system_long_wq,
+                     &zsi->s_flush_work,
+                     zsi->s_commit_interval);
 }
 
 static void
 zarufs_init_inode_once(void *object) {
   struct zarufs_inode_info *ei = (struct zarufs_inode_info*) object;
   /* initialize locks. */
-  rwlock_init(&ei->i_meta_lock);
-  mutex_init(&ei->truncate_mutex);
+  seqlock_init(&ei->i_meta_lock);
+  spin_lock_init(&ei->i_range_lock);
+  INIT_LIST_HEAD(&ei->i_ranges);
+  init_waitqueue_head(&ei->i_range_wait);
+  init_rwsem(&ei->xattr_sem);
+  mutex_init(&ei->i_compr_mutex);
+  spin_lock_init(&ei->i_compr_lock);
+  INIT_WORK(&ei->i_compr_work, zarufs_compress_work);
+  spin_lock_init(&ei->i_dir_cache_lock);
+  spin_lock_init(&ei->i_dir_gap_lock);
+  init_rwsem(&ei->i_dir_sem);
 
   /* initialize vfs inode. */
   inode_init_once(&ei->vfs_inode);
@@ -482,3 +1128,207 @@ int zarufs_init_inode_cache(void) {
 void zarufs_destroy_inode_cache(void) {
   kmem_cache_destroy(zarufs_inode_cachep);
 }
+
+static void
+get_mount_options(struct zarufs_sb_info *zsi,
+                  struct zarufs_mount_options *opts) {
+  opts->mount_opt       = zsi->s_mount_opt;
+  opts->resuid          = zsi->s_resuid;
+  opts->resgid          = zsi->s_resgid;
+  opts->commit_interval = zsi->s_commit_interval;
+  opts->dir_ra_pages    = zsi->s_dir_ra_pages;
+  opts->inode_prefetch  = zsi->s_inode_prefetch;
+  opts->alloc_colors    = zsi->s_alloc_colors;
+  opts->bitmap_cache_max = zsi->s_bitmap_cache_max;
+}
+
+static void
+set_mount_options(struct super_block *sb,
+                  struct zarufs_mount_options *opts) {
+  struct zarufs_sb_info *zsi;
+
+  zsi = ZARUFS_SB(sb);
+  zsi->s_mount_opt       = opts->mount_opt;
+  zsi->s_resuid          = opts->resuid;
+  zsi->s_resgid          = opts->resgid;
+  zsi->s_commit_interval = opts->commit_interval;
+  zsi->s_dir_ra_pages    = opts->dir_ra_pages;
+  zsi->s_inode_prefetch  = opts->inode_prefetch;
+  zsi->s_alloc_colors    = opts->alloc_colors;
+  zsi->s_bitmap_cache_max = opts->bitmap_cache_max;
+  sb->s_flags = (sb->s_flags & ~MS_POSIXACL) |
+    ((zsi->s_mount_opt & EXT2_MOUNT_POSIX_ACL) ? MS_POSIXACL : 0);
+}
+
+/*
+ * options are parsed into opts, which the caller applies only when all of
+ * them are valid. returns 1 on success, 0 on a bad option.
+ */
+static int
+parse_options(char *options,
+              struct super_block *sb,
+              struct zarufs_mount_options *opts) {
+  substring_t args[MAX_OPT_ARGS];
+  char        *p;
+  int         option;
+  kuid_t      uid;
+  kgid_t      gid;
+
+  if (!options) {
+    return (1);
+  }
+
+  while ((p = strsep(&options, ",")) != NULL) {
+    int token;
+    if (!*p) {
+      continue;
+    }
+
+    token = match_token(p, zarufs_tokens, args);
+    switch (token) {
+    case Opt_bsd_df:
+      opts->mount_opt &= ~EXT2_MOUNT_MINIX_DF;
+      break;
+    case Opt_minix_df:
+      opts->mount_opt |= EXT2_MOUNT_MINIX_DF;
+      break;
+    case Opt_grpid:
+      opts->mount_opt |= EXT2_MOUNT_GRPID;
+      break;
+    case Opt_nogrpid:
+      opts->mount_opt &= ~EXT2_MOUNT_GRPID;
+      break;
+    case Opt_resuid:
+      if (match_int(&args[0], &option)) {
+        return (0);
+      }
+      uid = make_kuid(current_user_ns(), option);
+      if (!uid_valid(uid)) {
+        ZARUFS_ERROR("[ZARUFS] %s: invalid uid value %d\n",
+                     __func__, option);
+        return (0);
+      }
+      opts->resuid = uid;
+      break;
+    case Opt_resgid:
+      if (match_int(&args[0], &option)) {
+        return (0);
+      }
+      gid = make_kgid(current_user_ns(), option);
+      if (!gid_valid(gid)) {
+        ZARUFS_ERROR("[ZARUFS] %s: invalid gid value %d\n",
+                     __func__, option);
+        return (0);
+      }
+      opts->resgid = gid;
+      break;
+    case Opt_err_panic:
+      opts->mount_opt &= ~(EXT2_MOUNT_ERRORS_CONT | EXT2_MOUNT_ERRORS_RO);
+      opts->mount_opt |= EXT2_MOUNT_ERRORS_PANIC;
+      break;
+    case Opt_err_ro:
+      opts->mount_opt &= ~(EXT2_MOUNT_ERRORS_CONT | EXT2_MOUNT_ERRORS_PANIC);
+      opts->mount_opt |= EXT2_MOUNT_ERRORS_RO;
+      break;
+    case Opt_err_cont:
+      opts->mount_opt &= ~(EXT2_MOUNT_ERRORS_RO | EXT2_MOUNT_ERRORS_PANIC);
+      opts->mount_opt |= EXT2_MOUNT_ERRORS_CONT;
+      break;
+    case Opt_nouid32:
+      opts->mount_opt |= EXT2_MOUNT_NO_UID32;
+      break;
+    case Opt_check:
+      opts->mount_opt |= EXT2_MOUNT_CHECK;
+      break;
+    case Opt_nocheck:
+      opts->mount_opt &= ~EXT2_MOUNT_CHECK;
+      break;
+    case Opt_debug:
+      opts->mount_opt |= EXT2_MOUNT_DEBUG;
+      break;
+    case Opt_oldalloc:
+      opts->mount_opt |= EXT2_MOUNT_OLDALLOC;
+      break;
+    case Opt_orlov:
+      opts->mount_opt &= ~EXT2_MOUNT_OLDALLOC;
+      break;
+    case Opt_nobh:
+      opts->mount_opt |= EXT2_MOUNT_NOBH;
+      break;
+    case Opt_user_xattr:
+      opts->mount_opt |= EXT2_MOUNT_XATTR_USER;
+      break;
+    case Opt_nouser_xattr:
+      opts->mount_opt &= ~EXT2_MOUNT_XATTR_USER;
+      break;
+    case Opt_acl:
+      opts->mount_opt |= EXT2_MOUNT_POSIX_ACL;
+      break;
+    case Opt_noacl:
+      opts->mount_opt &= ~EXT2_MOUNT_POSIX_ACL;
+      break;
+    case Opt_reservation:
+      opts->mount_opt |= EXT2_MOUNT_RESERVATION;
+      break;
+    case Opt_noreservation:
+      opts->mount_opt &= ~EXT2_MOUNT_RESERVATION;
+      break;
+    case Opt_prefetch:
+      opts->mount_opt |= EXT2_MOUNT_PREFETCH;
+      break;
+    case Opt_noprefetch:
+      opts->mount_opt &= ~EXT2_MOUNT_PREFETCH;
+      break;
+    case Opt_commit:
+      if (match_int(&args[0], &option) ||
+          (option < 1) || (ZARUFS_MAX_COMMIT_INTERVAL < option)) {
+        ZARUFS_ERROR("[ZARUFS] %s: commit must be 1..%d seconds\n",
+                     __func__, ZARUFS_MAX_COMMIT_INTERVAL);
+        return (0);
+      }
+      opts->commit_interval = msecs_to_jiffies(option * MSEC_PER_SEC);
+      break;
+    case Opt_dir_readahead:
+      if (match_int(&args[0], &option) ||
+          (option < 0) || (ZARUFS_MAX_DIR_RA_PAGES < option)) {
+        ZARUFS_ERROR("[ZARUFS] %s: dir_readahead must be 0..%d pages\n",
+                     __func__, ZARUFS_MAX_DIR_RA_PAGES);
+        return (0);
+      }
+      opts->dir_ra_pages = option;
+      break;
+    case Opt_inode_prefetch:
+      if (match_int(&args[0], &option) ||
+          (option < 0) || (ZARUFS_PREFETCH_INODES < option)) {
+        ZARUFS_ERROR("[ZARUFS] %s: inode_prefetch must be 0..%d\n",
+                     __func__, ZARUFS_PREFETCH_INODES);
+        return (0);
+      }
+      opts->inode_prefetch = option;
+      break;
+    case Opt_alloc_colors:
+      if (match_int(&args[0], &option) ||
+          (option < 1) || (ZARUFS_MAX_ALLOC_COLORS < option)) {
+        ZARUFS_ERROR("[ZARUFS] %s: alloc_colors must be 1..%d\n",
+                     __func__, ZARUFS_MAX_ALLOC_COLORS);
+        return (0);
+      }
+      opts->alloc_colors = option;
+      break;
+    case Opt_bitmap_cache:
+      if (match_int(&args[0], &option) ||
+          (option < 0) || (ZARUFS_MAX_BITMAP_CACHE < option)) {
+        ZARUFS_ERROR("[ZARUFS] %s: bitmap_cache must be 0..%d\n",
+                     __func__, ZARUFS_MAX_BITMAP_CACHE);
+        return (0);
+      }
+      opts->bitmap_cache_max = option;
+      break;
+    default:
+      ZARUFS_ERROR("[ZARUFS] %s: unrecognized mount option \"%s\" "
+                   "or missing value\n", __func__, p);
+      return (0);
+    }
+  }
+  return (1);
+}
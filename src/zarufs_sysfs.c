@@ -0,0 +1,264 @@
+/* zarufs_sysfs.c */
+#include <linux/fs.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include <linux/slab.h>
+
+#include "../include/zarufs.h"
+#include "zarufs_inode.h"
+#include "zarufs_sysfs.h"
+#include "zarufs_utils.h"
+#include "zarufs_bitmap.h"
+
+/*
+ * /sys/fs/zarufs/<dev>/ holds the tunables of a mounted volume which the
+ * hot paths read at each use, so that a change takes effect at once. the
+ * same values are taken by mount and remount options.
+ */
+
+struct zarufs_attr {
+  struct attribute attr;
+  ssize_t (*show)(struct zarufs_attr *a, struct zarufs_sb_info *zsi, char *buf);
+  ssize_t (*store)(struct zarufs_attr *a,
+                   struct zarufs_sb_info *zsi,
+                   const char *buf,
+                   size_t len);
+  size_t           offset; /* of an unsigned int in zarufs_sb_info. */
+  unsigned int     min;
+  unsigned int     max;
+};
+
+static ssize_t
+uint_show(struct zarufs_attr *a, struct zarufs_sb_info *zsi, char *buf);
+
+static ssize_t
+uint_store(struct zarufs_attr *a,
+           struct zarufs_sb_info *zsi,
+           const char *buf,
+           size_t len);
+
+static ssize_t
+commit_interval_show(struct zarufs_attr *a,
+                     struct zarufs_sb_info *zsi,
+                     char *buf);
+
+static ssize_t
+commit_interval_store(struct zarufs_attr *a,
+                      struct zarufs_sb_info *zsi,
+                      const char *buf,
+                      size_t len);
+
+static ssize_t
+bitmap_cache_store(struct zarufs_attr *a,
+                   struct zarufs_sb_info *zsi,
+                   const char *buf,
+                   size_t len);
+
+static ssize_t
+zarufs_attr_show(struct kobject *kobj, struct attribute *attr, char *buf);
+
+static ssize_t
+zarufs_attr_store(struct kobject *kobj,
+                  struct attribute *attr,
+                  const char *buf,
+                  size_t len);
+
+static void
+zarufs_sb_release(struct kobject *kobj);
+
+#define ZARUFS_UINT_ATTR(_name, _field, _min, _max)     \
+  static struct zarufs_attr zarufs_attr_##_name = {     \
+    .attr   = { .name = #_name, .mode = 0644 },         \
+    .show   = uint_show,                                \
+    .store  = uint_store,                               \
+    .offset = offsetof(struct zarufs_sb_info, _field),  \
+    .min    = (_min),                                   \
+    .max    = (_max),                                   \
+  }
+
+ZARUFS_UINT_ATTR(dir_readahead, s_dir_ra_pages, 0, ZARUFS_MAX_DIR_RA_PAGES);
+ZARUFS_UINT_ATTR(inode_prefetch, s_inode_prefetch, 0, ZARUFS_PREFETCH_INODES);
+ZARUFS_UINT_ATTR(alloc_colors, s_alloc_colors, 1, ZARUFS_MAX_ALLOC_COLORS);
+
+/* bitmaps beyond a lowered limit are given back at once. */
+static struct zarufs_attr zarufs_attr_bitmap_cache = {
+  .attr   = { .name = "bitmap_cache", .mode = 0644 },
+  .show   = uint_show,
+  .store  = bitmap_cache_store,
+  .offset = offsetof(struct zarufs_sb_info, s_bitmap_cache_max),
+  .min    = 0,
+  .max    = ZARUFS_MAX_BITMAP_CACHE,
+};
+
+/* in seconds, kept in jiffies. */
+static struct zarufs_attr zarufs_attr_commit_interval = {
+  .attr  = { .name = "commit_interval", .mode = 0644 },
+  .show  = commit_interval_show,
+  .store = commit_interval_store,
+  .min   = 1,
+  .max   = ZARUFS_MAX_COMMIT_INTERVAL,
+};
+
+static struct attribute *zarufs_attrs[] = {
+  &zarufs_attr_commit_interval.attr,
+  &zarufs_attr_dir_readahead.attr,
+  &zarufs_attr_inode_prefetch.attr,
+  &zarufs_attr_alloc_colors.attr,
+  &zarufs_attr_bitmap_cache.attr,
+  NULL,
+};
+
+static const struct sysfs_ops zarufs_attr_ops = {
+  .show  = zarufs_attr_show,
+  .store = zarufs_attr_store,
+};
+
+static struct kobj_type zarufs_sb_ktype = {
+  .default_attrs = zarufs_attrs,
+  .sysfs_ops     = &zarufs_attr_ops,
+  .release       = zarufs_sb_release,
+};
+
+static struct kset *zarufs_kset;
+
+int
+zarufs_register_sysfs(struct super_block *sb) {
+  struct zarufs_sb_info *zsi;
+  int                   err;
+
+  zsi = ZARUFS_SB(sb);
+  zsi->s_kobj.kset = zarufs_kset;
+  init_completion(&zsi->s_kobj_unregister);
+  err = kobject_init_and_add(&zsi->s_kobj, &zarufs_sb_ktype, NULL,
+                             "%s", sb->s_id);
+  if (err) {
+    ZARUFS_ERROR("[ZARUFS] %s: cannot add sysfs entry of %s\n",
+                 __func__, sb->s_id);
+    kobject_put(&zsi->s_kobj);
+    wait_for_completion(&zsi->s_kobj_unregister);
+  }
+  return (err);
+}
+
+/* the sb info outlives its kobject until the last reader has gone. */
+void
+zarufs_unregister_sysfs(struct super_block *sb) {
+  struct zarufs_sb_info *zsi;
+
+  zsi = ZARUFS_SB(sb);
+  kobject_del(&zsi->s_kobj);
+  kobject_put(&zsi->s_kobj);
+  wait_for_completion(&zsi->s_kobj_unregister);
+}
+
+int
+zarufs_init_sysfs(void) {
+  if (!(zarufs_kset = kset_create_and_add("zarufs", NULL, fs_kobj))) {
+    return (-ENOMEM);
+  }
+  return (0);
+}
+
+void
+zarufs_exit_sysfs(void) {
+  kset_unregister(zarufs_kset);
+}
+
+static ssize_t
+uint_show(struct zarufs_attr *a, struct zarufs_sb_info *zsi, char *buf) {
+  unsigned int *p;
+
+  p = (unsigned int*) ((char*) zsi + a->offset);
+  return (snprintf(buf, PAGE_SIZE, "%u\n", *p));
+}
+
+static ssize_t
+uint_store(struct zarufs_attr *a,
+           struct zarufs_sb_info *zsi,
+           const char *buf,
+           size_t len) {
+  unsigned int *p;
+  unsigned int val;
+  int          err;
+
+  if ((err = kstrtouint(skip_spaces(buf), 0, &val))) {
+    return (err);
+  }
+  if ((val < a->min) || (a->max < val)) {
+    return (-EINVAL);
+  }
+  p = (unsigned int*) ((char*) zsi + a->offset);
+  *p = val;
+  return (len);
+}
+
+static ssize_t
+commit_interval_show(struct zarufs_attr *a,
+                     struct zarufs_sb_info *zsi,
+                     char *buf) {
+  return (snprintf(buf, PAGE_SIZE, "%u\n",
+                   jiffies_to_msecs(zsi->s_commit_interval) / MSEC_PER_SEC));
+}
+
+/* the flusher picks up the new interval when it queues itself next. */
+static ssize_t
+commit_interval_store(struct zarufs_attr *a,
+                      struct zarufs_sb_info *zsi,
+                      const char *buf,
+                      size_t len) {
+  unsigned int val;
+  int          err;
+
+  if ((err = kstrtouint(skip_spaces(buf), 0, &val))) {
+    return (err);
+  }
+  if ((val < a->min) || (a->max < val)) {
+    return (-EINVAL);
+  }
+  zsi->s_commit_interval = msecs_to_jiffies(val * MSEC_PER_SEC);
+  return (len);
+}
+
+static ssize_t
+bitmap_cache_store(struct zarufs_attr *a,
+                   struct zarufs_sb_info *zsi,
+                   const char *buf,
+                   size_t len) {
+  ssize_t ret;
+
+  if (0 <= (ret = uint_store(a, zsi, buf, len))) {
+    zarufs_trim_bitmap_cache(zsi->s_sb);
+  }
+  return (ret);
+}
+
+static ssize_t
+zarufs_attr_show(struct kobject *kobj, struct attribute *attr, char *buf) {
+  struct zarufs_sb_info *zsi;
+  struct zarufs_attr    *a;
+
+  zsi = container_of(kobj, struct zarufs_sb_info, s_kobj);
+  a   = container_of(attr, struct zarufs_attr, attr);
+  return (a->show(a, zsi, buf));
+}
+
+static ssize_t
+zarufs_attr_store(struct kobject *kobj,
+                  struct attribute *attr,
+                  const char *buf,
+                  size_t len) {
+  struct zarufs_sb_info *zsi;
+  struct zarufs_attr    *a;
+
+  zsi = container_of(kobj, struct zarufs_sb_info, s_kobj);
+  a   = container_of(attr, struct zarufs_attr, attr);
+  return (a->store(a, zsi, buf, len));
+}
+
+static void
+zarufs_sb_release(struct kobject *kobj) {
+  struct zarufs_sb_info *zsi;
+
+  zsi = container_of(kobj, struct zarufs_sb_info, s_kobj);
+  complete(&zsi->s_kobj_unregister);
+}
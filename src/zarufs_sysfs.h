@@ -0,0 +1,14 @@
+/* zarufs_sysfs.h */
+#ifndef _ZARUFS_SYSFS_H_
+#define _ZARUFS_SYSFS_H_
+
+int
+zarufs_register_sysfs(struct super_block *sb);
+
+void
+zarufs_unregister_sysfs(struct super_block *sb);
+
+int  zarufs_init_sysfs(void);
+void zarufs_exit_sysfs(void);
+
+#endif
@@ -0,0 +1,1146 @@
+/* zarufs_xattr.c */
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <linux/mbcache.h>
+#include <linux/xattr.h>
+#include <linux/security.h>
+#include <linux/posix_acl_xattr.h>
+
+#include "../include/zarufs.h"
+#include "zarufs_utils.h"
+#include "zarufs_block.h"
+#include "zarufs_inode.h"
+#include "zarufs_xattr.h"
+
+/*
+ * attributes are looked up in the spare space of a large inode first,
+ * then in the external block pointed by i_file_acl. identical external
+ * blocks are shared between inodes with the help of mbcache.
+ */
+
+#define XATTR_HDR(bh)   ((struct zarufs_xattr_header*)((bh)->b_data))
+#define XATTR_FIRST(p)  ((struct zarufs_xattr_entry*)                   \
+                         ((struct zarufs_xattr_header*)(p) + 1))
+
+#define NAME_HASH_SHIFT  (5)
+#define VALUE_HASH_SHIFT (16)
+#define BLOCK_HASH_SHIFT (16)
+
+/* a region holding entries followed by values packed at its end. */
+struct xattr_region {
+  char                      *base; /* e_value_offs is relative to base. */
+  struct zarufs_xattr_entry *first;
+  char                      *end;
+};
+
+static struct mb_cache *zarufs_xattr_cache;
+
+static struct zarufs_xattr_entry*
+find_entry(struct xattr_region *r,
+           int name_index,
+           const char *name,
+           size_t name_len);
+
+static int
+set_entry(struct xattr_region *r,
+          int name_index,
+          const char *name,
+          size_t name_len,
+          const void *value,
+          size_t value_len);
+
+static int
+copy_value(struct xattr_region *r,
+           struct zarufs_xattr_entry *entry,
+           void *buffer,
+           size_t buffer_size);
+
+static int
+list_entries(struct dentry *dentry,
+             struct xattr_region *r,
+             char *buffer,
+             size_t *rest);
+
+static int
+ibody_region(struct inode *inode,
+             struct ext2_inode *raw,
+             struct xattr_region *r,
+             int create);
+
+static int
+ibody_set(struct inode *inode,
+          int name_index,
+          const char *name,
+          const void *value,
+          size_t value_len);
+
+static struct buffer_head*
+read_xattr_block(struct inode *inode);
+
+static int
+block_set(struct inode *inode,
+          int name_index,
+          const char *name,
+          const void *value,
+          size_t value_len);
+
+static void
+release_xattr_block(struct inode *inode, struct buffer_head *bh);
+
+static void
+hash_entry(char *base, struct zarufs_xattr_entry *entry);
+
+static void
+rehash_block(struct zarufs_xattr_header *header);
+
+static int
+cache_insert(struct buffer_head *bh);
+
+static struct buffer_head*
+cache_find(struct inode *inode, struct zarufs_xattr_header *header);
+
+static int
+cmp_blocks(struct zarufs_xattr_header *h1, struct zarufs_xattr_header *h2);
+
+static void
+set_ext_attr_feature(struct super_block *sb);
+
+static const struct xattr_handler*
+zarufs_xattr_handler(int name_index);
+
+/* -------------------------------------------------------------------------- */
+
+int
+zarufs_xattr_get(struct inode *inode,
+                 int name_index,
+                 const char *name,
+                 void *buffer,
+                 size_t buffer_size) {
+  struct zarufs_inode_info  *zi;
+  struct zarufs_xattr_entry *entry;
+  struct xattr_region       r;
+  struct ext2_inode         *raw;
+  struct buffer_head        *bh;
+  size_t                    name_len;
+  int                       err;
+
+  if (!name) {
+    return (-EINVAL);
+  }
+  name_len = strlen(name);
+  if (255 < name_len) {
+    return (-ERANGE);
+  }
+
+  zi = ZARUFS_I(inode);
+  down_read(&zi->xattr_sem);
+
+  /* attributes in the inode body come from the cached inode table block. */
+  raw = zarufs_get_ext2_inode(inode->i_sb, inode->i_ino, &bh);
+  if (IS_ERR(raw)) {
+    err = PTR_ERR(raw);
+    goto out;
+  }
+  err = ibody_region(inode, raw, &r, 0);
+  if (!err) {
+    entry = find_entry(&r, name_index, name, name_len);
+    if (IS_ERR(entry)) {
+      err = PTR_ERR(entry);
+    } else if (entry) {
+      err = copy_value(&r, entry, buffer, buffer_size);
+    } else {
+      err = -ENODATA;
+    }
+  }
+  brelse(bh);
+  if (err != -ENODATA) {
+    goto out;
+  }
+
+  if (!zi->i_file_acl) {
+    goto out;
+  }
+  bh = read_xattr_block(inode);
+  if (IS_ERR(bh)) {
+    err = PTR_ERR(bh);
+    goto out;
+  }
+  r.base  = bh->b_data;
+  r.first = XATTR_FIRST(bh->b_data);
+  r.end   = bh->b_data + inode->i_sb->s_blocksize;
+  entry   = find_entry(&r, name_index, name, name_len);
+  if (IS_ERR(entry)) {
+    err = PTR_ERR(entry);
+  } else if (entry) {
+    err = copy_value(&r, entry, buffer, buffer_size);
+  }
+  brelse(bh);
+
+ out:
+  up_read(&zi->xattr_sem);
+  return (err);
+}
+
+ssize_t
+zarufs_listxattr(struct dentry *dentry, char *buffer, size_t buffer_size) {
+  struct inode             *inode;
+  struct zarufs_inode_info *zi;
+  struct xattr_region      r;
+  struct ext2_inode        *raw;
+  struct buffer_head       *bh;
+  size_t                   rest;
+  int                      err;
+
+  inode = dentry->d_inode;
+  zi    = ZARUFS_I(inode);
+  rest  = buffer_size;
+
+  down_read(&zi->xattr_sem);
+  raw = zarufs_get_ext2_inode(inode->i_sb, inode->i_ino, &bh);
+  if (IS_ERR(raw)) {
+    err = PTR_ERR(raw);
+    goto out;
+  }
+  err = ibody_region(inode, raw, &r, 0);
+  if (!err) {
+    err = list_entries(dentry, &r, buffer, &rest);
+  } else if (err == -ENODATA) {
+    err = 0;
+  }
+  brelse(bh);
+  if (err) {
+    goto out;
+  }
+
+  if (zi->i_file_acl) {
+    bh = read_xattr_block(inode);
+    if (IS_ERR(bh)) {
+      err = PTR_ERR(bh);
+      goto out;
+    }
+    r.base  = bh->b_data;
+    r.first = XATTR_FIRST(bh->b_data);
+    r.end   = bh->b_data + inode->i_sb->s_blocksize;
+    if (buffer) {
+      err = list_entries(dentry, &r, buffer + (buffer_size - rest), &rest);
+    } else {
+      err = list_entries(dentry, &r, NULL, &rest);
+    }
+    brelse(bh);
+  }
+
+ out:
+  up_read(&zi->xattr_sem);
+  if (err) {
+    return (err);
+  }
+  return (buffer_size - rest);
+}
+
+int
+zarufs_xattr_set(struct inode *inode,
+                 int name_index,
+                 const char *name,
+                 const void *value,
+                 size_t value_len,
+                 int flags) {
+  struct zarufs_inode_info  *zi;
+  struct zarufs_xattr_entry *entry;
+  struct xattr_region       r;
+  struct ext2_inode         *raw;
+  struct buffer_head        *bh;
+  size_t                    name_len;
+  int                       in_ibody;
+  int                       in_block;
+  int                       err;
+
+  if (!name) {
+    return (-EINVAL);
+  }
+  name_len = strlen(name);
+  if ((255 < name_len) || (inode->i_sb->s_blocksize < value_len)) {
+    return (-ERANGE);
+  }
+
+  zi = ZARUFS_I(inode);
+  down_write(&zi->xattr_sem);
+
+  /* find where the attribute lives now. */
+  in_ibody = 0;
+  in_block = 0;
+  raw = zarufs_get_ext2_inode(inode->i_sb, inode->i_ino, &bh);
+  if (IS_ERR(raw)) {
+    err = PTR_ERR(raw);
+    goto out;
+  }
+  if (!ibody_region(inode, raw, &r, 0)) {
+    entry    = find_entry(&r, name_index, name, name_len);
+    in_ibody = (entry && !IS_ERR(entry));
+  }
+  brelse(bh);
+
+  if (!in_ibody && zi->i_file_acl) {
+    bh = read_xattr_block(inode);
+    if (IS_ERR(bh)) {
+      err = PTR_ERR(bh);
+      goto out;
+    }
+    r.base   = bh->b_data;
+    r.first  = XATTR_FIRST(bh->b_data);
+    r.end    = bh->b_data + inode->i_sb->s_blocksize;
+    entry    = find_entry(&r, name_index, name, name_len);
+    in_block = (entry && !IS_ERR(entry));
+    brelse(bh);
+  }
+
+  if ((flags & XATTR_REPLACE) && !in_ibody && !in_block) {
+    err = -ENODATA;
+    goto out;
+  }
+  if ((flags & XATTR_CREATE) && (in_ibody || in_block)) {
+    err = -EEXIST;
+    goto out;
+  }
+
+  if (!value) {
+    /* remove. */
+    err = 0;
+    if (in_ibody) {
+      err = ibody_set(inode, name_index, name, NULL, 0);
+    } else if (in_block) {
+      err = block_set(inode, name_index, name, NULL, 0);
+    }
+    goto out;
+  }
+
+  /* prefer the inode body. spill to the external block if it is full. */
+  err = ibody_set(inode, name_index, name, value, value_len);
+  if (!err) {
+    if (in_block) {
+      err = block_set(inode, name_index, name, NULL, 0);
+    }
+  } else if (err == -ENOSPC) {
+    err = block_set(inode, name_index, name, value, value_len);
+    if (!err && in_ibody) {
+      err = ibody_set(inode, name_index, name, NULL, 0);
+    }
+  }
+
+ out:
+  up_write(&zi->xattr_sem);
+  return (err);
+}
+
+static struct zarufs_xattr_entry*
+find_entry(struct xattr_region *r,
+           int name_index,
+           const char *name,
+           size_t name_len) {
+  struct zarufs_xattr_entry *entry;
+
+  for (entry = r->first; ; entry = ZARUFS_XATTR_NEXT(entry)) {
+    if (r->end < (char*) entry + sizeof(__u32)) {
+      return (ERR_PTR(-EIO));
+    }
+    if (ZARUFS_XATTR_IS_LAST(entry)) {
+      return (NULL);
+    }
+    if (r->end < (char*) ZARUFS_XATTR_NEXT(entry)) {
+      return (ERR_PTR(-EIO));
+    }
+    if ((name_index == entry->e_name_index) &&
+        (name_len == entry->e_name_len) &&
+        !memcmp(name, entry->e_name, name_len)) {
+      return (entry);
+    }
+  }
+}
+
+static int
+copy_value(struct xattr_region *r,
+           struct zarufs_xattr_entry *entry,
+           void *buffer,
+           size_t buffer_size) {
+  size_t offs;
+  size_t size;
+
+  offs = le16_to_cpu(entry->e_value_offs);
+  size = le32_to_cpu(entry->e_value_size);
+  if (entry->e_value_block || (r->end < r->base + offs + size)) {
+    ZARUFS_ERROR("[ZARUFS] %s: corrupted attribute value.\n", __func__);
+    return (-EIO);
+  }
+
+  if (buffer) {
+    if (buffer_size < size) {
+      return (-ERANGE);
+    }
+    memcpy(buffer, r->base + offs, size);
+  }
+  return (size);
+}
+
+static int
+set_entry(struct xattr_region *r,
+          int name_index,
+          const char *name,
+          size_t name_len,
+          const void *value,
+          size_t value_len) {
+  struct zarufs_xattr_entry *here;
+  struct zarufs_xattr_entry *last;
+  struct zarufs_xattr_entry *entry;
+  size_t                    min_offs;
+  size_t                    used;
+  size_t                    free;
+
+  here     = NULL;
+  min_offs = r->end - r->base;
+  for (last = r->first; !ZARUFS_XATTR_IS_LAST(last); last = ZARUFS_XATTR_NEXT(last)) {
+    if (!last->e_value_block && last->e_value_size) {
+      size_t offs = le16_to_cpu(last->e_value_offs);
+      if (offs < min_offs) {
+        min_offs = offs;
+      }
+    }
+    if (!here &&
+        (name_index == last->e_name_index) &&
+        (name_len == last->e_name_len) &&
+        !memcmp(name, last->e_name, name_len)) {
+      here = last;
+    }
+  }
+
+  used = ((char*) last - r->base) + sizeof(__u32);
+  if (min_offs < used) {
+    return (-EIO);
+  }
+  free = min_offs - used;
+  if (here) {
+    free += ZARUFS_XATTR_LEN(name_len)
+      + ZARUFS_XATTR_SIZE(le32_to_cpu(here->e_value_size));
+  }
+  if (value &&
+      (free < ZARUFS_XATTR_LEN(name_len) + ZARUFS_XATTR_SIZE(value_len))) {
+    return (-ENOSPC);
+  }
+
+  if (here) {
+    size_t offs;
+    size_t size;
+    size_t rm_len;
+
+    /* remove the old value and close the gap. */
+    offs = le16_to_cpu(here->e_value_offs);
+    size = ZARUFS_XATTR_SIZE(le32_to_cpu(here->e_value_size));
+    if (size) {
+      memmove(r->base + min_offs + size, r->base + min_offs, offs - min_offs);
+      memset(r->base + min_offs, 0, size);
+      for (entry = r->first;
+           !ZARUFS_XATTR_IS_LAST(entry);
+           entry = ZARUFS_XATTR_NEXT(entry)) {
+        size_t o = le16_to_cpu(entry->e_value_offs);
+        if (!entry->e_value_block && entry->e_value_size && (o < offs)) {
+          entry->e_value_offs = cpu_to_le16(o + size);
+        }
+      }
+      min_offs += size;
+    }
+
+    /* remove the old entry. */
+    rm_len = ZARUFS_XATTR_LEN(here->e_name_len);
+    memmove(here,
+            (char*) here + rm_len,
+            (char*) last - (char*) here - rm_len + sizeof(__u32));
+    last = (struct zarufs_xattr_entry*)((char*) last - rm_len);
+    memset((char*) last + sizeof(__u32), 0, rm_len);
+  }
+
+  if (value) {
+    /* append the new entry, and put its value in front of the others. */
+    memset(last, 0, ZARUFS_XATTR_LEN(name_len));
+    last->e_name_len   = name_len;
+    last->e_name_index = name_index;
+    last->e_value_size = cpu_to_le32(value_len);
+    memcpy(last->e_name, name, name_len);
+    if (value_len) {
+      min_offs -= ZARUFS_XATTR_SIZE(value_len);
+      last->e_value_offs = cpu_to_le16(min_offs);
+      memset(r->base + min_offs, 0, ZARUFS_XATTR_SIZE(value_len));
+      memcpy(r->base + min_offs, value, value_len);
+    }
+    *(__u32*) ZARUFS_XATTR_NEXT(last) = 0;
+  }
+  return (0);
+}
+
+static int
+list_entries(struct dentry *dentry,
+             struct xattr_region *r,
+             char *buffer,
+             size_t *rest) {
+  struct zarufs_xattr_entry *entry;
+
+  for (entry = r->first; ; entry = ZARUFS_XATTR_NEXT(entry)) {
+    const struct xattr_handler *handler;
+
+    if ((r->end < (char*) entry + sizeof(__u32)) ||
+        (!ZARUFS_XATTR_IS_LAST(entry) &&
+         (r->end < (char*) ZARUFS_XATTR_NEXT(entry)))) {
+      return (-EIO);
+    }
+    if (ZARUFS_XATTR_IS_LAST(entry)) {
+      return (0);
+    }
+
+    if ((handler = zarufs_xattr_handler(entry->e_name_index))) {
+      size_t size;
+
+      size = handler->list(dentry,
+                           buffer,
+                           *rest,
+                           entry->e_name,
+                           entry->e_name_len,
+                           handler->flags);
+      if (buffer) {
+        if (*rest < size) {
+          return (-ERANGE);
+        }
+        buffer += size;
+      }
+      *rest -= size;
+    }
+  }
+}
+
+static int
+ibody_region(struct inode *inode,
+             struct ext2_inode *raw,
+             struct xattr_region *r,
+             int create) {
+  struct zarufs_inode_info         *zi;
+  struct zarufs_inode_extra        *extra;
+  struct zarufs_xattr_ibody_header *header;
+  unsigned int                     inode_size;
+
+  zi         = ZARUFS_I(inode);
+  inode_size = ZARUFS_SB(inode->i_sb)->s_inode_size;
+  if (inode_size <= EXT2_GOOD_OLD_INODE_SIZE + zarufs_want_extra_isize(inode->i_sb)
+      + sizeof(*header) + sizeof(__u32)) {
+    return (create ? -ENOSPC : -ENODATA);
+  }
+
+  extra = (struct zarufs_inode_extra*)(raw + 1);
+  if (create && !zi->i_extra_isize) {
+    /* large inode written without extra fields. */
+    zi->i_extra_isize    = zarufs_want_extra_isize(inode->i_sb);
+    extra->i_extra_isize = cpu_to_le16(zi->i_extra_isize);
+  }
+  if (!zi->i_extra_isize) {
+    return (-ENODATA);
+  }
+
+  header = (struct zarufs_xattr_ibody_header*)
+    ((char*) raw + EXT2_GOOD_OLD_INODE_SIZE + zi->i_extra_isize);
+  r->first = (struct zarufs_xattr_entry*)(header + 1);
+  r->base  = (char*) r->first;
+  r->end   = (char*) raw + inode_size;
+  if (r->end < r->base + sizeof(__u32)) {
+    return (create ? -ENOSPC : -ENODATA);
+  }
+
+  if (header->h_magic != cpu_to_le32(ZARUFS_XATTR_MAGIC)) {
+    if (!create) {
+      return (-ENODATA);
+    }
+    memset(header, 0, r->end - (char*) header);
+    header->h_magic = cpu_to_le32(ZARUFS_XATTR_MAGIC);
+  }
+  return (0);
+}
+
+static int
+ibody_set(struct inode *inode,
+          int name_index,
+          const char *name,
+          const void *value,
+          size_t value_len) {
+  struct zarufs_inode_info *zi;
+  struct xattr_region      r;
+  struct ext2_inode        *raw;
+  struct buffer_head       *bh;
+  int                      err;
+
+  zi  = ZARUFS_I(inode);
+  raw = zarufs_get_ext2_inode(inode->i_sb, inode->i_ino, &bh);
+  if (IS_ERR(raw)) {
+    return (PTR_ERR(raw));
+  }
+
+  if (zi->i_state & EXT2_STATE_NEW) {
+    /* the on-disk inode is initialized here instead of in write_inode, */
+    /* so that it does not wipe the attributes out. */
+    memset(raw, 0, ZARUFS_SB(inode->i_sb)->s_inode_size);
+    zi->i_state &= ~EXT2_STATE_NEW;
+    if (zi->i_extra_isize) {
+      ((struct zarufs_inode_extra*)(raw + 1))->i_extra_isize
+        = cpu_to_le16(zi->i_extra_isize);
+    }
+  }
+
+  if ((err = ibody_region(inode, raw, &r, 1))) {
+    goto out;
+  }
+
+  if ((err = set_entry(&r, name_index, name, strlen(name), value, value_len))) {
+    goto out;
+  }
+
+  mark_buffer_dirty(bh);
+  if (IS_SYNC(inode)) {
+    sync_dirty_buffer(bh);
+  }
+  inode->i_ctime = CURRENT_TIME_SEC;
+  mark_inode_dirty(inode);
+
+ out:
+  brelse(bh);
+  return (err);
+}
+
+static struct buffer_head*
+read_xattr_block(struct inode *inode) {
+  struct buffer_head *bh;
+
+  if (!(bh = sb_bread(inode->i_sb, ZARUFS_I(inode)->i_file_acl))) {
+    ZARUFS_ERROR("[ZARUFS] %s: cannot read attribute block.", __func__);
+    ZARUFS_ERROR("ino=%lu, block=%lu\n",
+                 inode->i_ino, ZARUFS_I(inode)->i_file_acl);
+    return (ERR_PTR(-EIO));
+  }
+
+  if ((XATTR_HDR(bh)->h_magic != cpu_to_le32(ZARUFS_XATTR_MAGIC)) ||
+      (XATTR_HDR(bh)->h_blocks != cpu_to_le32(1))) {
+    ZARUFS_ERROR("[ZARUFS] %s: bad attribute block.", __func__);
+    ZARUFS_ERROR("ino=%lu, block=%lu\n",
+                 inode->i_ino, ZARUFS_I(inode)->i_file_acl);
+    brelse(bh);
+    return (ERR_PTR(-EIO));
+  }
+
+  cache_insert(bh);
+  return (bh);
+}
+
+static int
+block_set(struct inode *inode,
+          int name_index,
+          const char *name,
+          const void *value,
+          size_t value_len) {
+  struct super_block         *sb;
+  struct zarufs_inode_info   *zi;
+  struct zarufs_xattr_header *header;
+  struct zarufs_xattr_entry  *entry;
+  struct xattr_region        r;
+  struct buffer_head         *bh;
+  struct buffer_head         *new_bh;
+  char                       *buf;
+  int                        err;
+
+  sb     = inode->i_sb;
+  zi     = ZARUFS_I(inode);
+  bh     = NULL;
+  new_bh = NULL;
+
+  if (!(buf = kzalloc(sb->s_blocksize, GFP_NOFS))) {
+    return (-ENOMEM);
+  }
+  header = (struct zarufs_xattr_header*) buf;
+
+  /* build the new block image in memory. */
+  if (zi->i_file_acl) {
+    bh = read_xattr_block(inode);
+    if (IS_ERR(bh)) {
+      err = PTR_ERR(bh);
+      bh  = NULL;
+      goto out;
+    }
+    memcpy(buf, bh->b_data, sb->s_blocksize);
+  } else {
+    header->h_magic  = cpu_to_le32(ZARUFS_XATTR_MAGIC);
+    header->h_blocks = cpu_to_le32(1);
+  }
+  header->h_refcount = cpu_to_le32(1);
+
+  r.base  = buf;
+  r.first = XATTR_FIRST(buf);
+  r.end   = buf + sb->s_blocksize;
+  if ((err = set_entry(&r, name_index, name, strlen(name), value, value_len))) {
+    goto out;
+  }
+
+  if (!ZARUFS_XATTR_IS_LAST(r.first)) {
+    for (entry = r.first;
+         !ZARUFS_XATTR_IS_LAST(entry);
+         entry = ZARUFS_XATTR_NEXT(entry)) {
+      hash_entry(buf, entry);
+    }
+    rehash_block(header);
+
+    if ((new_bh = cache_find(inode, header))) {
+      /* share an identical block. cache_find returns it locked. */
+      if (bh && (new_bh->b_blocknr == bh->b_blocknr)) {
+        unlock_buffer(new_bh);
+      } else {
+        le32_add_cpu(&XATTR_HDR(new_bh)->h_refcount, 1);
+        unlock_buffer(new_bh);
+        mark_buffer_dirty(new_bh);
+      }
+    } else if (bh) {
+      struct mb_cache_entry *ce;
+
+      ce = mb_cache_entry_get(zarufs_xattr_cache, bh->b_bdev, bh->b_blocknr);
+      lock_buffer(bh);
+      if (XATTR_HDR(bh)->h_refcount == cpu_to_le32(1)) {
+        /* nobody else refers to the block. modify it in place. */
+        if (ce) {
+          mb_cache_entry_free(ce);
+        }
+        memcpy(bh->b_data, buf, sb->s_blocksize);
+        unlock_buffer(bh);
+        mark_buffer_dirty(bh);
+        cache_insert(bh);
+        get_bh(bh);
+        new_bh = bh;
+      } else {
+        unlock_buffer(bh);
+        if (ce) {
+          mb_cache_entry_release(ce);
+        }
+      }
+    }
+
+    if (!new_bh) {
+      unsigned long goal;
+      unsigned long count;
+      unsigned long block;
+
+      goal  = zarufs_get_first_block_num(sb, zi->i_block_group);
+      count = 1;
+      err   = -ENOSPC;
+      block = zarufs_new_blocks(inode, goal, &count, &err);
+      if (err || !block) {
+        /* block 0 is never handed out, and must not be written over. */
+        err = err ? err : -ENOSPC;
+        goto out;
+      }
+      if (unlikely(!(new_bh = sb_getblk(sb, block)))) {
+        zarufs_free_blocks(inode, block, 1);
+        err = -ENOMEM;
+        goto out;
+      }
+      lock_buffer(new_bh);
+      memcpy(new_bh->b_data, buf, sb->s_blocksize);
+      set_buffer_uptodate(new_bh);
+      unlock_buffer(new_bh);
+      mark_buffer_dirty(new_bh);
+      cache_insert(new_bh);
+      set_ext_attr_feature(sb);
+    }
+
+    if (IS_SYNC(inode)) {
+      sync_dirty_buffer(new_bh);
+    }
+  }
+
+  zi->i_file_acl = new_bh ? new_bh->b_blocknr : 0;
+  inode->i_ctime = CURRENT_TIME_SEC;
+  mark_inode_dirty(inode);
+
+  /* drop the reference to the old block. */
+  if (bh && (!new_bh || (bh->b_blocknr != new_bh->b_blocknr))) {
+    release_xattr_block(inode, bh);
+  }
+  err = 0;
+
+ out:
+  brelse(new_bh);
+  brelse(bh);
+  kfree(buf);
+  return (err);
+}
+
+static void
+release_xattr_block(struct inode *inode, struct buffer_head *bh) {
+  struct mb_cache_entry *ce;
+
+  ce = mb_cache_entry_get(zarufs_xattr_cache, bh->b_bdev, bh->b_blocknr);
+  lock_buffer(bh);
+  if (XATTR_HDR(bh)->h_refcount == cpu_to_le32(1)) {
+    if (ce) {
+      mb_cache_entry_free(ce);
+    }
+    zarufs_free_blocks(inode, bh->b_blocknr, 1);
+    clear_buffer_dirty(bh);
+  } else {
+    le32_add_cpu(&XATTR_HDR(bh)->h_refcount, -1);
+    if (ce) {
+      mb_cache_entry_release(ce);
+    }
+    mark_buffer_dirty(bh);
+  }
+  unlock_buffer(bh);
+}
+
+static void
+hash_entry(char *base, struct zarufs_xattr_entry *entry) {
+  __u32 hash;
+  char  *name;
+  int   n;
+
+  hash = 0;
+  name = entry->e_name;
+  for (n = 0; n < entry->e_name_len; n++) {
+    hash = (hash << NAME_HASH_SHIFT)
+      ^ (hash >> (8 * sizeof(hash) - NAME_HASH_SHIFT))
+      ^ *name++;
+  }
+
+  if (!entry->e_value_block && entry->e_value_size) {
+    __le32 *value;
+
+    value = (__le32*)(base + le16_to_cpu(entry->e_value_offs));
+    for (n = ZARUFS_XATTR_SIZE(le32_to_cpu(entry->e_value_size))
+           >> ZARUFS_XATTR_PAD_BITS; n; n--) {
+      hash = (hash << VALUE_HASH_SHIFT)
+        ^ (hash >> (8 * sizeof(hash) - VALUE_HASH_SHIFT))
+        ^ le32_to_cpu(*value++);
+    }
+  }
+  entry->e_hash = cpu_to_le32(hash);
+}
+
+static void
+rehash_block(struct zarufs_xattr_header *header) {
+  struct zarufs_xattr_entry *entry;
+  __u32                     hash;
+
+  hash = 0;
+  for (entry = XATTR_FIRST(header);
+       !ZARUFS_XATTR_IS_LAST(entry);
+       entry = ZARUFS_XATTR_NEXT(entry)) {
+    if (!entry->e_hash) {
+      /* block is not shared if an entry's hash value == 0. */
+      hash = 0;
+      break;
+    }
+    hash = (hash << BLOCK_HASH_SHIFT)
+      ^ (hash >> (8 * sizeof(hash) - BLOCK_HASH_SHIFT))
+      ^ le32_to_cpu(entry->e_hash);
+  }
+  header->h_hash = cpu_to_le32(hash);
+}
+
+static int
+cache_insert(struct buffer_head *bh) {
+  struct mb_cache_entry *ce;
+  int                   err;
+
+  if (!(ce = mb_cache_entry_alloc(zarufs_xattr_cache, GFP_NOFS))) {
+    return (-ENOMEM);
+  }
+  err = mb_cache_entry_insert(ce,
+                              bh->b_bdev,
+                              bh->b_blocknr,
+                              le32_to_cpu(XATTR_HDR(bh)->h_hash));
+  if (err) {
+    mb_cache_entry_free(ce);
+    if (err == -EBUSY) {
+      /* already cached. */
+      err = 0;
+    }
+  } else {
+    mb_cache_entry_release(ce);
+  }
+  return (err);
+}
+
+static struct buffer_head*
+cache_find(struct inode *inode, struct zarufs_xattr_header *header) {
+  struct mb_cache_entry *ce;
+  __u32                 hash;
+
+  if (!header->h_hash) {
+    return (NULL);
+  }
+  hash = le32_to_cpu(header->h_hash);
+
+ again:
+  ce = mb_cache_entry_find_first(zarufs_xattr_cache, inode->i_sb->s_bdev, hash);
+  while (ce) {
+    struct buffer_head *bh;
+
+    if (IS_ERR(ce)) {
+      if (PTR_ERR(ce) == -EAGAIN) {
+        goto again;
+      }
+      break;
+    }
+
+    if (!(bh = sb_bread(inode->i_sb, ce->e_block))) {
+      ZARUFS_ERROR("[ZARUFS] %s: cannot read attribute block %lu\n",
+                   __func__, (unsigned long) ce->e_block);
+    } else {
+      lock_buffer(bh);
+      if ((XATTR_HDR(bh)->h_magic == cpu_to_le32(ZARUFS_XATTR_MAGIC)) &&
+          (le32_to_cpu(XATTR_HDR(bh)->h_refcount) < ZARUFS_XATTR_REFCOUNT_MAX) &&
+          !cmp_blocks(header, XATTR_HDR(bh))) {
+        mb_cache_entry_release(ce);
+        return (bh);
+      }
+      unlock_buffer(bh);
+      brelse(bh);
+    }
+    ce = mb_cache_entry_find_next(ce, inode->i_sb->s_bdev, hash);
+  }
+  return (NULL);
+}
+
+static int
+cmp_blocks(struct zarufs_xattr_header *h1, struct zarufs_xattr_header *h2) {
+  struct zarufs_xattr_entry *e1;
+  struct zarufs_xattr_entry *e2;
+
+  e1 = XATTR_FIRST(h1);
+  e2 = XATTR_FIRST(h2);
+  while (!ZARUFS_XATTR_IS_LAST(e1)) {
+    if (ZARUFS_XATTR_IS_LAST(e2) ||
+        (e1->e_hash != e2->e_hash) ||
+        (e1->e_name_index != e2->e_name_index) ||
+        (e1->e_name_len != e2->e_name_len) ||
+        (e1->e_value_size != e2->e_value_size) ||
+        memcmp(e1->e_name, e2->e_name, e1->e_name_len)) {
+      return (1);
+    }
+    if (e1->e_value_block || e2->e_value_block) {
+      return (-EIO);
+    }
+    if (memcmp((char*) h1 + le16_to_cpu(e1->e_value_offs),
+               (char*) h2 + le16_to_cpu(e2->e_value_offs),
+               le32_to_cpu(e1->e_value_size))) {
+      return (1);
+    }
+    e1 = ZARUFS_XATTR_NEXT(e1);
+    e2 = ZARUFS_XATTR_NEXT(e2);
+  }
+  return (!ZARUFS_XATTR_IS_LAST(e2));
+}
+
+static void
+set_ext_attr_feature(struct super_block *sb) {
+  struct zarufs_sb_info *zsi;
+
+  zsi = ZARUFS_SB(sb);
+  if (zsi->s_zsb->s_feature_compat
+      & cpu_to_le32(EXT2_FEATURE_COMPAT_EXT_ATTR)) {
+    return;
+  }
+
+  lock_buffer(zsi->s_sbh);
+  zsi->s_zsb->s_feature_compat |= cpu_to_le32(EXT2_FEATURE_COMPAT_EXT_ATTR);
+  unlock_buffer(zsi->s_sbh);
+  mark_buffer_dirty(zsi->s_sbh);
+}
+
+/* -------------------------------------------------------------------------- */
+/* handlers.                                                                  */
+
+static size_t
+list_name(char *list,
+          size_t list_size,
+          const char *prefix,
+          size_t prefix_len,
+          const char *name,
+          size_t name_len) {
+  size_t total_len;
+
+  total_len = prefix_len + name_len + 1;
+  if (list && (total_len <= list_size)) {
+    memcpy(list, prefix, prefix_len);
+    memcpy(list + prefix_len, name, name_len);
+    list[prefix_len + name_len] = '\0';
+  }
+  return (total_len);
+}
+
+static size_t
+zarufs_xattr_user_list(struct dentry *dentry,
+                       char *list,
+                       size_t list_size,
+                       const char *name,
+                       size_t name_len,
+                       int type) {
+  if (!(ZARUFS_SB(dentry->d_sb)->s_mount_opt & EXT2_MOUNT_XATTR_USER)) {
+    return (0);
+  }
+  return (list_name(list, list_size,
+                    XATTR_USER_PREFIX, XATTR_USER_PREFIX_LEN,
+                    name, name_len));
+}
+
+static size_t
+zarufs_xattr_trusted_list(struct dentry *dentry,
+                          char *list,
+                          size_t list_size,
+                          const char *name,
+                          size_t name_len,
+                          int type) {
+  if (!capable(CAP_SYS_ADMIN)) {
+    return (0);
+  }
+  return (list_name(list, list_size,
+                    XATTR_TRUSTED_PREFIX, XATTR_TRUSTED_PREFIX_LEN,
+                    name, name_len));
+}
+
+static size_t
+zarufs_xattr_security_list(struct dentry *dentry,
+                           char *list,
+                           size_t list_size,
+                           const char *name,
+                           size_t name_len,
+                           int type) {
+  return (list_name(list, list_size,
+                    XATTR_SECURITY_PREFIX, XATTR_SECURITY_PREFIX_LEN,
+                    name, name_len));
+}
+
+static int
+zarufs_xattr_handler_get(struct dentry *dentry,
+                         const char *name,
+                         void *buffer,
+                         size_t size,
+                         int type) {
+  if (!strcmp(name, "")) {
+    return (-EINVAL);
+  }
+  if ((type == ZARUFS_XATTR_INDEX_USER) &&
+      !(ZARUFS_SB(dentry->d_sb)->s_mount_opt & EXT2_MOUNT_XATTR_USER)) {
+    return (-EOPNOTSUPP);
+  }
+  return (zarufs_xattr_get(dentry->d_inode, type, name, buffer, size));
+}
+
+static int
+zarufs_xattr_handler_set(struct dentry *dentry,
+                         const char *name,
+                         const void *value,
+                         size_t size,
+                         int flags,
+                         int type) {
+  if (!strcmp(name, "")) {
+    return (-EINVAL);
+  }
+  if ((type == ZARUFS_XATTR_INDEX_USER) &&
+      !(ZARUFS_SB(dentry->d_sb)->s_mount_opt & EXT2_MOUNT_XATTR_USER)) {
+    return (-EOPNOTSUPP);
+  }
+  return (zarufs_xattr_set(dentry->d_inode, type, name, value, size, flags));
+}
+
+static const struct xattr_handler zarufs_xattr_user_handler = {
+  .prefix = XATTR_USER_PREFIX,
+  .flags  = ZARUFS_XATTR_INDEX_USER,
+  .list   = zarufs_xattr_user_list,
+  .get    = zarufs_xattr_handler_get,
+  .set    = zarufs_xattr_handler_set,
+};
+
+static const struct xattr_handler zarufs_xattr_trusted_handler = {
+  .prefix = XATTR_TRUSTED_PREFIX,
+  .flags  = ZARUFS_XATTR_INDEX_TRUSTED,
+  .list   = zarufs_xattr_trusted_list,
+  .get    = zarufs_xattr_handler_get,
+  .set    = zarufs_xattr_handler_set,
+};
+
+static const struct xattr_handler zarufs_xattr_security_handler = {
+  .prefix = XATTR_SECURITY_PREFIX,
+  .flags  = ZARUFS_XATTR_INDEX_SECURITY,
+  .list   = zarufs_xattr_security_list,
+  .get    = zarufs_xattr_handler_get,
+  .set    = zarufs_xattr_handler_set,
+};
+
+const struct xattr_handler *zarufs_xattr_handlers[] = {
+  &zarufs_xattr_user_handler,
+  &zarufs_xattr_trusted_handler,
+  &posix_acl_access_xattr_handler,
+  &posix_acl_default_xattr_handler,
+  &zarufs_xattr_security_handler,
+  NULL
+};
+
+static const struct xattr_handler*
+zarufs_xattr_handler(int name_index) {
+  switch (name_index) {
+  case ZARUFS_XATTR_INDEX_USER:
+    return (&zarufs_xattr_user_handler);
+  case ZARUFS_XATTR_INDEX_POSIX_ACL_ACCESS:
+    return (&posix_acl_access_xattr_handler);
+  case ZARUFS_XATTR_INDEX_POSIX_ACL_DEFAULT:
+    return (&posix_acl_default_xattr_handler);
+  case ZARUFS_XATTR_INDEX_TRUSTED:
+    return (&zarufs_xattr_trusted_handler);
+  case ZARUFS_XATTR_INDEX_SECURITY:
+    return (&zarufs_xattr_security_handler);
+  default:
+    return (NULL);
+  }
+}
+
+static int
+zarufs_initxattrs(struct inode *inode,
+                  const struct xattr *xattr_array,
+                  void *fs_info) {
+  const struct xattr *xattr;
+  int                err;
+
+  err = 0;
+  for (xattr = xattr_array; xattr->name != NULL; xattr++) {
+    err = zarufs_xattr_set(inode,
+                           ZARUFS_XATTR_INDEX_SECURITY,
+                           xattr->name,
+                           xattr->value,
+                           xattr->value_len,
+                           0);
+    if (err < 0) {
+      break;
+    }
+  }
+  return (err);
+}
+
+int
+zarufs_init_security(struct inode *inode,
+                     struct inode *dir,
+                     const struct qstr *qstr) {
+  return (security_inode_init_security(inode, dir, qstr,
+                                       &zarufs_initxattrs, NULL));
+}
+
+int
+zarufs_init_xattr(void) {
+  zarufs_xattr_cache = mb_cache_create("zarufs_xattr", 6);
+  if (!zarufs_xattr_cache) {
+    return (-ENOMEM);
+  }
+  return (0);
+}
+
+void
+zarufs_exit_xattr(void) {
+  mb_cache_destroy(zarufs_xattr_cache);
+}
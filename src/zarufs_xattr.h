@@ -0,0 +1,33 @@
+/* zarufs_xattr.h */
+#ifndef _ZARUFS_XATTR_H_
+#define _ZARUFS_XATTR_H_
+
+extern const struct xattr_handler *zarufs_xattr_handlers[];
+
+int
+zarufs_xattr_get(struct inode *inode,
+                 int name_index,
+                 const char *name,
+                 void *buffer,
+                 size_t buffer_size);
+
+int
+zarufs_xattr_set(struct inode *inode,
+                 int name_index,
+                 const char *name,
+                 const void *value,
+                 size_t value_len,
+                 int flags);
+
+ssize_t
+zarufs_listxattr(struct dentry *dentry, char *buffer, size_t buffer_size);
+
+int
+zarufs_init_security(struct inode *inode,
+                     struct inode *dir,
+                     const struct qstr *qstr);
+
+int  zarufs_init_xattr(void);
+void zarufs_exit_xattr(void);
+
+#endif